@@ -0,0 +1,452 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include "kernel_clones.h"
+
+using namespace std;
+
+/**
+ *?                             ==================================================
+ *?                                          🛈 Convolution Layers
+ *?                             ==================================================
+ *
+ * A convolution layer slides a small kernel (ex. 5 × 5) over feature maps, every output channel has a kernel for each
+ * input channel, shared by every position of the image. Sharing them takes far fewer weights than connecting every input
+ * to every output, and a kernel finds a stroke wherever in the image it is. A max pooling layer keeps the largest value
+ * of each window of `window` × `window` positions of every channel, shrinking the feature maps that the layers after it
+ * have to work through. Convolutions are padded with 0s so their outputs are as wide and high as their inputs, and have a
+ * stride of 1. Pooling windows don't overlap, positions past the last whole window are dropped.
+ *
+ * Feature maps are stored blocked by channels (NCHWc): channels are split into blocks of `CHANNEL_BLOCK`, and within a
+ * block the channels of a position are next to each other,
+ *
+ *      | block 0: (row 0, column 0: channels 0-7) (row 0, column 1: channels 0-7) ... | block 1: channels 8-15 ... |
+ *
+ * Maps with fewer channels than that, or a number of channels that isn't a multiple of it (ex. the 1 channel of the input
+ * image), are a single block of every channel. Kernels are stored to match, output channels blocked the same way and
+ * innermost: [output block][input channel][kernel row][kernel column][8 output channels]. Every layer's activations are
+ * still one array of floats, so fully connected layers after a convolution take the blocked maps as they are.
+ *
+ * Convolutions are computed directly, without unrolling the inputs into a matrix first. For each block of output channels,
+ * `CONVOLUTION_TILE` neighbouring positions are computed at once, each with a vector of `CHANNEL_BLOCK` sums, so every
+ * input read is a single value multiplied with 8 consecutive weights, which is one 8 wide fused multiply-add with AVX2.
+ * The 8 sums of the tile stay in 8 vector registers across every input channel and kernel position, and each vector of
+ * weights is shared by every position of the tile. Positions whose kernel has every column inside the inputs are tiled
+ * along their row. The columns near the edges, where part of the kernel lands on padding, are tiled down their column
+ * instead, with the kernel cut to the columns inside the image, which is the same for every position of the column.
+ * Only the corners, where the kernel is cut both ways, are computed one position at a time. The padding is never stored
+ * or read. Every output gets its products added in the same order whichever way it's computed.
+ *
+ * With AVX2 and FMA, `conv8x5` on a 28 × 28 image takes about 7 µs (21 GMAC/s, billion multiply-adds per second) and
+ * `conv16x5` on 8 channels of 14 × 14 about 31 µs (20 GMAC/s) on one core, against about 1.7 GMAC/s when the sums didn't
+ * stay in registers.
+ *
+ * Backpropagating works the same way in reverse. The error of each input is gathered from the outputs its value went to,
+ * multiplying the errors of a block of output channels with the matching 8 weights, so it's written once rather than
+ * added to from every output. The gradient of each row of a kernel (for one block of output channels and one input
+ * channel) sums the inputs under it times the errors of the outputs, over every position and every record of the batch
+ * in order, so, like fully connected layers, the result doesn't depend on how the rows are split between threads.
+ *
+ * The kernels are compiled for AVX2 with FMA and for the baseline instruction set (see `KERNEL_CLONES`).
+ */
+
+/**
+ * @brief Number of channels stored together at each position of a feature map, and of output channels every convolution
+ *        kernel computes at once. Convolution layers must have a multiple of this many output channels.
+ */
+const int CHANNEL_BLOCK = 8;
+
+/**
+ * @brief Number of neighbouring positions a convolution computes at once, their sums take 8 of the 16 AVX2 registers
+ */
+const int CONVOLUTION_TILE = 8;
+
+/**
+ * @brief The sums of one position's block of output channels, 8 floats that the compiler keeps in one AVX2 register (or
+ *        two SSE registers in the baseline version) and adds and multiplies with single instructions
+ */
+typedef float ChannelSums __attribute__((vector_size(CHANNEL_BLOCK * sizeof(float))));
+
+/**
+ * @brief Channels, height and width of the feature maps of a layer
+ */
+struct FeatureMaps {
+    int channels = 0, height = 0, width = 0;
+
+    int count() const { return channels * height * width; }
+
+    /**
+     * @brief Number of channels stored together at each position, see 🛈 Convolution Layers
+     */
+    int block() const { return channels % CHANNEL_BLOCK == 0 ? CHANNEL_BLOCK : channels; }
+
+    /**
+     * @brief Values in each block of channels
+     */
+    size_t block_size() const { return (size_t)height * width * block(); }
+
+    /**
+     * @brief Index of a channel at a position
+     */
+    size_t index(int channel, int row, int column) const {
+        const int b = block();
+        return (((size_t)(channel / b) * height + row) * width + column) * b + channel % b;
+    }
+
+    bool operator==(const FeatureMaps &other) const {
+        return channels == other.channels && height == other.height && width == other.width;
+    }
+};
+
+/**
+ * @brief Feature maps in and out of a convolution or max pooling layer, and the size of its kernel or window
+ */
+struct FeatureShape {
+    FeatureMaps input, output;
+
+    /**
+     * @brief Width and height of a convolution's kernel or of a pooling window
+     */
+    int window = 0;
+
+    /**
+     * @brief Rows and columns of 0s around the inputs of a convolution
+     */
+    int padding = 0;
+
+    /**
+     * @param input Feature maps of the previous layer
+     * @param channels Number of output channels
+     * @param kernel Width and height of the kernel, odd so the outputs are as big as the inputs
+     */
+    static FeatureShape convolution(FeatureMaps input, int channels, int kernel) {
+        return {input, {channels, input.height, input.width}, kernel, kernel / 2};
+    }
+
+    /**
+     * @param input Feature maps of the previous layer
+     * @param window Width and height of each window
+     */
+    static FeatureShape pooling(FeatureMaps input, int window) {
+        return {input, {input.channels, input.height / window, input.width / window}, window, 0};
+    }
+
+    bool operator==(const FeatureShape &other) const {
+        return input == other.input && output == other.output && window == other.window && padding == other.padding;
+    }
+};
+
+/**
+ * @brief Compute a tile of `Tile` outputs for one block of output channels, either neighbours in a row or in a column.
+ *        The kernel rows and columns inside the inputs must be the same for every position of the tile.
+ *
+ * @param weights Kernels of the block of output channels, for every input channel
+ * @param biases Biases of the block of output channels
+ * @param row Row of the tile's first output
+ * @param column Column of the tile's first output
+ * @param row_begin First row of the kernel inside the inputs
+ * @param row_end One past the last row of the kernel inside the inputs
+ * @param column_begin First column of the kernel inside the inputs
+ * @param column_end One past the last column of the kernel inside the inputs
+ * @param step Distance between the inputs of neighbouring positions of the tile
+ * @param out_step Distance between the outputs of neighbouring positions of the tile
+ * @param out Where to write the outputs of the block of channels, the tile's first position
+ */
+template <int Tile>
+inline __attribute__((always_inline)) void convolution_tile(const float *in, const FeatureShape &shape,
+                                                            const float *weights, const float *biases, int row,
+                                                            int column, int row_begin, int row_end, int column_begin,
+                                                            int column_end, size_t step, size_t out_step, float *out) {
+    const int block = shape.input.block();
+    const int kernel = shape.window;
+
+    ChannelSums sums[Tile];
+    for (int t = 0; t < Tile; t++) {
+        memcpy(&sums[t], biases, sizeof(ChannelSums));
+    }
+
+    for (int channel = 0; channel < shape.input.channels; channel++) {
+        const float *plane = in + (channel / block) * shape.input.block_size() + channel % block;
+        const float *channel_weights = weights + (size_t)channel * kernel * kernel * CHANNEL_BLOCK;
+
+        for (int k_row = row_begin; k_row < row_end; k_row++) {
+            const float *inputs = plane + (size_t)(row + k_row - shape.padding) * shape.input.width * block;
+            const float *row_weights = channel_weights + (size_t)k_row * kernel * CHANNEL_BLOCK;
+
+            for (int k_column = column_begin; k_column < column_end; k_column++) {
+                ChannelSums w;
+                memcpy(&w, row_weights + k_column * CHANNEL_BLOCK, sizeof(w));
+                const float *first = inputs + (size_t)(column + k_column - shape.padding) * block;
+
+                for (int t = 0; t < Tile; t++) {
+                    sums[t] += first[t * step] * w;
+                }
+            }
+        }
+    }
+
+    for (int t = 0; t < Tile; t++) {
+        memcpy(out + t * out_step, &sums[t], sizeof(ChannelSums));
+    }
+}
+
+/**
+ * @brief out = biases + in ∗ weights, the outputs of a convolution layer for one image before its activation function
+ *
+ * @param in Feature maps of the previous layer, blocked as described in 🛈 Convolution Layers
+ * @param shape Feature maps in and out of the layer
+ * @param weights Every kernel, [output block][input channel][kernel row][kernel column][output channel]
+ * @param biases Bias of each output channel
+ * @param out Where to write the output feature maps
+ */
+KERNEL_CLONES inline void convolution_forward(const float *in, const FeatureShape &shape, const float *weights,
+                                              const float *biases, float *out) {
+    const FeatureMaps &input = shape.input, &output = shape.output;
+    const int kernel = shape.window;
+    const size_t block = input.block();
+
+    // the columns tiled along their row, which have the whole kernel inside the inputs
+    const int tiled_begin = shape.padding;
+    const int tiled_end = shape.padding + max(0, input.width - kernel + 1) / CONVOLUTION_TILE * CONVOLUTION_TILE;
+
+    // the rows with the whole kernel inside the inputs, which the other columns are tiled along
+    const int interior_rows_end = input.height + shape.padding - kernel + 1;
+
+    for (int o_block = 0; o_block < output.channels / CHANNEL_BLOCK; o_block++) {
+        const float *block_weights = weights + (size_t)o_block * input.channels * kernel * kernel * CHANNEL_BLOCK;
+        const float *block_biases = biases + o_block * CHANNEL_BLOCK;
+        float *block_out = out + output.index(o_block * CHANNEL_BLOCK, 0, 0);
+
+        for (int row = 0; row < output.height; row++) {
+            const int row_begin = max(0, shape.padding - row);
+            const int row_end = min(kernel, input.height + shape.padding - row);
+
+            for (int column = tiled_begin; column < tiled_end; column += CONVOLUTION_TILE) {
+                convolution_tile<CONVOLUTION_TILE>(in, shape, block_weights, block_biases, row, column, row_begin,
+                                                   row_end, 0, kernel, block, CHANNEL_BLOCK,
+                                                   block_out + ((size_t)row * output.width + column) * CHANNEL_BLOCK);
+            }
+        }
+
+        for (int column = 0; column < output.width; column++) {
+            if (column >= tiled_begin && column < tiled_end) {
+                continue;
+            }
+
+            const int column_begin = max(0, shape.padding - column);
+            const int column_end = min(kernel, input.width + shape.padding - column);
+
+            for (int row = 0; row < output.height;) {
+                float *position_out = block_out + ((size_t)row * output.width + column) * CHANNEL_BLOCK;
+
+                if (row >= shape.padding && row + CONVOLUTION_TILE <= interior_rows_end) {
+                    convolution_tile<CONVOLUTION_TILE>(in, shape, block_weights, block_biases, row, column, 0, kernel,
+                                                       column_begin, column_end, input.width * block,
+                                                       (size_t)output.width * CHANNEL_BLOCK, position_out);
+                    row += CONVOLUTION_TILE;
+                } else {
+                    const int row_begin = max(0, shape.padding - row);
+                    const int row_end = min(kernel, input.height + shape.padding - row);
+                    convolution_tile<1>(in, shape, block_weights, block_biases, row, column, row_begin, row_end,
+                                        column_begin, column_end, 0, 0, position_out);
+                    row++;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Backpropagate the error of a convolution layer's outputs to its inputs for one image: each input's value in
+ *        `previous_error` (the gradient of the previous layer's activation function) is multiplied by the sum of the
+ *        errors of the outputs it went to, times the weights it went through.
+ *
+ * @param error Error of the layer's outputs
+ * @param shape Feature maps in and out of the layer
+ * @param weights Every kernel, as for `convolution_forward()`
+ * @param previous_error Error of the previous layer, holding the gradient of its activation function
+ */
+KERNEL_CLONES inline void convolution_backward(const float *error, const FeatureShape &shape, const float *weights,
+                                               float *previous_error) {
+    const FeatureMaps &input = shape.input, &output = shape.output;
+    const int kernel = shape.window;
+    const size_t kernel_values = (size_t)kernel * kernel * CHANNEL_BLOCK;
+
+    for (int channel = 0; channel < input.channels; channel++) {
+        for (int row = 0; row < input.height; row++) {
+            // the kernel rows and columns that took this input to an output
+            const int row_begin = max(0, row + shape.padding - output.height + 1);
+            const int row_end = min(kernel, row + shape.padding + 1);
+
+            for (int column = 0; column < input.width; column++) {
+                const int column_begin = max(0, column + shape.padding - output.width + 1);
+                const int column_end = min(kernel, column + shape.padding + 1);
+
+                float sums[CHANNEL_BLOCK] = {};
+
+                for (int o_block = 0; o_block < output.channels / CHANNEL_BLOCK; o_block++) {
+                    const float *channel_weights =
+                        weights + ((size_t)o_block * input.channels + channel) * kernel_values;
+
+                    for (int k_row = row_begin; k_row < row_end; k_row++) {
+                        const float *errors =
+                            error + output.index(o_block * CHANNEL_BLOCK, row + shape.padding - k_row, 0);
+
+                        for (int k_column = column_begin; k_column < column_end; k_column++) {
+                            const float *__restrict e = errors + (column + shape.padding - k_column) * CHANNEL_BLOCK;
+                            const float *__restrict w = channel_weights + (k_row * kernel + k_column) * CHANNEL_BLOCK;
+
+                            for (int c = 0; c < CHANNEL_BLOCK; c++) {
+                                sums[c] += e[c] * w[c];
+                            }
+                        }
+                    }
+                }
+
+                float sum = 0;
+                for (int c = 0; c < CHANNEL_BLOCK; c++) {
+                    sum += sums[c];
+                }
+                previous_error[input.index(channel, row, column)] *= sum;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Add one record's gradient of one row of the kernel between one input channel and one block of output channels
+ *
+ * @param in Feature maps of the previous layer for the record
+ * @param error Error of the layer's outputs for the record
+ * @param shape Feature maps in and out of the layer
+ * @param o_block Block of output channels
+ * @param channel Input channel
+ * @param k_row Row of the kernel
+ * @param gradient Gradient of the row of the kernel, [kernel column][output channel], added to
+ */
+KERNEL_CLONES inline void convolution_weight_gradient(const float *in, const float *error, const FeatureShape &shape,
+                                                      int o_block, int channel, int k_row, float *gradient) {
+    const FeatureMaps &input = shape.input, &output = shape.output;
+    const int block = input.block();
+    const float *plane = in + (channel / block) * input.block_size() + channel % block;
+
+    // the outputs whose kernel has this row inside the inputs
+    const int row_begin = max(0, shape.padding - k_row);
+    const int row_end = min(output.height, input.height + shape.padding - k_row);
+
+    for (int k_column = 0; k_column < shape.window; k_column++) {
+        const int column_begin = max(0, shape.padding - k_column);
+        const int column_end = min(output.width, input.width + shape.padding - k_column);
+
+        float *__restrict g = gradient + k_column * CHANNEL_BLOCK;
+        float sums[CHANNEL_BLOCK];
+        for (int c = 0; c < CHANNEL_BLOCK; c++) {
+            sums[c] = g[c];
+        }
+
+        for (int row = row_begin; row < row_end; row++) {
+            const float *inputs = plane + (size_t)(row + k_row - shape.padding) * input.width * block;
+            const float *errors = error + output.index(o_block * CHANNEL_BLOCK, row, 0);
+
+            for (int column = column_begin; column < column_end; column++) {
+                const float a = inputs[(size_t)(column + k_column - shape.padding) * block];
+
+                // adding 0 changes nothing, and most input pixels are 0
+                if (a == 0) {
+                    continue;
+                }
+
+                const float *__restrict e = errors + column * CHANNEL_BLOCK;
+                for (int c = 0; c < CHANNEL_BLOCK; c++) {
+                    sums[c] += a * e[c];
+                }
+            }
+        }
+
+        for (int c = 0; c < CHANNEL_BLOCK; c++) {
+            g[c] = sums[c];
+        }
+    }
+}
+
+/**
+ * @brief out = the largest value of each window of every channel, the outputs of a max pooling layer for one image
+ */
+KERNEL_CLONES inline void max_pool_forward(const float *in, const FeatureShape &shape, float *out) {
+    const FeatureMaps &input = shape.input, &output = shape.output;
+    const int block = input.block();
+
+    for (int channel = 0; channel < output.channels; channel += block) {
+        for (int row = 0; row < output.height; row++) {
+            for (int column = 0; column < output.width; column++) {
+                float *__restrict o = out + output.index(channel, row, column);
+                const float *first = in + input.index(channel, row * shape.window, column * shape.window);
+                copy(first, first + block, o);
+
+                for (int w_row = 0; w_row < shape.window; w_row++) {
+                    for (int w_column = 0; w_column < shape.window; w_column++) {
+                        const float *__restrict values =
+                            in + input.index(channel, row * shape.window + w_row, column * shape.window + w_column);
+                        for (int c = 0; c < block; c++) {
+                            o[c] = max(o[c], values[c]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Backpropagate the error of a max pooling layer's outputs to its inputs for one image. Only the first input of
+ *        each window holding its largest value went to the output, its value in `previous_error` is multiplied by the
+ *        output's error and every other input's is set to 0.
+ *
+ * @param in Feature maps of the previous layer
+ * @param out Outputs of the layer
+ * @param error Error of the layer's outputs
+ * @param previous_error Error of the previous layer, holding the gradient of its activation function
+ */
+KERNEL_CLONES inline void max_pool_backward(const float *in, const float *out, const float *error,
+                                            const FeatureShape &shape, float *previous_error) {
+    const FeatureMaps &input = shape.input, &output = shape.output;
+    const int block = input.block();
+
+    for (int channel = 0; channel < input.channels; channel += block) {
+        for (int row = 0; row < input.height; row++) {
+            for (int column = 0; column < input.width; column++) {
+                // past the last whole window
+                if (row >= output.height * shape.window || column >= output.width * shape.window) {
+                    float *p = previous_error + input.index(channel, row, column);
+                    fill(p, p + block, 0.0f);
+                }
+            }
+        }
+
+        for (int row = 0; row < output.height; row++) {
+            for (int column = 0; column < output.width; column++) {
+                const size_t o = output.index(channel, row, column);
+
+                // the channels of a block are routed side by side, without branching on the values
+                for (int first = 0; first < block; first += CHANNEL_BLOCK) {
+                    const int count = min(CHANNEL_BLOCK, block - first);
+                    bool routed[CHANNEL_BLOCK] = {};
+
+                    for (int w_row = row * shape.window; w_row < (row + 1) * shape.window; w_row++) {
+                        for (int w_column = column * shape.window; w_column < (column + 1) * shape.window; w_column++) {
+                            const size_t x = input.index(channel, w_row, w_column) + first;
+
+                            for (int c = 0; c < count; c++) {
+                                const bool route = !routed[c] && in[x + c] == out[o + first + c];
+                                previous_error[x + c] = route ? previous_error[x + c] * error[o + first + c] : 0.0f;
+                                routed[c] = routed[c] || route;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
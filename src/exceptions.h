@@ -19,4 +19,18 @@ class invalid_function_call : public std::exception {
     const char *what() const noexcept override { return this->message.c_str(); }
 };
 
-invalid_function_call::invalid_function_call(const std::string &message) : message(message) {}
\ No newline at end of file
+inline invalid_function_call::invalid_function_call(const std::string &message) : message(message) {}
+
+/**
+ * @brief Thrown when communicating with another process fails.
+ */
+class communication_error : public std::exception {
+  private:
+    std::string message;
+
+  public:
+    explicit communication_error(const std::string &message);
+    const char *what() const noexcept override { return this->message.c_str(); }
+};
+
+inline communication_error::communication_error(const std::string &message) : message(message) {}
\ No newline at end of file
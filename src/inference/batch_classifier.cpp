@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "../block_sparse.cpp"
+#include "../exceptions.h"
+#include "../math_functions.cpp"
+#include "../network.cpp"
+#include "../utils/thread_pool.cpp"
+#include "inference_context.cpp"
+
+using namespace std;
+
+/**
+ *?                             ==================================================
+ *?                                          🛈 Batched Forward Pass
+ *?                             ==================================================
+ *
+ * Each thread classifies its own rows of a batch, a tile of `TILE_ROWS` images at a time, and the activations of a tile
+ * stay in cache between layers. Every layer of a tile is a multiplication of the tile's activations with the layer's
+ * weights, `LISTED_IMAGES` images at a time with the kernel of 🛈 Single Image Inference: the inputs that aren't 0 for
+ * at least one of the images are listed without branching, then each listed row of weights is multiplied with the
+ * inputs of every image while their sums stay in registers. Each weight is read once for every `LISTED_IMAGES` images
+ * rather than once per image, and an input that is 0 for every one of them (the blank border of a digit, a neuron that
+ * is inactive for all of them) is skipped. Images left over at the end of a tile are propagated one at a time the same way. Every output
+ * gets its products added in the same order as with `InferenceContext`, so the two give the same predictions. Low-rank
+ * layers are two thinner multiplications, by each of their factors (see 🛈 Low-Rank Layers). Convolution and pooling
+ * layers (see 🛈 Convolution Layers) go through the tile one image at a time, and apply their own activation function.
+ *
+ * The probability of each class is its output activation divided by the sum of the output activations, with negative
+ * activations counted as 0. The network is trained to output 1 for the right class and 0 for the others, so this is how
+ * strongly it picks each class rather than a calibrated probability.
+ */
+
+/**
+ * @brief Propagates batches of images through a trained network on a pool of threads, and ranks the classes of each
+ *        image. Used by both `BatchInference` and `InferenceServer`.
+ */
+class BatchClassifier {
+  public:
+    /**
+     * @brief Number of most likely classes ranked for every image, at least 1 is always ranked for the prediction
+     */
+    int top_k = 0;
+
+    /**
+     * @brief Layers with more of their blocks left than this are faster with the dense weights. Two images at a time,
+     *        pixels are listed from about 3 in 5 rows of the first layer, but every weight read is used twice: at 20% of
+     *        the blocks the sparse kernel went from 400k to 800k images/s for a 784 x 40 layer and was about as fast as
+     *        the dense weights for a 784 x 256 layer.
+     */
+    static constexpr float MAX_SPARSE_DENSITY = 0.2f;
+
+    /**
+     * @param network Network to classify with, it isn't changed and must outlive the classifier
+     * @param threads Number of threads propagating each batch
+     * @param sparse Propagate layers that are mostly pruned with block sparse copies of their weights (see 🛈 Block
+     *               Sparse Weights), false to always use the dense weights
+     */
+    BatchClassifier(const Network &network, int threads, bool sparse = true)
+        : network(network), thread_pool(max(1, threads)), sparse_weights(network.layers.size()) {
+        int highest_rank = 0;
+        for (int l = 1; l < network.layers.size(); l++) {
+            // the weights of a low-rank layer are a product, they're never sparse
+            if (sparse && network.layers[l]->rank == 0 && network.layers[l]->kind == Layer::Dense) {
+                sparse_weights[l] = BlockSparseWeights::if_sparse(*network.layers[l], MAX_SPARSE_DENSITY);
+            }
+            highest_rank = max(highest_rank, network.layers[l]->rank);
+        }
+
+        activations.assign(thread_pool.size(), vector<vector<float>>(network.layers.size()));
+        for (auto &thread_activations : activations) {
+            for (int l = 1; l < network.layers.size(); l++) {
+                thread_activations[l].assign((size_t)TILE_ROWS * network.layers[l]->size, 0.0f);
+            }
+        }
+
+        factor_tiles.assign(thread_pool.size(), vector<float>((size_t)TILE_ROWS * highest_rank));
+
+        int widest_input = 0;
+        for (int l = 1; l < network.layers.size(); l++) {
+            widest_input = max({widest_input, network.layers[l]->previous_layer_size, network.layers[l]->rank});
+        }
+        listed_rows.assign(thread_pool.size(), vector<int>(widest_input));
+        listed_values.assign(thread_pool.size(), vector<float>((size_t)widest_input * LISTED_IMAGES));
+    }
+
+    int threads() const { return thread_pool.size(); }
+
+    /**
+     * @brief Number of layers propagated with block sparse copies of their weights
+     */
+    int sparse_layers() const {
+        return count_if(sparse_weights.begin(), sparse_weights.end(), [](const auto &weights) { return weights != NULL; });
+    }
+
+    /**
+     * @brief Number of values in each image
+     */
+    int input_size() const { return network.layers[0]->size; }
+
+    /**
+     * @brief Number of classes, the size of the output layer
+     */
+    int classes() const { return network.layers.back()->size; }
+
+    /**
+     * @brief Number of classes ranked for each image, the stride of `top_classes` and `top_probabilities`
+     */
+    int ranked() const { return max(1, top_k); }
+
+    /**
+     * @brief Propagate a batch of images through the network and rank the classes of each
+     *
+     * @param input Every image of the batch, one after another, already scaled
+     * @param count Number of images in the batch
+     * @param predictions Where to write the most likely class of each image, `count` values
+     * @param top_classes Where to write the `ranked()` most likely classes of each image, most likely first
+     * @param top_probabilities Where to write the probability of each of `top_classes`
+     */
+    void classify(const float *input, int count, int32_t *predictions, int32_t *top_classes, float *top_probabilities) {
+        if (top_k < 0 || top_k > classes()) {
+            throw invalid_argument("Top-k must be between 0 and the number of classes (" + to_string(classes()) + ")");
+        }
+
+        const int threads = thread_pool.size();
+        const int values = input_size();
+        const int stride = ranked();
+
+        thread_pool.run_on_each_thread([&](int t) {
+            const int begin = (long)count * t / threads;
+            const int end = (long)count * (t + 1) / threads;
+            vector<vector<float>> &tile = activations[t];
+
+            for (int row = begin; row < end; row += TILE_ROWS) {
+                const int rows = min(TILE_ROWS, end - row);
+
+                const float *in = input + (size_t)row * values;
+                int in_width = values;
+
+                for (int l = 1; l < network.layers.size(); l++) {
+                    const Layer *layer = network.layers[l];
+                    float *out = tile[l].data();
+
+                    if (layer->kind != Layer::Dense) {
+                        for (int r = 0; r < rows; r++) {
+                            layer->propagate(in + (size_t)r * in_width, out + (size_t)r * layer->size);
+                        }
+                    } else if (sparse_weights[l] != NULL) {
+                        sparse_weights[l]->multiply(in, in_width, out, layer->size, rows);
+                    } else if (layer->rank > 0) {
+                        float *factored = factor_tiles[t].data();
+                        multiply(t, in, in_width, rows, layer->factor_u, layer->rank, factored);
+                        multiply(t, factored, layer->rank, rows, layer->factor_v, layer->size, out);
+                    } else {
+                        multiply(t, in, in_width, rows, layer->parameters, layer->size, out);
+                    }
+                    if (layer->kind == Layer::Dense) {
+                        activate(layer, out, rows);
+                    }
+
+                    in = out;
+                    in_width = layer->size;
+                }
+
+                for (int r = 0; r < rows; r++) {
+                    const size_t index = row + r;
+                    rank(in + (size_t)r * in_width, in_width, top_classes + index * stride,
+                         top_probabilities + index * stride);
+                    predictions[index] = top_classes[index * stride];
+                }
+            }
+        });
+    }
+
+  private:
+    /**
+     * @brief Number of images each thread propagates through the network at a time
+     */
+    static const int TILE_ROWS = 32;
+
+    const Network &network;
+
+    ThreadPool thread_pool;
+
+    /**
+     * @brief Block sparse copy of each layer's weights, NULL for layers propagated with their dense weights
+     */
+    vector<unique_ptr<BlockSparseWeights>> sparse_weights;
+
+    /**
+     * @brief Activations of every layer of a tile, for each thread. Index 0 (the input layer) is empty, tiles are
+     *        propagated straight from the batch.
+     */
+    vector<vector<vector<float>>> activations;
+
+    /**
+     * @brief A tile of inputs times U of a low-rank layer, for each thread, as wide as the highest rank
+     */
+    vector<vector<float>> factor_tiles;
+
+    /**
+     * @brief Row and values of each input listed by `multiply()`, for each thread
+     */
+    vector<vector<int>> listed_rows;
+    vector<vector<float>> listed_values;
+
+    /**
+     * @brief out = a tile of inputs · matrix, see 🛈 Batched Forward Pass
+     *
+     * @param thread Thread multiplying, whose lists are used
+     * @param in Inputs of the first image of the tile, `inputs` of them
+     * @param inputs Number of inputs of each image, and rows of the matrix
+     * @param images Number of images in the tile
+     * @param matrix Stored row by row
+     * @param size Number of columns of the matrix, and outputs of each image
+     * @param out Where to write the outputs of every image, one after another
+     */
+    void multiply(int thread, const float *in, int inputs, int images, const float *matrix, int size, float *out) {
+        int *__restrict listed = listed_rows[thread].data();
+        float *__restrict values = listed_values[thread].data();
+
+        int image = 0;
+        for (; image + LISTED_IMAGES <= images; image += LISTED_IMAGES) {
+            const float *first = in + (size_t)image * inputs;
+
+            // every input is written, but only the ones that aren't 0 for some image are counted
+            int count = 0;
+            for (int x = 0; x < inputs; x++) {
+                bool any = false;
+                for (int i = 0; i < LISTED_IMAGES; i++) {
+                    const float value = first[(size_t)i * inputs + x];
+                    values[(size_t)count * LISTED_IMAGES + i] = value;
+                    any |= value != 0;
+                }
+                listed[count] = x;
+                count += any;
+            }
+
+            listed_rows_multiply_images(count, listed, values, matrix, size, out + (size_t)image * size, size);
+        }
+
+        for (; image < images; image++) {
+            const float *single = in + (size_t)image * inputs;
+
+            int count = 0;
+            for (int x = 0; x < inputs; x++) {
+                listed[count] = x;
+                values[count] = single[x];
+                count += single[x] != 0;
+            }
+
+            listed_rows_multiply(count, listed, values, matrix, size, out + (size_t)image * size);
+        }
+    }
+
+    /**
+     * @brief Add biases to a tile of a layer's outputs and apply its activation function
+     */
+    static void activate(const Layer *layer, float *out, int rows) {
+        for (int r = 0; r < rows; r++) {
+            float *row = out + (size_t)r * layer->size;
+
+            if (layer->activation_function == Layer::ReLU) {
+                for (int x = 0; x < layer->size; x++) {
+                    row[x] = ActivationFunctions::ReLU(row[x] + layer->biases[x]);
+                }
+            } else {
+                for (int x = 0; x < layer->size; x++) {
+                    row[x] = ActivationFunctions::sigmoid(row[x] + layer->biases[x]);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Find the most likely classes of one image from its output activations, and their probabilities
+     */
+    void rank(const float *output, int size, int32_t *classes, float *probabilities) const {
+        const int ranked = this->ranked();
+
+        float sum = 0;
+        for (int x = 0; x < size; x++) {
+            sum += max(output[x], 0.0f);
+        }
+
+        // insertion into the sorted top classes, a class only moves ahead of another if its activation is higher, so
+        // ties go to the lower class like in `Trainer::test_network()`
+        int found = 0;
+        for (int x = 0; x < size; x++) {
+            int position = found;
+            while (position > 0 && output[x] > output[classes[position - 1]]) {
+                position--;
+            }
+            if (position >= ranked) {
+                continue;
+            }
+
+            for (int y = min(found, ranked - 1); y > position; y--) {
+                classes[y] = classes[y - 1];
+            }
+            classes[position] = x;
+            found = min(found + 1, ranked);
+        }
+
+        for (int k = 0; k < ranked; k++) {
+            probabilities[k] = sum > 0 ? max(output[classes[k]], 0.0f) / sum : 1.0f / size;
+        }
+    }
+};
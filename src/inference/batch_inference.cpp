@@ -0,0 +1,327 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../exceptions.h"
+#include "../logging.h"
+#include "../math_functions.cpp"
+#include "../network.cpp"
+#include "batch_classifier.cpp"
+#include "inference_context.cpp"
+#include "input_file.cpp"
+
+using namespace std;
+
+/**
+ *?                             ==================================================
+ *?                                            🛈 Batch Inference
+ *?                             ==================================================
+ *
+ * Classifying a file works through it a batch of images at a time, so files far larger than memory can be classified.
+ * While one batch is propagated through the network, the next batch is read from the input file and the results of the
+ * previous batch are written out on another thread, so reading and writing overlap with the forward pass (see 🛈 Batched
+ * Forward Pass).
+ *
+ * Results are written as CSV, or as binary records of native int32 and float32 values:
+ *
+ *      | prediction | class 1 | probability 1 | ... | class k | probability k |
+ *
+ * for top-k probabilities, or just the prediction when k is 0.
+ */
+
+/**
+ * @brief Classifies every image in an input file with a trained network, writing the prediction (and optionally the k
+ *        most likely classes) of each one to an output file
+ */
+class BatchInference {
+  public:
+    enum Format { CSV, Binary };
+
+    /**
+     * @brief Number of images read from the input file at a time
+     */
+    int batch_size = 1024;
+
+    /**
+     * @brief Number of most likely classes written for every image along with their probabilities, 0 for only the
+     *        prediction
+     */
+    int top_k = 0;
+
+    Format format = CSV;
+
+    /**
+     * @brief Parse an output format as given on the command line (csv, binary)
+     */
+    static Format parse_format(const string &name) {
+        if (name == "csv") {
+            return CSV;
+        } else if (name == "binary") {
+            return Binary;
+        }
+
+        throw invalid_argument("Unknown output format '" + name + "', expected csv or binary");
+    }
+
+    /**
+     * @param network Network to classify with, it isn't changed
+     * @param threads Number of threads propagating each batch
+     */
+    BatchInference(const Network &network, int threads) : network(network), classifier(network, threads) {}
+
+    /**
+     * @brief Classify every image in an input file
+     *
+     * @param input File to read images from, its images must be the size of the network's input layer
+     * @param output_path Path of the file to write results to, replaced if it exists
+     *
+     * @return Images classified per second
+     */
+    double run(InputFile &input, const string &output_path) {
+        const int outputs = classifier.classes();
+
+        if (input.values != classifier.input_size()) {
+            throw invalid_argument("The network has " + to_string(classifier.input_size()) +
+                                   " inputs but input images have " + to_string(input.values) + " values");
+        }
+        if (batch_size < 1) {
+            throw invalid_argument("Batch size must be at least 1");
+        }
+        if (top_k < 0 || top_k > outputs) {
+            throw invalid_argument("Top-k must be between 0 and the number of classes (" + to_string(outputs) + ")");
+        }
+
+        ofstream output(output_path, ios::out | ios::binary | ios::trunc);
+        if (!output.good()) {
+            throw invalid_argument("Unable to create output file '" + output_path + "'");
+        }
+
+        classifier.top_k = top_k;
+        allocate(input.values);
+        io_error = NULL;
+
+        if (format == CSV) {
+            output << "index,prediction";
+            for (int k = 1; k <= top_k; k++) {
+                output << ",class_" << k << ",probability_" << k;
+            }
+            output << "\n";
+        }
+
+        SPDLOG_INFO("Classifying {0} images in batches of {1} with {2} threads", input.records, batch_size,
+                    classifier.threads());
+
+        auto t_start = chrono::high_resolution_clock::now();
+        double propagate_seconds = 0;
+
+        // batches alternate between the two buffers, one is propagated while the other is read into and written from
+        int current = 0;
+        int count = input.read(batches[current].input.data(), batch_size);
+        long first_record = 0;
+
+        while (count > 0) {
+            Batch &batch = batches[current];
+            Batch &other = batches[1 - current];
+            int next_count = 0;
+
+            thread io([&] {
+                try {
+                    if (other.count > 0) {
+                        write(other, output);
+                    }
+                    next_count = input.read(other.input.data(), batch_size);
+                } catch (...) {
+                    io_error = current_exception();
+                }
+            });
+
+            auto t_propagate = chrono::high_resolution_clock::now();
+            batch.first_record = first_record;
+            batch.count = count;
+            classifier.classify(batch.input.data(), batch.count, batch.predictions.data(), batch.top_classes.data(),
+                                batch.top_probabilities.data());
+            propagate_seconds +=
+                chrono::duration<double>(chrono::high_resolution_clock::now() - t_propagate).count();
+
+            // reading or writing failed, throw the error from this thread
+            io.join();
+            if (io_error != NULL) {
+                rethrow_exception(io_error);
+            }
+
+            other.count = 0;
+            first_record += count;
+            count = next_count;
+            current = 1 - current;
+        }
+
+        // the last batch classified hasn't been written yet
+        Batch &last = batches[1 - current];
+        if (last.count > 0) {
+            write(last, output);
+        }
+
+        output.close();
+        if (output.fail()) {
+            throw invalid_argument("Unable to write output file '" + output_path + "'");
+        }
+
+        double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - t_start).count();
+        double images_per_second = first_record / max(seconds, 1e-9);
+
+        SPDLOG_INFO("Classified {0} images in {1:.2f} s: {2:.0f} images/s ({3:.0f} images/s propagating, the rest is "
+                    "waiting on reading and writing)",
+                    first_record, seconds, images_per_second, first_record / max(propagate_seconds, 1e-9));
+        SPDLOG_INFO("Wrote results to {0}", output_path);
+
+        return images_per_second;
+    }
+
+    /**
+     * @brief Classify the first images of a file one at a time with an `InferenceContext`, and log how long a single
+     *        prediction takes
+     *
+     * @param input File to read images from
+     * @param count Most images to classify
+     */
+    void log_single_image_latency(InputFile &input, int count) {
+        const int values = classifier.input_size();
+        count = (int)min<long>(count, input.records);
+        if (count <= 0 || input.values != values) {
+            return;
+        }
+
+        vector<uint8_t> pixels;
+        vector<float> scaled;
+        if (input.type == InputFile::UnsignedByte) {
+            pixels.resize((size_t)count * values);
+            input.read_bytes(pixels.data(), count);
+        } else {
+            scaled.resize((size_t)count * values);
+            input.read(scaled.data(), count);
+        }
+
+        InferenceContext context(network);
+        vector<float> latencies(count);
+        long sum = 0; // used below, so the predictions can't be optimized away
+
+        for (int x = 0; x < count; x++) {
+            auto t_start = chrono::steady_clock::now();
+            if (pixels.empty()) {
+                sum += context.predict(scaled.data() + (size_t)x * values);
+            } else {
+                sum += context.predict(pixels.data() + (size_t)x * values);
+            }
+            latencies[x] = chrono::duration<float, micro>(chrono::steady_clock::now() - t_start).count();
+        }
+
+        double mean = 0;
+        for (float latency : latencies) {
+            mean += latency / count;
+        }
+
+        SPDLOG_INFO("Classified {0} images one at a time: latency p50 {1:.2f} µs, p99 {2:.2f} µs, mean {3:.2f} µs "
+                    "(average class {4:.2f})",
+                    count, percentile(latencies, 0.50), percentile(latencies, 0.99), mean, sum / (double)count);
+    }
+
+  private:
+    /**
+     * @brief A batch of images, and the results of classifying it
+     */
+    struct Batch {
+        /**
+         * @brief Every image of the batch, one after another
+         */
+        vector<float> input;
+
+        /**
+         * @brief Index of the first image of the batch in the input file
+         */
+        long first_record = 0;
+
+        /**
+         * @brief Number of images in the batch, 0 once its results have been written
+         */
+        int count = 0;
+
+        vector<int32_t> predictions;
+
+        /**
+         * @brief The `top_k` most likely classes of every image, most likely first, and their probabilities
+         */
+        vector<int32_t> top_classes;
+        vector<float> top_probabilities;
+
+        /**
+         * @brief Text or bytes of the results, reused for every batch
+         */
+        string text;
+    };
+
+    const Network &network;
+
+    BatchClassifier classifier;
+
+    Batch batches[2];
+
+    /**
+     * @brief Set by the thread reading and writing if it fails, so the error can be thrown from the calling thread
+     */
+    exception_ptr io_error = NULL;
+
+    void allocate(int values) {
+        const int ranked = classifier.ranked();
+
+        for (Batch &batch : batches) {
+            batch.input.assign((size_t)batch_size * values, 0.0f);
+            batch.predictions.assign(batch_size, 0);
+            batch.top_classes.assign((size_t)batch_size * ranked, 0);
+            batch.top_probabilities.assign((size_t)batch_size * ranked, 0.0f);
+            batch.count = 0;
+        }
+    }
+
+    /**
+     * @brief Write the results of a batch, usually from the thread reading the next batch
+     */
+    void write(Batch &batch, ofstream &output) {
+        string &text = batch.text;
+        text.clear();
+
+        if (format == CSV) {
+            char field[32];
+            for (int r = 0; r < batch.count; r++) {
+                text.append(field,
+                            snprintf(field, sizeof(field), "%ld,%d", batch.first_record + r, batch.predictions[r]));
+
+                for (int k = 0; k < top_k; k++) {
+                    text.append(field, snprintf(field, sizeof(field), ",%d,%.6f", batch.top_classes[(size_t)r * top_k + k],
+                                                batch.top_probabilities[(size_t)r * top_k + k]));
+                }
+                text += '\n';
+            }
+        } else {
+            for (int r = 0; r < batch.count; r++) {
+                text.append((const char *)&batch.predictions[r], sizeof(int32_t));
+
+                for (int k = 0; k < top_k; k++) {
+                    text.append((const char *)&batch.top_classes[(size_t)r * top_k + k], sizeof(int32_t));
+                    text.append((const char *)&batch.top_probabilities[(size_t)r * top_k + k], sizeof(float));
+                }
+            }
+        }
+
+        output.write(text.data(), text.size());
+        if (output.fail()) {
+            throw invalid_argument("Unable to write results to the output file");
+        }
+    }
+};
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../exceptions.h"
+#include "../logging.h"
+#include "../math_functions.cpp"
+#include "../utils/socket.cpp"
+#include "inference_server.cpp"
+#include "input_file.cpp"
+
+using namespace std;
+
+/**
+ * @brief Load tests an `InferenceServer`. Every connection sends one request at a time and sends the next as soon as
+ *        the response arrives, so the number of connections is the number of requests in flight.
+ */
+class InferenceClient {
+  public:
+    /**
+     * @brief Number of connections sending requests at the same time
+     */
+    int connections = 4;
+
+    /**
+     * @brief Total number of requests to send, split between the connections
+     */
+    long requests = 10000;
+
+    /**
+     * @brief Number of images in each request
+     */
+    int images_per_request = 1;
+
+    /**
+     * @brief Most images loaded from the input file, requests cycle through them
+     */
+    int max_images = 65536;
+
+    /**
+     * @param address Address of the server, `unix:/path/to/socket` or `host:port`
+     */
+    InferenceClient(const string &address) : address(address) {}
+
+    /**
+     * @brief Send every request and log the latency and throughput seen by the client, then the server's counters
+     *
+     * @param input File to take the images sent from
+     */
+    void run(InputFile &input) {
+        if (connections < 1 || requests < 1 || images_per_request < 1) {
+            throw invalid_argument("Connections, requests and images per request must be at least 1");
+        }
+
+        load_images(input);
+
+        vector<vector<float>> latencies(connections);
+        vector<exception_ptr> errors(connections);
+        vector<thread> threads;
+        atomic<long> next_request{0};
+
+        SPDLOG_INFO("Sending {0} requests of {1} images to {2} over {3} connections", requests, images_per_request,
+                    address, connections);
+
+        auto t_start = chrono::steady_clock::now();
+
+        for (int c = 0; c < connections; c++) {
+            latencies[c].reserve(requests / connections + 1);
+
+            threads.emplace_back([&, c] {
+                try {
+                    send_requests(next_request, latencies[c]);
+                } catch (...) {
+                    errors[c] = current_exception();
+                }
+            });
+        }
+
+        for (thread &worker : threads) {
+            worker.join();
+        }
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - t_start).count();
+
+        for (exception_ptr error : errors) {
+            if (error != NULL) {
+                rethrow_exception(error);
+            }
+        }
+
+        vector<float> all;
+        for (const vector<float> &connection_latencies : latencies) {
+            all.insert(all.end(), connection_latencies.begin(), connection_latencies.end());
+        }
+        float slowest = *max_element(all.begin(), all.end());
+
+        SPDLOG_INFO("{0} requests in {1:.2f} s: {2:.0f} requests/s, {3:.0f} images/s, latency p50 {4:.0f} µs, p99 {5:.0f} "
+                    "µs, max {6:.0f} µs",
+                    all.size(), seconds, all.size() / seconds, all.size() * images_per_request / seconds,
+                    percentile(all, 0.50), percentile(all, 0.99), slowest);
+
+        log_server_counters();
+    }
+
+  private:
+    string address;
+
+    /**
+     * @brief Images sent to the server, as bytes
+     */
+    vector<uint8_t> pixels;
+    int values = 0;
+    int image_count = 0;
+
+    void load_images(InputFile &input) {
+        values = input.values;
+        image_count = (int)min<long>(input.records, max_images);
+
+        if (image_count < images_per_request) {
+            throw invalid_argument("The input file has fewer images than a single request");
+        }
+
+        pixels.resize((size_t)image_count * values);
+
+        if (input.type == InputFile::UnsignedByte) {
+            input.read_bytes(pixels.data(), image_count);
+            return;
+        }
+
+        vector<float> scaled(pixels.size());
+        input.read(scaled.data(), image_count);
+
+        // the server takes the same bytes as the IDX files, convert back from the scaled values
+        for (size_t x = 0; x < scaled.size(); x++) {
+            pixels[x] = (uint8_t)lround(min(max(scaled[x], 0.0f), 1.0f) * 255);
+        }
+    }
+
+    /**
+     * @brief Connect and read the server's hello, checking it takes images the size of the input file's
+     */
+    int connect_to_server() {
+        int socket = connect_to(address, 10);
+
+        InferenceServer::Hello hello;
+        if (!receive_all(socket, &hello, sizeof(hello)) || hello.magic != InferenceServer::MAGIC ||
+            hello.version != InferenceServer::VERSION) {
+            close(socket);
+            throw communication_error("'" + address + "' is not an inference server");
+        }
+        if (hello.input_size != values) {
+            close(socket);
+            throw invalid_argument("The server takes images of " + to_string(hello.input_size) +
+                                   " values, but input images have " + to_string(values));
+        }
+        if (hello.max_request_images < images_per_request) {
+            close(socket);
+            throw invalid_argument("The server takes at most " + to_string(hello.max_request_images) +
+                                   " images per request");
+        }
+
+        return socket;
+    }
+
+    /**
+     * @brief Send requests over one connection until every request has been sent, runs on its own thread
+     */
+    void send_requests(atomic<long> &next_request, vector<float> &latencies) {
+        int socket = connect_to_server();
+
+        vector<InferenceServer::Prediction> results(images_per_request);
+        const int starts = image_count - images_per_request + 1;
+
+        for (long r = next_request++; r < requests; r = next_request++) {
+            const uint8_t *images = pixels.data() + (size_t)(r * images_per_request % starts) * values;
+
+            auto t_start = chrono::steady_clock::now();
+
+            InferenceServer::Header header = {InferenceServer::MAGIC, InferenceServer::Classify,
+                                              (uint32_t)images_per_request, 0};
+            bool sent = send_all(socket, &header, sizeof(header)) &&
+                        send_all(socket, images, (size_t)images_per_request * values);
+
+            bool received = sent && receive_all(socket, &header, sizeof(header));
+            if (received && (header.field != InferenceServer::Ok || header.count != images_per_request)) {
+                close(socket);
+                throw communication_error("The server rejected a request");
+            }
+            if (!received || !receive_all(socket, results.data(), results.size() * sizeof(results[0]))) {
+                close(socket);
+                throw communication_error("The server closed the connection");
+            }
+
+            latencies.push_back(chrono::duration<float, micro>(chrono::steady_clock::now() - t_start).count());
+        }
+
+        close(socket);
+    }
+
+    void log_server_counters() {
+        int socket = connect_to_server();
+
+        InferenceServer::Header header = {InferenceServer::MAGIC, InferenceServer::Stats, 0, 0};
+        InferenceServer::Counters counters;
+
+        bool received = send_all(socket, &header, sizeof(header)) && receive_all(socket, &header, sizeof(header)) &&
+                        receive_all(socket, &counters, sizeof(counters));
+        close(socket);
+
+        if (!received) {
+            throw communication_error("Unable to read the server's counters");
+        }
+
+        SPDLOG_INFO("Server: {0} requests, {1} images in {2} batches ({3:.1f} images per batch) over {4:.1f} s, latency "
+                    "p50 {5:.0f} µs, p99 {6:.0f} µs",
+                    counters.requests, counters.images, counters.batches,
+                    counters.batches > 0 ? counters.images / (double)counters.batches : 0.0, counters.seconds,
+                    counters.p50_us, counters.p99_us);
+    }
+};
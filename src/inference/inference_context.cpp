@@ -0,0 +1,373 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "../block_sparse.cpp"
+#include "../exceptions.h"
+#include "../kernel_clones.h"
+#include "../math_functions.cpp"
+#include "../network.cpp"
+
+using namespace std;
+
+/**
+ *?                             ==================================================
+ *?                                       🛈 Single Image Inference
+ *?                             ==================================================
+ *
+ * `Network::propagate()` needs a buffer for the activations of every layer, all set to 0 before every record. To classify
+ * one image as fast as possible, an inference context allocates two buffers as wide as the widest layer once, and
+ * propagates back and forth between them: layer 1 writes to the first buffer, layer 2 reads it and writes to the second,
+ * layer 3 writes to the first again, and so on.
+ *
+ * Inputs that are 0 (blank pixels, inactive ReLUs) are skipped, adding 0 wouldn't change anything. Rather than branching
+ * on every input, which mispredicts on about every other pixel, the inputs that aren't 0 are first listed along with
+ * their row of weights, without any branches. The outputs are then computed `INFERENCE_COLUMNS` at a time: the sums stay
+ * in registers while every listed input is multiplied with the matching weights of its row, 8 consecutive weights being
+ * a single fused multiply-add with AVX2, and each output is written once at the end, so nothing has to be zeroed first.
+ * The kernel is compiled for AVX2 with FMA and for the baseline instruction set (see `KERNEL_CLONES`).
+ *
+ * Pixels are scaled to between 0 and 1 through a table as they're listed, giving exactly the values `TrainingData`
+ * scales them to. Every output gets its products added in the same order as when testing, so predictions are the same
+ * apart from the rounding of fused multiply-adds.
+ *
+ * A low-rank layer (see 🛈 Low-Rank Layers) is propagated the same way in two steps, through U into a third buffer as
+ * wide as the highest rank, then through V. Convolution and pooling layers (see 🛈 Convolution Layers) write every output
+ * and apply their own activation function, when the first layer is one the pixels are scaled into a buffer first.
+ */
+
+/**
+ * @brief Number of outputs computed at once, the sums of a layer of 40 neurons take 4 AVX2 registers for the first 32
+ *        outputs, then 1 for the last 8
+ */
+const int INFERENCE_COLUMNS = 32;
+
+/**
+ * @brief Number of images of a tile propagated together by `listed_rows_multiply_images()`, each row of weights read
+ *        is used for all of them. An input is listed when it isn't 0 for any of them, about 300 of the 784 pixels of
+ *        one MNIST digit, 480 of two and 650 of four, so more images skip too few inputs to make up for reading the
+ *        weights less often.
+ */
+const int LISTED_IMAGES = 2;
+
+/**
+ * @brief Number of outputs of each image computed at once with `LISTED_IMAGES` images, their sums take 8 AVX2 registers
+ */
+const int LISTED_IMAGE_COLUMNS = 32;
+
+/**
+ * @brief Compute `Columns` outputs of `Images` images from the listed inputs, starting at `column`
+ *
+ * @param values `Images` values of each listed input, one for each image
+ * @param out_stride Distance between the outputs of consecutive images
+ */
+template <int Images, int Columns>
+inline __attribute__((always_inline)) void listed_rows_columns(int count, const int *rows, const float *values,
+                                                               const float *matrix, int size, int column,
+                                                               float *__restrict out, size_t out_stride) {
+    float sums[Images][Columns] = {};
+
+    for (int k = 0; k < count; k++) {
+        const float *__restrict weights = matrix + (size_t)rows[k] * size + column;
+
+        // unrolled, so the outputs stay in registers rather than the loop over inputs being unrolled and jammed into it
+#pragma GCC unroll 8
+        for (int i = 0; i < Images; i++) {
+            const float a = values[(size_t)k * Images + i];
+#pragma GCC unroll 32
+            for (int c = 0; c < Columns; c++) {
+                sums[i][c] += a * weights[c];
+            }
+        }
+    }
+
+    for (int i = 0; i < Images; i++) {
+        for (int c = 0; c < Columns; c++) {
+            out[i * out_stride + column + c] = sums[i][c];
+        }
+    }
+}
+
+/**
+ * @brief out = the listed inputs · their rows of a matrix
+ *
+ * @param count Number of listed inputs
+ * @param rows Row of the matrix of each listed input, in order
+ * @param values Value of each listed input
+ * @param matrix Stored row by row
+ * @param size Number of columns of the matrix, and outputs
+ */
+KERNEL_CLONES inline void listed_rows_multiply(int count, const int *rows, const float *values, const float *matrix,
+                                               int size, float *out) {
+    int column = 0;
+    for (; column + INFERENCE_COLUMNS <= size; column += INFERENCE_COLUMNS) {
+        listed_rows_columns<1, INFERENCE_COLUMNS>(count, rows, values, matrix, size, column, out, 0);
+    }
+    for (; column + 8 <= size; column += 8) {
+        listed_rows_columns<1, 8>(count, rows, values, matrix, size, column, out, 0);
+    }
+    for (; column < size; column++) {
+        listed_rows_columns<1, 1>(count, rows, values, matrix, size, column, out, 0);
+    }
+}
+
+/**
+ * @brief out = the listed inputs · their rows of a matrix, for `LISTED_IMAGES` images at once. An input is listed when
+ *        it isn't 0 for at least one of the images, the others add a product of 0.
+ *
+ * @param values `LISTED_IMAGES` values of each listed input, one for each image
+ * @param out Outputs of the first image, `size` of them
+ * @param out_stride Distance between the outputs of consecutive images
+ */
+KERNEL_CLONES inline void listed_rows_multiply_images(int count, const int *rows, const float *values,
+                                                      const float *matrix, int size, float *out, size_t out_stride) {
+    int column = 0;
+    for (; column + LISTED_IMAGE_COLUMNS <= size; column += LISTED_IMAGE_COLUMNS) {
+        listed_rows_columns<LISTED_IMAGES, LISTED_IMAGE_COLUMNS>(count, rows, values, matrix, size, column, out,
+                                                                 out_stride);
+    }
+    for (; column + 8 <= size; column += 8) {
+        listed_rows_columns<LISTED_IMAGES, 8>(count, rows, values, matrix, size, column, out, out_stride);
+    }
+    for (; column < size; column++) {
+        listed_rows_columns<LISTED_IMAGES, 1>(count, rows, values, matrix, size, column, out, out_stride);
+    }
+}
+
+/**
+ * @brief Classifies one image at a time with no memory allocated and no buffers cleared per image. One context can only
+ *        be used by one thread at a time, give each thread its own.
+ */
+class InferenceContext {
+  public:
+    /**
+     * @brief Layers with more of their blocks left than this are faster with the dense weights. One image at a time,
+     *        pixels are listed from about 2 in 5 rows of the first layer, the sparse kernel went from 2.7 to 1.1 µs at
+     *        20% of the blocks of a 784 x 40 layer but was still as slow as the dense weights for a 784 x 256 layer.
+     */
+    static constexpr float MAX_SPARSE_DENSITY = 0.2f;
+
+    /**
+     * @param network Network to classify with. It isn't copied, so it must outlive the context and not be trained while
+     *                the context is used.
+     * @param sparse Propagate layers that are mostly pruned with block sparse copies of their weights (see 🛈 Block
+     *               Sparse Weights), false to always use the dense weights
+     */
+    InferenceContext(const Network &network, bool sparse = true) : network(network), sparse_weights(network.layers.size()) {
+        if (network.layers.size() < 2) {
+            throw invalid_argument("Network must contain at least 2 layers");
+        }
+
+        int widest = 0, highest_rank = 0;
+        for (int l = 1; l < network.layers.size(); l++) {
+            widest = max(widest, network.layers[l]->size);
+            highest_rank = max(highest_rank, network.layers[l]->rank);
+
+            if (sparse && network.layers[l]->rank == 0 && network.layers[l]->kind == Layer::Dense) {
+                sparse_weights[l] = BlockSparseWeights::if_sparse(*network.layers[l], MAX_SPARSE_DENSITY);
+            }
+        }
+
+        buffers[0].assign(widest, 0.0f);
+        buffers[1].assign(widest, 0.0f);
+        factored.assign(highest_rank, 0.0f);
+        listed_rows.assign(max(widest, network.layers[0]->size), 0);
+        listed_values.assign(max(widest, network.layers[0]->size), 0.0f);
+
+        if (network.layers[1]->kind != Layer::Dense) {
+            scaled.assign(network.layers[0]->size, 0.0f);
+        }
+
+        for (int value = 0; value < 256; value++) {
+            scale[value] = value / 255.0f; // normalize input between 0 and 1
+        }
+    }
+
+    /**
+     * @brief Classify an image
+     *
+     * @param pixels Every pixel of the image as a byte, the way they're stored in IDX files. There must be as many as
+     *               the network has inputs.
+     *
+     * @return Index of the output neuron with the highest activation
+     */
+    int predict(const uint8_t *pixels) { return propagate(pixels); }
+
+    /**
+     * @brief Classify an image that has already been scaled
+     *
+     * @param input Every value of the image, between 0 and 1
+     *
+     * @return Index of the output neuron with the highest activation
+     */
+    int predict(const float *input) { return propagate(input); }
+
+    /**
+     * @brief Number of layers propagated with block sparse copies of their weights
+     */
+    int sparse_layers() const {
+        return count_if(sparse_weights.begin(), sparse_weights.end(), [](const auto &weights) { return weights != NULL; });
+    }
+
+    /**
+     * @brief Output layer activations of the last image classified
+     */
+    const float *outputs() const { return output; }
+
+    /**
+     * @brief Probability of a class for the last image classified, its output activation divided by the sum of the
+     *        output activations, with negative activations counted as 0 (see 🛈 Batched Forward Pass)
+     */
+    float probability(int label) const {
+        const int size = network.layers.back()->size;
+
+        float sum = 0;
+        for (int x = 0; x < size; x++) {
+            sum += max(output[x], 0.0f);
+        }
+
+        return sum > 0 ? max(output[label], 0.0f) / sum : 1.0f / size;
+    }
+
+  private:
+    const Network &network;
+
+    /**
+     * @brief Block sparse copy of each layer's weights, NULL for layers propagated with their dense weights
+     */
+    vector<unique_ptr<BlockSparseWeights>> sparse_weights;
+
+    /**
+     * @brief Activations of alternate layers, each as wide as the widest layer
+     */
+    vector<float> buffers[2];
+
+    /**
+     * @brief Inputs of a low-rank layer times its U, as wide as the highest rank
+     */
+    vector<float> factored;
+
+    /**
+     * @brief Row and value of each input that isn't 0, for the multiplication in progress
+     */
+    vector<int> listed_rows;
+    vector<float> listed_values;
+
+    /**
+     * @brief Pixels of the image once scaled, when the first layer is a convolution or pooling layer
+     */
+    vector<float> scaled;
+
+    /**
+     * @brief Value of every possible pixel once scaled
+     */
+    float scale[256];
+
+    /**
+     * @brief Points into whichever buffer holds the output layer after the last image
+     */
+    const float *output = NULL;
+
+    float value(uint8_t pixel) const { return scale[pixel]; }
+    float value(float input) const { return input; }
+
+    const float *scale_input(const uint8_t *pixels) {
+        for (int x = 0; x < scaled.size(); x++) {
+            scaled[x] = scale[pixels[x]];
+        }
+        return scaled.data();
+    }
+    const float *scale_input(const float *input) { return input; }
+
+    void sparse_multiply(const BlockSparseWeights *weights, const uint8_t *in, float *out) const {
+        weights->multiply(in, scale, out);
+    }
+    void sparse_multiply(const BlockSparseWeights *weights, const float *in, float *out) const {
+        weights->multiply(in, out);
+    }
+
+    template <typename Input> int propagate(const Input *input) {
+        float *out = buffers[0].data();
+        const float *in = NULL;
+
+        for (int l = 1; l < network.layers.size(); l++) {
+            const Layer *layer = network.layers[l];
+
+            if (layer->kind != Layer::Dense) {
+                layer->propagate(l == 1 ? scale_input(input) : in, out);
+            } else {
+                if (l == 1) {
+                    multiply(input, l, out);
+                } else {
+                    multiply(in, l, out);
+                }
+
+                if (layer->activation_function == Layer::ReLU) {
+                    for (int y = 0; y < layer->size; y++) {
+                        out[y] = ActivationFunctions::ReLU(out[y] + layer->biases[y]);
+                    }
+                } else {
+                    for (int y = 0; y < layer->size; y++) {
+                        out[y] = ActivationFunctions::sigmoid(out[y] + layer->biases[y]);
+                    }
+                }
+            }
+
+            in = out;
+            out = out == buffers[0].data() ? buffers[1].data() : buffers[0].data();
+        }
+
+        output = in;
+
+        // same as `Trainer::test_network()`, ties go to the first neuron
+        const int size = network.layers.back()->size;
+        int highest = 0;
+        for (int x = 1; x < size; x++) {
+            if (output[x] > output[highest]) {
+                highest = x;
+            }
+        }
+        return highest;
+    }
+
+    /**
+     * @brief out = in · weights of a layer, without out having to be cleared first
+     */
+    template <typename Input> void multiply(const Input *in, int l, float *__restrict out) {
+        const Layer *layer = network.layers[l];
+
+        if (sparse_weights[l] != NULL) {
+            sparse_multiply(sparse_weights[l].get(), in, out);
+        } else if (layer->rank > 0) {
+            multiply(in, layer->previous_layer_size, layer->factor_u, layer->rank, factored.data());
+            multiply(factored.data(), layer->rank, layer->factor_v, layer->size, out);
+        } else {
+            multiply(in, layer->previous_layer_size, layer->parameters, layer->size, out);
+        }
+    }
+
+    /**
+     * @brief out = in · matrix, without out having to be cleared first
+     *
+     * @param rows Number of inputs, and rows of the matrix
+     * @param matrix Stored row by row
+     * @param size Number of columns of the matrix, and outputs
+     */
+    template <typename Input> void multiply(const Input *in, int rows, const float *matrix, int size, float *out) {
+        int *__restrict listed = listed_rows.data();
+        float *__restrict values = listed_values.data();
+
+        // every input is written, but only the ones that aren't 0 are counted, so the next one overwrites them
+        int count = 0;
+        for (int x = 0; x < rows; x++) {
+            listed[count] = x;
+            values[count] = value(in[x]);
+            count += in[x] != 0;
+        }
+
+        listed_rows_multiply(count, listed, values, matrix, size, out);
+    }
+};
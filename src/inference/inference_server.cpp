@@ -0,0 +1,544 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../exceptions.h"
+#include "../logging.h"
+#include "../math_functions.cpp"
+#include "../network.cpp"
+#include "../utils/allocation_tracker.cpp"
+#include "../utils/socket.cpp"
+#include "batch_classifier.cpp"
+#include "inference_context.cpp"
+
+using namespace std;
+
+/**
+ *?                             ==================================================
+ *?                                           🛈 Inference Server
+ *?                             ==================================================
+ *
+ * The server classifies images for other processes on the same machine, over a Unix domain socket or TCP. Every
+ * connection is served by its own thread, which reads a request, hands it to the batching thread and waits for the
+ * results. The batching thread coalesces requests from every connection into micro-batches: once a request arrives it
+ * waits until either `max_batch_size` images are waiting or the oldest request has waited `max_delay_us`, then propagates
+ * them all through the network at once (see 🛈 Batched Forward Pass). Under load batches fill up straight away and
+ * throughput is that of large batches, when idle a single request only waits `max_delay_us`.
+ *
+ * As soon as a client connects the server sends a `Hello`, then every request and response starts with a `Header`. All
+ * fields are native (host byte order) uint32s:
+ *
+ *      hello:      | MAGIC | VERSION | values per image | classes | most images per request | 0 |
+ *      request:    | MAGIC | type | image count | 0 | pixels, image count x values per image bytes
+ *      response:   | MAGIC | status | image count | 0 | image count x (int32 class, float32 probability)
+ *
+ * A request of type `Stats` has no pixels, and is answered by a response header followed by `Counters`. Any request the
+ * server doesn't understand is answered with status `Invalid`, and the connection is closed.
+ *
+ * Latency is measured from when a request has been read until its response has been written. p50 and p99 are over the
+ * last `LATENCY_WINDOW` requests, and are logged every `stats_interval` seconds along with throughput.
+ */
+
+/**
+ * @brief Serves a trained network to other processes, coalescing concurrent requests into micro-batches
+ */
+class InferenceServer {
+  public:
+    static const uint32_t MAGIC = 0x4E4E444D; // "MDNN" in little endian
+    static const uint32_t VERSION = 1;
+
+    enum RequestType : uint32_t { Classify = 0, Stats = 1 };
+    enum Status : uint32_t { Ok = 0, Invalid = 1 };
+
+    struct Header {
+        uint32_t magic;
+        uint32_t field;
+        uint32_t count;
+        uint32_t reserved;
+    };
+
+    struct Hello {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t input_size;
+        uint32_t classes;
+        uint32_t max_request_images;
+        uint32_t reserved;
+    };
+
+    struct Prediction {
+        int32_t label;
+        float probability;
+    };
+
+    /**
+     * @brief Counters sent in answer to a `Stats` request
+     */
+    struct Counters {
+        uint64_t requests;
+        uint64_t images;
+        uint64_t batches;
+        double seconds;
+        double p50_us;
+        double p99_us;
+    };
+
+    /**
+     * @brief Most images propagated at once
+     */
+    int max_batch_size = 64;
+
+    /**
+     * @brief Longest a request waits for more requests to batch it with, in microseconds
+     */
+    int max_delay_us = 500;
+
+    /**
+     * @brief Most images in a single request
+     */
+    int max_request_images = 4096;
+
+    /**
+     * @brief How often throughput and latency are logged, in seconds
+     */
+    double stats_interval = 10;
+
+    /**
+     * @param network Network to classify with, it isn't changed
+     * @param threads Number of threads propagating each batch
+     */
+    InferenceServer(const Network &network, int threads) : classifier(network, threads), context(network) {}
+
+    /**
+     * @brief Serve requests until the process is interrupted (SIGINT or SIGTERM)
+     *
+     * @param address Address to listen on, `unix:/path/to/socket` or `host:port`
+     */
+    void run(const string &address) {
+        if (max_batch_size < 1 || max_delay_us < 0 || max_request_images < 1) {
+            throw invalid_argument("Batch size and request size must be at least 1, and the delay can't be negative");
+        }
+
+        string unix_socket_path;
+        listen_socket = open_listen_socket(address, 128, unix_socket_path);
+
+        stop_requested = false;
+        signal(SIGINT, handle_signal);
+        signal(SIGTERM, handle_signal);
+
+        start_time = chrono::steady_clock::now();
+        latencies.assign(LATENCY_WINDOW, 0.0f);
+
+        thread batcher(&InferenceServer::run_batches, this);
+
+        SPDLOG_INFO("Serving on {0} with batches of up to {1} images, waiting at most {2} µs for a batch to fill, {3} "
+                    "threads",
+                    address, max_batch_size, max_delay_us, classifier.threads());
+
+        auto next_report = chrono::steady_clock::now() + chrono::duration<double>(stats_interval);
+        Counters reported = counters();
+
+        while (!stop_requested) {
+            pollfd fd = {listen_socket, POLLIN, 0};
+            if (poll(&fd, 1, 200) > 0) {
+                int socket = accept(listen_socket, NULL, NULL);
+                if (socket >= 0) {
+                    set_no_delay(socket);
+                    start_connection(socket);
+                }
+            }
+
+            reap_connections(false);
+
+            if (chrono::steady_clock::now() >= next_report) {
+                Counters current = counters();
+                log_counters(current, reported);
+                reported = current;
+                next_report += chrono::duration<double>(stats_interval);
+            }
+        }
+
+        SPDLOG_INFO("Stopping server");
+
+        close(listen_socket);
+        if (!unix_socket_path.empty()) {
+            unlink(unix_socket_path.c_str());
+        }
+
+        // the batching thread finishes every request already queued, then no connection can wait on it any more
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        queue_changed.notify_all();
+        batcher.join();
+
+        reap_connections(true);
+
+        log_counters(counters(), Counters{});
+
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+    }
+
+  private:
+    /**
+     * @brief Number of most recent requests p50 and p99 latency are calculated over
+     */
+    static const int LATENCY_WINDOW = 65536;
+
+    /**
+     * @brief A request being served, owned by the thread of its connection and reused for every request on it
+     */
+    struct Request {
+        vector<uint8_t> pixels;
+        vector<Prediction> results;
+
+        int count = 0;
+
+        /**
+         * @brief Number of images of the request put in a batch so far, and number classified so far
+         */
+        int batched = 0;
+        int classified = 0;
+
+        chrono::steady_clock::time_point received;
+
+        /**
+         * @brief Notified once every image of the request has been classified
+         */
+        condition_variable finished;
+    };
+
+    /**
+     * @brief Part of a request in the batch being classified
+     */
+    struct Slot {
+        Request *request;
+        int first;
+        int count;
+    };
+
+    struct Connection {
+        int socket;
+        thread worker;
+        atomic<bool> done{false};
+    };
+
+    BatchClassifier classifier;
+
+    /**
+     * @brief Classifies batches of a single image, used only by the batching thread
+     */
+    InferenceContext context;
+
+    int listen_socket = -1;
+
+    static inline atomic<bool> stop_requested{false};
+
+    list<unique_ptr<Connection>> connections;
+
+    /**
+     * @brief Requests waiting to be batched, oldest first
+     */
+    deque<Request *> queue;
+
+    /**
+     * @brief Number of images in `queue` not put in a batch yet
+     */
+    int queued_images = 0;
+
+    bool stopping = false;
+
+    mutex queue_mutex;
+
+    /**
+     * @brief Notified when a request is queued or the server is stopping
+     */
+    condition_variable queue_changed;
+
+    chrono::steady_clock::time_point start_time;
+
+    atomic<uint64_t> requests{0};
+    atomic<uint64_t> images{0};
+    atomic<uint64_t> batches{0};
+
+    /**
+     * @brief Latency of the last `LATENCY_WINDOW` requests in microseconds, a ring buffer
+     */
+    vector<float> latencies;
+    uint64_t latency_count = 0;
+    mutex latency_mutex;
+
+    static void handle_signal(int) { stop_requested = true; }
+
+    void start_connection(int socket) {
+        connections.push_back(make_unique<Connection>());
+        Connection *connection = connections.back().get();
+        connection->socket = socket;
+        connection->worker = thread([this, connection] {
+            serve_connection(connection->socket);
+            connection->done = true;
+        });
+    }
+
+    /**
+     * @brief Join the threads of closed connections, or close and join every connection
+     */
+    void reap_connections(bool all) {
+        for (auto it = connections.begin(); it != connections.end();) {
+            Connection &connection = **it;
+
+            if (all && !connection.done) {
+                // wakes up the connection's thread if it's waiting for a request
+                shutdown(connection.socket, SHUT_RDWR);
+            }
+
+            if (all || connection.done) {
+                connection.worker.join();
+                close(connection.socket);
+                it = connections.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+
+    /**
+     * @brief Serve one connection until it's closed, runs on the connection's own thread
+     */
+    void serve_connection(int socket) {
+        // requests only allocate until their buffers have grown to the largest request on the connection
+        AllocationTracker::Scope scope(AllocationTracker::Background);
+
+        Hello hello = {MAGIC, VERSION, (uint32_t)classifier.input_size(), (uint32_t)classifier.classes(),
+                       (uint32_t)max_request_images, 0};
+        if (!send_all(socket, &hello, sizeof(hello))) {
+            return;
+        }
+
+        Request request;
+        Header header;
+
+        while (receive_all(socket, &header, sizeof(header))) {
+            if (header.magic == MAGIC && header.field == Stats) {
+                Counters current = counters();
+                Header response = {MAGIC, Ok, 0, 0};
+                if (!send_all(socket, &response, sizeof(response)) || !send_all(socket, &current, sizeof(current))) {
+                    return;
+                }
+                continue;
+            }
+
+            if (header.magic != MAGIC || header.field != Classify || header.count < 1 ||
+                header.count > (uint32_t)max_request_images) {
+                Header response = {MAGIC, Invalid, 0, 0};
+                send_all(socket, &response, sizeof(response));
+                return;
+            }
+
+            request.pixels.resize((size_t)header.count * classifier.input_size());
+            if (!receive_all(socket, request.pixels.data(), request.pixels.size())) {
+                return;
+            }
+
+            request.received = chrono::steady_clock::now();
+            request.results.resize(header.count);
+
+            if (!classify(request, header.count)) {
+                return;
+            }
+
+            Header response = {MAGIC, Ok, header.count, 0};
+            if (!send_all(socket, &response, sizeof(response)) ||
+                !send_all(socket, request.results.data(), header.count * sizeof(Prediction))) {
+                return;
+            }
+
+            record_latency(chrono::duration<float, micro>(chrono::steady_clock::now() - request.received).count());
+            requests++;
+            images += header.count;
+        }
+    }
+
+    /**
+     * @brief Queue a request and wait until the batching thread has classified it
+     *
+     * @return Whether the request was classified, false if the server is stopping
+     */
+    bool classify(Request &request, int count) {
+        unique_lock<mutex> lock(queue_mutex);
+        if (stopping) {
+            return false;
+        }
+
+        request.count = count;
+        request.batched = 0;
+        request.classified = 0;
+
+        queue.push_back(&request);
+        queued_images += count;
+        queue_changed.notify_all();
+
+        request.finished.wait(lock, [&request] { return request.classified == request.count; });
+        return true;
+    }
+
+    /**
+     * @brief Batch and classify queued requests until the server stops, runs on its own thread
+     */
+    void run_batches() {
+        AllocationTracker::Scope scope(AllocationTracker::Background);
+
+        const int values = classifier.input_size();
+
+        vector<float> input((size_t)max_batch_size * values);
+        vector<int32_t> predictions(max_batch_size);
+        vector<int32_t> top_classes(max_batch_size);
+        vector<float> top_probabilities(max_batch_size);
+
+        vector<Slot> slots;
+        slots.reserve(max_batch_size);
+
+        while (true) {
+            unique_lock<mutex> lock(queue_mutex);
+            queue_changed.wait(lock, [this] { return stopping || !queue.empty(); });
+
+            if (queue.empty()) {
+                // stopping and every request has been answered
+                return;
+            }
+
+            // wait for the batch to fill, but no longer than the oldest request can wait
+            auto deadline = queue.front()->received + chrono::microseconds(max_delay_us);
+            while (!stopping && queued_images < max_batch_size) {
+                if (queue_changed.wait_until(lock, deadline) == cv_status::timeout) {
+                    break;
+                }
+            }
+
+            // take whole requests while they fit, a request larger than a batch is split between batches
+            slots.clear();
+            int batch_images = 0;
+
+            while (batch_images < max_batch_size && !queue.empty()) {
+                Request *request = queue.front();
+                int count = min(request->count - request->batched, max_batch_size - batch_images);
+
+                slots.push_back({request, request->batched, count});
+                request->batched += count;
+                batch_images += count;
+
+                if (request->batched == request->count) {
+                    queue.pop_front();
+                }
+            }
+            queued_images -= batch_images;
+
+            // the connections are waiting for these requests, so their pixels won't change while the lock is released
+            lock.unlock();
+
+            if (batch_images == 1) {
+                // a lone request doesn't need threads or scaling its pixels up front, take the single image path
+                const Slot &slot = slots[0];
+                predictions[0] = context.predict(slot.request->pixels.data() + (size_t)slot.first * values);
+                top_probabilities[0] = context.probability(predictions[0]);
+            } else {
+                classify_batch(slots, batch_images, input.data(), predictions.data(), top_classes.data(),
+                               top_probabilities.data());
+            }
+            batches++;
+
+            lock.lock();
+
+            int offset = 0;
+            for (const Slot &slot : slots) {
+                for (int x = 0; x < slot.count; x++) {
+                    slot.request->results[slot.first + x] = {predictions[offset + x], top_probabilities[offset + x]};
+                }
+                offset += slot.count;
+
+                slot.request->classified += slot.count;
+                if (slot.request->classified == slot.request->count) {
+                    slot.request->finished.notify_one();
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Scale the images of a batch and propagate them all at once
+     */
+    void classify_batch(const vector<Slot> &slots, int batch_images, float *input, int32_t *predictions,
+                        int32_t *top_classes, float *top_probabilities) {
+        const int values = classifier.input_size();
+
+        int offset = 0;
+        for (const Slot &slot : slots) {
+            const uint8_t *pixels = slot.request->pixels.data() + (size_t)slot.first * values;
+            float *destination = input + (size_t)offset * values;
+
+            for (size_t x = 0; x < (size_t)slot.count * values; x++) {
+                destination[x] = pixels[x] / 255.0f; // normalize input between 0 and 1
+            }
+            offset += slot.count;
+        }
+
+        classifier.classify(input, batch_images, predictions, top_classes, top_probabilities);
+    }
+
+    void record_latency(float microseconds) {
+        lock_guard<mutex> lock(latency_mutex);
+        latencies[latency_count % LATENCY_WINDOW] = microseconds;
+        latency_count++;
+    }
+
+    /**
+     * @brief Current counters, and latency percentiles over the latest requests
+     */
+    Counters counters() {
+        Counters current = {requests, images, batches,
+                            chrono::duration<double>(chrono::steady_clock::now() - start_time).count(), 0, 0};
+
+        vector<float> window;
+        {
+            lock_guard<mutex> lock(latency_mutex);
+            window.assign(latencies.begin(), latencies.begin() + min<uint64_t>(latency_count, LATENCY_WINDOW));
+        }
+
+        current.p50_us = percentile(window, 0.50);
+        current.p99_us = percentile(window, 0.99);
+        return current;
+    }
+
+    /**
+     * @brief Log throughput since an earlier reading of the counters, and the current latency percentiles
+     */
+    void log_counters(const Counters &current, const Counters &previous) {
+        uint64_t requests = current.requests - previous.requests;
+        uint64_t images = current.images - previous.images;
+        uint64_t batches = current.batches - previous.batches;
+        double seconds = max(current.seconds - previous.seconds, 1e-9);
+
+        SPDLOG_INFO("{0} requests ({1:.0f}/s), {2} images ({3:.0f}/s), {4:.1f} images per batch, latency p50 {5:.0f} "
+                    "µs, p99 {6:.0f} µs",
+                    requests, requests / seconds, images, images / seconds, batches > 0 ? images / (double)batches : 0.0,
+                    current.p50_us, current.p99_us);
+    }
+};
@@ -0,0 +1,273 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "../exceptions.h"
+#include "../logging.h"
+#include "../utils/endian.cpp"
+
+using namespace std;
+
+/**
+ *?                             ==================================================
+ *?                                             🛈 Input Files
+ *?                             ==================================================
+ *
+ * Images to classify can be given in two formats, told apart by the first bytes of the file:
+ *
+ *  - IDX, the format of the MNIST data set. A 4 byte magic number (two 0 bytes, the type of the values and the number of
+ *    dimensions), then the size of each dimension as a big endian int32, then the values. Only unsigned bytes (type
+ *    0x08) are supported, the same as the training data.
+ *
+ *  - NumPy's .npy format. A magic string, the format version, and a text header describing the array, ex.
+ *    {'descr': '|u1', 'fortran_order': False, 'shape': (10000, 28, 28), }, followed by the values in row major order.
+ *    Arrays of unsigned bytes ('|u1') and little endian float32 ('<f4') are supported.
+ *
+ * The first dimension is the number of images, the size of every image is the product of the others. Bytes are scaled to
+ * between 0 and 1 the same way the training data is, floats are used as they are and should already be scaled.
+ *
+ * https://numpy.org/doc/stable/reference/generated/numpy.lib.format.html
+ */
+
+/**
+ * @brief Reads images from an IDX or .npy file a batch at a time, so files of any size can be classified in constant
+ *        memory.
+ */
+class InputFile {
+  public:
+    enum Type { UnsignedByte, Float32 };
+
+    /**
+     * @brief Type of the values in the file
+     */
+    Type type = UnsignedByte;
+
+    /**
+     * @brief Number of images in the file
+     */
+    long records = 0;
+
+    /**
+     * @brief Number of values in each image
+     */
+    int values = 0;
+
+    /**
+     * @brief Open a file and read its header
+     *
+     * @param path Path of an IDX or .npy file
+     */
+    InputFile(const string &path) : path(path), file(path, ios::in | ios::binary) {
+        if (file.fail()) {
+            throw invalid_argument("Unable to open input file '" + path + "'");
+        }
+
+        char magic[6] = {};
+        file.read(magic, sizeof(magic));
+        file.seekg(0);
+
+        if (memcmp(magic, "\x93NUMPY", sizeof(magic)) == 0) {
+            read_npy_header();
+        } else {
+            read_idx_header();
+        }
+
+        if (file.fail()) {
+            throw invalid_argument("Input file '" + path + "' ends before the end of its header");
+        }
+
+        SPDLOG_INFO("Opened input file '{0}', {1} images of {2} {3}", path, records, values,
+                    type == UnsignedByte ? "bytes" : "floats");
+    }
+
+    /**
+     * @brief Read the next images of the file
+     *
+     * @param out Where to write the images, one after another, room for `count * values` floats
+     * @param count Most images to read
+     *
+     * @return Number of images read, less than `count` only at the end of the file
+     */
+    int read(float *out, int count) {
+        if (type == Float32) {
+            return read_values((char *)out, count, sizeof(float));
+        }
+
+        bytes.resize((size_t)min<long>(count, records - next_record) * values);
+        count = read_values((char *)bytes.data(), count, 1);
+
+        for (size_t x = 0; x < (size_t)count * values; x++) {
+            out[x] = bytes[x] / 255.0f; // normalize input between 0 and 1
+        }
+        return count;
+    }
+
+    /**
+     * @brief Read the next images of a file of bytes without scaling them
+     *
+     * @param out Where to write the images, one after another, room for `count * values` bytes
+     * @param count Most images to read
+     *
+     * @return Number of images read, less than `count` only at the end of the file
+     */
+    int read_bytes(uint8_t *out, int count) {
+        if (type != UnsignedByte) {
+            throw invalid_function_call("Input file '" + path + "' doesn't contain bytes");
+        }
+        return read_values((char *)out, count, 1);
+    }
+
+  private:
+    string path;
+
+    ifstream file;
+
+    /**
+     * @brief Index of the next image `read()` returns
+     */
+    long next_record = 0;
+
+    /**
+     * @brief Raw bytes of the images being read, reused for every batch
+     */
+    vector<uint8_t> bytes;
+
+    /**
+     * @brief Read the values of the next images as they're stored in the file
+     */
+    int read_values(char *out, int count, size_t value_bytes) {
+        count = (int)min<long>(count, records - next_record);
+        if (count <= 0) {
+            return 0;
+        }
+
+        file.read(out, (size_t)count * values * value_bytes);
+        if (file.fail()) {
+            throw invalid_argument("Input file '" + path + "' ended before image " + to_string(next_record + count) +
+                                   " of " + to_string(records));
+        }
+
+        next_record += count;
+        return count;
+    }
+
+    void read_idx_header() {
+        unsigned char magic[4] = {};
+        file.read((char *)magic, sizeof(magic));
+
+        if (magic[0] != 0 || magic[1] != 0) {
+            throw invalid_argument("Input file '" + path + "' is neither an IDX nor a .npy file");
+        }
+        if (magic[2] != 0x08) {
+            throw invalid_argument("IDX input file '" + path + "' must contain unsigned bytes");
+        }
+        if (magic[3] < 2) {
+            throw invalid_argument("IDX input file '" + path + "' must have at least 2 dimensions");
+        }
+
+        type = UnsignedByte;
+        records = file_read_big_endian_int32(file);
+
+        long size = 1;
+        for (int d = 1; d < magic[3]; d++) {
+            size *= file_read_big_endian_int32(file);
+        }
+        set_image_size(size);
+    }
+
+    void read_npy_header() {
+        char magic[6];
+        unsigned char version[2];
+        file.read(magic, sizeof(magic));
+        file.read((char *)version, sizeof(version));
+
+        // the header length is a little endian uint16 in version 1, and a uint32 after that
+        unsigned char length_bytes[4] = {};
+        file.read((char *)length_bytes, version[0] == 1 ? 2 : 4);
+        uint32_t length = length_bytes[0] | length_bytes[1] << 8 | length_bytes[2] << 16 | (uint32_t)length_bytes[3] << 24;
+
+        if (version[0] < 1 || version[0] > 3 || length > (1 << 20)) {
+            throw invalid_argument("Input file '" + path + "' is not a supported .npy file");
+        }
+
+        string header(length, ' ');
+        file.read(header.data(), length);
+
+        string descr = header_value(header, "descr");
+        if (descr == "'|u1'" || descr == "'u1'") {
+            type = UnsignedByte;
+        } else if (descr == "'<f4'" && is_little_endian()) {
+            type = Float32;
+        } else {
+            throw invalid_argument(".npy input file '" + path +
+                                   "' must contain uint8 or little endian float32 values, not " + descr);
+        }
+
+        if (header_value(header, "fortran_order") != "False") {
+            throw invalid_argument(".npy input file '" + path + "' must be stored in row major (C) order");
+        }
+
+        // ex. (10000, 28, 28)
+        string shape = header_value(header, "shape");
+        vector<long> dimensions;
+        for (size_t x = 0; x < shape.size(); x++) {
+            if (isdigit(shape[x])) {
+                size_t end = shape.find_first_not_of("0123456789", x);
+                dimensions.push_back(stol(shape.substr(x, end - x)));
+                x = end;
+            }
+        }
+
+        if (dimensions.size() < 2) {
+            throw invalid_argument(".npy input file '" + path + "' must have at least 2 dimensions, not " + shape);
+        }
+
+        records = dimensions[0];
+
+        long size = 1;
+        for (int d = 1; d < dimensions.size(); d++) {
+            size *= dimensions[d];
+        }
+        set_image_size(size);
+    }
+
+    /**
+     * @brief Find the value of a key in a .npy header, ex. "'<f4'" for descr or "(100, 784)" for shape
+     */
+    string header_value(const string &header, const string &key) {
+        size_t position = header.find("'" + key + "'");
+        if (position != string::npos) {
+            position = header.find(':', position);
+        }
+        if (position == string::npos) {
+            throw invalid_argument(".npy input file '" + path + "' has no '" + key + "' in its header");
+        }
+
+        size_t begin = header.find_first_not_of(' ', position + 1);
+        size_t end = string::npos;
+        if (begin != string::npos) {
+            end = header[begin] == '(' ? header.find(')', begin) : header.find(',', begin);
+        }
+        if (end == string::npos) {
+            throw invalid_argument(".npy input file '" + path + "' has an invalid header");
+        }
+
+        return header.substr(begin, header[begin] == '(' ? end + 1 - begin : end - begin);
+    }
+
+    void set_image_size(long size) {
+        if (records < 0 || size <= 0 || size > (1 << 24)) {
+            throw invalid_argument("Input file '" + path + "' has an invalid size");
+        }
+        values = size;
+    }
+
+    static bool is_little_endian() {
+        int num = 1;
+        return *(char *)&num == 1;
+    }
+};
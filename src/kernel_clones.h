@@ -0,0 +1,16 @@
+#pragma once
+
+/**
+ * @brief Compile a kernel for x86-64-v3 (AVX2 and FMA) and for the baseline instruction set, the CPU picks one when the
+ *        program starts. In the x86-64-v3 version `sum += a * b` is one fused multiply-add, rounded once rather than
+ *        after the multiply and again after the add, so its results can differ from the baseline version's in the last
+ *        bit. Every thread runs the same version, so training still doesn't depend on the number of threads.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+    // GCC only fuses a * b + c across statements when asked to, and not at all with -std=c++17
+    #define KERNEL_CLONES __attribute__((target_clones("arch=x86-64-v3", "default"), optimize("fp-contract=fast")))
+#elif defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+    #define KERNEL_CLONES __attribute__((target_clones("arch=x86-64-v3", "default")))
+#else
+    #define KERNEL_CLONES
+#endif
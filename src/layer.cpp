@@ -1,13 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
 #include <random>
 #include <vector>
 
 #include "config.h"
+#include "convolution.cpp"
 #include "exceptions.h"
+#include "low_rank.cpp"
 #include "math_functions.cpp"
 #include "neuron.cpp"
+#include "utils/huge_pages.cpp"
 
 using namespace std;
 
+/**
+ * @brief One copy of a layer's weights (or low-rank factors) and biases, and the table of pointers to each row of
+ *        weights in it. Shared between a layer and the snapshots taken of it, see `Layer::snapshot()`, and
+ *        freed once none of them use it.
+ */
+struct ParameterBlock {
+    float *parameters;
+    float **weights;
+
+    /**
+     * @brief Keeps memory the block doesn't own alive, ex. a mapped model file. NULL when the block allocated its
+     *        parameters itself.
+     */
+    shared_ptr<void> owner;
+
+    /**
+     * @param rows Number of rows of weights, see `Layer::weight_rows()`
+     * @param columns Number of weights in each row
+     * @param count Number of values in the block, see `Layer::parameter_count()`
+     * @param layer_index Index of the layer in the network
+     */
+    ParameterBlock(int rows, int columns, size_t count, int layer_index) {
+        parameters = (float *)HugePageAllocator::instance().allocate(count * sizeof(float),
+                                                                      "layer " + to_string(layer_index) + " parameters");
+
+        point_rows(rows, columns);
+    }
+
+    /**
+     * @brief Use weights and biases that are already in memory, in the same layout as `Layer::parameters`
+     *
+     * @param parameters Weights and biases of the layer
+     * @param owner Keeps `parameters` alive for as long as the block exists
+     */
+    ParameterBlock(float *parameters, int rows, int columns, shared_ptr<void> owner)
+        : parameters(parameters), owner(owner) {
+        point_rows(rows, columns);
+    }
+
+    ParameterBlock(const ParameterBlock &) = delete;
+    ParameterBlock &operator=(const ParameterBlock &) = delete;
+
+    ~ParameterBlock() {
+        if (owner == NULL) {
+            HugePageAllocator::instance().free(parameters);
+        }
+        delete[] weights;
+    }
+
+  private:
+    void point_rows(int rows, int columns) {
+        weights = new float *[rows];
+        for (int x = 0; x < rows; x++) {
+            weights[x] = parameters + (size_t)x * columns;
+        }
+    }
+};
+
+/**
+ *?                             ==================================================
+ *?                                           🛈 Layer Snapshots
+ *?                             ==================================================
+ *
+ * Evaluating, checkpointing or serving a network while it keeps training needs a copy of the weights that doesn't
+ * change underneath the reader. Copying every weight for that costs a pass over all of them each time.
+ *
+ * Instead a snapshot shares the layer's `ParameterBlock`, which takes no copying at all. The layer keeps a second, spare
+ * block: the next optimizer update after a snapshot reads the current weights from the shared block and writes the
+ * updated ones into the spare (see `begin_update()`), then the two swap. The update has to read and write every weight
+ * anyway, so it costs nothing extra, and the snapshot keeps the weights it was taken with. Once the snapshot is
+ * destroyed its block becomes the spare again, so alternating snapshots and updates never allocates.
+ *
+ * Anything else that writes to a layer's weights must call `detach()` first.
+ */
+
 /**
  * @brief A layer in the neural network.
  */
@@ -19,7 +101,16 @@ class Layer {
     float *biases;
 
     /**
-     * 2-D array containing weights for each neuron in the previous layer to each neuron in the current layer.
+     * @brief Every weight and bias of the layer in one contiguous block, weights first (row by row, or the factors of a
+     *        low-rank layer) followed by the biases. `weights` and `biases` point into this block, so optimizers can
+     *        update the whole layer in one pass. The block belongs to `block`, it moves to a different address when an
+     *        update is written to the spare block.
+     */
+    float *parameters;
+
+    /**
+     * 2-D array containing weights for each neuron in the previous layer to each neuron in the current layer. NULL for a
+     * low-rank layer, which only stores its factors.
      *
      * * This is the Weight-Matrix *
      */
@@ -60,6 +151,56 @@ class Layer {
      */
     Function activation_function = Function::ReLU;
 
+    /**
+     * @brief Kind of layer
+     */
+    enum Kind {
+        /**
+         * @brief Fully connected, every neuron of the previous layer is connected to every neuron of this one
+         */
+        Dense,
+        /**
+         * @brief Convolution over the previous layer's feature maps, see 🛈 Convolution Layers
+         */
+        Convolution,
+        /**
+         * @brief Largest value of each window of the previous layer's feature maps, without weights or biases
+         */
+        MaxPool
+    };
+
+    Kind kind = Kind::Dense;
+
+    /**
+     * @brief Feature maps in and out of a convolution or max pooling layer, and the size of its kernel or window. Unused
+     *        by dense layers. `previous_layer_size` and `size` are still the number of values in and out.
+     */
+    FeatureShape shape;
+
+    /**
+     * @brief Rank of the layer's low-rank factors, 0 for a dense layer. See 🛈 Low-Rank Layers.
+     */
+    int rank = 0;
+
+    /**
+     * @brief The low-rank factors the weights are the product of, `factor_u` · `factor_v`. U is previous_layer_size x
+     *        rank and V is rank x size, both stored row by row at the start of `parameters`, in place of the weights.
+     *        NULL for a dense layer.
+     */
+    float *factor_u = NULL;
+    float *factor_v = NULL;
+
+    /**
+     * @brief Number of consecutive weights of a row that are pruned together, see 🛈 Magnitude Pruning
+     */
+    static const int PRUNE_BLOCK = 8;
+
+    /**
+     * @brief Index of every block of weights that has been pruned and is kept at 0, empty if the layer isn't pruned.
+     *        Blocks are numbered row by row, `blocks_per_row()` to a row.
+     */
+    vector<int> pruned_blocks;
+
     /**
      * @brief Construct a new input layer. This should only be the first layer of the Network.
      *
@@ -71,6 +212,7 @@ class Layer {
         // no weights or biases for input layer
         weights = NULL;
         biases = NULL;
+        parameters = NULL;
 
         SPDLOG_DEBUG("Created input layer of size " + to_string(size));
     }
@@ -90,12 +232,9 @@ class Layer {
         this->previous_layer_size = previous_layer_size;
         this->layer_index = layer_index;
 
-        // initialize weight matrix
+        // initialize weight matrix and biases
 
-        weights = new float *[previous_layer_size];
-        for (int x = 0; x < previous_layer_size; x++) {
-            weights[x] = new float[size];
-        }
+        allocate_parameters();
 
         // randomly initialize weights on a normal distribution
 
@@ -111,8 +250,6 @@ class Layer {
 
         // randomly initialize biases
 
-        biases = new float[size];
-
         for (int x = 0; x < size; x++) {
             biases[x] = distr(engine);
         }
@@ -120,6 +257,393 @@ class Layer {
         SPDLOG_DEBUG("Created hidden/output layer of size " + to_string(size));
     }
 
+    /**
+     * @brief Construct a new convolution or max pooling layer, see 🛈 Convolution Layers
+     *
+     * @param kind `Convolution` or `MaxPool`
+     * @param shape Feature maps in and out of the layer, from `FeatureShape::convolution()` or `FeatureShape::pooling()`
+     * @param layer_index Index in the neural network that this layer is in.
+     * @param engine Random engine used for generating random weights, biases start at 0
+     */
+    Layer(Kind kind, const FeatureShape &shape, int layer_index, default_random_engine engine)
+        : Layer(shape.output.count(), shape.input.count(), layer_index) {
+        if (kind == Dense) {
+            throw invalid_argument("Fully connected layers are constructed from their sizes");
+        }
+
+        this->kind = kind;
+        this->shape = shape;
+
+        if (!has_parameters()) {
+            SPDLOG_DEBUG("Created max pooling layer of size " + to_string(size));
+            return;
+        }
+
+        allocate_parameters();
+
+        // a kernel only has a few inputs, drawn with `INIT_NORMAL_STDDEV` the outputs would start out too small to learn
+        // from, so the weights are scaled by the number of inputs (He initialization)
+        const int fan_in = shape.input.channels * shape.window * shape.window;
+        normal_distribution<float> distr(INIT_NORMAL_MEAN, sqrt(2.0f / fan_in));
+
+        for (int x = 0; x < weight_count(); x++) {
+            parameters[x] = distr(engine);
+        }
+        fill(biases, biases + bias_count(), 0.0f);
+
+        SPDLOG_DEBUG("Created convolution layer of size " + to_string(size));
+    }
+
+    /**
+     * @brief Construct a deep copy of another layer. Weights and biases are copied so the copy can be used while the
+     *        original keeps being trained.
+     *
+     * @param other Layer to copy
+     */
+    Layer(const Layer &other) : Layer(other.size, other.previous_layer_size, other.layer_index) {
+        activation_function = other.activation_function;
+        kind = other.kind;
+        shape = other.shape;
+        rank = other.rank;
+
+        // input and max pooling layers have no weights or biases to copy
+        if (has_parameters()) {
+            allocate_parameters();
+            copy(other.parameters, other.parameters + parameter_count(), parameters);
+        }
+    }
+
+    /**
+     * @brief Construct a hidden layer around weights and biases that already exist, ex. mapped from a model file
+     *
+     * @param block Weights (or factors, if it has a rank) and biases of the layer, used in place
+     * @param rank Rank of the layer's factors, 0 for a dense layer
+     */
+    Layer(int size, int previous_layer_size, int layer_index, Function activation_function,
+          shared_ptr<ParameterBlock> block, int rank = 0)
+        : Layer(size, previous_layer_size, layer_index) {
+        this->activation_function = activation_function;
+        this->rank = rank;
+        this->block = block;
+        point_at(block.get());
+    }
+
+    /**
+     * @brief Construct a convolution layer around weights and biases that already exist, ex. mapped from a model file, or
+     *        a max pooling layer
+     *
+     * @param block Weights and biases of the layer, used in place. NULL for a max pooling layer.
+     */
+    Layer(Kind kind, const FeatureShape &shape, int layer_index, Function activation_function,
+          shared_ptr<ParameterBlock> block)
+        : Layer(shape.output.count(), shape.input.count(), layer_index) {
+        this->activation_function = activation_function;
+        this->kind = kind;
+        this->shape = shape;
+        this->block = block;
+        point_at(block.get());
+    }
+
+    Layer(Layer &&other) noexcept { *this = move(other); }
+
+    Layer &operator=(const Layer &) = delete;
+
+    Layer &operator=(Layer &&other) noexcept {
+        size = other.size;
+        previous_layer_size = other.previous_layer_size;
+        layer_index = other.layer_index;
+        activation_function = other.activation_function;
+        kind = other.kind;
+        shape = other.shape;
+        rank = other.rank;
+
+        pruned_blocks = move(other.pruned_blocks);
+
+        block = move(other.block);
+        spare = move(other.spare);
+        updating_spare = other.updating_spare;
+        point_at(block.get());
+
+        other.point_at(NULL);
+        return *this;
+    }
+
+    /**
+     * @brief Create a read-only view of this layer's current weights and biases, sharing them rather than copying them.
+     *        The view keeps these values while this layer is trained further, see 🛈 Layer Snapshots. Must be called
+     *        from the thread that trains the layer.
+     *
+     * @return New layer sharing this layer's weights and biases, which must not be written to
+     */
+    Layer *snapshot() {
+        Layer *view = new Layer(size, previous_layer_size, layer_index);
+        view->activation_function = activation_function;
+        view->kind = kind;
+        view->shape = shape;
+        view->rank = rank;
+
+        if (has_parameters()) {
+            view->block = block;
+            view->point_at(block.get());
+
+            // the next update goes to the spare block, make sure no older snapshot is still reading it
+            if (spare == NULL || spare.use_count() > 1) {
+                spare = make_block();
+            }
+        }
+
+        return view;
+    }
+
+    /**
+     * @brief Start updating every weight and bias of the layer
+     *
+     * @return Where to write the updated values: `parameters` itself, unless a snapshot shares them, then the spare
+     *         block. The current values must always be read from `parameters`, and every value (factors included) must
+     *         be written before calling `commit_update()`.
+     */
+    float *begin_update() {
+        updating_spare = block.use_count() > 1;
+        return updating_spare ? spare->parameters : parameters;
+    }
+
+    /**
+     * @brief Finish an update started by `begin_update()`, making the updated values the layer's weights and biases
+     */
+    void commit_update() {
+        if (updating_spare) {
+            swap(block, spare);
+            point_at(block.get());
+            updating_spare = false;
+        }
+    }
+
+    /**
+     * @brief Make sure no snapshot shares the weights and biases, copying them to the spare block if one does. Must be
+     *        called before writing to the weights in any way other than `begin_update()`.
+     */
+    void detach() {
+        if (!has_parameters() || block.use_count() == 1) {
+            return;
+        }
+
+        if (spare == NULL || spare.use_count() > 1) {
+            spare = make_block();
+        }
+        copy(parameters, parameters + parameter_count(), spare->parameters);
+
+        swap(block, spare);
+        point_at(block.get());
+    }
+
+    /**
+     * @brief Whether the layer has weights and biases, every layer but the input layer and max pooling layers
+     */
+    bool has_parameters() const { return layer_index > 0 && kind != MaxPool; }
+
+    /**
+     * @brief Number of weights in this layer, the values of its factors for a low-rank layer
+     */
+    int weight_count() const {
+        if (kind == Convolution) {
+            return shape.output.channels * shape.input.channels * shape.window * shape.window;
+        }
+        if (rank > 0) {
+            return factor_count();
+        }
+        return kind == Dense ? previous_layer_size * size : 0;
+    }
+
+    /**
+     * @brief Number of rows of weights `weights` points to: one for each neuron of the previous layer, or for a
+     *        convolution one for each output block, input channel and position of the kernel, see 🛈 Convolution Layers.
+     *        None for a low-rank layer.
+     */
+    int weight_rows() const {
+        if (rank > 0) {
+            return 0;
+        }
+        return kind == Dense ? previous_layer_size : weight_count() / CHANNEL_BLOCK;
+    }
+
+    /**
+     * @brief Number of weights in each row of `weights`
+     */
+    int weight_columns() const { return kind == Dense ? size : CHANNEL_BLOCK; }
+
+    /**
+     * @brief Number of biases, one for each neuron or for each output channel of a convolution
+     */
+    int bias_count() const {
+        if (!has_parameters()) {
+            return 0;
+        }
+        return kind == Convolution ? shape.output.channels : size;
+    }
+
+    /**
+     * @brief Number of weights and biases in this layer, the length of `parameters`
+     */
+    int parameter_count() const { return has_parameters() ? weight_count() + bias_count() : 0; }
+
+    /**
+     * @brief Number of values in the low-rank factors, 0 for a dense layer
+     */
+    int factor_count() const { return rank * (previous_layer_size + size); }
+
+    /**
+     * @brief Number of multiply-adds to propagate one image through the layer
+     */
+    long multiply_adds() const {
+        if (kind == Convolution) {
+            return (long)weight_count() * shape.output.height * shape.output.width;
+        }
+        return weight_count();
+    }
+
+    /**
+     * @brief Change the rank of the layer's factors, keeping its biases. The factors are left for the caller to set,
+     *        rank 0 makes the layer dense again with the product of its factors as its weights.
+     */
+    void set_rank(int rank) {
+        if (layer_index == 0) {
+            throw invalid_function_call("The input layer has no weights to factor.");
+        }
+        if (kind != Dense && rank > 0) {
+            throw invalid_function_call("Only fully connected layers can be factored.");
+        }
+        if (rank < 0 || rank > min(previous_layer_size, size)) {
+            throw invalid_argument("Rank must be between 0 and the smaller of the layer's sizes");
+        }
+        if (rank == this->rank) {
+            return;
+        }
+
+        // a new block, snapshots keep the old one
+        shared_ptr<ParameterBlock> previous = block;
+        const float *previous_biases = biases, *previous_u = factor_u, *previous_v = factor_v;
+        const int previous_rank = this->rank;
+
+        this->rank = rank;
+        allocate_parameters();
+        copy(previous_biases, previous_biases + bias_count(), biases);
+        spare = NULL;
+
+        if (rank == 0) {
+            matrix_multiply(previous_u, previous_rank, previous_v, size, parameters, size, previous_layer_size,
+                            previous_rank, size);
+        }
+    }
+
+    /**
+     * @brief Replace the weights with the closest weights of a rank, and store them as factors of that rank (see 🛈
+     *        Low-Rank Layers)
+     *
+     * @param decomposition Decomposition of the layer's weights, from before it was factored
+     * @param rank Rank to factor to, at most the smaller of the layer's sizes
+     */
+    void factorize(const SingularValueDecomposition &decomposition, int rank) {
+        if (rank < 1 || decomposition.rows != previous_layer_size || decomposition.columns != size) {
+            throw invalid_argument("Layer can only be factored to a rank of at least 1, from a decomposition of its "
+                                   "weights");
+        }
+
+        set_rank(rank);
+        detach();
+        decomposition.factors(rank, factor_u, factor_v);
+    }
+
+    /**
+     * @brief Number of blocks of `PRUNE_BLOCK` weights in each row, the last one is narrower when the layer size isn't a
+     *        multiple of `PRUNE_BLOCK`
+     */
+    int blocks_per_row() const { return (size + PRUNE_BLOCK - 1) / PRUNE_BLOCK; }
+
+    int block_count() const { return previous_layer_size * blocks_per_row(); }
+
+    /**
+     * @brief Fraction of the layer's blocks of weights that are pruned
+     */
+    float sparsity() const { return layer_index > 0 ? pruned_blocks.size() / (float)block_count() : 0; }
+
+    /**
+     * @brief Number of weights in the pruned blocks
+     */
+    long pruned_weight_count() const {
+        const int per_row = blocks_per_row();
+        long count = 0;
+        for (int index : pruned_blocks) {
+            const int b = index % per_row;
+            count += min((b + 1) * PRUNE_BLOCK, size) - b * PRUNE_BLOCK;
+        }
+        return count;
+    }
+
+    /**
+     * @brief Prune the blocks of weights with the smallest magnitude (sum of absolute values), until a fraction of every
+     *        block in the layer is pruned, and set them to 0. Blocks pruned earlier are all 0, so they're always among
+     *        the smallest and stay pruned as the sparsity grows.
+     *
+     * @param sparsity Fraction of blocks to prune, between 0 and 1
+     */
+    void prune(float sparsity) {
+        if (layer_index == 0) {
+            throw invalid_function_call("The input layer has no weights to prune.");
+        }
+        if (rank > 0) {
+            throw invalid_function_call("Low-rank layers can't be pruned, they only store the factors of their weights.");
+        }
+        if (kind != Dense) {
+            throw invalid_function_call("Only fully connected layers can be pruned.");
+        }
+        if (sparsity < 0 || sparsity >= 1) {
+            throw invalid_argument("Sparsity must be at least 0 and below 1");
+        }
+
+        const int per_row = blocks_per_row();
+        vector<pair<float, int>> magnitudes(block_count());
+
+        for (int x = 0; x < previous_layer_size; x++) {
+            for (int b = 0; b < per_row; b++) {
+                float magnitude = 0;
+                for (int y = b * PRUNE_BLOCK; y < min((b + 1) * PRUNE_BLOCK, size); y++) {
+                    magnitude += abs(weights[x][y]);
+                }
+                magnitudes[x * per_row + b] = {magnitude, x * per_row + b};
+            }
+        }
+
+        // ties go to the lower block, so every process pruning the same weights prunes the same blocks
+        const int count = (int)lround(sparsity * magnitudes.size());
+        nth_element(magnitudes.begin(), magnitudes.begin() + count, magnitudes.end());
+
+        pruned_blocks.resize(count);
+        for (int x = 0; x < count; x++) {
+            pruned_blocks[x] = magnitudes[x].second;
+        }
+        sort(pruned_blocks.begin(), pruned_blocks.end());
+
+        apply_pruning();
+    }
+
+    /**
+     * @brief Set every pruned weight back to 0, after an update has moved them
+     */
+    void apply_pruning() {
+        if (pruned_blocks.empty()) {
+            return;
+        }
+
+        detach();
+
+        const int per_row = blocks_per_row();
+        for (int index : pruned_blocks) {
+            float *row = weights[index / per_row];
+            const int b = index % per_row;
+            fill(row + b * PRUNE_BLOCK, row + min((b + 1) * PRUNE_BLOCK, size), 0.0f);
+        }
+    }
+
     /**
      * @brief Propagate data through layer and output result to a destination array.
      *
@@ -127,7 +651,7 @@ class Layer {
      * @param out Destination array to output final layer activations to (σ(z)). Size is equal to this layer size. Should
      *            already be allocated and have input layer values set as well as 0s for every other layer.
      */
-    void propagate(float *in, float *out) {
+    void propagate(const float *in, float *out) const {
 
         // matrix multiplication of in and weight-matrix
 
@@ -136,8 +660,17 @@ class Layer {
             throw invalid_function_call("The propagate function cannot be called on the input layer.");
         }
 
-        for (int x = 0; x < previous_layer_size; x++) {
-            dot_product(in[x], weights[x], out, size);
+        if (kind != Dense) {
+            propagate_feature_maps(in, out, NULL);
+            return;
+        }
+
+        if (rank > 0) {
+            multiply_factors(in, out, NULL);
+        } else {
+            for (int x = 0; x < previous_layer_size; x++) {
+                dot_product(in[x], weights[x], out, size);
+            }
         }
 
         // apply activation function,
@@ -167,8 +700,12 @@ class Layer {
      * @param gradient_out Destination array to write the gradient of activation function given input from previous layer
      *                     (σ′(z)). Size is equal to this layer size. This is later used when backpropagating to calculate
      *                     the error for each layer/neuron in the network.
+     *
+     * @param factored For a low-rank layer, where to keep in · U (`rank` values) for the gradient of V, followed by room
+     *                 for `backpropagate()` to keep V · error (`rank` more) for the gradient of U. May be NULL when
+     *                 neither gradient is needed, and for other layers.
      */
-    void propagate_backpropagate(float *in, float *out, float *gradient_out) {
+    void propagate_backpropagate(const float *in, float *out, float *gradient_out, float *factored = NULL) {
 
         // matrix multiplication of in and weight-matrix
 
@@ -177,14 +714,17 @@ class Layer {
             throw invalid_function_call("The propagate function cannot be called on the input layer.");
         }
 
-        for (int x = 0; x < previous_layer_size; x++) {
-            dot_product(in[x], weights[x], out, size);
+        if (kind != Dense) {
+            propagate_feature_maps(in, out, gradient_out);
+            return;
         }
 
-        // for each neuron in this layer, copy the weight activations from previous layer + bias into the weight & bias
-        // gradient
-        for (int x = 0; x < previous_layer_size; x++) {
-            dot_product(in[x], weights[x], out, size);
+        if (rank > 0) {
+            multiply_factors(in, out, factored);
+        } else {
+            for (int x = 0; x < previous_layer_size; x++) {
+                dot_product(in[x], weights[x], out, size);
+            }
         }
 
         // Before overwriting out[] array by running them through the activation funcition, we calculate and write the
@@ -213,18 +753,194 @@ class Layer {
         }
     }
 
-    ~Layer() {
+    /**
+     * @brief Backpropagate the error of this layer to the previous layer. Every value of `previous_error`, which holds
+     *        the gradient of the previous layer's activation function (σ′(z)), is multiplied by the sum of the errors of
+     *        this layer's neurons its activation went to, times the weights in between. A low-rank layer does it in two
+     *        steps, V · error then U · that, see 🛈 Low-Rank Layers.
+     *
+     * @param in Activations of the previous layer
+     * @param out Activations of this layer
+     * @param error Error of this layer
+     * @param previous_error Error of the previous layer. For the first layer of a network, which has no previous layer
+     *                       to backpropagate to, NULL: a low-rank first layer then only keeps V · error.
+     * @param factored For a low-rank layer, the values `propagate_backpropagate()` was given, V · error is written after
+     *                 the first `rank`. Unused by other layers.
+     */
+    void backpropagate(const float *in, const float *out, const float *error, float *previous_error,
+                       float *factored = NULL) const {
+        if (rank > 0) {
+            backpropagate_factors(error, previous_error, factored);
+            return;
+        }
+        if (kind == Convolution) {
+            convolution_backward(error, shape, parameters, previous_error);
+            return;
+        }
+        if (kind == MaxPool) {
+            max_pool_backward(in, out, error, shape, previous_error);
+            return;
+        }
+
+        for (int x = 0; x < previous_layer_size; x++) {
+            // calculate dot-product between this layer's weights and its error,
+            float dot_product = 0;
+            for (int y = 0; y < size; y++) {
+                dot_product += weights[x][y] * error[y];
+            }
+            previous_error[x] *= dot_product;
+        }
+    }
 
-        // the input layer has no biases or weights to delete
-        if (layer_index > 0) {
+    ~Layer() {
+        // the weights and biases are freed along with the last layer or snapshot sharing them
+        if (block != NULL && block.use_count() == 1) {
             SPDLOG_DEBUG("Deleting weights/biases for layer " + to_string(layer_index));
+        }
+    }
+
+  private:
+    /**
+     * @brief Block `parameters` points into, and the block the next update after a snapshot is written to
+     */
+    shared_ptr<ParameterBlock> block, spare;
+
+    /**
+     * @brief Whether the update in progress is being written to `spare`, see `begin_update()`
+     */
+    bool updating_spare = false;
+
+    /**
+     * @brief Create a layer without any weights or biases yet
+     */
+    Layer(int size, int previous_layer_size, int layer_index)
+        : previous_layer_size(previous_layer_size), size(size), layer_index(layer_index) {
+        point_at(NULL);
+    }
+
+    /**
+     * @brief Allocate the block holding every weight and bias, and point `weights` and `biases` into it
+     */
+    void allocate_parameters() {
+        block = make_block();
+        point_at(block.get());
+    }
+
+    /**
+     * @brief Allocate a block with room for every weight, bias and factor of the layer
+     */
+    shared_ptr<ParameterBlock> make_block() const {
+        return make_shared<ParameterBlock>(weight_rows(), weight_columns(), parameter_count(), layer_index);
+    }
+
+    /**
+     * @brief Propagate through a convolution or max pooling layer (see 🛈 Convolution Layers), writing the gradient of
+     *        the activation function to `gradient_out` unless it's NULL
+     */
+    void propagate_feature_maps(const float *in, float *out, float *gradient_out) const {
+        if (kind == MaxPool) {
+            // no activation function, the error passes straight through
+            max_pool_forward(in, shape, out);
+            if (gradient_out != NULL) {
+                fill(gradient_out, gradient_out + size, 1.0f);
+            }
+            return;
+        }
+
+        convolution_forward(in, shape, parameters, biases, out);
+
+        if (activation_function == ReLU) {
+            for (int x = 0; x < size; x++) {
+                if (gradient_out != NULL) {
+                    gradient_out[x] = ActivationFunctionGradients::ReLU_gradient(out[x]);
+                }
+                out[x] = ActivationFunctions::ReLU(out[x]);
+            }
+        } else if (activation_function == Sigmoid) {
+            for (int x = 0; x < size; x++) {
+                if (gradient_out != NULL) {
+                    gradient_out[x] = ActivationFunctionGradients::sigmoid_gradient(out[x]);
+                }
+                out[x] = ActivationFunctions::sigmoid(out[x]);
+            }
+        }
+    }
 
-            delete[] biases;
+    /**
+     * @brief Number of values of in · U a low-rank layer works out at a time on the stack, when it's given nowhere to
+     *        keep them
+     */
+    static const int FACTOR_CHUNK = 64;
 
+    /**
+     * @brief out += in · U · V for a low-rank layer, the products for each output added in the same order as by
+     *        `InferenceContext` and `BatchClassifier`
+     *
+     * @param factored Where to keep in · U, NULL to work it out a chunk at a time and only keep the outputs
+     */
+    void multiply_factors(const float *in, float *out, float *factored) const {
+        float chunk[FACTOR_CHUNK];
+
+        for (int first = 0; first < rank; first += FACTOR_CHUNK) {
+            const int count = min(FACTOR_CHUNK, rank - first);
+            float *z = factored != NULL ? factored + first : chunk;
+
+            fill(z, z + count, 0.0f);
             for (int x = 0; x < previous_layer_size; x++) {
-                delete[] weights[x];
+                const float *u = factor_u + (size_t)x * rank + first;
+                for (int k = 0; k < count; k++) {
+                    z[k] += in[x] * u[k];
+                }
+            }
+
+            for (int k = 0; k < count; k++) {
+                dot_product(z[k], factor_v + (size_t)(first + k) * size, out, size);
+            }
+        }
+    }
+
+    /**
+     * @brief Backpropagate the error of a low-rank layer through V then U, see `backpropagate()`
+     */
+    void backpropagate_factors(const float *error, float *previous_error, float *factored) const {
+        if (factored == NULL) {
+            throw invalid_function_call("Low-rank layers need somewhere to keep V · error to be backpropagated.");
+        }
+
+        float *factored_error = factored + rank;
+        for (int k = 0; k < rank; k++) {
+            const float *v = factor_v + (size_t)k * size;
+
+            float sum = 0;
+            for (int y = 0; y < size; y++) {
+                sum += v[y] * error[y];
             }
-            delete[] weights;
+            factored_error[k] = sum;
+        }
+
+        if (previous_error == NULL) {
+            return;
         }
+
+        for (int x = 0; x < previous_layer_size; x++) {
+            const float *u = factor_u + (size_t)x * rank;
+
+            float sum = 0;
+            for (int k = 0; k < rank; k++) {
+                sum += u[k] * factored_error[k];
+            }
+            previous_error[x] *= sum;
+        }
+    }
+
+    /**
+     * @brief Point `parameters`, `weights`, `biases` and the factors into a block, or at nothing
+     */
+    void point_at(ParameterBlock *target) {
+        parameters = target != NULL ? target->parameters : NULL;
+        weights = target != NULL && rank == 0 ? target->weights : NULL;
+        biases = target != NULL ? target->parameters + weight_count() : NULL;
+        factor_u = target != NULL && rank > 0 ? target->parameters : NULL;
+        factor_v = factor_u != NULL ? factor_u + (size_t)previous_layer_size * rank : NULL;
     }
 };
\ No newline at end of file
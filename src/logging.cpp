@@ -12,7 +12,7 @@ namespace logging {
  *
  * @param verbose
  */
-void initialize(bool verbose) {
+inline void initialize(bool verbose) {
     if (verbose) {
         SPDLOG_INFO("Logging level set to VERBOSE");
         spdlog::set_level(spdlog::level::trace); // Set global log level to trace
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <vector>
+
+using namespace std;
+
+/**
+ *?                             ==================================================
+ *?                                            🛈 Low-Rank Layers
+ *?                             ==================================================
+ *
+ * A layer's weights W (previous layer size × size) can be stored as the product of two thin matrices, W = U · V, where U
+ * is previous layer size × rank and V is rank × size. With a rank well below both sizes, the factors take far fewer
+ * values than W, and propagating through them as two skinny multiplications (in · U, then · V) takes rank × (previous
+ * layer size + size) multiply-adds per image rather than previous layer size × size. For the 784 × 40 first layer, rank
+ * 8 is a fifth of the weights and of the work.
+ *
+ * A layer is factored with a truncated singular value decomposition: W = Σ σᵢ uᵢ vᵢᵀ, keeping the `rank` terms with the
+ * largest singular values σᵢ, which is the closest rank `rank` matrix to W. U gets the uᵢ scaled by √σᵢ and V the vᵢ
+ * scaled by √σᵢ, so both factors have values of the same size. Factoring a trained layer loses some accuracy, which
+ * fine-tuning the factors wins back. Factoring the random initial weights instead trains the factors from the start.
+ *
+ * A low-rank layer stores only its factors, U then V in place of the weights and followed by the biases, so snapshots,
+ * checkpoints, model files and the optimizer's state hold rank × (previous layer size + size) values rather than the
+ * weights. Training propagates through the factors too: in · U is kept for each record, then multiplied by V. The error
+ * is backpropagated the same way, through V (V · error, also kept) and then U. The gradient of U is the previous layer's
+ * activations times V · error, and the gradient of V is in · U times the error, each summed over the batch like the
+ * gradient of a dense layer's weights, so the optimizer updates the factors and biases like any other parameters.
+ *
+ * The decomposition uses one-sided Jacobi rotations: pairs of columns are rotated until every column is orthogonal to
+ * every other, at which point the length of each column is a singular value. It's done in double precision, and layers
+ * are small enough that it takes a few milliseconds.
+ */
+
+/**
+ * @brief Singular value decomposition of a matrix, W = Σ σᵢ uᵢ vᵢᵀ, with the singular values largest first
+ */
+class SingularValueDecomposition {
+  public:
+    int rows, columns;
+
+    /**
+     * @brief Singular values, largest first, as many as the smaller of `rows` and `columns`
+     */
+    vector<double> values;
+
+    /**
+     * @brief Decompose a matrix
+     *
+     * @param matrix Pointer to each row of the matrix
+     * @param rows Number of rows
+     * @param columns Number of columns
+     */
+    SingularValueDecomposition(const float *const *matrix, int rows, int columns) : rows(rows), columns(columns) {
+        // the rotations orthogonalize the columns of a tall matrix, so a wide one is decomposed transposed
+        const bool transposed = rows < columns;
+        const int m = transposed ? columns : rows;
+        const int n = transposed ? rows : columns;
+
+        vector<double> a((size_t)n * m), v((size_t)n * n, 0.0);
+        for (int j = 0; j < n; j++) {
+            for (int i = 0; i < m; i++) {
+                a[(size_t)j * m + i] = transposed ? matrix[j][i] : matrix[i][j];
+            }
+            v[(size_t)j * n + j] = 1;
+        }
+
+        for (int sweep = 0; sweep < MAX_SWEEPS; sweep++) {
+            bool rotated = false;
+
+            for (int p = 0; p < n - 1; p++) {
+                for (int q = p + 1; q < n; q++) {
+                    double *a_p = a.data() + (size_t)p * m;
+                    double *a_q = a.data() + (size_t)q * m;
+
+                    double alpha = 0, beta = 0, gamma = 0;
+                    for (int i = 0; i < m; i++) {
+                        alpha += a_p[i] * a_p[i];
+                        beta += a_q[i] * a_q[i];
+                        gamma += a_p[i] * a_q[i];
+                    }
+
+                    if (abs(gamma) <= TOLERANCE * sqrt(alpha * beta)) {
+                        continue;
+                    }
+                    rotated = true;
+
+                    // the rotation that makes columns p and q orthogonal
+                    double zeta = (beta - alpha) / (2 * gamma);
+                    double t = (zeta >= 0 ? 1.0 : -1.0) / (abs(zeta) + sqrt(1 + zeta * zeta));
+                    double c = 1 / sqrt(1 + t * t);
+                    double s = c * t;
+
+                    rotate(a_p, a_q, m, c, s);
+                    rotate(v.data() + (size_t)p * n, v.data() + (size_t)q * n, n, c, s);
+                }
+            }
+
+            if (!rotated) {
+                break;
+            }
+        }
+
+        // each column of a is now σ times a singular vector
+        vector<double> lengths(n);
+        for (int j = 0; j < n; j++) {
+            const double *a_j = a.data() + (size_t)j * m;
+            lengths[j] = sqrt(inner_product(a_j, a_j + m, a_j, 0.0));
+        }
+
+        vector<int> order(n);
+        iota(order.begin(), order.end(), 0);
+        stable_sort(order.begin(), order.end(), [&lengths](int x, int y) { return lengths[x] > lengths[y]; });
+
+        values.resize(n);
+        left.assign((size_t)n * rows, 0.0);
+        right.assign((size_t)n * columns, 0.0);
+
+        for (int k = 0; k < n; k++) {
+            const int j = order[k];
+            values[k] = lengths[j];
+
+            // the normalized columns of a are the singular vectors of the long side, v holds those of the short side
+            double *normalized = transposed ? right.data() + (size_t)k * columns : left.data() + (size_t)k * rows;
+            double *rotations = transposed ? left.data() + (size_t)k * rows : right.data() + (size_t)k * columns;
+
+            if (lengths[j] > 0) {
+                for (int i = 0; i < m; i++) {
+                    normalized[i] = a[(size_t)j * m + i] / lengths[j];
+                }
+            }
+            copy(v.begin() + (size_t)j * n, v.begin() + (size_t)(j + 1) * n, rotations);
+        }
+    }
+
+    /**
+     * @brief Largest rank worth factoring a matrix to, the largest with fewer values in the factors than in the matrix
+     */
+    static int max_rank(int rows, int columns) {
+        return min({rows, columns, (int)(((long)rows * columns - 1) / (rows + columns))});
+    }
+
+    /**
+     * @brief Write the factors of the closest matrix of a rank, U (rows × rank) and V (rank × columns), both row by row
+     *
+     * @param rank Number of singular values to keep, at most the smaller of `rows` and `columns`
+     * @param u Where to write U
+     * @param v Where to write V
+     */
+    void factors(int rank, float *u, float *v) const {
+        for (int k = 0; k < rank; k++) {
+            const double scale = sqrt(values[k]);
+
+            for (int i = 0; i < rows; i++) {
+                u[(size_t)i * rank + k] = left[(size_t)k * rows + i] * scale;
+            }
+            for (int j = 0; j < columns; j++) {
+                v[(size_t)k * columns + j] = right[(size_t)k * columns + j] * scale;
+            }
+        }
+    }
+
+    /**
+     * @brief Fraction of the matrix's energy (sum of its squared values) kept at a rank
+     */
+    double energy(int rank) const {
+        double kept = 0, total = 0;
+        for (int k = 0; k < values.size(); k++) {
+            total += values[k] * values[k];
+            kept += k < rank ? values[k] * values[k] : 0;
+        }
+        return total > 0 ? kept / total : 1;
+    }
+
+  private:
+    /**
+     * @brief Decomposition stops once a sweep over every pair of columns rotates none of them, or after this many sweeps
+     */
+    static const int MAX_SWEEPS = 60;
+
+    /**
+     * @brief Columns count as orthogonal once the cosine of the angle between them is below this
+     */
+    static constexpr double TOLERANCE = 1e-12;
+
+    /**
+     * @brief Left singular vectors (length `rows`) and right singular vectors (length `columns`), one after another in
+     *        the order of `values`
+     */
+    vector<double> left, right;
+
+    static void rotate(double *x, double *y, int length, double c, double s) {
+        for (int i = 0; i < length; i++) {
+            double x_i = x[i];
+            x[i] = c * x_i - s * y[i];
+            y[i] = s * x_i + c * y[i];
+        }
+    }
+};
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -6,9 +7,16 @@
 #include <CLI/Config.hpp>
 #include <CLI/Formatter.hpp>
 
+#include "inference/batch_inference.cpp"
+#include "inference/inference_client.cpp"
+#include "inference/inference_server.cpp"
 #include "logging.cpp" // contains #import <spdlog/spdlog.h> as well as configuration defines
+#include "model_file.cpp"
 #include "network.cpp"
+#include "trainer/population_trainer.cpp"
+#include "trainer/sweep.cpp"
 #include "trainer/trainer.cpp"
+#include "utils/string.cpp"
 
 using namespace std;
 
@@ -25,17 +33,294 @@ int main(int argc, char *argv[]) {
 
     bool verbose = false;
     bool log_accuracy = true;
+    bool async_evaluation = false;
+    int epochs = 100;
+    string optimizer_name = "sgd";
+    float step_size = 0;
+    string schedule_name = "constant";
+    float warmup_epochs = 0;
+    int decay_epochs = 10;
+    float decay = 0.5f;
+    float target_accuracy = 0;
+    int patience = 0;
+    double time_budget = 0;
+    bool fused_gradients = false;
+    int batch_size = 100;
+    string batch_schedule_name = "constant";
+    float batch_growth = 2;
+    int batch_growth_epochs = 5;
+    int max_batch_size = 1000;
+    string prune;
+    int prune_rounds = 4;
+    int prune_start = 1;
+    int prune_interval = 1;
+    string low_rank;
+    int low_rank_start = 0;
+    string conv_layers;
+    string hidden_layers = "40";
+    int hogwild_threads = 0;
+    bool hogwild_report = false;
+    string hosts;
+    int rank = 0;
+    unsigned int seed = time(0);
+    int threads = 1;
+    bool shuffle = false;
+    bool huge_pages = false;
+    bool numa = false;
+    string save_model, load_model;
+    bool verify_model = false;
+    string checkpoint;
+    int checkpoint_every = 0;
+    bool resume = false;
 
-    app.add_option("--training_data", training_data_file, "Path to training data file")->required();
-    app.add_option("--training_labels", training_labels_file, "Path to training labels file")->required();
-    app.add_option("--test_data", test_data_file, "Path to test data file")->required();
-    app.add_option("--test_labels", test_labels_file, "Path to test labels file")->required();
+    app.add_option("--training_data", training_data_file, "Path to training data file");
+    app.add_option("--training_labels", training_labels_file, "Path to training labels file");
+    app.add_option("--test_data", test_data_file, "Path to test data file");
+    app.add_option("--test_labels", test_labels_file, "Path to test labels file");
 
     app.add_flag("-v,--verbose", verbose, "Print out debug information as well")->default_val(false);
 
     // We can disable logging for whatever reason by passing the --no-logging flag
     app.add_flag("--no-logging{false}", log_accuracy, "Disable logging by passing the --no-logging flag")->default_val(true);
 
+    app.add_flag("--async-eval", async_evaluation,
+                 "Evaluate accuracy on a background thread using a snapshot of the network taken at the start of every "
+                 "epoch, instead of pausing training to test the network")
+        ->default_val(false);
+
+    CLI::Option *epochs_option = app.add_option(
+        "-e,--epochs", epochs, "Number of epochs to train for (default is 100 with sgd, 50 with lbfgs, 20 otherwise)");
+    app.add_option("--optimizer", optimizer_name,
+                   "Optimizer used to update weights: sgd, momentum, nesterov, adam, adamw or lbfgs")
+        ->default_val("sgd");
+    CLI::Option *step_size_option = app.add_option(
+        "--step-size", step_size, "Step size (learning rate), default is 0.005 with sgd and 0.001 with other optimizers");
+
+    app.add_option("--schedule", schedule_name,
+                   "How the step size changes during training: constant, step, cosine or onecycle")
+        ->default_val("constant");
+    app.add_option("--warmup", warmup_epochs, "Grow the step size linearly from 0 over this many epochs")->default_val(0);
+    app.add_option("--decay-epochs", decay_epochs, "With --schedule step, decay the step size every this many epochs")
+        ->default_val(10);
+    app.add_option("--decay", decay, "With --schedule step, multiply the step size by this every --decay-epochs")
+        ->default_val(0.5);
+    app.add_option("--target-accuracy", target_accuracy,
+                   "Stop training once test accuracy reaches this (ex. 0.97), 0 to train every epoch")
+        ->default_val(0);
+    app.add_option("--patience", patience,
+                   "Stop training after this many epochs without accuracy improving by at least 0.1%, 0 to never stop "
+                   "early")
+        ->default_val(0);
+    app.add_option("--time-budget", time_budget, "Stop training after this many seconds, 0 for no limit")
+        ->default_val(0);
+    app.add_option("-b,--batch-size", batch_size, "Number of training records in each batch")->default_val(100);
+    app.add_option("--batch-schedule", batch_schedule_name,
+                   "How the batch size grows between epochs: constant, step (every --batch-growth-epochs) or noise (when "
+                   "the estimated gradient noise scale is larger than the batch size). The step size grows with it")
+        ->default_val("constant");
+    app.add_option("--batch-growth", batch_growth, "Multiply the batch size by this every time it grows")->default_val(2);
+    app.add_option("--batch-growth-epochs", batch_growth_epochs,
+                   "With --batch-schedule step, grow the batch size every this many epochs")
+        ->default_val(5);
+    app.add_option("--max-batch-size", max_batch_size, "The batch size never grows beyond this")->default_val(1000);
+    app.add_option("--prune", prune,
+                   "Prune blocks of 8 weights with the smallest magnitude during training until this fraction of them is "
+                   "pruned, one value for every layer but the output layer (ex. 0.9) or a comma separated value for each "
+                   "layer with weights");
+    app.add_option("--prune-rounds", prune_rounds, "With --prune, number of times to prune a little more")
+        ->default_val(4);
+    app.add_option("--prune-start", prune_start, "With --prune, epoch of the first round")->default_val(1);
+    app.add_option("--prune-interval", prune_interval, "With --prune, epochs of fine-tuning between rounds")
+        ->default_val(1);
+    app.add_option("--low-rank", low_rank,
+                   "Store weights as the product of two thin matrices of this rank, one value for every layer but the "
+                   "output layer (ex. 8) or a comma separated value for each layer with weights, 0 for dense");
+    app.add_option("--low-rank-start", low_rank_start,
+                   "With --low-rank, epoch to factor the trained layers at before fine-tuning them, 0 trains the "
+                   "factors from the start")
+        ->default_val(0);
+    app.add_option("--conv", conv_layers,
+                   "Convolution and max pooling layers between the input and the hidden layers, comma separated "
+                   "conv<channels>x<kernel> (a multiple of 8 channels, an odd kernel) or pool<window>, ex. "
+                   "conv8x5,pool2,conv16x5,pool2");
+    app.add_option("--hidden", hidden_layers,
+                   "Comma separated sizes of the fully connected hidden layers, ex. 64,32, or none for no hidden layers")
+        ->default_val("40");
+    app.add_flag("--fused-gradients", fused_gradients,
+                 "Apply weight gradients tile by tile as they are calculated instead of storing the whole batch's "
+                 "gradient first, saves memory and bandwidth about the size of the network")
+        ->default_val(false);
+    app.add_option("--hogwild", hogwild_threads,
+                   "Train using lock-free Hogwild updates from this many threads rather than synchronous batches. Loads "
+                   "the training data into memory")
+        ->default_val(0);
+
+    app.add_flag("--hogwild-report", hogwild_report,
+                 "Instead of training, compare accuracy and throughput of synchronous and Hogwild training over "
+                 "--epochs epochs, starting from the same weights")
+        ->default_val(false);
+
+    app.add_option("--hosts", hosts,
+                   "Comma separated addresses (host:port or unix:/path) of every process taking part in distributed "
+                   "training. Each process trains on its own shard of the training data and gradients are summed across "
+                   "all processes every batch");
+    app.add_option("--rank", rank, "Index of this process in --hosts")->default_val(0);
+
+    app.add_option("--seed", seed,
+                   "Seed used for initializing weights and shuffling training data. Runs with the same seed and options "
+                   "produce identical weights, no matter how many --threads are used (except for --hogwild)");
+    app.add_option("-j,--threads", threads, "Number of threads used to train each batch")->default_val(1);
+    app.add_flag("--shuffle", shuffle,
+                 "Shuffle the order of training records every epoch. Loads the training data into memory")
+        ->default_val(false);
+    app.add_flag("--huge-pages", huge_pages,
+                 "Back weights, training buffers and data loaded into memory with 2 MB huge pages where the system allows "
+                 "it, and report which of them got huge pages before training")
+        ->default_val(false);
+
+    app.add_flag("--numa", numa,
+                 "Pin training threads to the CPUs of each NUMA node, place the training data and buffers each thread "
+                 "uses on its own node, test on a copy of the network per node, and log the bandwidth between nodes")
+        ->default_val(false);
+
+    app.add_option("--save-model", save_model, "Save the trained network to this model file once training is done");
+    app.add_option("--load-model", load_model,
+                   "Start from the network in this model file instead of random weights, its layer sizes are used. With "
+                   "-e 0 the network is only tested");
+    app.add_flag("--verify-model", verify_model,
+                 "Check the weights of the --load-model file against their checksum, which reads the whole file")
+        ->default_val(false);
+
+    app.add_option("--checkpoint", checkpoint,
+                   "Write a checkpoint of the weights, optimizer, shuffle order and position in the training data to this "
+                   "file after every epoch, from a background thread. Replaced atomically every time");
+    app.add_option("--checkpoint-every", checkpoint_every,
+                   "Also write a checkpoint every this many batches within an epoch, 0 for only after every epoch")
+        ->default_val(0);
+    app.add_flag("--resume", resume,
+                 "Carry on training from the --checkpoint file. With the same options as the run that wrote it, training "
+                 "ends with exactly the same weights as if it had never stopped")
+        ->default_val(false);
+
+    // sweep subcommand, trains many configurations at once rather than a single network
+    CLI::App *sweep_command = app.add_subcommand(
+        "sweep", "Train many configurations at once on the same data and find the most accurate using successive halving");
+
+    string sweep_step_sizes = "0.005", sweep_batch_sizes = "100", sweep_hidden_layers = "40";
+    int sweep_random_configs = 0, sweep_min_epochs = 1, sweep_max_epochs = 16, sweep_reduction_factor = 2;
+    int sweep_jobs = max(1, (int)thread::hardware_concurrency());
+
+    sweep_command->add_option("--step-sizes", sweep_step_sizes, "Comma separated step sizes to try")
+        ->default_val("0.005");
+    sweep_command->add_option("--batch-sizes", sweep_batch_sizes, "Comma separated batch sizes to try")
+        ->default_val("100");
+    sweep_command
+        ->add_option("--hidden", sweep_hidden_layers,
+                     "Comma separated hidden layer configurations to try, layers within a configuration are separated by "
+                     "':' (ex. 40,100,64:32)")
+        ->default_val("40");
+    sweep_command
+        ->add_option("--random", sweep_random_configs,
+                     "Try this many random configurations instead of every combination. Step sizes are picked on a log "
+                     "scale between the smallest and largest given")
+        ->default_val(0);
+    sweep_command->add_option("--min-epochs", sweep_min_epochs, "Epochs every configuration is trained for first")
+        ->default_val(1);
+    sweep_command->add_option("--max-epochs", sweep_max_epochs, "Most epochs any configuration is trained for")
+        ->default_val(16);
+    sweep_command
+        ->add_option("--reduction-factor", sweep_reduction_factor,
+                     "Only the best 1/N configurations are kept after every round")
+        ->default_val(2);
+    sweep_command->add_option("--jobs", sweep_jobs, "Number of configurations trained at the same time");
+
+    // population subcommand, trains many networks with the same layer sizes at once
+    CLI::App *population_command = app.add_subcommand(
+        "population", "Train many networks with the same layer sizes at once, for ensembles or to compare seeds");
+
+    int population_members = 8;
+    bool population_compare = false;
+
+    population_command
+        ->add_option("--members", population_members,
+                     "Number of networks to train, each starts from its own seed (--seed, --seed + 1, ...)")
+        ->default_val(8);
+    population_command
+        ->add_flag("--compare", population_compare,
+                   "Also time one epoch of a single network with the regular trainer and report the speedup")
+        ->default_val(false);
+
+    // infer subcommand, classifies images with a saved model rather than training
+    CLI::App *infer_command = app.add_subcommand(
+        "infer", "Classify every image in an IDX or .npy file with a saved model, writing the prediction of each one");
+
+    string infer_model, infer_input, infer_output, infer_format = "csv";
+    int infer_top_k = 0, infer_batch_size = 1024, infer_latency = 0;
+    int infer_threads = max(1, (int)thread::hardware_concurrency());
+
+    infer_command->add_option("--model", infer_model, "Model file to classify with, saved with --save-model")
+        ->required();
+    infer_command
+        ->add_option("--input", infer_input,
+                     "IDX file of unsigned bytes, or .npy file of uint8 or float32 values, with one image per row")
+        ->required();
+    infer_command->add_option("--output", infer_output, "File to write the results to")->required();
+    infer_command->add_option("--format", infer_format, "Format of the results: csv or binary")->default_val("csv");
+    infer_command
+        ->add_option("--top-k", infer_top_k,
+                     "Also write the k most likely classes of every image and their probabilities")
+        ->default_val(0);
+    infer_command->add_option("-b,--batch-size", infer_batch_size, "Number of images read from the input at a time")
+        ->default_val(1024);
+    infer_command->add_option("-j,--threads", infer_threads,
+                              "Number of threads classifying each batch, default is one per core");
+    infer_command
+        ->add_option("--latency", infer_latency,
+                     "Afterwards, also classify this many images one at a time with the single image path and log the "
+                     "latency of a prediction")
+        ->default_val(0);
+
+    // serve subcommand, classifies images sent by other processes
+    CLI::App *serve_command = app.add_subcommand(
+        "serve", "Serve a saved model to other processes on this machine, batching concurrent requests together");
+
+    string serve_model, serve_listen = "unix:/tmp/mnist-dnn.sock";
+    int serve_max_batch_size = 64, serve_max_delay = 500;
+    double serve_stats_interval = 10;
+    int serve_threads = 1;
+
+    serve_command->add_option("--model", serve_model, "Model file to classify with, saved with --save-model")->required();
+    serve_command->add_option("--listen", serve_listen, "Address to listen on, unix:/path or host:port")
+        ->default_val("unix:/tmp/mnist-dnn.sock");
+    serve_command->add_option("--max-batch-size", serve_max_batch_size, "Most images propagated through the network at once")
+        ->default_val(64);
+    serve_command
+        ->add_option("--max-delay", serve_max_delay,
+                     "Longest a request waits for others to batch it with, in microseconds")
+        ->default_val(500);
+    serve_command->add_option("--stats-interval", serve_stats_interval, "Log throughput and latency every this many seconds")
+        ->default_val(10);
+    serve_command->add_option("-j,--threads", serve_threads, "Number of threads propagating each batch")->default_val(1);
+
+    // client subcommand, load tests a server
+    CLI::App *client_command =
+        app.add_subcommand("client", "Load test a server started with serve, and report its latency and throughput");
+
+    string client_connect = "unix:/tmp/mnist-dnn.sock", client_input;
+    long client_requests = 10000;
+    int client_connections = 4, client_images = 1;
+
+    client_command->add_option("--connect", client_connect, "Address of the server, unix:/path or host:port")
+        ->default_val("unix:/tmp/mnist-dnn.sock");
+    client_command->add_option("--input", client_input, "IDX or .npy file to take the images sent from")->required();
+    client_command->add_option("--requests", client_requests, "Number of requests to send")->default_val(10000);
+    client_command
+        ->add_option("--connections", client_connections,
+                     "Number of connections sending requests at the same time, each waits for the response to its last "
+                     "request before sending the next")
+        ->default_val(4);
+    client_command->add_option("--images", client_images, "Number of images in each request")->default_val(1);
+
     CLI11_PARSE(app);
 
     // initalize and configure spdlog
@@ -45,15 +330,225 @@ int main(int argc, char *argv[]) {
         SPDLOG_INFO("--no-logging flag means logging is disabled.");
     }
 
-    int layer_sizes[] = {28 * 28, 40, 10};
-
-    int num_layers = sizeof(layer_sizes) / sizeof(int); // calculate the size of layer_sizes
+    // must be set before anything large is allocated
+    HugePageAllocator::instance().enabled = huge_pages;
 
     try {
-        Network network(layer_sizes, num_layers);
+        vector<int> layer_sizes = {28 * 28};
+        if (hidden_layers != "none") {
+            for (const string &size : split_string(hidden_layers, ',')) {
+                layer_sizes.push_back(stoi(size));
+            }
+        }
+        layer_sizes.push_back(10);
+
+        int num_layers = layer_sizes.size();
+
+        if (infer_command->parsed()) {
+            Network network = ModelFile::load(infer_model);
+            InputFile input(infer_input);
+
+            BatchInference inference(network, infer_threads);
+            inference.batch_size = infer_batch_size;
+            inference.top_k = infer_top_k;
+            inference.format = BatchInference::parse_format(infer_format);
+            inference.run(input, infer_output);
+
+            if (infer_latency > 0) {
+                InputFile latency_input(infer_input);
+                inference.log_single_image_latency(latency_input, infer_latency);
+            }
+            return 0;
+        }
+
+        if (serve_command->parsed()) {
+            Network network = ModelFile::load(serve_model);
+
+            InferenceServer server(network, serve_threads);
+            server.max_batch_size = serve_max_batch_size;
+            server.max_delay_us = serve_max_delay;
+            server.stats_interval = serve_stats_interval;
+            server.run(serve_listen);
+            return 0;
+        }
+
+        if (client_command->parsed()) {
+            InputFile input(client_input);
+
+            InferenceClient client(client_connect);
+            client.requests = client_requests;
+            client.connections = client_connections;
+            client.images_per_request = client_images;
+            client.run(input);
+            return 0;
+        }
+
+        // everything else trains or tests a network
+        if (training_data_file.empty() || training_labels_file.empty() || test_data_file.empty() ||
+            test_labels_file.empty()) {
+            throw invalid_argument("--training_data, --training_labels, --test_data and --test_labels are required");
+        }
+
+        SPDLOG_INFO("Using seed {0}", seed);
+
+        Optimizer::Type optimizer = Optimizer::parse(optimizer_name);
+
+        if (epochs_option->count() == 0) {
+            epochs = Optimizer::default_epochs(optimizer);
+        }
+        if (step_size_option->count() == 0) {
+            step_size = Optimizer::default_step_size(optimizer);
+        }
+
+        if (sweep_command->parsed()) {
+            // load the data once, every configuration reads from the same copy
+            TrainingData data;
+            data.set_test_data_file(test_data_file);
+            data.set_test_labels_file(test_labels_file);
+            data.get_test_data();
+            data.get_test_labels();
+            data.set_training_data_file(training_data_file);
+            data.set_training_labels_file(training_labels_file);
+            data.load_training_data();
+
+            Sweep sweep(data);
+
+            sweep.step_sizes.clear();
+            for (const string &step_size : split_string(sweep_step_sizes, ',')) {
+                sweep.step_sizes.push_back(stof(step_size));
+            }
+
+            sweep.batch_sizes.clear();
+            for (const string &batch_size : split_string(sweep_batch_sizes, ',')) {
+                sweep.batch_sizes.push_back(stoi(batch_size));
+            }
+
+            sweep.hidden_layers.clear();
+            for (const string &config : split_string(sweep_hidden_layers, ',')) {
+                vector<int> hidden;
+                for (const string &size : split_string(config, ':')) {
+                    hidden.push_back(stoi(size));
+                }
+                sweep.hidden_layers.push_back(hidden);
+            }
+
+            sweep.random_configs = sweep_random_configs;
+            sweep.min_epochs = sweep_min_epochs;
+            sweep.max_epochs = sweep_max_epochs;
+            sweep.reduction_factor = sweep_reduction_factor;
+            sweep.jobs = sweep_jobs;
+            sweep.seed = seed;
+            sweep.shuffle = shuffle;
+            sweep.optimizer = optimizer;
+
+            if (huge_pages) {
+                HugePageAllocator::instance().log_report();
+            }
 
-        // make last layer activation function, sigmoid:
-        network.layers[network.layers.size() - 1]->activation_function = Layer::Function::Sigmoid;
+            sweep.run();
+
+            AllocationTracker::log_report();
+            return AllocationTracker::steady_state_clean() ? 0 : 1;
+        }
+
+        if (population_command->parsed()) {
+            if (!conv_layers.empty()) {
+                throw invalid_argument("Population training only supports fully connected layers");
+            }
+            if (optimizer != Optimizer::SGD) {
+                throw invalid_argument("Population training only supports the sgd optimizer");
+            }
+
+            vector<unique_ptr<Network>> members;
+            vector<Network *> networks;
+            for (int m = 0; m < population_members; m++) {
+                members.push_back(make_unique<Network>(layer_sizes.data(), num_layers, seed + m));
+                members[m]->layers[num_layers - 1]->activation_function = Layer::Function::Sigmoid;
+                networks.push_back(members[m].get());
+            }
+
+            PopulationTrainer population(networks);
+            population.step_size = step_size;
+
+            population.training_data.set_test_data_file(test_data_file);
+            population.training_data.set_test_labels_file(test_labels_file);
+            population.training_data.get_test_data();
+            population.training_data.get_test_labels();
+            population.training_data.set_training_data_file(training_data_file);
+            population.training_data.set_training_labels_file(training_labels_file);
+            population.training_data.set_batch_size(batch_size);
+            population.training_data.shuffle = shuffle;
+            population.training_data.shuffle_engine.seed(seed);
+            population.training_data.load_training_data();
+            population.set_threads(threads);
+
+            if (huge_pages) {
+                HugePageAllocator::instance().log_report();
+            }
+
+            double records_per_second = population.train(epochs, log_accuracy);
+
+            if (population_compare) {
+                // time the regular trainer on a single network with the same data and threads, training the members one
+                // after another with it would take this long per member
+                Network single(*networks[0]);
+                Trainer trainer;
+                trainer.training_data.share_data_with(population.training_data);
+                trainer.setNetwork(single);
+                trainer.set_threads(threads);
+
+                auto t_start = chrono::high_resolution_clock::now();
+                trainer.train_epoch();
+                auto t_end = chrono::high_resolution_clock::now();
+
+                double single_records_per_second = trainer.training_data.training_data_items_count /
+                                                   chrono::duration<double>(t_end - t_start).count();
+
+                SPDLOG_INFO("Regular trainer throughput: {0:.0f} records/s, population is {1:.1f}x faster than "
+                            "training {2} networks one after another",
+                            single_records_per_second, records_per_second / single_records_per_second,
+                            population_members);
+            }
+
+            if (!save_model.empty()) {
+                for (int m = 0; m < population_members; m++) {
+                    population.copy_member_to(m, *networks[m]);
+                    ModelFile::save(*networks[m], PopulationTrainer::member_path(save_model, m));
+                }
+            }
+            return 0;
+        }
+
+        Network network;
+
+        if (resume) {
+            if (checkpoint.empty()) {
+                throw invalid_argument("--resume needs the --checkpoint file to resume from");
+            }
+            if (!load_model.empty()) {
+                throw invalid_argument("--resume continues from the weights in the checkpoint, it can't be used with "
+                                       "--load-model");
+            }
+
+            // a checkpoint is a model file followed by the training state, the layer sizes come from it
+            network = ModelFile::load(checkpoint);
+        } else if (!load_model.empty()) {
+            network = ModelFile::load(load_model, verify_model);
+        } else if (!conv_layers.empty()) {
+            vector<int> dense_sizes(layer_sizes.begin() + 1, layer_sizes.end());
+            network = Network(FeatureMaps{1, 28, 28}, FeatureLayerSpec::parse(conv_layers), dense_sizes, seed);
+
+            network.layers[network.layers.size() - 1]->activation_function = Layer::Function::Sigmoid;
+        } else {
+            network = Network(layer_sizes.data(), num_layers, seed);
+
+            // make last layer activation function, sigmoid:
+            network.layers[network.layers.size() - 1]->activation_function = Layer::Function::Sigmoid;
+        }
+
+        NetworkCost cost = NetworkCost::of(network);
+        SPDLOG_INFO("Network of {0} layers, {1} parameters, {2} multiply-adds per image", network.layers.size(),
+                    cost.parameters, cost.multiply_adds);
 
         Trainer trainer(network);
 
@@ -61,13 +556,117 @@ int main(int argc, char *argv[]) {
         trainer.training_data.set_test_data_file(test_data_file);
         trainer.training_data.set_test_labels_file(test_labels_file);
 
+        if (network.layers[0]->size != trainer.training_data.input_rows * trainer.training_data.input_columns) {
+            throw invalid_argument("The network has " + to_string(network.layers[0]->size) + " inputs but test records have " +
+                                   to_string(trainer.training_data.input_rows * trainer.training_data.input_columns) +
+                                   " values");
+        }
+
         trainer.training_data.get_test_data();
         trainer.training_data.get_test_labels();
 
         trainer.training_data.set_training_data_file(training_data_file);
         trainer.training_data.set_training_labels_file(training_labels_file);
+        trainer.set_batch_size(batch_size);
+
+        trainer.set_optimizer(optimizer);
+        trainer.step_size = step_size;
+        if (optimizer == Optimizer::LBFGS) {
+            SPDLOG_INFO("Using full-batch lbfgs optimizer");
+        } else {
+            SPDLOG_INFO("Using {0} optimizer with a step size of {1}", optimizer_name, step_size);
+        }
+
+        trainer.set_fused_gradients(fused_gradients);
+
+        trainer.schedule.type = LearningRateSchedule::parse(schedule_name);
+        trainer.schedule.warmup_epochs = warmup_epochs;
+        trainer.schedule.decay_epochs = decay_epochs;
+        trainer.schedule.decay = decay;
 
-        trainer.train(100, log_accuracy);
+        trainer.batch_schedule.type = BatchSizeSchedule::parse(batch_schedule_name);
+        trainer.batch_schedule.growth = batch_growth;
+        trainer.batch_schedule.growth_epochs = batch_growth_epochs;
+        trainer.batch_schedule.max_batch_size = max_batch_size;
+
+        if (!prune.empty()) {
+            trainer.pruning.sparsity = PruningSchedule::parse(prune, network.layers.size() - 1);
+            trainer.pruning.rounds = prune_rounds;
+            trainer.pruning.start_epoch = prune_start;
+            trainer.pruning.interval = prune_interval;
+        }
+
+        if (!low_rank.empty()) {
+            trainer.factorization.ranks = FactorizationSchedule::parse(low_rank, network.layers.size() - 1);
+            trainer.factorization.start_epoch = low_rank_start;
+        }
+
+        trainer.stopping.target_accuracy = target_accuracy;
+        trainer.stopping.patience = patience;
+        trainer.stopping.time_budget = time_budget;
+
+        trainer.async_evaluation = async_evaluation;
+        trainer.hogwild_threads = hogwild_threads;
+        trainer.set_threads(threads);
+
+        trainer.training_data.shuffle = shuffle;
+        trainer.training_data.shuffle_engine.seed(seed);
+
+        bool full_batch = optimizer == Optimizer::LBFGS;
+
+        if ((hogwild_threads > 0 || hogwild_report || shuffle || full_batch) && hosts.empty()) {
+            // Hogwild threads and shuffling pick records at random, and L-BFGS goes over the whole training data set many
+            // times per epoch, so the whole training data set needs to be in memory
+            trainer.training_data.load_training_data();
+        }
+
+        unique_ptr<RingAllReduce> communicator;
+
+        if (!hosts.empty()) {
+            vector<string> addresses = split_string(hosts, ',');
+
+            communicator = make_unique<RingAllReduce>(addresses, rank);
+            trainer.communicator = communicator.get();
+
+            // every process trains on its own shard of the training data
+            trainer.training_data.load_training_data(rank, addresses.size());
+        }
+
+        if (numa) {
+            trainer.set_numa(true);
+        }
+
+        trainer.checkpoint_path = checkpoint;
+        trainer.checkpoint_interval = checkpoint_every;
+        if (resume) {
+            trainer.resume(checkpoint);
+        }
+
+        if (huge_pages) {
+            HugePageAllocator::instance().log_report();
+        }
+
+        if (hogwild_report) {
+            // default to one thread per core if --hogwild wasn't given
+            int threads = hogwild_threads > 0 ? hogwild_threads : max(1, (int)thread::hardware_concurrency());
+            trainer.hogwild_threads = 0;
+            trainer.hogwild_report(epochs, threads);
+            return 0;
+        }
+
+        trainer.train(epochs, log_accuracy);
+
+        communicator.reset();
+
+        if (!save_model.empty() && rank == 0) {
+            ModelFile::save(network, save_model);
+        }
+
+        // only counts anything when built with TRACK_ALLOCATIONS
+        AllocationTracker::log_report();
+        if (!AllocationTracker::steady_state_clean()) {
+            return 1;
+        }
 
     } catch (invalid_argument e) {
         SPDLOG_ERROR(e.what());
@@ -75,6 +674,9 @@ int main(int argc, char *argv[]) {
     } catch (invalid_function_call e) {
         SPDLOG_ERROR(e.what());
         return 1;
+    } catch (communication_error e) {
+        SPDLOG_ERROR(e.what());
+        return 1;
     }
 
     return 0;
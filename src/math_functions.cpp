@@ -1,3 +1,11 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+
 /**
  * Math functions used throughout training and testing
  */
@@ -36,8 +44,141 @@ class ActivationFunctionGradients {
     }
 };
 
-void dot_product(float a, float *b, float *c, int length) {
+inline void dot_product(float a, float *b, float *c, int length) {
     for (int x = 0; x < length; x++) {
         c[x] += a * b[x];
     }
+}
+
+/**
+ * @brief Add to a value that other threads may be updating at the same time, without any locking (used by Hogwild
+ *        training). The load and store are each atomic, but the addition as a whole isn't, so an update can be lost when
+ *        two threads write the same value at once. Hogwild relies on this being rare enough not to matter.
+ */
+inline void racy_add(float &value, float delta) {
+#if defined(__GNUC__)
+    float current;
+    __atomic_load(&value, &current, __ATOMIC_RELAXED);
+    current += delta;
+    __atomic_store(&value, &current, __ATOMIC_RELAXED);
+#else
+    value += delta;
+#endif
+}
+
+/**
+ * @brief Value below which a fraction of the samples fall (ex. 0.99 for the 99th percentile), 0 when there are none.
+ *        Reorders the samples.
+ */
+inline double percentile(vector<float> &samples, double fraction) {
+    if (samples.empty()) {
+        return 0;
+    }
+
+    size_t index = min(samples.size() - 1, (size_t)(fraction * samples.size()));
+    nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+/**
+ *?                             ==================================================
+ *?                                        🛈 Matrix Multiplication
+ *?                             ==================================================
+ *
+ * All matrices are stored row by row. The leading dimension (ld) of a matrix is the distance between the start of one row
+ * and the start of the next, which lets a function work on a block of columns inside a wider matrix. Rows of B and C are
+ * walked through from start to end in the innermost loop, which compilers turn into vectorized code.
+ */
+
+/**
+ * @brief Number of rows of B used at a time in `matrix_multiply()`, so they stay in cache while every row of A uses them
+ */
+const int MATRIX_MULTIPLY_BLOCK = 64;
+
+/**
+ * @brief C = A · B, or C += A · B when accumulating. A is rows x inner, B is inner x columns and C is rows x columns.
+ */
+inline void matrix_multiply(const float *a, int lda, const float *b, int ldb, float *c, int ldc, int rows, int inner,
+                            int columns, bool accumulate = false) {
+    if (!accumulate) {
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < columns; j++) {
+                c[i * ldc + j] = 0;
+            }
+        }
+    }
+
+    for (int k_start = 0; k_start < inner; k_start += MATRIX_MULTIPLY_BLOCK) {
+        int k_end = min(k_start + MATRIX_MULTIPLY_BLOCK, inner);
+
+        for (int i = 0; i < rows; i++) {
+            float *__restrict c_row = c + (size_t)i * ldc;
+
+            for (int k = k_start; k < k_end; k++) {
+                float a_value = a[(size_t)i * lda + k];
+
+                // inputs are mostly zeros (blank pixels, inactive ReLUs), skip them
+                if (a_value == 0) {
+                    continue;
+                }
+
+                const float *b_row = b + (size_t)k * ldb;
+                for (int j = 0; j < columns; j++) {
+                    c_row[j] += a_value * b_row[j];
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief C = Aᵀ · B, or C += Aᵀ · B when accumulating. A is inner x rows, B is inner x columns and C is rows x columns.
+ *        Used to calculate weight gradients, where A is a batch of activations and B is a batch of errors.
+ */
+inline void matrix_multiply_transposed_a(const float *a, int lda, const float *b, int ldb, float *c, int ldc, int rows,
+                                         int inner, int columns, bool accumulate = false) {
+    if (!accumulate) {
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < columns; j++) {
+                c[i * ldc + j] = 0;
+            }
+        }
+    }
+
+    for (int k = 0; k < inner; k++) {
+        const float *b_row = b + (size_t)k * ldb;
+
+        for (int i = 0; i < rows; i++) {
+            float a_value = a[(size_t)k * lda + i];
+            if (a_value == 0) {
+                continue;
+            }
+
+            float *__restrict c_row = c + (size_t)i * ldc;
+            for (int j = 0; j < columns; j++) {
+                c_row[j] += a_value * b_row[j];
+            }
+        }
+    }
+}
+
+/**
+ * @brief C = A · Bᵀ. A is rows x inner, B is columns x inner and C is rows x columns. Used to backpropagate errors, where A
+ *        is a batch of errors and B is the weight matrix.
+ */
+inline void matrix_multiply_transposed_b(const float *a, int lda, const float *b, int ldb, float *c, int ldc, int rows,
+                                         int inner, int columns) {
+    for (int i = 0; i < rows; i++) {
+        const float *a_row = a + (size_t)i * lda;
+
+        for (int j = 0; j < columns; j++) {
+            const float *b_row = b + (size_t)j * ldb;
+
+            float sum = 0;
+            for (int k = 0; k < inner; k++) {
+                sum += a_row[k] * b_row[k];
+            }
+            c[(size_t)i * ldc + j] = sum;
+        }
+    }
 }
\ No newline at end of file
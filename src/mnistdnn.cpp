@@ -0,0 +1,289 @@
+// C interface of the mnistdnn library, see mnistdnn.h
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mnistdnn.h"
+
+#include "exceptions.h"
+#include "inference/batch_classifier.cpp"
+#include "inference/inference_context.cpp"
+#include "logging.h"
+#include "model_file.cpp"
+#include "network.cpp"
+#include "trainer/trainer.cpp"
+
+// after logging.h, which sets the level spdlog's macros are compiled for
+#include <spdlog/sinks/stdout_sinks.h>
+
+using namespace std;
+
+/**
+ * @brief A network, along with whatever has been needed so far to train it or classify with it. Everything is created
+ *        on first use and kept, so repeated calls don't allocate.
+ */
+struct mnistdnn_model {
+    Network network;
+
+    int threads = 1;
+
+    unique_ptr<Trainer> trainer;
+    unique_ptr<BatchClassifier> classifier;
+    unique_ptr<InferenceContext> context;
+
+    /**
+     * @brief Pointer to each image of the last batch trained, the trainer takes a batch as rows
+     */
+    vector<const float *> rows;
+
+    /**
+     * @brief Probabilities written by the classifier when the caller doesn't want them
+     */
+    vector<float> probabilities;
+
+    mnistdnn_model(Network &&network) : network(move(network)) {}
+
+    /**
+     * @brief Throw away anything that holds on to the network's layers, after the network has been replaced
+     */
+    void reset() {
+        trainer.reset();
+        classifier.reset();
+        context.reset();
+    }
+};
+
+namespace {
+
+thread_local string last_error;
+
+/**
+ * @brief Make the library's log go to standard error at the level asked for with `mnistdnn_set_log_level()`, nothing
+ *        until then. Every message is logged through spdlog's default logger, so it's replaced before any function
+ *        of the library that can log runs. In a shared library spdlog is the library's own, a host linking the static
+ *        library that also uses spdlog shares the default logger with it.
+ */
+spdlog::logger &library_logger() {
+    static shared_ptr<spdlog::logger> logger = [] {
+        auto logger = spdlog::stderr_logger_mt("mnistdnn");
+        logger->set_pattern("mnistdnn [%l]: %v");
+        logger->set_level(spdlog::level::off);
+        spdlog::set_default_logger(logger);
+        return logger;
+    }();
+    return *logger;
+}
+
+/**
+ * @brief Run a function, turning anything it throws into a status and `last_error`, exceptions must not reach C code
+ */
+template <typename Function> mnistdnn_status guarded(Function function) {
+    try {
+        library_logger();
+        function();
+        return MNISTDNN_OK;
+    } catch (const invalid_argument &e) {
+        last_error = e.what();
+        return MNISTDNN_INVALID_ARGUMENT;
+    } catch (const exception &e) {
+        last_error = e.what();
+        return MNISTDNN_ERROR;
+    } catch (...) {
+        last_error = "Unknown error";
+        return MNISTDNN_ERROR;
+    }
+}
+
+void check_model(const mnistdnn_model *model) {
+    if (model == NULL) {
+        throw invalid_argument("Model must not be NULL");
+    }
+}
+
+void check_batch(int count, const void *inputs, const void *outputs) {
+    if (count < 0) {
+        throw invalid_argument("Number of images must not be negative");
+    }
+    if (count > 0 && (inputs == NULL || outputs == NULL)) {
+        throw invalid_argument("Inputs and outputs must not be NULL");
+    }
+}
+
+} // namespace
+
+extern "C" {
+
+int mnistdnn_api_version(void) { return MNISTDNN_API_VERSION; }
+
+const char *mnistdnn_last_error(void) { return last_error.c_str(); }
+
+mnistdnn_status mnistdnn_set_log_level(mnistdnn_log_level level) {
+    return guarded([&] {
+        const spdlog::level::level_enum levels[] = {spdlog::level::off, spdlog::level::err, spdlog::level::warn,
+                                                    spdlog::level::info, spdlog::level::debug};
+        if (level < MNISTDNN_LOG_OFF || level > MNISTDNN_LOG_DEBUG) {
+            throw invalid_argument("Unknown log level " + to_string((int)level));
+        }
+
+        library_logger().set_level(levels[level]);
+    });
+}
+
+mnistdnn_status mnistdnn_create(const int *layer_sizes, int layer_count, unsigned int seed, mnistdnn_model **model) {
+    return guarded([&] {
+        if (layer_sizes == NULL || model == NULL) {
+            throw invalid_argument("Layer sizes and model must not be NULL");
+        }
+        if (layer_count < 2) {
+            throw invalid_argument("Network must contain at least 2 layers");
+        }
+
+        vector<int> sizes(layer_sizes, layer_sizes + layer_count);
+        for (int size : sizes) {
+            if (size < 1) {
+                throw invalid_argument("Every layer must have at least 1 neuron");
+            }
+        }
+
+        Network network(sizes.data(), layer_count, seed);
+        network.layers.back()->activation_function = Layer::Function::Sigmoid;
+
+        *model = new mnistdnn_model(move(network));
+    });
+}
+
+mnistdnn_status mnistdnn_load(const char *path, mnistdnn_model **model) {
+    return guarded([&] {
+        if (path == NULL || model == NULL) {
+            throw invalid_argument("Path and model must not be NULL");
+        }
+
+        *model = new mnistdnn_model(ModelFile::load(path));
+    });
+}
+
+mnistdnn_status mnistdnn_save(const mnistdnn_model *model, const char *path) {
+    return guarded([&] {
+        check_model(model);
+        if (path == NULL) {
+            throw invalid_argument("Path must not be NULL");
+        }
+
+        ModelFile::save(model->network, path);
+    });
+}
+
+void mnistdnn_free(mnistdnn_model *model) {
+    if (model != NULL) {
+        // the trainer and classifier refer to the network, so they go first
+        model->reset();
+        delete model;
+    }
+}
+
+int mnistdnn_input_size(const mnistdnn_model *model) { return model == NULL ? 0 : model->network.layers[0]->size; }
+
+int mnistdnn_classes(const mnistdnn_model *model) { return model == NULL ? 0 : model->network.layers.back()->size; }
+
+mnistdnn_status mnistdnn_set_threads(mnistdnn_model *model, int threads) {
+    return guarded([&] {
+        check_model(model);
+        if (threads < 1) {
+            throw invalid_argument("Number of threads must be at least 1");
+        }
+        if (threads == model->threads) {
+            return;
+        }
+
+        model->threads = threads;
+        model->classifier.reset();
+        if (model->trainer != NULL) {
+            model->trainer->set_threads(threads);
+        }
+    });
+}
+
+mnistdnn_status mnistdnn_train_step(mnistdnn_model *model, const float *inputs, const uint8_t *labels, int count,
+                                    float step_size) {
+    return guarded([&] {
+        check_model(model);
+        check_batch(count, inputs, labels);
+        if (count == 0) {
+            return;
+        }
+
+        const int classes = mnistdnn_classes(model);
+        for (int x = 0; x < count; x++) {
+            if (labels[x] >= classes) {
+                throw invalid_argument("Label " + to_string(labels[x]) + " of image " + to_string(x) +
+                                       " isn't below the number of classes (" + to_string(classes) + ")");
+            }
+        }
+
+        if (model->trainer == NULL) {
+            model->trainer = make_unique<Trainer>();
+            model->trainer->set_batch_size(count);
+            model->trainer->set_threads(model->threads);
+            model->trainer->setNetwork(model->network);
+        } else if (count > model->trainer->training_data.batch_size) {
+            model->trainer->set_batch_size(count);
+        }
+
+        const int values = mnistdnn_input_size(model);
+        model->rows.resize(count);
+        for (int x = 0; x < count; x++) {
+            model->rows[x] = inputs + (size_t)x * values;
+        }
+
+        model->trainer->step_size = step_size;
+        model->trainer->train_batch(model->rows.data(), labels, count, 0.0f);
+    });
+}
+
+mnistdnn_status mnistdnn_predict(mnistdnn_model *model, const float *inputs, int count, int32_t *predictions,
+                                 float *probabilities) {
+    return guarded([&] {
+        check_model(model);
+        check_batch(count, inputs, predictions);
+        if (count == 0) {
+            return;
+        }
+
+        if (model->classifier == NULL) {
+            model->classifier = make_unique<BatchClassifier>(model->network, model->threads);
+        }
+
+        if (probabilities == NULL) {
+            if (model->probabilities.size() < count) {
+                model->probabilities.resize(count);
+            }
+            probabilities = model->probabilities.data();
+        }
+
+        // only the most likely class is ranked, so it's both the prediction and the top class
+        model->classifier->classify(inputs, count, predictions, predictions, probabilities);
+    });
+}
+
+mnistdnn_status mnistdnn_predict_bytes(mnistdnn_model *model, const uint8_t *pixels, int count, int32_t *predictions,
+                                       float *probabilities) {
+    return guarded([&] {
+        check_model(model);
+        check_batch(count, pixels, predictions);
+
+        if (model->context == NULL) {
+            model->context = make_unique<InferenceContext>(model->network);
+        }
+
+        const int values = mnistdnn_input_size(model);
+        for (int x = 0; x < count; x++) {
+            predictions[x] = model->context->predict(pixels + (size_t)x * values);
+            if (probabilities != NULL) {
+                probabilities[x] = model->context->probability(predictions[x]);
+            }
+        }
+    });
+}
+}
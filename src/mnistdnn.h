@@ -0,0 +1,148 @@
+#pragma once
+
+/**
+ * C interface to the network, for programs that embed it rather than running `runme`. Built as the `mnistdnn` library.
+ *
+ * Every function returns `MNISTDNN_OK` or an error status, and `mnistdnn_last_error()` describes the last error on the
+ * calling thread. Inputs are read straight from the caller's buffers, nothing is copied before it's propagated. A model
+ * must only be used by one thread at a time, give each thread its own model or serialize calls. The library doesn't log
+ * anything unless asked to with `mnistdnn_set_log_level()`.
+ */
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+    #define MNISTDNN_EXPORT __declspec(dllexport)
+#else
+    #define MNISTDNN_EXPORT __attribute__((visibility("default")))
+#endif
+
+/**
+ * @brief Changes whenever a function's signature or behaviour changes in a way existing callers would notice
+ */
+#define MNISTDNN_API_VERSION 2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mnistdnn_model mnistdnn_model;
+
+typedef enum mnistdnn_status {
+    MNISTDNN_OK = 0,
+
+    /**
+     * @brief An argument was out of range, or didn't match the model (ex. a layer size below 1)
+     */
+    MNISTDNN_INVALID_ARGUMENT = 1,
+
+    /**
+     * @brief Anything else, such as a model file that couldn't be read
+     */
+    MNISTDNN_ERROR = 2
+} mnistdnn_status;
+
+typedef enum mnistdnn_log_level {
+    MNISTDNN_LOG_OFF = 0,
+    MNISTDNN_LOG_ERROR = 1,
+    MNISTDNN_LOG_WARNING = 2,
+    MNISTDNN_LOG_INFO = 3,
+    MNISTDNN_LOG_DEBUG = 4
+} mnistdnn_log_level;
+
+/**
+ * @brief `MNISTDNN_API_VERSION` of the library, to check against the header a program was compiled with
+ */
+MNISTDNN_EXPORT int mnistdnn_api_version(void);
+
+/**
+ * @brief Log messages of a level and above to standard error, such as how long loading and saving models took. Nothing
+ *        is logged by default, so the library never writes to the host program's output on its own. Applies to every
+ *        model and thread.
+ */
+MNISTDNN_EXPORT mnistdnn_status mnistdnn_set_log_level(mnistdnn_log_level level);
+
+/**
+ * @brief Description of the last error on the calling thread, an empty string if there hasn't been one. Valid until the
+ *        next call on the same thread.
+ */
+MNISTDNN_EXPORT const char *mnistdnn_last_error(void);
+
+/**
+ * @brief Create a model with random weights and biases. Hidden layers use ReLU and the output layer sigmoid, like
+ *        networks created by `runme`.
+ *
+ * @param layer_sizes Size of each layer, input layer first
+ * @param layer_count Number of layers, at least 2
+ * @param seed Seed for the initial weights and biases
+ * @param model Set to the new model, free it with `mnistdnn_free()`
+ */
+MNISTDNN_EXPORT mnistdnn_status mnistdnn_create(const int *layer_sizes, int layer_count, unsigned int seed,
+                                                mnistdnn_model **model);
+
+/**
+ * @brief Load a model saved with `mnistdnn_save()` or `runme --save-model`. The file is mapped rather than read, so
+ *        loading is quick and models loaded by several processes share memory.
+ */
+MNISTDNN_EXPORT mnistdnn_status mnistdnn_load(const char *path, mnistdnn_model **model);
+
+MNISTDNN_EXPORT mnistdnn_status mnistdnn_save(const mnistdnn_model *model, const char *path);
+
+/**
+ * @brief Free a model and everything it allocated, does nothing when given NULL
+ */
+MNISTDNN_EXPORT void mnistdnn_free(mnistdnn_model *model);
+
+/**
+ * @brief Number of values in each image, the size of the input layer
+ */
+MNISTDNN_EXPORT int mnistdnn_input_size(const mnistdnn_model *model);
+
+/**
+ * @brief Number of classes, the size of the output layer
+ */
+MNISTDNN_EXPORT int mnistdnn_classes(const mnistdnn_model *model);
+
+/**
+ * @brief Set the number of threads used by `mnistdnn_train_step()` and `mnistdnn_predict()`, 1 by default. The threads
+ *        are created once and kept until the model is freed.
+ */
+MNISTDNN_EXPORT mnistdnn_status mnistdnn_set_threads(mnistdnn_model *model, int threads);
+
+/**
+ * @brief Train the model on one batch with stochastic gradient descent, updating its weights and biases once with the
+ *        average gradient of the batch
+ *
+ * @param inputs `count` images one after another, `mnistdnn_input_size()` values each, between 0 and 1
+ * @param labels Label of each image, below `mnistdnn_classes()`
+ * @param count Number of images in the batch
+ * @param step_size Step size (learning rate) of the update
+ */
+MNISTDNN_EXPORT mnistdnn_status mnistdnn_train_step(mnistdnn_model *model, const float *inputs, const uint8_t *labels,
+                                                    int count, float step_size);
+
+/**
+ * @brief Classify a batch of images, split between the model's threads
+ *
+ * @param inputs `count` images one after another, `mnistdnn_input_size()` values each, between 0 and 1
+ * @param count Number of images
+ * @param predictions Where to write the most likely class of each image
+ * @param probabilities Where to write the probability of each prediction, or NULL. The probability is the output
+ *                      activation of the class divided by the sum of the output activations, negative ones counted as 0.
+ */
+MNISTDNN_EXPORT mnistdnn_status mnistdnn_predict(mnistdnn_model *model, const float *inputs, int count,
+                                                 int32_t *predictions, float *probabilities);
+
+/**
+ * @brief Classify images stored as bytes the way IDX files store them, one at a time on the calling thread. Pixels are
+ *        scaled as they're read and nothing is allocated per image, which makes this the lowest latency way to
+ *        classify a single image.
+ *
+ * @param pixels `count` images one after another, `mnistdnn_input_size()` bytes each
+ */
+MNISTDNN_EXPORT mnistdnn_status mnistdnn_predict_bytes(mnistdnn_model *model, const uint8_t *pixels, int count,
+                                                       int32_t *predictions, float *probabilities);
+
+#ifdef __cplusplus
+}
+#endif
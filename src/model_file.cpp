@@ -0,0 +1,461 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "exceptions.h"
+#include "logging.h"
+#include "network.cpp"
+#include "utils/file.cpp"
+
+using namespace std;
+
+/**
+ *?                             ==================================================
+ *?                                             🛈 Model Files
+ *?                             ==================================================
+ *
+ * A trained network is saved as a header, a table describing every layer, and each layer's weights and biases stored
+ * exactly the way `Layer::parameters` holds them in memory (weights row by row, then biases, as native floats):
+ *
+ *      | header | layer table | padding | layer 1 parameters | padding | layer 2 parameters | ...
+ *
+ * A low-rank layer (see 🛈 Low-Rank Layers) stores its factors in place of its weights, as it does in memory, and its
+ * rank is in the layer table. Files without low-rank layers are the same as before there were any.
+ *
+ * Networks with convolution or pooling layers (see 🛈 Convolution Layers) have a shape table right after the layer table,
+ * with the kind of every layer and the feature maps in and out of it. Their weights and biases are stored the way the
+ * layers hold them as well, kernels blocked by output channels. Files of fully connected networks have no shape table.
+ *
+ * Every layer's parameters start on a multiple of `ALIGNMENT` bytes from the start of the file. Loading maps the file
+ * into memory and points each layer straight at its parameters in the mapping, nothing is read or converted up front, so
+ * loading takes about the same time no matter how big the model is. Pages are read from disk the first time they're
+ * used, and the mapping is private, so training a loaded network never writes to the file.
+ *
+ * The header records the byte order and float type of the machine that saved the file, files saved on a machine with
+ * different ones are rejected rather than converted. The header and layer table are always checked against a checksum.
+ * The weights are checked against `Network::checksum()` only when asked to, since that reads the whole file.
+ *
+ * Anything stored after the last layer's parameters is ignored when loading, checkpoints keep the rest of the training
+ * state there (see `Checkpoint`), so a checkpoint can also be loaded as a model.
+ */
+
+/**
+ * @brief Saves networks to model files and maps them back
+ */
+class ModelFile {
+  public:
+    static constexpr char MAGIC[8] = {'M', 'N', 'I', 'S', 'T', 'D', 'N', 'N'};
+    static const uint32_t VERSION = 1;
+
+    /**
+     * @brief Written as a native integer, so a file saved with another byte order reads it back differently
+     */
+    static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    /**
+     * @brief Type of every weight and bias in the file
+     */
+    enum DataType : uint32_t { Float32 = 0 };
+
+    /**
+     * @brief Every layer's parameters start on a page boundary
+     */
+    static const uint32_t ALIGNMENT = 4096;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t data_type;
+        uint32_t alignment;
+        uint32_t layer_count;
+
+        /**
+         * @brief Number of entries in the shape table, one for each layer, or 0 if every layer is fully connected
+         */
+        uint32_t shape_count;
+
+        /**
+         * @brief Size of the model, to catch files that were cut short. Anything after it isn't part of the model.
+         */
+        uint64_t file_bytes;
+
+        /**
+         * @brief `Network::checksum()` of the saved network
+         */
+        uint64_t weights_checksum;
+
+        /**
+         * @brief FNV-1a of the header (with this field set to 0) followed by the layer table
+         */
+        uint64_t header_checksum;
+    };
+
+    struct LayerEntry {
+        uint32_t size;
+        uint32_t previous_layer_size;
+        uint32_t activation_function;
+
+        /**
+         * @brief Rank of the layer's factors, stored in place of its weights, 0 for a dense layer
+         */
+        uint32_t rank;
+
+        /**
+         * @brief Where the layer's parameters start in the file, and how many weights (or factors) and biases there
+         *        are. Both 0 for the input layer.
+         */
+        uint64_t offset;
+        uint64_t count;
+    };
+
+    /**
+     * @brief Kind of a layer, and for convolution and max pooling layers the feature maps in and out of it and the size
+     *        of its kernel or window
+     */
+    struct ShapeEntry {
+        uint32_t kind;
+        uint32_t input_channels, input_height, input_width;
+        uint32_t output_channels, output_height, output_width;
+        uint32_t window;
+        uint32_t padding;
+        uint32_t reserved;
+    };
+
+    /**
+     * @brief Save a network, replacing the file if it exists only once the whole model has been written. The network
+     *        may have been loaded from that same file, its parameters then point into the file's mapping, which
+     *        truncating the file in place would pull out from under them.
+     *
+     * @param network Network to save
+     * @param path Path of the model file
+     */
+    static void save(const Network &network, const string &path) {
+        auto t_start = chrono::high_resolution_clock::now();
+
+        uint64_t bytes = 0;
+        write_atomically(path, "model file", [&](ostream &file) { bytes = write(network, file); });
+
+        auto t_end = chrono::high_resolution_clock::now();
+        SPDLOG_INFO("Saved model to {0} ({1:.2f} MB) in {2:.1f} ms", path, bytes / (1024.0 * 1024.0),
+                    chrono::duration<double, milli>(t_end - t_start).count());
+    }
+
+    /**
+     * @brief Write a network in the model file format to a stream, which must be at the start of the file, since
+     *        parameters are aligned relative to it
+     *
+     * @param network Network to write
+     * @param file Stream to write to
+     *
+     * @return Number of bytes written
+     */
+    static uint64_t write(const Network &network, ostream &file) {
+        Header header = {};
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.byte_order = BYTE_ORDER_MARK;
+        header.data_type = Float32;
+        header.alignment = ALIGNMENT;
+        header.layer_count = network.layers.size();
+        header.weights_checksum = network.checksum();
+
+        vector<LayerEntry> table(network.layers.size());
+        vector<ShapeEntry> shapes;
+
+        if (any_of(network.layers.begin(), network.layers.end(),
+                   [](const Layer *layer) { return layer->kind != Layer::Dense; })) {
+            for (const Layer *layer : network.layers) {
+                const FeatureShape &shape = layer->shape;
+                shapes.push_back({(uint32_t)layer->kind, (uint32_t)shape.input.channels, (uint32_t)shape.input.height,
+                                  (uint32_t)shape.input.width, (uint32_t)shape.output.channels,
+                                  (uint32_t)shape.output.height, (uint32_t)shape.output.width, (uint32_t)shape.window,
+                                  (uint32_t)shape.padding, 0});
+            }
+        }
+        header.shape_count = shapes.size();
+
+        uint64_t offset = sizeof(Header) + table.size() * sizeof(LayerEntry) + shapes.size() * sizeof(ShapeEntry);
+
+        for (int l = 0; l < network.layers.size(); l++) {
+            const Layer *layer = network.layers[l];
+            table[l] = {(uint32_t)layer->size, (uint32_t)layer->previous_layer_size,
+                        (uint32_t)layer->activation_function, (uint32_t)layer->rank, 0, (uint64_t)layer->parameter_count()};
+
+            if (l > 0) {
+                offset = aligned(offset);
+                table[l].offset = offset;
+                offset += (uint64_t)layer->parameter_count() * sizeof(float);
+            }
+        }
+
+        header.file_bytes = offset;
+        header.header_checksum = calculate_header_checksum(header, table, shapes);
+
+        file.write((const char *)&header, sizeof(header));
+        file.write((const char *)table.data(), table.size() * sizeof(LayerEntry));
+        file.write((const char *)shapes.data(), shapes.size() * sizeof(ShapeEntry));
+
+        for (int l = 1; l < network.layers.size(); l++) {
+            const vector<char> padding(table[l].offset - (uint64_t)file.tellp(), 0);
+            file.write(padding.data(), padding.size());
+            file.write((const char *)network.layers[l]->parameters, network.layers[l]->parameter_count() * sizeof(float));
+        }
+
+        return header.file_bytes;
+    }
+
+    /**
+     * @brief Map a model file and create a network using its weights and biases in place
+     *
+     * @param path Path of the model file
+     * @param verify Whether to check the weights against the checksum they were saved with, which reads the whole file
+     *
+     * @return The network, its layers keep the file mapped until they (and every snapshot of them) are gone
+     */
+    static Network load(const string &path, bool verify = false) {
+        auto t_start = chrono::high_resolution_clock::now();
+
+        shared_ptr<Mapping> mapping = Mapping::map(path);
+        const char *bytes = (const char *)mapping->address;
+
+        if (mapping->bytes < sizeof(Header)) {
+            throw invalid_argument("'" + path + "' is too small to be a model file");
+        }
+
+        Header header;
+        memcpy(&header, bytes, sizeof(header));
+
+        if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+            throw invalid_argument("'" + path + "' is not a model file");
+        }
+        if (header.version != VERSION) {
+            throw invalid_argument("Model file '" + path + "' has version " + to_string(header.version) +
+                                   ", only version " + to_string(VERSION) + " is supported");
+        }
+        if (header.byte_order != BYTE_ORDER_MARK || header.data_type != Float32) {
+            throw invalid_argument("Model file '" + path + "' was saved with a different byte order or float type");
+        }
+        if (header.file_bytes > mapping->bytes ||
+            sizeof(Header) + (uint64_t)header.layer_count * sizeof(LayerEntry) +
+                    (uint64_t)header.shape_count * sizeof(ShapeEntry) >
+                mapping->bytes) {
+            throw invalid_argument("Model file '" + path + "' is truncated");
+        }
+
+        vector<LayerEntry> table(header.layer_count);
+        memcpy(table.data(), bytes + sizeof(Header), table.size() * sizeof(LayerEntry));
+
+        vector<ShapeEntry> shapes(header.shape_count);
+        memcpy(shapes.data(), bytes + sizeof(Header) + table.size() * sizeof(LayerEntry),
+               shapes.size() * sizeof(ShapeEntry));
+
+        if (calculate_header_checksum(header, table, shapes) != header.header_checksum) {
+            throw invalid_argument("Model file '" + path + "' is corrupt, its header doesn't match its checksum");
+        }
+
+        validate_table(header, table, shapes, path);
+
+        Network network;
+        network.layers.push_back(new Layer(table[0].size));
+
+        for (int l = 1; l < table.size(); l++) {
+            const Layer::Kind kind = shapes.empty() ? Layer::Dense : (Layer::Kind)shapes[l].kind;
+            const Layer::Function activation_function = (Layer::Function)table[l].activation_function;
+
+            if (kind == Layer::MaxPool) {
+                network.layers.push_back(new Layer(kind, shape_of(shapes[l]), l, activation_function, NULL));
+                continue;
+            }
+
+            float *parameters = (float *)(bytes + table[l].offset);
+
+            if (kind == Layer::Convolution) {
+                const FeatureShape shape = shape_of(shapes[l]);
+                auto block = make_shared<ParameterBlock>(parameters, table[l].count / CHANNEL_BLOCK, CHANNEL_BLOCK,
+                                                         mapping);
+                network.layers.push_back(new Layer(kind, shape, l, activation_function, block));
+                continue;
+            }
+
+            // a low-rank layer has no rows of weights to point to
+            const int rows = table[l].rank > 0 ? 0 : table[l].previous_layer_size;
+            auto block = make_shared<ParameterBlock>(parameters, rows, table[l].size, mapping);
+
+            network.layers.push_back(
+                new Layer(table[l].size, table[l].previous_layer_size, l, activation_function, block, table[l].rank));
+        }
+
+        if (verify && network.checksum() != header.weights_checksum) {
+            throw invalid_argument("Model file '" + path + "' is corrupt, its weights don't match their checksum");
+        }
+
+        auto t_end = chrono::high_resolution_clock::now();
+        SPDLOG_INFO("Loaded model from {0} ({1:.2f} MB, {2} layers{3}) in {4:.2f} ms", path,
+                    header.file_bytes / (1024.0 * 1024.0), table.size(), verify ? ", checksum verified" : "",
+                    chrono::duration<double, milli>(t_end - t_start).count());
+
+        return network;
+    }
+
+    static const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ULL;
+
+    /**
+     * @brief FNV-1a hash of some bytes, continuing from `hash`
+     */
+    static uint64_t fnv1a(uint64_t hash, const void *data, size_t count) {
+        const unsigned char *bytes = (const unsigned char *)data;
+        for (size_t x = 0; x < count; x++) {
+            hash = (hash ^ bytes[x]) * 1099511628211ULL;
+        }
+        return hash;
+    }
+
+  private:
+    /**
+     * @brief A file mapped into memory, unmapped once the last layer using it is gone
+     */
+    struct Mapping {
+        void *address = NULL;
+        size_t bytes = 0;
+
+        static shared_ptr<Mapping> map(const string &path) {
+            int descriptor = open(path.c_str(), O_RDONLY);
+            if (descriptor < 0) {
+                throw invalid_argument("Unable to open model file '" + path + "'");
+            }
+
+            struct stat status;
+            if (fstat(descriptor, &status) != 0 || status.st_size == 0) {
+                close(descriptor);
+                throw invalid_argument("Unable to read model file '" + path + "'");
+            }
+
+            // private and writable, so a loaded network can be trained without writing to the file
+            void *address = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, descriptor, 0);
+            close(descriptor);
+
+            if (address == MAP_FAILED) {
+                throw invalid_argument("Unable to map model file '" + path + "'");
+            }
+
+            shared_ptr<Mapping> mapping = make_shared<Mapping>();
+            mapping->address = address;
+            mapping->bytes = status.st_size;
+            return mapping;
+        }
+
+        ~Mapping() {
+            if (address != NULL) {
+                munmap(address, bytes);
+            }
+        }
+    };
+
+    static uint64_t aligned(uint64_t offset) { return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; }
+
+    static uint64_t calculate_header_checksum(Header header, const vector<LayerEntry> &table,
+                                              const vector<ShapeEntry> &shapes) {
+        header.header_checksum = 0;
+
+        uint64_t hash = fnv1a(FNV_OFFSET_BASIS, &header, sizeof(header));
+        hash = fnv1a(hash, table.data(), table.size() * sizeof(LayerEntry));
+        return fnv1a(hash, shapes.data(), shapes.size() * sizeof(ShapeEntry));
+    }
+
+    static FeatureShape shape_of(const ShapeEntry &entry) {
+        return {{(int)entry.input_channels, (int)entry.input_height, (int)entry.input_width},
+                {(int)entry.output_channels, (int)entry.output_height, (int)entry.output_width},
+                (int)entry.window,
+                (int)entry.padding};
+    }
+
+    /**
+     * @brief Check a convolution or max pooling layer's shape is one its layer could have been created with, and count
+     *        its weights and biases
+     *
+     * @return Whether the shape is valid
+     */
+    static bool validate_shape(const ShapeEntry &entry, const LayerEntry &layer, uint64_t &count) {
+        // below 2^16 each, a convolution's channels times its kernel stay below 2^64 and can't wrap around
+        const uint64_t limit = 1 << 16;
+        if (entry.input_channels == 0 || entry.input_channels >= limit || entry.input_height >= limit ||
+            entry.input_width >= limit || entry.window == 0 || entry.window >= limit || entry.reserved != 0) {
+            return false;
+        }
+
+        const FeatureShape shape = shape_of(entry);
+
+        if (entry.kind == Layer::Convolution) {
+            count = (uint64_t)entry.output_channels * entry.input_channels * entry.window * entry.window +
+                    entry.output_channels;
+            if (entry.output_channels == 0 || entry.output_channels % CHANNEL_BLOCK != 0 || entry.output_channels >= limit ||
+                !(FeatureShape::convolution(shape.input, shape.output.channels, shape.window) == shape)) {
+                return false;
+            }
+        } else if (entry.kind == Layer::MaxPool) {
+            count = 0;
+            if (!(FeatureShape::pooling(shape.input, shape.window) == shape) || shape.output.count() == 0) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+
+        return layer.previous_layer_size == (uint64_t)shape.input.count() && layer.size == (uint64_t)shape.output.count() &&
+               layer.rank == 0;
+    }
+
+    /**
+     * @brief Check that the layers fit together and every layer's parameters are inside the file and aligned
+     */
+    static void validate_table(const Header &header, const vector<LayerEntry> &table, const vector<ShapeEntry> &shapes,
+                               const string &path) {
+        if (table.size() < 2) {
+            throw invalid_argument("Model file '" + path + "' must contain at least 2 layers");
+        }
+        if (!shapes.empty() && (shapes.size() != table.size() || shapes[0].kind != Layer::Dense)) {
+            throw invalid_argument("Model file '" + path + "' has an invalid shape table");
+        }
+
+        if (header.alignment == 0 || header.alignment % alignof(float) != 0) {
+            throw invalid_argument("Model file '" + path + "' has an invalid alignment of " +
+                                   to_string(header.alignment));
+        }
+
+        for (int l = 1; l < table.size(); l++) {
+            const LayerEntry &entry = table[l];
+            uint64_t count = entry.rank > 0 ? (uint64_t)entry.rank * (entry.previous_layer_size + entry.size)
+                                            : (uint64_t)entry.previous_layer_size * entry.size;
+            count += entry.size;
+
+            if (!shapes.empty() && shapes[l].kind != Layer::Dense && !validate_shape(shapes[l], entry, count)) {
+                throw invalid_argument("Model file '" + path + "' has an invalid layer " + to_string(l));
+            }
+
+            if (entry.previous_layer_size != table[l - 1].size || entry.count != count ||
+                entry.activation_function > Layer::Sigmoid || entry.rank > min(entry.previous_layer_size, entry.size)) {
+                throw invalid_argument("Model file '" + path + "' has an invalid layer " + to_string(l));
+            }
+
+            // compared with the space left after the offset rather than added to it, the offset and sizes of a corrupt
+            // file could add up past the largest uint64_t and wrap around to something small
+            if (entry.offset % header.alignment != 0 || entry.offset > header.file_bytes ||
+                count > (header.file_bytes - entry.offset) / sizeof(float)) {
+                throw invalid_argument("Model file '" + path + "' has layer " + to_string(l) + " outside the file");
+            }
+        }
+    }
+};
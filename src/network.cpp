@@ -8,9 +8,68 @@
 #include "logging.h" // for logging
 
 #include "layer.cpp"
+#include "utils/string.cpp"
 
 using namespace std;
 
+/**
+ * @brief A convolution or max pooling layer of a network to create, see `Network(FeatureMaps, ...)`
+ */
+struct FeatureLayerSpec {
+    Layer::Kind kind;
+
+    /**
+     * @brief Number of output channels of a convolution, a multiple of `CHANNEL_BLOCK`
+     */
+    int channels = 0;
+
+    /**
+     * @brief Width and height of a convolution's kernel (odd) or of a pooling window
+     */
+    int window = 0;
+
+    /**
+     * @brief Parse convolution and pooling layers as given on the command line, comma separated: conv<channels>x<kernel>
+     *        or pool<window>, ex. conv8x5,pool2 for a convolution with 8 output channels and 5 x 5 kernels followed by
+     *        2 x 2 max pooling
+     */
+    static vector<FeatureLayerSpec> parse(const string &text) {
+        vector<FeatureLayerSpec> specs;
+
+        for (const string &value : split_string(text, ',')) {
+            FeatureLayerSpec spec;
+            size_t x = value.find('x');
+
+            if (value.rfind("conv", 0) == 0 && x != string::npos) {
+                spec.kind = Layer::Convolution;
+                spec.channels = stoi(value.substr(4, x - 4));
+                spec.window = stoi(value.substr(x + 1));
+
+                if (spec.channels < 1 || spec.channels % CHANNEL_BLOCK != 0) {
+                    throw invalid_argument("Convolutions need a multiple of " + to_string(CHANNEL_BLOCK) +
+                                           " output channels, got " + value);
+                }
+                if (spec.window < 1 || spec.window % 2 == 0) {
+                    throw invalid_argument("Convolution kernels must be an odd size, got " + value);
+                }
+            } else if (value.rfind("pool", 0) == 0) {
+                spec.kind = Layer::MaxPool;
+                spec.window = stoi(value.substr(4));
+
+                if (spec.window < 1) {
+                    throw invalid_argument("Pooling windows must be at least 1 wide, got " + value);
+                }
+            } else {
+                throw invalid_argument("Expected conv<channels>x<kernel> or pool<window>, got " + value);
+            }
+
+            specs.push_back(spec);
+        }
+
+        return specs;
+    }
+};
+
 /**
  * A neural network with layers and neurons in each layer. Has functions used to execute training iterations.
  */
@@ -27,7 +86,17 @@ class Network {
      * @param layer_sizes An array containing size of each layer in network
      * @param num_layers Number of layers in network (AKA the size of layer_sizes array)
      */
-    Network(int layer_sizes[], int num_layers) {
+    Network(int layer_sizes[], int num_layers) : Network(layer_sizes, num_layers, time(0)) {}
+
+    /**
+     * @brief Construct a new Neural Network with weights and biases generated from a specific seed. Networks created
+     *        with the same seed and layer sizes start with identical weights and biases.
+     *
+     * @param layer_sizes An array containing size of each layer in network
+     * @param num_layers Number of layers in network (AKA the size of layer_sizes array)
+     * @param seed Seed for the random engine used to initialize weights and biases
+     */
+    Network(int layer_sizes[], int num_layers, unsigned int seed) {
         /**
          * Error checking
          */
@@ -39,7 +108,7 @@ class Network {
         layers.push_back(new Layer(layer_sizes[0]));
 
         // create a random engine
-        default_random_engine engine(time(0));
+        default_random_engine engine(seed);
 
         // now create hidden and ouput layers,
         for (int x = 1; x < num_layers; x++) {
@@ -49,6 +118,103 @@ class Network {
         SPDLOG_DEBUG("Created network with {0} layers", num_layers);
     }
 
+    /**
+     * @brief Construct a new Neural Network with convolution and max pooling layers (see 🛈 Convolution Layers) between
+     *        the input layer and the fully connected layers
+     *
+     * @param input Feature maps of the input layer, ex. 1 channel of 28 x 28 pixels
+     * @param feature_layers Convolution and pooling layers, in order
+     * @param dense_sizes Sizes of the fully connected layers after them, the last one is the output layer
+     * @param seed Seed for the random engine used to initialize weights and biases
+     */
+    Network(FeatureMaps input, const vector<FeatureLayerSpec> &feature_layers, const vector<int> &dense_sizes,
+            unsigned int seed) {
+        if (dense_sizes.empty()) {
+            throw invalid_argument("Network must end with a fully connected output layer");
+        }
+
+        layers.push_back(new Layer(input.count()));
+
+        default_random_engine engine(seed);
+        FeatureMaps maps = input;
+
+        for (const FeatureLayerSpec &spec : feature_layers) {
+            FeatureShape shape = spec.kind == Layer::Convolution
+                                     ? FeatureShape::convolution(maps, spec.channels, spec.window)
+                                     : FeatureShape::pooling(maps, spec.window);
+            if (shape.output.height < 1 || shape.output.width < 1) {
+                throw invalid_argument("A " + to_string(spec.window) + " x " + to_string(spec.window) +
+                                       " pooling window doesn't fit in feature maps of " + to_string(maps.height) +
+                                       " x " + to_string(maps.width));
+            }
+
+            layers.push_back(new Layer(spec.kind, shape, layers.size(), engine));
+            maps = shape.output;
+        }
+
+        for (int size : dense_sizes) {
+            layers.push_back(new Layer(size, layers.back()->size, layers.size(), engine));
+        }
+
+        SPDLOG_DEBUG("Created network with {0} layers", layers.size());
+    }
+
+    /**
+     * @brief Construct a deep copy of another network. Used to take a snapshot of the weights and biases that can be
+     *        read from another thread while the original network keeps training.
+     *
+     * @param other Network to copy
+     */
+    Network(const Network &other) {
+        for (int x = 0; x < other.layers.size(); x++) {
+            layers.push_back(new Layer(*other.layers[x]));
+        }
+    }
+
+    /**
+     * @brief Construct an empty network, with no layers. Useful to move another network into later.
+     */
+    Network() {}
+
+    Network(Network &&other) noexcept : layers(move(other.layers)) { other.layers.clear(); }
+
+    Network &operator=(const Network &) = delete;
+
+    Network &operator=(Network &&other) noexcept {
+        if (this != &other) {
+            delete_layers();
+            layers = move(other.layers);
+            other.layers.clear();
+        }
+        return *this;
+    }
+
+    /**
+     * @brief Take a read-only snapshot of the current weights and biases, without copying them. The snapshot keeps
+     *        these values while this network is trained further, so it can be read from another thread (to evaluate,
+     *        save or serve it) while training continues. See 🛈 Layer Snapshots. Must be called from the thread that
+     *        trains the network.
+     *
+     * @return Network sharing this network's current weights and biases, which must not be trained or written to
+     */
+    Network snapshot() {
+        Network view;
+        for (Layer *layer : layers) {
+            view.layers.push_back(layer->snapshot());
+        }
+        return view;
+    }
+
+    /**
+     * @brief Make sure no snapshot shares the weights and biases of any layer. Must be called before writing to the
+     *        weights of the network directly, rather than through `Layer::begin_update()`.
+     */
+    void detach() {
+        for (Layer *layer : layers) {
+            layer->detach();
+        }
+    }
+
     /*------------------------------------------- Training Functions -------------------------------------------*/
 
     /**
@@ -59,7 +225,7 @@ class Network {
      *                    propagation, all activations are stored in the activations array. Should already be initialzed
      *                    and have hidden/output layer activations initialized to 0.
      */
-    void propagate(float **activations) {
+    void propagate(float **activations) const {
         /**
          *?                         ==================================================
          *?                                       🛈 How propagation works
@@ -106,6 +272,32 @@ class Network {
      *                     total number of training records/batch-size to obtain average loss for all training data/batch.
      */
     void propagate_backpropagate(float **activations, float **error, float ***weight_gradient, unsigned char label) {
+        calculate_error(activations, error, label);
+
+        // now calculate how much weights change
+        for (int l = 1; l < layers.size(); l++) {
+            for (int x = 0; x < layers[l - 1]->size; x++) {
+                for (int y = 0; y < layers[l]->size; y++) {
+                    // we subtract 1 from l because like the error matrix, the weight gradient matrix doesn't include the
+                    // input layer as there are no weights to train.
+                    weight_gradient[l - 1][x][y] += activations[l - 1][x] * error[l - 1][y];
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Propagate input through network and then back propagate the error of each layer, without calculating the
+     *        weight gradients. Used when the caller applies the gradients itself, the weight gradient of a layer is the
+     *        outer product of the previous layer's activations and this layer's error.
+     *
+     * @param activations Same as in `propagate_backpropagate()`
+     * @param error Same as in `propagate_backpropagate()`
+     * @param label Same as in `propagate_backpropagate()`
+     * @param factored For each layer but the input layer, where a low-rank layer keeps in · U and V · error (2 × its
+     *                 rank values), see `Layer::propagate_backpropagate()`. Needed when the network has low-rank layers.
+     */
+    void calculate_error(float **activations, float **error, unsigned char label, float **factored = NULL) {
         // first propagate input through all layers, while also calculating the gradient of the activation function,
         for (int l = 1; l < layers.size(); l++) {
             // The the gradient of the activation function will be stored in the error array. Later, we'll multiply it
@@ -113,7 +305,8 @@ class Network {
 
             // note that we are doing error[l-1], this is because the error array has the length equal to the number of
             // layers in the network - 1 as the input layer has no error that needs to be calculated.
-            layers[l]->propagate_backpropagate(activations[l - 1], activations[l], error[l - 1]);
+            layers[l]->propagate_backpropagate(activations[l - 1], activations[l], error[l - 1],
+                                               factored != NULL ? factored[l - 1] : NULL);
         }
 
         // calculate the error for the output layer,
@@ -135,37 +328,86 @@ class Network {
             }
         }
 
-        // now backpropagate
-        for (int l = 1; l < layers.size() - 1; l++) {
-            for (int x = 0; x < layers[l]->size; x++) {
-                // calculate dot-product between this & next layer's weights and the error of the next layer,
-                float dot_product = 0;
-                for (int y = 0; y < layers[l + 1]->size; y++) {
-                    dot_product += layers[l + 1]->weights[x][y] * error[l][y];
-                }
-                error[l - 1][x] *= dot_product;
-            }
+        // now backpropagate, each layer's error through the next layer's weights (or kernels, or pooling windows),
+        // from the output layer back, so the next layer's error is complete before it's used
+        for (int l = layers.size() - 2; l >= 1; l--) {
+            layers[l + 1]->backpropagate(activations[l], activations[l + 1], error[l], error[l - 1],
+                                         factored != NULL ? factored[l] : NULL);
         }
 
-        // now calculate how much weights change
+        // the first layer has no error to pass on, but a low-rank one still needs V · error for the gradient of U
+        if (layers[1]->rank > 0) {
+            layers[1]->backpropagate(activations[0], activations[1], error[0], NULL, factored != NULL ? factored[0] : NULL);
+        }
+    }
+
+    /**
+     * @brief Copy the weights and biases of another network with the same layer sizes into this one, along with the
+     *        factors of any low-rank layers (layers take on the other network's ranks).
+     *
+     * @param other Network to copy weights and biases from
+     */
+    void copy_weights_from(const Network &other) {
+        if (other.layers.size() != layers.size()) {
+            throw invalid_argument("Cannot copy weights between networks with different numbers of layers");
+        }
+
+        detach();
+
         for (int l = 1; l < layers.size(); l++) {
-            for (int x = 0; x < layers[l - 1]->size; x++) {
-                for (int y = 0; y < layers[l]->size; y++) {
-                    // we subtract 1 from l because like the error matrix, the weight gradient matrix doesn't include the
-                    // input layer as there are no weights to train.
-                    weight_gradient[l - 1][x][y] += activations[l - 1][x] * error[l - 1][y];
-                }
+            if (other.layers[l]->size != layers[l]->size ||
+                other.layers[l]->previous_layer_size != layers[l]->previous_layer_size ||
+                other.layers[l]->kind != layers[l]->kind || !(other.layers[l]->shape == layers[l]->shape)) {
+                throw invalid_argument("Cannot copy weights between networks with different layer sizes");
             }
+
+            layers[l]->set_rank(other.layers[l]->rank);
+
+            // weights (or factors) and biases are stored one after another
+            copy(other.layers[l]->parameters, other.layers[l]->parameters + other.layers[l]->parameter_count(),
+                 layers[l]->parameters);
         }
     }
 
+    /**
+     * @brief Calculate a checksum of every weight and bias in the network (64-bit FNV-1a over their bytes). Two networks
+     *        only have the same checksum if their weights and biases are bit-for-bit identical, which makes it easy to
+     *        check whether two training runs were reproducible. Low-rank layers add their factors instead of their
+     *        weights.
+     *
+     * @return Checksum
+     */
+    uint64_t checksum() const {
+        uint64_t hash = 14695981039346656037ULL;
+
+        auto add = [&hash](const float *values, int count) {
+            const unsigned char *bytes = (const unsigned char *)values;
+            for (size_t x = 0; x < count * sizeof(float); x++) {
+                hash = (hash ^ bytes[x]) * 1099511628211ULL;
+            }
+        };
+
+        // weights row by row (or factors) and biases are stored one after another
+        for (int l = 1; l < layers.size(); l++) {
+            add(layers[l]->parameters, layers[l]->parameter_count());
+        }
+
+        return hash;
+    }
+
     // Clean up
 
     ~Network() {
+        delete_layers();
+
+        SPDLOG_DEBUG("Deleted network");
+    }
+
+  private:
+    void delete_layers() {
         for (int x = 0; x < layers.size(); x++) {
             delete layers[x];
         }
-
-        SPDLOG_DEBUG("Deleted network");
+        layers.clear();
     }
 };
\ No newline at end of file
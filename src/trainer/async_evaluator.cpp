@@ -0,0 +1,143 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+#include "../logging.h"
+#include "../network.cpp"
+#include "../utils/allocation_tracker.cpp"
+
+using namespace std;
+
+/**
+ * @brief Evaluates snapshots of a network on a background thread so that training does not have to wait for the accuracy
+ *        of every epoch to be calculated. Snapshots are evaluated in the order they were submitted.
+ */
+class AsyncEvaluator {
+  private:
+    /**
+     * @brief A snapshot of the network waiting to be evaluated, tagged with the epoch it was taken at.
+     */
+    struct Job {
+        int epoch;
+        Network snapshot;
+    };
+
+    queue<Job> jobs;
+
+    mutex jobs_mutex;
+
+    /**
+     * @brief Notified when a job is added to the queue or the evaluator is stopping.
+     */
+    condition_variable jobs_changed;
+
+    /**
+     * @brief Notified when the evaluator finishes a job and the queue is empty.
+     */
+    condition_variable jobs_done;
+
+    /**
+     * @brief Whether or not the background thread is in the middle of evaluating a job.
+     */
+    bool busy = false;
+
+    bool stopping = false;
+
+    thread worker;
+
+    /**
+     * @brief Function used for calculating the accuracy of a snapshot.
+     */
+    function<float(const Network &)> evaluate;
+
+    /**
+     * @brief Function called on the background thread with the accuracy of every evaluated snapshot.
+     */
+    function<void(int, float)> on_result;
+
+    void run() {
+        // logging results allocates, but isn't part of testing or training
+        AllocationTracker::Scope scope(AllocationTracker::Background);
+
+        while (true) {
+            Job job;
+            {
+                unique_lock<mutex> lock(jobs_mutex);
+                jobs_changed.wait(lock, [this] { return stopping || !jobs.empty(); });
+
+                if (jobs.empty()) {
+                    // stopping and there is nothing left to evaluate
+                    return;
+                }
+
+                job = move(jobs.front());
+                jobs.pop();
+                busy = true;
+            }
+
+            float accuracy = evaluate(job.snapshot);
+
+            // let go of the snapshot's weights right away, so training can reuse their memory for its next snapshot
+            job.snapshot = Network();
+
+            on_result(job.epoch, accuracy);
+
+            {
+                lock_guard<mutex> lock(jobs_mutex);
+                busy = false;
+            }
+            jobs_done.notify_all();
+        }
+    }
+
+  public:
+    /**
+     * @brief Create a new evaluator and start its background thread
+     *
+     * @param evaluate Function used for calculating the accuracy of a snapshot. Called on the background thread, so it
+     *                 must only read data that isn't modified by training.
+     * @param on_result Function called on the background thread with the epoch and accuracy of each snapshot
+     */
+    AsyncEvaluator(function<float(const Network &)> evaluate, function<void(int, float)> on_result)
+        : evaluate(evaluate), on_result(on_result) {
+        worker = thread(&AsyncEvaluator::run, this);
+    }
+
+    /**
+     * @brief Queue a snapshot for evaluation. The evaluator takes ownership of the snapshot and destroys it once
+     *        evaluated.
+     *
+     * @param epoch Epoch the snapshot was taken at
+     * @param snapshot Snapshot of the network being trained, see `Network::snapshot()`
+     */
+    void submit(int epoch, Network &&snapshot) {
+        {
+            lock_guard<mutex> lock(jobs_mutex);
+            jobs.push({epoch, move(snapshot)});
+        }
+        jobs_changed.notify_one();
+    }
+
+    /**
+     * @brief Block until every submitted snapshot has been evaluated.
+     */
+    void wait() {
+        unique_lock<mutex> lock(jobs_mutex);
+        jobs_done.wait(lock, [this] { return jobs.empty() && !busy; });
+    }
+
+    ~AsyncEvaluator() {
+        {
+            lock_guard<mutex> lock(jobs_mutex);
+            stopping = true;
+        }
+        jobs_changed.notify_one();
+        worker.join();
+
+        SPDLOG_DEBUG("Stopped async evaluator");
+    }
+};
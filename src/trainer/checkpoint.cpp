@@ -0,0 +1,448 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+
+#include "../exceptions.h"
+#include "../logging.h"
+#include "../model_file.cpp"
+#include "../network.cpp"
+#include "../utils/allocation_tracker.cpp"
+#include "../utils/file.cpp"
+#include "lbfgs.cpp"
+#include "optimizer.cpp"
+#include "schedule.cpp"
+
+using namespace std;
+
+/**
+ *?                             ==================================================
+ *?                                                🛈 Checkpoints
+ *?                             ==================================================
+ *
+ * A checkpoint holds everything training needs to carry on exactly where it left off, so a run that gets interrupted
+ * can be resumed rather than started over, ending with the same weights it would have had without the interruption:
+ *
+ *  - The weights and biases, stored as a model file (see 🛈 Model Files), so a checkpoint can be loaded as a model too.
+ *  - The optimizer's state (momentum, Adam's moments, the step count or L-BFGS history).
+ *  - Where training is: the epoch, how many of its batches have been trained, the position in the training data, the
+ *    shuffle order of the epoch and the state of the random engine shuffling it.
+ *  - The batch size and step size scaling, the state of the batch size schedule and stopping criteria, time spent so
+ *    far and the log file being written.
+ *
+ * The training state is stored after the model, as a header (magic, version, size and FNV-1a checksum) followed by the
+ * values in native byte order.
+ *
+ * Training hands the checkpoint to a `CheckpointWriter`, which writes it on a background thread. Taking a checkpoint
+ * doesn't copy the weights, they're a snapshot (see 🛈 Layer Snapshots), only the optimizer's state is copied. If the
+ * previous checkpoint is still being written, the new one is skipped rather than making training wait. Files are
+ * written next to their destination then renamed over it, so a checkpoint file is always complete, even if the process
+ * is killed partway through writing.
+ */
+
+/**
+ * @brief Everything needed to resume training exactly, see 🛈 Checkpoints
+ */
+struct Checkpoint {
+    static constexpr char MAGIC[8] = {'M', 'N', 'I', 'S', 'T', 'C', 'K', 'P'};
+    static const uint32_t VERSION = 1;
+
+    /**
+     * @brief Comes right after the model, followed by the training state
+     */
+    struct StateHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t bytes;
+        uint64_t checksum;
+    };
+
+    /**
+     * @brief Snapshot of the network being trained
+     */
+    Network network;
+
+    /**
+     * @brief Epoch being trained, and how many of its batches have been trained. With 0 batches the epoch hasn't
+     *        started, the network hasn't been tested at its start yet.
+     */
+    int epoch = 0;
+    int epoch_batches = 0;
+
+    int planned_epochs = 0;
+    double elapsed_seconds = 0;
+    float last_accuracy = -1;
+    string log_file;
+
+    int batch_size = 0;
+    int initial_batch_size = 0;
+    float batch_step_scale = 1;
+
+    /**
+     * @brief Current phase of the batch size schedule, see `Trainer::Phase`
+     */
+    int phase_index = 0;
+    int phase_batch_size = 0;
+    int phase_first_epoch = 0;
+    int phase_epochs = 0;
+    double phase_seconds = 0;
+
+    BatchSizeSchedule::State batch_schedule = {};
+    StoppingCriteria::State stopping = {};
+
+    /**
+     * @brief Position in the training data, and the shuffle order of this epoch
+     */
+    int current_record = 0;
+    int current_batch = 0;
+    string shuffle_engine;
+    vector<int> record_order;
+
+    int optimizer_type = 0;
+    Optimizer::State optimizer;
+
+    /**
+     * @brief State of L-BFGS, only if it has taken a step
+     */
+    bool has_lbfgs = false;
+    LBFGS::State lbfgs;
+    vector<float> lbfgs_parameters, lbfgs_gradient;
+    double lbfgs_loss = 0;
+
+    /**
+     * @brief Write the checkpoint to a file, replacing it only once the whole checkpoint has been written
+     *
+     * @param path Path of the checkpoint file
+     */
+    void save(const string &path) {
+        write_atomically(path, "checkpoint file", [this](ostream &file) {
+            ModelFile::write(network, file);
+
+            string state;
+            StateWriter writer{state};
+            transfer(writer);
+
+            StateHeader header = {};
+            memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.version = VERSION;
+            header.bytes = state.size();
+            header.checksum = ModelFile::fnv1a(ModelFile::FNV_OFFSET_BASIS, state.data(), state.size());
+
+            file.write((const char *)&header, sizeof(header));
+            file.write(state.data(), state.size());
+        });
+    }
+
+    /**
+     * @brief Read a checkpoint written by `save()`
+     *
+     * @param path Path of the checkpoint file
+     */
+    static Checkpoint load(const string &path) {
+        Checkpoint checkpoint;
+        checkpoint.network = ModelFile::load(path);
+
+        ifstream file(path, ios::in | ios::binary);
+        ModelFile::Header model;
+        file.read((char *)&model, sizeof(model));
+        file.seekg(model.file_bytes);
+
+        StateHeader header;
+        file.read((char *)&header, sizeof(header));
+
+        if (file.fail() || memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+            throw invalid_argument("'" + path + "' is a model file without training state, not a checkpoint");
+        }
+        if (header.version != VERSION) {
+            throw invalid_argument("Checkpoint '" + path + "' has version " + to_string(header.version) +
+                                   ", only version " + to_string(VERSION) + " is supported");
+        }
+
+        uint64_t state_start = model.file_bytes + sizeof(header);
+        file.seekg(0, ios::end);
+        if (header.bytes > (uint64_t)file.tellg() - state_start) {
+            throw invalid_argument("Checkpoint '" + path + "' is truncated");
+        }
+
+        string state(header.bytes, '\0');
+        file.seekg(state_start);
+        file.read(&state[0], state.size());
+
+        if (file.fail()) {
+            throw invalid_argument("Unable to read checkpoint '" + path + "'");
+        }
+        if (ModelFile::fnv1a(ModelFile::FNV_OFFSET_BASIS, state.data(), state.size()) != header.checksum) {
+            throw invalid_argument("Checkpoint '" + path + "' is corrupt, its training state doesn't match its checksum");
+        }
+
+        StateReader reader{state, 0, path};
+        checkpoint.transfer(reader);
+
+        if (reader.position != state.size()) {
+            throw invalid_argument("Checkpoint '" + path + "' is corrupt, its training state has extra bytes");
+        }
+
+        return checkpoint;
+    }
+
+  private:
+    /**
+     * @brief Every value of the training state in the order it's stored, written or read depending on the archive
+     */
+    template <typename Archive> void transfer(Archive &archive) {
+        archive(epoch);
+        archive(epoch_batches);
+        archive(planned_epochs);
+        archive(elapsed_seconds);
+        archive(last_accuracy);
+        archive(log_file);
+
+        archive(batch_size);
+        archive(initial_batch_size);
+        archive(batch_step_scale);
+        archive(phase_index);
+        archive(phase_batch_size);
+        archive(phase_first_epoch);
+        archive(phase_epochs);
+        archive(phase_seconds);
+        archive(batch_schedule);
+        archive(stopping);
+
+        archive(current_record);
+        archive(current_batch);
+        archive(shuffle_engine);
+        archive(record_order);
+
+        archive(optimizer_type);
+        archive(optimizer.step);
+        archive(optimizer.values);
+
+        archive(has_lbfgs);
+        if (has_lbfgs) {
+            archive(lbfgs.pairs);
+            archive(lbfgs.next_pair);
+            archive(lbfgs.s_history);
+            archive(lbfgs.y_history);
+            archive(lbfgs.rho);
+            archive(lbfgs_parameters);
+            archive(lbfgs_gradient);
+            archive(lbfgs_loss);
+        }
+    }
+
+    /**
+     * @brief Appends values to a string: plain values as they are in memory, strings and vectors after their length
+     */
+    struct StateWriter {
+        string &bytes;
+
+        template <typename T> void operator()(const T &value) {
+            static_assert(is_trivially_copyable<T>::value, "Only plain values can be written as they are");
+            bytes.append((const char *)&value, sizeof(T));
+        }
+
+        void operator()(const string &value) {
+            (*this)((uint64_t)value.size());
+            bytes.append(value);
+        }
+
+        template <typename T> void operator()(const vector<T> &values) {
+            (*this)((uint64_t)values.size());
+
+            if constexpr (is_trivially_copyable<T>::value) {
+                bytes.append((const char *)values.data(), values.size() * sizeof(T));
+            } else {
+                for (const T &value : values) {
+                    (*this)(value);
+                }
+            }
+        }
+    };
+
+    /**
+     * @brief Reads values back in the order `StateWriter` wrote them, checking it never reads past the end
+     */
+    struct StateReader {
+        const string &bytes;
+        size_t position;
+        const string &path;
+
+        void take(void *destination, size_t count) {
+            if (count > bytes.size() - position) {
+                throw invalid_argument("Checkpoint '" + path + "' is corrupt, its training state ends too early");
+            }
+            memcpy(destination, bytes.data() + position, count);
+            position += count;
+        }
+
+        template <typename T> void operator()(T &value) { take(&value, sizeof(T)); }
+
+        /**
+         * @brief Read the length of a string or vector, every element takes at least a byte so a length longer than
+         *        what's left must be corrupt, rather than an allocation to attempt
+         */
+        uint64_t take_length() {
+            uint64_t length;
+            take(&length, sizeof(length));
+
+            if (length > bytes.size() - position) {
+                throw invalid_argument("Checkpoint '" + path + "' is corrupt, its training state ends too early");
+            }
+            return length;
+        }
+
+        void operator()(string &value) {
+            value.resize(take_length());
+            take(&value[0], value.size());
+        }
+
+        template <typename T> void operator()(vector<T> &values) {
+            values.resize(take_length());
+
+            if constexpr (is_trivially_copyable<T>::value) {
+                take(values.data(), values.size() * sizeof(T));
+            } else {
+                for (T &value : values) {
+                    (*this)(value);
+                }
+            }
+        }
+    };
+};
+
+/**
+ * @brief Writes checkpoints to a file on a background thread, so training never waits for disk. Only one checkpoint is
+ *        written at a time.
+ */
+class CheckpointWriter {
+  private:
+    string path;
+
+    /**
+     * @brief Checkpoint waiting to be written, and whether there is one
+     */
+    Checkpoint pending;
+    bool has_pending = false;
+
+    /**
+     * @brief Whether the background thread is in the middle of writing a checkpoint
+     */
+    bool writing = false;
+
+    bool stopping = false;
+
+    mutex pending_mutex;
+
+    /**
+     * @brief Notified when a checkpoint is handed over or the writer is stopping
+     */
+    condition_variable pending_changed;
+
+    /**
+     * @brief Notified when a checkpoint has been written
+     */
+    condition_variable written;
+
+    thread worker;
+
+    void run() {
+        // writing allocates, but isn't part of testing or training
+        AllocationTracker::Scope scope(AllocationTracker::Background);
+
+        while (true) {
+            Checkpoint checkpoint;
+            {
+                unique_lock<mutex> lock(pending_mutex);
+                pending_changed.wait(lock, [this] { return stopping || has_pending; });
+
+                if (!has_pending) {
+                    // stopping and there is nothing left to write
+                    return;
+                }
+
+                checkpoint = move(pending);
+                has_pending = false;
+                writing = true;
+            }
+
+            auto t_start = chrono::high_resolution_clock::now();
+
+            try {
+                checkpoint.save(path);
+
+                auto t_end = chrono::high_resolution_clock::now();
+                SPDLOG_INFO("Saved checkpoint at epoch {0}, batch {1} to {2} in {3:.1f} ms", checkpoint.epoch,
+                            checkpoint.epoch_batches, path, chrono::duration<double, milli>(t_end - t_start).count());
+            } catch (invalid_argument e) {
+                // training carries on, the previous checkpoint is still there
+                SPDLOG_ERROR(e.what());
+            }
+
+            // let go of the snapshot's weights before training takes its next snapshot
+            checkpoint = Checkpoint();
+
+            {
+                lock_guard<mutex> lock(pending_mutex);
+                writing = false;
+            }
+            written.notify_all();
+        }
+    }
+
+  public:
+    /**
+     * @brief Create a writer and start its background thread
+     *
+     * @param path Path of the checkpoint file, replaced by every checkpoint
+     */
+    CheckpointWriter(const string &path) : path(path) { worker = thread(&CheckpointWriter::run, this); }
+
+    /**
+     * @brief Whether a checkpoint is still waiting to be written or being written
+     */
+    bool busy() {
+        lock_guard<mutex> lock(pending_mutex);
+        return has_pending || writing;
+    }
+
+    /**
+     * @brief Hand a checkpoint over to be written, replacing one still waiting to be written if there is one
+     */
+    void submit(Checkpoint &&checkpoint) {
+        {
+            lock_guard<mutex> lock(pending_mutex);
+            pending = move(checkpoint);
+            has_pending = true;
+        }
+        pending_changed.notify_one();
+    }
+
+    /**
+     * @brief Block until every checkpoint handed over has been written
+     */
+    void wait() {
+        unique_lock<mutex> lock(pending_mutex);
+        written.wait(lock, [this] { return !has_pending && !writing; });
+    }
+
+    ~CheckpointWriter() {
+        {
+            lock_guard<mutex> lock(pending_mutex);
+            stopping = true;
+        }
+        pending_changed.notify_one();
+        worker.join();
+
+        SPDLOG_DEBUG("Stopped checkpoint writer");
+    }
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "../exceptions.h"
+#include "../logging.h"
+#include "../low_rank.cpp"
+#include "../network.cpp"
+#include "../utils/string.cpp"
+#include "pruning.cpp"
+
+using namespace std;
+
+/**
+ * @brief Decides which layers are factored during training (see 🛈 Low-Rank Layers), to what rank, and when
+ */
+class FactorizationSchedule {
+  public:
+    /**
+     * @brief Rank of each layer with weights, starting with layer 1, 0 to keep a layer dense. Empty for no factoring.
+     */
+    vector<int> ranks;
+
+    /**
+     * @brief Epoch at the start of which layers are factored. At 0 the random initial weights are factored and the
+     *        factors are trained from the start, later the trained dense layers are factored and then fine-tuned.
+     */
+    int start_epoch = 0;
+
+    bool enabled() const { return !ranks.empty(); }
+
+    /**
+     * @brief Parse the ranks as given on the command line. A single value applies to every layer but the output layer,
+     *        otherwise there must be a comma separated value for each layer with weights.
+     *
+     * @param text Ranks, ex. 8 or 8,0
+     * @param weight_layers Number of layers with weights
+     */
+    static vector<int> parse(const string &text, int weight_layers) {
+        auto parse_rank = [](const string &value) {
+            int parsed = stoi(value);
+            if (parsed < 0) {
+                throw invalid_argument("Rank must not be negative, got " + value);
+            }
+            return parsed;
+        };
+
+        return parse_per_layer(text, weight_layers, "rank", parse_rank, 0);
+    }
+
+    /**
+     * @brief Check there's a rank for every layer with weights, and that each rank has fewer values than the layer has
+     *        weights
+     */
+    void validate(const Network &network) const {
+        if (!enabled()) {
+            return;
+        }
+        if (ranks.size() != network.layers.size() - 1) {
+            throw invalid_argument("Expected a rank for each of the " + to_string(network.layers.size() - 1) +
+                                   " layers with weights");
+        }
+        if (start_epoch < 0) {
+            throw invalid_argument("Layers can't be factored before epoch 0");
+        }
+
+        for (int l = 1; l < network.layers.size(); l++) {
+            const Layer *layer = network.layers[l];
+            const int max_rank = SingularValueDecomposition::max_rank(layer->previous_layer_size, layer->size);
+
+            if (ranks[l - 1] > max_rank) {
+                throw invalid_argument("Layer " + to_string(l) + " (" + to_string(layer->previous_layer_size) + " x " +
+                                       to_string(layer->size) + ") has fewer weights than factors of rank " +
+                                       to_string(ranks[l - 1]) + ", it can be factored to at most rank " +
+                                       to_string(max_rank));
+            }
+        }
+    }
+
+    /**
+     * @brief Whether any layer isn't factored to its rank yet
+     */
+    bool pending(const Network &network) const {
+        for (int l = 1; l < network.layers.size() && enabled(); l++) {
+            if (ranks[l - 1] > 0 && network.layers[l]->rank != ranks[l - 1]) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+/**
+ * @brief How big a network is, and how much work it takes to classify an image with it
+ */
+struct NetworkCost {
+    /**
+     * @brief Number of values stored: weights (or factors, for low-rank layers) and biases
+     */
+    long parameters = 0;
+
+    /**
+     * @brief Number of multiply-adds to propagate one image
+     */
+    long multiply_adds = 0;
+
+    static NetworkCost of(const Network &network) {
+        NetworkCost cost;
+        for (int l = 1; l < network.layers.size(); l++) {
+            cost.parameters += network.layers[l]->parameter_count();
+            cost.multiply_adds += network.layers[l]->multiply_adds();
+        }
+        return cost;
+    }
+};
+
+/**
+ * @brief What factoring the network did, logged at the end of `Trainer::train()`
+ */
+struct FactorizationReport {
+    /**
+     * @brief The network at a few ranks around the ones it's factored to, straight from the decomposition. Only when
+     *        trained layers are factored, the random initial weights have no accuracy to lose.
+     */
+    struct Level {
+        string ranks;
+        NetworkCost cost;
+        float accuracy;
+    };
+
+    int epoch = -1;
+
+    NetworkCost dense_cost, factored_cost;
+    vector<Level> levels;
+
+    /**
+     * @brief Accuracy of the dense network, and right after factoring it
+     */
+    float dense_accuracy = -1, factored_accuracy = -1;
+
+    InferenceSpeed dense_speed, factored_speed;
+
+    bool empty() const { return epoch < 0; }
+
+    /**
+     * @brief Log the size, work and accuracy of the factored network (and at each level) relative to the dense network
+     *
+     * @param tuned_accuracy Accuracy at the end of training
+     */
+    void log(float tuned_accuracy) const {
+        if (!levels.empty()) {
+            SPDLOG_INFO("Low-rank report, layers factored at epoch {0} (accuracy {1:.2f}% dense), before fine-tuning:",
+                        epoch, dense_accuracy * 100);
+            SPDLOG_INFO("  ranks        parameters  reduction  multiply-adds/image  reduction  accuracy     cost");
+            for (const Level &level : levels) {
+                SPDLOG_INFO("  {0:<11}  {1:10d}  {2:8.2f}x  {3:19d}  {4:8.2f}x  {5:7.2f}%  {6:+6.2f}%", level.ranks,
+                            level.cost.parameters, dense_cost.parameters / (double)level.cost.parameters,
+                            level.cost.multiply_adds, dense_cost.multiply_adds / (double)level.cost.multiply_adds,
+                            level.accuracy * 100, (level.accuracy - dense_accuracy) * 100);
+            }
+        }
+
+        SPDLOG_INFO("Low-rank network: {0} parameters ({1:.2f}x fewer), {2} multiply-adds per image ({3:.2f}x fewer), "
+                    "single image {4:.2f} -> {5:.2f} µs ({6:.2f}x), batches {7:.0f} -> {8:.0f} images/s ({9:.2f}x)",
+                    factored_cost.parameters, dense_cost.parameters / (double)factored_cost.parameters,
+                    factored_cost.multiply_adds, dense_cost.multiply_adds / (double)factored_cost.multiply_adds,
+                    dense_speed.single_us, factored_speed.single_us, dense_speed.single_us / factored_speed.single_us,
+                    dense_speed.batch_images_per_s, factored_speed.batch_images_per_s,
+                    factored_speed.batch_images_per_s / dense_speed.batch_images_per_s);
+
+        if (epoch == 0) {
+            SPDLOG_INFO("Factors trained from the start, accuracy {0:.2f}%", tuned_accuracy * 100);
+        } else {
+            SPDLOG_INFO("Accuracy {0:.2f}% dense, {1:.2f}% right after factoring, {2:.2f}% after fine-tuning ({3:+.2f}% "
+                        "against dense)",
+                        dense_accuracy * 100, factored_accuracy * 100, tuned_accuracy * 100,
+                        (tuned_accuracy - dense_accuracy) * 100);
+        }
+    }
+};
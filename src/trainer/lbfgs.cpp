@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "../exceptions.h"
+
+using namespace std;
+
+/**
+ *?                             ==================================================
+ *?                                                 🛈 L-BFGS
+ *?                             ==================================================
+ *
+ * Rather than taking many small steps along noisy batch gradients, L-BFGS takes a few large steps using the gradient of
+ * the whole training set. Each step approximates Newton's method: it estimates how the gradient changes as the weights
+ * move (the curvature) from the last few steps, and uses that to pick both the direction and length of the next step.
+ *
+ * Only the last `history_size` pairs of s (how far the weights moved) and y (how much the gradient changed) are kept. The
+ * direction is calculated from them with the "two-loop recursion", which only needs dot products and vector additions,
+ * so its cost is a small multiple of the number of weights. A line search then checks that the step actually lowers the
+ * loss, halving it until it does.
+ *
+ * https://en.wikipedia.org/wiki/Limited-memory_BFGS
+ */
+
+/**
+ * @brief Keeps the (s, y) history of L-BFGS and calculates search directions from it. Doesn't know anything about the
+ *        network, parameters and gradients are flat arrays of `parameter_count` values.
+ */
+class LBFGS {
+  private:
+    size_t parameter_count;
+
+    /**
+     * @brief The last `history_size` s and y vectors, each stored as one contiguous block of history_size x
+     *        parameter_count values used as a ring buffer
+     */
+    vector<float> s_history;
+    vector<float> y_history;
+
+    /**
+     * @brief 1 / (y · s) of each pair
+     */
+    vector<double> rho;
+
+    /**
+     * @brief Scratch for the two-loop recursion
+     */
+    vector<double> alpha;
+
+    /**
+     * @brief Number of pairs stored, and where the next one goes
+     */
+    int pairs = 0;
+    int next_pair = 0;
+
+    static double dot(const float *a, const float *b, size_t count) {
+        double sum = 0;
+        for (size_t x = 0; x < count; x++) {
+            sum += (double)a[x] * b[x];
+        }
+        return sum;
+    }
+
+  public:
+    /**
+     * @brief Number of (s, y) pairs kept
+     */
+    const int history_size;
+
+    /**
+     * @brief Create L-BFGS state
+     *
+     * @param parameter_count Number of values in parameter and gradient vectors
+     * @param history_size Number of (s, y) pairs kept
+     */
+    LBFGS(size_t parameter_count, int history_size = 10) : parameter_count(parameter_count), history_size(history_size) {
+        if (history_size < 1) {
+            throw invalid_argument("L-BFGS needs a history of at least 1 step");
+        }
+
+        s_history.assign((size_t)history_size * parameter_count, 0.0f);
+        y_history.assign((size_t)history_size * parameter_count, 0.0f);
+        rho.assign(history_size, 0.0);
+        alpha.assign(history_size, 0.0);
+    }
+
+    /**
+     * @brief Number of (s, y) pairs currently stored
+     */
+    int stored_pairs() const { return pairs; }
+
+    /**
+     * @brief Stored pairs and where the next one goes, so training can be checkpointed and resumed exactly
+     */
+    struct State {
+        int pairs = 0;
+        int next_pair = 0;
+        vector<float> s_history;
+        vector<float> y_history;
+        vector<double> rho;
+    };
+
+    void save_state(State &saved) const {
+        saved.pairs = pairs;
+        saved.next_pair = next_pair;
+        saved.s_history.assign(s_history.begin(), s_history.end());
+        saved.y_history.assign(y_history.begin(), y_history.end());
+        saved.rho.assign(rho.begin(), rho.end());
+    }
+
+    /**
+     * @brief Carry on from a saved state, which must have the same parameter count and history size
+     */
+    void restore_state(const State &saved) {
+        if (saved.s_history.size() != s_history.size() || saved.y_history.size() != y_history.size() ||
+            saved.rho.size() != rho.size() || saved.pairs < 0 || saved.pairs > history_size || saved.next_pair < 0 ||
+            saved.next_pair >= history_size) {
+            throw invalid_argument("Saved L-BFGS state doesn't match the number of parameters or the history size");
+        }
+
+        pairs = saved.pairs;
+        next_pair = saved.next_pair;
+        s_history = saved.s_history;
+        y_history = saved.y_history;
+        rho = saved.rho;
+    }
+
+    /**
+     * @brief Forget every stored pair, the next direction will be the negative gradient
+     */
+    void reset() {
+        pairs = 0;
+        next_pair = 0;
+    }
+
+    /**
+     * @brief Store the result of a step. Pairs where the gradient didn't increase along the step (y · s <= 0) would make
+     *        the curvature estimate useless, they're skipped.
+     *
+     * @param s New parameters - old parameters
+     * @param y New gradient - old gradient
+     *
+     * @return Whether the pair was stored
+     */
+    bool add_pair(const float *s, const float *y) {
+        double ys = dot(y, s, parameter_count);
+        if (ys <= 1e-10) {
+            return false;
+        }
+
+        copy(s, s + parameter_count, s_history.begin() + (size_t)next_pair * parameter_count);
+        copy(y, y + parameter_count, y_history.begin() + (size_t)next_pair * parameter_count);
+        rho[next_pair] = 1.0 / ys;
+
+        next_pair = (next_pair + 1) % history_size;
+        pairs = min(pairs + 1, history_size);
+        return true;
+    }
+
+    /**
+     * @brief Calculate the search direction, an approximation of -H⁻¹g where H is the Hessian of the loss
+     *
+     * @param gradient Gradient at the current parameters
+     * @param direction Where to write the direction
+     */
+    void direction(const float *gradient, float *direction) {
+        for (size_t x = 0; x < parameter_count; x++) {
+            direction[x] = -gradient[x];
+        }
+
+        // first loop, newest pair to oldest
+        for (int p = 0; p < pairs; p++) {
+            int i = (next_pair - 1 - p + history_size) % history_size;
+            const float *s = s_history.data() + (size_t)i * parameter_count;
+            const float *y = y_history.data() + (size_t)i * parameter_count;
+
+            alpha[i] = rho[i] * dot(s, direction, parameter_count);
+            for (size_t x = 0; x < parameter_count; x++) {
+                direction[x] -= alpha[i] * y[x];
+            }
+        }
+
+        // scale by the curvature of the newest pair as the initial Hessian estimate
+        if (pairs > 0) {
+            int newest = (next_pair - 1 + history_size) % history_size;
+            const float *y = y_history.data() + (size_t)newest * parameter_count;
+            double gamma = 1.0 / (rho[newest] * dot(y, y, parameter_count));
+
+            for (size_t x = 0; x < parameter_count; x++) {
+                direction[x] *= gamma;
+            }
+        }
+
+        // second loop, oldest pair to newest
+        for (int p = pairs - 1; p >= 0; p--) {
+            int i = (next_pair - 1 - p + history_size) % history_size;
+            const float *s = s_history.data() + (size_t)i * parameter_count;
+            const float *y = y_history.data() + (size_t)i * parameter_count;
+
+            double beta = rho[i] * dot(y, direction, parameter_count);
+            for (size_t x = 0; x < parameter_count; x++) {
+                direction[x] += (alpha[i] - beta) * s[x];
+            }
+        }
+    }
+};
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "../exceptions.h"
+#include "../logging.h"
+#include "../network.cpp"
+
+using namespace std;
+
+/**
+ *?                             ==================================================
+ *?                                               🛈 Optimizers
+ *?                             ==================================================
+ *
+ * Plain stochastic gradient descent (SGD) moves every weight by its gradient times the step size. The other optimizers
+ * keep some state for every weight and bias, and use it to decide how far to move:
+ *
+ *  - Momentum keeps a running sum of past gradients (v = μv + g) and moves by that instead, so weights keep moving in
+ *    directions the gradient consistently points in.
+ *  - Nesterov momentum moves by g + μv, looking ahead to where momentum is about to take the weights.
+ *  - Adam keeps running averages of the gradient (m) and the squared gradient (v), and moves each weight by m / √v. Every
+ *    weight gets its own step size, weights with noisy gradients move less.
+ *  - AdamW is Adam with weight decay applied to the weights directly rather than added to the gradient.
+ *
+ * The state of each layer is stored in one contiguous buffer laid out the same way as `Layer::parameters`, so the whole
+ * update of a layer (moments, bias correction, weight decay and step) is a single pass over a few arrays. Low-rank layers
+ * store their factors in place of their weights, so the factors are updated and decayed like weights.
+ *
+ * https://arxiv.org/abs/1412.6980 (Adam), https://arxiv.org/abs/1711.05101 (AdamW)
+ */
+
+/**
+ * @brief Updates the weights and biases of a network from their gradients.
+ */
+class Optimizer {
+  public:
+    /**
+     * @brief LBFGS doesn't update weights batch by batch at all, it is handled by `Trainer::train_epoch_lbfgs()`
+     */
+    enum Type { SGD, Momentum, Nesterov, Adam, AdamW, LBFGS };
+
+    Type type = SGD;
+
+    /**
+     * @brief Momentum coefficient (μ) for momentum and Nesterov
+     */
+    float momentum = 0.9f;
+
+    /**
+     * @brief Decay rates of Adam's running averages of the gradient and squared gradient
+     */
+    float beta1 = 0.9f;
+    float beta2 = 0.999f;
+
+    /**
+     * @brief Added to √v so Adam never divides by 0
+     */
+    float epsilon = 1e-8f;
+
+    /**
+     * @brief Weight decay, only used by AdamW. Biases are never decayed, low-rank factors are.
+     */
+    float weight_decay = 0.01f;
+
+    /**
+     * @brief Parse an optimizer name as given on the command line (sgd, momentum, nesterov, adam, adamw)
+     */
+    static Type parse(const string &name) {
+        if (name == "sgd") {
+            return SGD;
+        } else if (name == "momentum") {
+            return Momentum;
+        } else if (name == "nesterov") {
+            return Nesterov;
+        } else if (name == "adam") {
+            return Adam;
+        } else if (name == "adamw") {
+            return AdamW;
+        } else if (name == "lbfgs") {
+            return LBFGS;
+        }
+
+        throw invalid_argument("Unknown optimizer '" + name + "', expected sgd, momentum, nesterov, adam, adamw or lbfgs");
+    }
+
+    /**
+     * @brief Step size that works well with each optimizer on MNIST. Momentum moves about 1/(1 - μ) times further than
+     *        SGD with the same step size, and Adam's steps don't scale with the gradient at all.
+     */
+    static float default_step_size(Type type) { return type == SGD ? 0.005f : 0.001f; }
+
+    /**
+     * @brief Default number of epochs to train for with each optimizer, the others converge much faster than SGD. For
+     *        L-BFGS every epoch is a single full-batch step.
+     */
+    static int default_epochs(Type type) {
+        if (type == LBFGS) {
+            return 50;
+        }
+        return type == SGD ? 100 : 20;
+    }
+
+    /**
+     * @brief Allocate state for every layer of a network, all set to 0. Must be called again if the optimizer is used
+     *        with a different network.
+     */
+    void initialize(const Network &network) {
+        step = 0;
+        state.assign(network.layers.size(), vector<float>());
+        weight_counts.assign(network.layers.size(), 0);
+
+        for (int l = 1; l < network.layers.size(); l++) {
+            initialize_layer(l, *network.layers[l]);
+        }
+    }
+
+    /**
+     * @brief Set the state of one layer back to 0, sized for the layer as it is now. Called when a layer is factored,
+     *        which changes what there is to update.
+     */
+    void initialize_layer(int l, const Layer &layer) {
+        int buffers = 0;
+        if (type == Momentum || type == Nesterov) {
+            buffers = 1;
+        } else if (type == Adam || type == AdamW) {
+            buffers = 2;
+        }
+
+        state[l].assign((size_t)buffers * layer.parameter_count(), 0.0f);
+        weight_counts[l] = layer.weight_count();
+    }
+
+    /**
+     * @brief Start a new update, called once per batch before `update()` is called for each layer
+     *
+     * @param step_size Step size (learning rate) of this update
+     * @param gradient_scale Gradients are multiplied by this first, ex. 1 / batch size when given the sum of the
+     *                       gradients of a batch
+     */
+    void begin_update(float step_size, float gradient_scale) {
+        step++;
+        this->step_size = step_size;
+        this->gradient_scale = gradient_scale;
+
+        if (type == Adam || type == AdamW) {
+            // bias correction, m and v start at 0 and would be too small for the first few steps without it
+            correction1 = 1.0f - pow(beta1, (float)step);
+            correction2 = 1.0f - pow(beta2, (float)step);
+        }
+    }
+
+    /**
+     * @brief Update part of a layer's weights (or factors) and biases. Different ranges of the same layer can be
+     *        updated from different threads at the same time.
+     *
+     * @param l Index of the layer in the network
+     * @param source Current values of the layer's parameters, `Layer::parameters`
+     * @param parameters Where to write the updated values, from `Layer::begin_update()`. Either `source` itself, or
+     *                   another block, so a snapshot sharing `source` keeps its values.
+     * @param gradient Gradients of the parameters being updated, `gradient[0]` is the gradient of `parameters[begin]`.
+     *                 Doesn't have to be a gradient of the whole layer, so gradients can be applied a tile at a time.
+     * @param begin First index to update
+     * @param end One past the last index to update
+     */
+    void update(int l, const float *source, float *parameters, const float *gradient, int begin, int end) {
+        // biases are never decayed, so split the range where the weights end
+        int weights_end = max(begin, min(end, weight_counts[l]));
+
+        update_range(l, source, parameters, gradient, begin, weights_end, weight_decay);
+        update_range(l, source, parameters, gradient + (weights_end - begin), weights_end, end, 0.0f);
+    }
+
+    /**
+     * @brief Update part of a layer's weights and biases in place
+     */
+    void update(int l, float *parameters, const float *gradient, int begin, int end) {
+        update(l, parameters, parameters, gradient, begin, end);
+    }
+
+    /**
+     * @brief Update every weight and bias of a layer
+     */
+    void update(int l, Layer &layer, const float *gradient) {
+        update(l, layer.parameters, gradient, 0, layer.parameter_count());
+    }
+
+    /**
+     * @brief Everything the optimizer keeps between updates, so training can be checkpointed and resumed exactly
+     */
+    struct State {
+        long step = 0;
+        vector<vector<float>> values;
+    };
+
+    /**
+     * @brief Copy the optimizer's state, reusing any memory `saved` already has
+     */
+    void save_state(State &saved) const {
+        saved.step = step;
+        saved.values.resize(state.size());
+        for (int l = 0; l < state.size(); l++) {
+            saved.values[l].assign(state[l].begin(), state[l].end());
+        }
+    }
+
+    /**
+     * @brief Carry on from a saved state, which must come from the same type of optimizer and the same layer sizes
+     */
+    void restore_state(const State &saved) {
+        bool matches = saved.values.size() == state.size();
+        for (int l = 0; matches && l < state.size(); l++) {
+            matches = saved.values[l].size() == state[l].size();
+        }
+
+        if (!matches) {
+            throw invalid_argument("Saved optimizer state doesn't match the optimizer or the network");
+        }
+
+        step = saved.step;
+        state = saved.values;
+    }
+
+  private:
+    /**
+     * @brief State of each layer: nothing for SGD, velocity for momentum/Nesterov, m followed by v for Adam/AdamW
+     */
+    vector<vector<float>> state;
+
+    /**
+     * @brief Number of weights (or factors) in each layer, parameters after these are biases
+     */
+    vector<int> weight_counts;
+
+    /**
+     * @brief Number of updates so far
+     */
+    long step = 0;
+
+    float step_size = 0;
+    float gradient_scale = 1;
+    float correction1 = 1;
+    float correction2 = 1;
+
+    /**
+     * @brief The fused update. Each case is one simple loop the compiler can vectorize.
+     */
+    void update_range(int l, const float *source, float *parameters, const float *gradient, int begin, int end,
+                      float decay) {
+        if (begin >= end) {
+            return;
+        }
+
+        const int count = end - begin;
+        const float scale = gradient_scale;
+        const float rate = step_size;
+
+        const float *s = source + begin;
+        float *p = parameters + begin;
+        const float *g = gradient;
+
+        switch (type) {
+        case SGD:
+            for (int x = 0; x < count; x++) {
+                p[x] = s[x] - rate * scale * g[x];
+            }
+            break;
+
+        case Momentum: {
+            float *velocity = state[l].data() + begin;
+            for (int x = 0; x < count; x++) {
+                velocity[x] = momentum * velocity[x] + scale * g[x];
+                p[x] = s[x] - rate * velocity[x];
+            }
+            break;
+        }
+
+        case Nesterov: {
+            float *velocity = state[l].data() + begin;
+            for (int x = 0; x < count; x++) {
+                float scaled = scale * g[x];
+                velocity[x] = momentum * velocity[x] + scaled;
+                p[x] = s[x] - rate * (scaled + momentum * velocity[x]);
+            }
+            break;
+        }
+
+        case Adam:
+        case AdamW: {
+            // m and v each take up half of the state
+            float *m = state[l].data() + begin;
+            float *v = state[l].data() + state[l].size() / 2 + begin;
+
+            const float step_m = rate / correction1;
+            const float inverse_correction2 = 1.0f / correction2;
+            const float decay_step = type == AdamW ? rate * decay : 0.0f;
+
+            for (int x = 0; x < count; x++) {
+                float scaled = scale * g[x];
+                m[x] = beta1 * m[x] + (1.0f - beta1) * scaled;
+                v[x] = beta2 * v[x] + (1.0f - beta2) * scaled * scaled;
+                p[x] = s[x] - (step_m * m[x] / (sqrt(v[x] * inverse_correction2) + epsilon) + decay_step * s[x]);
+            }
+            break;
+        }
+
+        case LBFGS:
+            throw invalid_function_call("L-BFGS updates the whole network at once, it can't update a range of weights");
+        }
+    }
+};
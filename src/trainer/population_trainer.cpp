@@ -0,0 +1,781 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "../utils/datetime.cpp"
+#include "../utils/file.cpp"
+#include "../utils/function_ref.cpp"
+#include "../utils/thread_pool.cpp"
+
+#include "../exceptions.h"
+#include "../inference/inference_context.cpp"
+#include "../logging.h"
+#include "../math_functions.cpp"
+#include "../network.cpp"
+#include "training_data.cpp"
+
+using namespace std;
+
+/**
+ *?                             ==================================================
+ *?                                          🛈 Population Training
+ *?                             ==================================================
+ *
+ * A small network like {784, 40, 10} does too little work per record to keep a core busy, most of the time goes to
+ * looping rather than arithmetic. When training many networks with the same layer sizes (for an ensemble, or to see how
+ * much results depend on the seed), their weights can be stacked side by side so that each layer of every network is
+ * computed at once.
+ *
+ * The weights of layer l for all M members are stored as one (previous layer size) x (M * layer size) matrix, member m's
+ * weights being columns [m * layer size, (m + 1) * layer size). Activations and errors are stored the same way, one row
+ * per record in the batch. Every member sees the same input batch, so the first layer of every member is a single matrix
+ * multiplication of the batch with the stacked weights. Deeper layers multiply each member's block of activations with its
+ * own block of weights, a batch of M small matrix multiplications.
+ *
+ * The first layer is nearly all of the work, and both its multiplications use the register-blocked kernel of 🛈 Single
+ * Image Inference. Propagating lists the pixels that aren't 0 for either of two records, then multiplies each listed row
+ * of the stacked weights with both records while the sums of 32 outputs stay in registers. The weight gradient is the
+ * same multiplication turned around: for two pixels at a time, the records in which either isn't 0 are listed, and each
+ * listed record's errors are multiplied with both pixels into two rows of the gradient. Blank pixels are skipped either
+ * way. Each task lists all of its pairs first, then goes through the stacked weights (or errors) 32 columns at a time,
+ * multiplying the block with every pair while it's in cache: with 32 members the stacked weights of a 784 x 40 layer
+ * take 4 MB, reading all of them for every pair of records took longer than the arithmetic.
+ */
+
+/**
+ * @brief Compute `Columns` outputs starting at `column` for every list, see `listed_rows_multiply_lists()`
+ */
+template <int Columns>
+inline __attribute__((always_inline)) void listed_rows_columns_lists(int lists, const int *counts, const int *rows,
+                                                                     const float *values, int list_stride,
+                                                                     const float *matrix, int size, int column,
+                                                                     float *out, size_t out_stride) {
+    for (int list = 0; list < lists; list++) {
+        listed_rows_columns<LISTED_IMAGES, Columns>(counts[list], rows + (size_t)list * list_stride,
+                                                    values + (size_t)list * list_stride * LISTED_IMAGES, matrix, size,
+                                                    column, out + list * LISTED_IMAGES * out_stride, out_stride);
+    }
+}
+
+/**
+ * @brief out = the listed inputs · their rows of a matrix, for several lists of `LISTED_IMAGES` images (see
+ *        `listed_rows_multiply_images()`). Goes through the matrix a block of columns at a time, computing the block's
+ *        outputs for every list while the block is in cache.
+ *
+ * @param lists Number of lists
+ * @param counts Number of inputs listed in each list
+ * @param rows Row of the matrix of each listed input, the lists `list_stride` apart
+ * @param values `LISTED_IMAGES` values of each listed input, the lists `list_stride` × `LISTED_IMAGES` apart
+ * @param matrix Stored row by row
+ * @param size Number of columns of the matrix, and outputs of each image
+ * @param out Outputs of the first image of the first list, the images of every list one after another
+ * @param out_stride Distance between the outputs of consecutive images
+ */
+KERNEL_CLONES inline void listed_rows_multiply_lists(int lists, const int *counts, const int *rows, const float *values,
+                                                     int list_stride, const float *matrix, int size, float *out,
+                                                     size_t out_stride) {
+    int column = 0;
+    for (; column + LISTED_IMAGE_COLUMNS <= size; column += LISTED_IMAGE_COLUMNS) {
+        listed_rows_columns_lists<LISTED_IMAGE_COLUMNS>(lists, counts, rows, values, list_stride, matrix, size, column,
+                                                        out, out_stride);
+    }
+    for (; column + 8 <= size; column += 8) {
+        listed_rows_columns_lists<8>(lists, counts, rows, values, list_stride, matrix, size, column, out, out_stride);
+    }
+    for (; column < size; column++) {
+        listed_rows_columns_lists<1>(lists, counts, rows, values, list_stride, matrix, size, column, out, out_stride);
+    }
+}
+
+/**
+ * @brief Trains many networks with the same layer sizes at the same time, on the same batches of training data.
+ */
+class PopulationTrainer {
+  private:
+    /**
+     * @brief Number of neurons in each layer, the same for every member
+     */
+    vector<int> layer_sizes;
+
+    /**
+     * @brief Activation function of each layer, the same for every member
+     */
+    vector<Layer::Function> activation_functions;
+
+    /**
+     * @brief Stacked weights of each layer (index 0, the input layer, is empty). Layer l is
+     *        layer_sizes[l - 1] x (members * layer_sizes[l]).
+     */
+    vector<vector<float>> weights;
+
+    /**
+     * @brief Stacked biases of each layer, members * layer_sizes[l]
+     */
+    vector<vector<float>> biases;
+
+    /**
+     * @brief Weight gradient of the current batch, same shape as `weights`
+     */
+    vector<vector<float>> weight_gradient;
+
+    /**
+     * @brief Activations of each layer for every record in the batch. Layer 0 is the input batch, shared by every member,
+     *        batch_size x layer_sizes[0]. Other layers are batch_size x (members * layer_sizes[l]).
+     */
+    vector<vector<float>> activations;
+
+    /**
+     * @brief Error of each layer for every record in the batch, same shape as `activations` (index 0 is empty)
+     */
+    vector<vector<float>> error;
+
+    /**
+     * @brief Errors backpropagated from the next layer before being multiplied with the activation function gradient
+     */
+    vector<float> backpropagated_error;
+
+    /**
+     * @brief Number of records or pixels each task of the first layer's multiplications works on
+     */
+    static const int ROWS_PER_TASK = 16;
+
+    /**
+     * @brief Rows and values listed for the kernels of the first layer, `ROWS_PER_TASK` / `LISTED_IMAGES` lists of
+     *        `list_stride` for each thread, and how many are listed in each, see 🛈 Population Training
+     */
+    vector<vector<int>> listed_rows, listed_counts;
+    vector<vector<float>> listed_values;
+    int list_stride = 0;
+
+    ThreadPool *thread_pool = NULL;
+
+    /**
+     * @brief Width of layer l once all members are stacked
+     */
+    int stacked_size(int l) const { return members * layer_sizes[l]; }
+
+    /**
+     * @brief Number of threads training, 1 when training on the calling thread only
+     */
+    int thread_count() const { return thread_pool != NULL ? thread_pool->size() : 1; }
+
+    /**
+     * @brief Run a loop on the trainer's threads, or on the calling thread when training single threaded.
+     */
+    void parallel_for(int count, FunctionRef<void(int)> function) {
+        if (thread_pool != NULL) {
+            thread_pool->parallel_for(count, function);
+        } else {
+            for (int x = 0; x < count; x++) {
+                function(x);
+            }
+        }
+    }
+
+    /**
+     * @brief Split `rows` rows into blocks and run a function on each block, on the trainer's threads
+     */
+    void parallel_rows(int rows, FunctionRef<void(int, int)> function) {
+        parallel_for((rows + ROWS_PER_TASK - 1) / ROWS_PER_TASK, [rows, &function](int task) {
+            function(task * ROWS_PER_TASK, min((task + 1) * ROWS_PER_TASK, rows));
+        });
+    }
+
+    /**
+     * @brief Like `parallel_rows()`, also passing the index of the thread running each block, for `listed_rows` and
+     *        `listed_values`. Blocks are handed out to whichever thread is free.
+     */
+    void parallel_rows_threads(int rows, FunctionRef<void(int, int, int)> function) {
+        const int tasks = (rows + ROWS_PER_TASK - 1) / ROWS_PER_TASK;
+
+        if (thread_pool == NULL) {
+            for (int task = 0; task < tasks; task++) {
+                function(task * ROWS_PER_TASK, min((task + 1) * ROWS_PER_TASK, rows), 0);
+            }
+            return;
+        }
+
+        atomic<int> next{0};
+        thread_pool->run_on_each_thread([&next, tasks, rows, &function](int thread) {
+            for (int task = next++; task < tasks; task = next++) {
+                function(task * ROWS_PER_TASK, min((task + 1) * ROWS_PER_TASK, rows), thread);
+            }
+        });
+    }
+
+    /**
+     * @brief Propagate records [begin, end) of the batch through the first layer of every member, without biases,
+     *        `LISTED_IMAGES` records at a time, see 🛈 Population Training
+     */
+    void multiply_first_layer(int begin, int end, int thread) {
+        const int inputs = layer_sizes[0];
+        const int width = stacked_size(1);
+        const float *records = activations[0].data();
+        float *out = activations[1].data();
+
+        // lists of the pixels that aren't 0 for some record of each pair, and of each record left over on its own
+        const int lists = list_inputs(
+            end - begin, inputs, thread,
+            [records, begin, inputs](int r, int x) { return records[(size_t)(begin + r) * inputs + x]; });
+
+        listed_rows_multiply_lists(lists, listed_counts[thread].data(), listed_rows[thread].data(),
+                                   listed_values[thread].data(), list_stride, weights[1].data(), width,
+                                   out + (size_t)begin * width, width);
+
+        for (int b = begin + lists * LISTED_IMAGES; b < end; b++) {
+            const int list = b - begin - lists * LISTED_IMAGES + lists;
+            listed_rows_multiply(listed_counts[thread][list], listed_rows[thread].data() + (size_t)list * list_stride,
+                                 listed_values[thread].data() + (size_t)list * list_stride * LISTED_IMAGES,
+                                 weights[1].data(), width, out + (size_t)b * width);
+        }
+    }
+
+    /**
+     * @brief Calculate rows [begin, end) of the first layer's stacked weight gradient, one row per pixel, `LISTED_IMAGES`
+     *        pixels at a time, see 🛈 Population Training
+     */
+    void first_layer_gradient(int begin, int end, int batch_size, int thread) {
+        const int inputs = layer_sizes[0];
+        const int width = stacked_size(1);
+        const float *records = activations[0].data();
+        float *gradient = weight_gradient[1].data();
+
+        // lists of the records in which some pixel of each pair isn't 0, and for each pixel left over on its own
+        const int lists = list_inputs(
+            end - begin, batch_size, thread,
+            [records, begin, inputs](int r, int b) { return records[(size_t)b * inputs + begin + r]; });
+
+        listed_rows_multiply_lists(lists, listed_counts[thread].data(), listed_rows[thread].data(),
+                                   listed_values[thread].data(), list_stride, error[1].data(), width,
+                                   gradient + (size_t)begin * width, width);
+
+        for (int x = begin + lists * LISTED_IMAGES; x < end; x++) {
+            const int list = x - begin - lists * LISTED_IMAGES + lists;
+            listed_rows_multiply(listed_counts[thread][list], listed_rows[thread].data() + (size_t)list * list_stride,
+                                 listed_values[thread].data() + (size_t)list * list_stride * LISTED_IMAGES,
+                                 error[1].data(), width, gradient + (size_t)x * width);
+        }
+    }
+
+    /**
+     * @brief Fill a thread's lists for `rows` rows (records or pixels): one list for every `LISTED_IMAGES` of them with
+     *        the inputs that aren't 0 for any, then a list for each row left over. Every input is written, but only the
+     *        ones that aren't 0 are counted.
+     *
+     * @param rows Number of rows, at most `ROWS_PER_TASK`
+     * @param inputs Number of inputs of each row
+     * @param value Value of an input of a row
+     *
+     * @return Number of lists of `LISTED_IMAGES` rows, the lists of the rows left over come after them
+     */
+    int list_inputs(int rows, int inputs, int thread, FunctionRef<float(int, int)> value) {
+        int *counts = listed_counts[thread].data();
+        const int lists = rows / LISTED_IMAGES;
+
+        for (int list = 0; list < lists; list++) {
+            int *__restrict listed = listed_rows[thread].data() + (size_t)list * list_stride;
+            float *__restrict values = listed_values[thread].data() + (size_t)list * list_stride * LISTED_IMAGES;
+
+            int count = 0;
+            for (int x = 0; x < inputs; x++) {
+                bool any = false;
+                for (int i = 0; i < LISTED_IMAGES; i++) {
+                    const float input = value(list * LISTED_IMAGES + i, x);
+                    values[(size_t)count * LISTED_IMAGES + i] = input;
+                    any |= input != 0;
+                }
+                listed[count] = x;
+                count += any;
+            }
+            counts[list] = count;
+        }
+
+        for (int r = lists * LISTED_IMAGES; r < rows; r++) {
+            const int list = lists + r - lists * LISTED_IMAGES;
+            int *__restrict listed = listed_rows[thread].data() + (size_t)list * list_stride;
+            float *__restrict values = listed_values[thread].data() + (size_t)list * list_stride * LISTED_IMAGES;
+
+            int count = 0;
+            for (int x = 0; x < inputs; x++) {
+                const float input = value(r, x);
+                listed[count] = x;
+                values[count] = input;
+                count += input != 0;
+            }
+            counts[list] = count;
+        }
+
+        return lists;
+    }
+
+    /**
+     * @brief Allocate the buffers that depend on the batch size
+     */
+    void allocate_batch_buffers() {
+        allocated_batch_size = training_data.batch_size;
+
+        activations.assign(layer_sizes.size(), vector<float>());
+        error.assign(layer_sizes.size(), vector<float>());
+
+        activations[0].resize((size_t)allocated_batch_size * layer_sizes[0]);
+
+        int widest = 0;
+        for (int l = 1; l < layer_sizes.size(); l++) {
+            activations[l].resize((size_t)allocated_batch_size * stacked_size(l));
+            error[l].resize((size_t)allocated_batch_size * stacked_size(l));
+            widest = max(widest, stacked_size(l));
+        }
+
+        backpropagated_error.resize((size_t)allocated_batch_size * widest);
+
+        // pixels of records to propagate, or records of pixels to calculate the gradient of, as many lists as rows at most
+        list_stride = max(layer_sizes[0], allocated_batch_size);
+        listed_rows.assign(thread_count(), vector<int>((size_t)ROWS_PER_TASK * list_stride));
+        listed_values.assign(thread_count(), vector<float>((size_t)ROWS_PER_TASK * list_stride * LISTED_IMAGES));
+        listed_counts.assign(thread_count(), vector<int>(ROWS_PER_TASK));
+    }
+
+    int allocated_batch_size = 0;
+
+  public:
+    /**
+     * @brief Number of networks being trained
+     */
+    int members = 0;
+
+    float step_size = 0.005f;
+
+    /**
+     * @brief Folder the results csv file is written to
+     */
+    string training_logs_output_folder = "./log";
+
+    /**
+     * @brief Training data shared by every member
+     */
+    TrainingData training_data;
+
+    /**
+     * @brief Create a population from existing networks. Weights and biases are copied, use `copy_member_to()` to get them
+     *        back after training.
+     *
+     * @param networks Networks to train, must all have the same layer sizes and activation functions
+     */
+    PopulationTrainer(const vector<Network *> &networks) {
+        if (networks.empty()) {
+            throw invalid_argument("A population needs at least one network");
+        }
+
+        members = networks.size();
+
+        const Network &first = *networks[0];
+        for (int l = 0; l < first.layers.size(); l++) {
+            layer_sizes.push_back(first.layers[l]->size);
+            activation_functions.push_back(first.layers[l]->activation_function);
+        }
+
+        for (const Network *network : networks) {
+            if (network->layers.size() != layer_sizes.size()) {
+                throw invalid_argument("Every network in a population must have the same layer sizes");
+            }
+            for (int l = 0; l < layer_sizes.size(); l++) {
+                if (network->layers[l]->size != layer_sizes[l] ||
+                    network->layers[l]->activation_function != activation_functions[l]) {
+                    throw invalid_argument("Every network in a population must have the same layer sizes and activation "
+                                           "functions");
+                }
+            }
+        }
+
+        weights.resize(layer_sizes.size());
+        biases.resize(layer_sizes.size());
+        weight_gradient.resize(layer_sizes.size());
+
+        for (int l = 1; l < layer_sizes.size(); l++) {
+            weights[l].resize((size_t)layer_sizes[l - 1] * stacked_size(l));
+            biases[l].resize(stacked_size(l));
+            weight_gradient[l].resize(weights[l].size());
+
+            for (int m = 0; m < members; m++) {
+                const Layer *layer = networks[m]->layers[l];
+
+                for (int x = 0; x < layer_sizes[l - 1]; x++) {
+                    copy(layer->weights[x], layer->weights[x] + layer_sizes[l],
+                         weights[l].begin() + (size_t)x * stacked_size(l) + m * layer_sizes[l]);
+                }
+                copy(layer->biases, layer->biases + layer_sizes[l], biases[l].begin() + m * layer_sizes[l]);
+            }
+        }
+
+        SPDLOG_DEBUG("Created population of {0} networks", members);
+    }
+
+    PopulationTrainer(const PopulationTrainer &) = delete;
+    PopulationTrainer &operator=(const PopulationTrainer &) = delete;
+
+    /**
+     * @brief Set the number of threads used for training and testing
+     */
+    void set_threads(int threads) {
+        if (threads < 1) {
+            throw invalid_argument("Number of training threads must be at least 1");
+        }
+
+        delete thread_pool;
+        thread_pool = threads > 1 ? new ThreadPool(threads) : NULL;
+
+        // the lists are per thread
+        allocated_batch_size = 0;
+    }
+
+    /**
+     * @brief Copy the trained weights and biases of one member back into a network with the same layer sizes
+     *
+     * @param member Index of the member
+     * @param network Network to copy into
+     */
+    void copy_member_to(int member, Network &network) const {
+        network.detach();
+
+        for (int l = 1; l < layer_sizes.size(); l++) {
+            Layer *layer = network.layers[l];
+
+            for (int x = 0; x < layer_sizes[l - 1]; x++) {
+                const float *row = weights[l].data() + (size_t)x * stacked_size(l) + member * layer_sizes[l];
+                copy(row, row + layer_sizes[l], layer->weights[x]);
+            }
+
+            const float *member_biases = biases[l].data() + member * layer_sizes[l];
+            copy(member_biases, member_biases + layer_sizes[l], layer->biases);
+        }
+    }
+
+    /**
+     * @brief Model file a member is saved to, the member's index added to the name of the population's model file, ex.
+     *        population_3.model for member 3 of population.model
+     */
+    static string member_path(const string &path, int member) {
+        filesystem::path member_path(path);
+        member_path.replace_filename(member_path.stem().string() + "_" + to_string(member) +
+                                     member_path.extension().string());
+        return member_path.string();
+    }
+
+    /**
+     * @brief Propagate a batch through every member. The batch must already be in `activations[0]`.
+     *
+     * @param batch_size Number of records in the batch
+     * @param store_gradient Whether to store the activation function gradient in `error`, needed for backpropagation
+     */
+    void propagate(int batch_size, bool store_gradient) {
+        for (int l = 1; l < layer_sizes.size(); l++) {
+            const int width = stacked_size(l);
+            float *out = activations[l].data();
+
+            if (l == 1) {
+                // every member gets the same input, so the whole first layer is one matrix multiplication
+                parallel_rows_threads(batch_size,
+                                      [this](int begin, int end, int thread) { multiply_first_layer(begin, end, thread); });
+            } else {
+                // each member multiplies its own block of activations with its own block of weights
+                const int previous_width = stacked_size(l - 1);
+                parallel_for(members, [&](int m) {
+                    matrix_multiply(activations[l - 1].data() + m * layer_sizes[l - 1], previous_width,
+                                    weights[l].data() + m * layer_sizes[l], width, out + m * layer_sizes[l], width,
+                                    batch_size, layer_sizes[l - 1], layer_sizes[l]);
+                });
+            }
+
+            // add biases and apply the activation function, storing its gradient first if needed
+            Layer::Function function = activation_functions[l];
+            float *gradient = error[l].data();
+            const float *layer_biases = biases[l].data();
+
+            parallel_rows(batch_size, [&](int begin, int end) {
+                for (int b = begin; b < end; b++) {
+                    float *row = out + (size_t)b * width;
+                    float *gradient_row = gradient + (size_t)b * width;
+
+                    for (int x = 0; x < width; x++) {
+                        float z = row[x] + layer_biases[x];
+
+                        if (function == Layer::Function::ReLU) {
+                            if (store_gradient) {
+                                gradient_row[x] = ActivationFunctionGradients::ReLU_gradient(z);
+                            }
+                            row[x] = ActivationFunctions::ReLU(z);
+                        } else {
+                            if (store_gradient) {
+                                gradient_row[x] = ActivationFunctionGradients::sigmoid_gradient(z);
+                            }
+                            row[x] = ActivationFunctions::sigmoid(z);
+                        }
+                    }
+                }
+            });
+        }
+    }
+
+    /**
+     * @brief Train every member on the next batch of training data
+     */
+    void train_next_batch() {
+        if (allocated_batch_size != training_data.batch_size) {
+            allocate_batch_buffers();
+        }
+
+        training_data.get_next_training_batch();
+
+        int batch_size = training_data.batch_size;
+        int remainder = training_data.training_data_items_count % batch_size;
+        if (training_data.current_batch == training_data.total_batch_count && remainder != 0) {
+            // on the last batch so batch size will be different,
+            batch_size = remainder;
+        }
+
+        // load batch into input layer
+        for (int b = 0; b < batch_size; b++) {
+            copy(training_data.training_data_batch_buffer[b], training_data.training_data_batch_buffer[b] + layer_sizes[0],
+                 activations[0].begin() + (size_t)b * layer_sizes[0]);
+        }
+
+        propagate(batch_size, true);
+
+        const int last = layer_sizes.size() - 1;
+
+        // error of the output layer, using the quadratic cost function (dC/da = a - y), see Network
+        parallel_rows(batch_size, [&](int begin, int end) {
+            for (int b = begin; b < end; b++) {
+                unsigned char label = training_data.training_labels_batch_buffer[b];
+
+                for (int m = 0; m < members; m++) {
+                    size_t offset = (size_t)b * stacked_size(last) + m * layer_sizes[last];
+
+                    for (int x = 0; x < layer_sizes[last]; x++) {
+                        float desired = x == label ? 1.0f : 0.0f;
+                        error[last][offset + x] *= activations[last][offset + x] - desired;
+                    }
+                }
+            }
+        });
+
+        // backpropagate error through hidden layers
+        for (int l = last; l > 1; l--) {
+            const int width = stacked_size(l);
+            const int previous_width = stacked_size(l - 1);
+
+            parallel_for(members, [&](int m) {
+                matrix_multiply_transposed_b(error[l].data() + m * layer_sizes[l], width,
+                                             weights[l].data() + m * layer_sizes[l], width,
+                                             backpropagated_error.data() + m * layer_sizes[l - 1], previous_width,
+                                             batch_size, layer_sizes[l], layer_sizes[l - 1]);
+            });
+
+            for (size_t x = 0; x < (size_t)batch_size * previous_width; x++) {
+                error[l - 1][x] *= backpropagated_error[x];
+            }
+        }
+
+        // weight gradients, the first layer is once again a single matrix multiplication for every member
+        for (int l = 1; l <= last; l++) {
+            const int width = stacked_size(l);
+
+            if (l == 1) {
+                parallel_rows_threads(layer_sizes[0], [this, batch_size](int begin, int end, int thread) {
+                    first_layer_gradient(begin, end, batch_size, thread);
+                });
+            } else {
+                const int previous_width = stacked_size(l - 1);
+                parallel_for(members, [&](int m) {
+                    matrix_multiply_transposed_a(activations[l - 1].data() + m * layer_sizes[l - 1], previous_width,
+                                                 error[l].data() + m * layer_sizes[l], width,
+                                                 weight_gradient[l].data() + m * layer_sizes[l], width,
+                                                 layer_sizes[l - 1], batch_size, layer_sizes[l]);
+                });
+            }
+        }
+
+        // update weights and biases with the average gradient of the batch
+        float coefficient = step_size / batch_size;
+
+        for (int l = 1; l <= last; l++) {
+            const int width = stacked_size(l);
+
+            parallel_rows(layer_sizes[l - 1], [&](int begin, int end) {
+                for (size_t x = (size_t)begin * width; x < (size_t)end * width; x++) {
+                    weights[l][x] -= weight_gradient[l][x] * coefficient;
+                }
+            });
+
+            for (int x = 0; x < width; x++) {
+                float error_sum = 0;
+                for (int b = 0; b < batch_size; b++) {
+                    error_sum += error[l][(size_t)b * width + x];
+                }
+                biases[l][x] -= error_sum * coefficient;
+            }
+        }
+    }
+
+    /**
+     * @brief Train every member on one epoch of training data
+     */
+    void train_epoch() {
+        for (int x = 0; x < training_data.total_batch_count; x++) {
+            train_next_batch();
+        }
+    }
+
+    /**
+     * @brief Test every member on the test data.
+     *
+     * @param ensemble_accuracy Set to the accuracy of the whole population used as an ensemble, where the output
+     *                          activations of every member are added up before picking the most active neuron.
+     *
+     * @return Accuracy of each member (ex, 0.45 is 45% accuracy)
+     */
+    vector<float> test_members(float &ensemble_accuracy) {
+        if (allocated_batch_size != training_data.batch_size) {
+            allocate_batch_buffers();
+        }
+
+        const int last = layer_sizes.size() - 1;
+        const int outputs = layer_sizes[last];
+
+        vector<int> correct(members, 0);
+        int ensemble_correct = 0;
+        vector<float> ensemble_output(outputs);
+
+        for (int start = 0; start < training_data.test_data_items_count; start += allocated_batch_size) {
+            int batch_size = min(allocated_batch_size, training_data.test_data_items_count - start);
+
+            for (int b = 0; b < batch_size; b++) {
+                const float *record = training_data.test_data_buffer[start + b];
+                copy(record, record + layer_sizes[0], activations[0].begin() + (size_t)b * layer_sizes[0]);
+            }
+
+            propagate(batch_size, false);
+
+            for (int b = 0; b < batch_size; b++) {
+                unsigned char label = training_data.test_labels_buffer[start + b];
+                fill(ensemble_output.begin(), ensemble_output.end(), 0.0f);
+
+                for (int m = 0; m < members; m++) {
+                    const float *output = activations[last].data() + (size_t)b * stacked_size(last) + m * outputs;
+
+                    if (max_element(output, output + outputs) - output == label) {
+                        correct[m]++;
+                    }
+
+                    for (int x = 0; x < outputs; x++) {
+                        ensemble_output[x] += output[x];
+                    }
+                }
+
+                if (max_element(ensemble_output.begin(), ensemble_output.end()) - ensemble_output.begin() == label) {
+                    ensemble_correct++;
+                }
+            }
+        }
+
+        ensemble_accuracy = ensemble_correct / (float)training_data.test_data_items_count;
+
+        vector<float> accuracies(members);
+        for (int m = 0; m < members; m++) {
+            accuracies[m] = correct[m] / (float)training_data.test_data_items_count;
+        }
+        return accuracies;
+    }
+
+    /**
+     * @brief Train every member for a number of epochs, logging the accuracy of the population after each epoch and
+     *        writing it to a csv file.
+     *
+     * @param epochs Number of epochs to train for
+     * @param log_accuracy Whether to write the accuracy of every epoch to a csv file
+     *
+     * @return Average number of records per second trained by the whole population, counting each record once per member
+     */
+    double train(int epochs, bool log_accuracy) {
+        SPDLOG_INFO("Training population of {0} networks for {1} epochs", members, epochs);
+
+        ofstream writer;
+        string filename;
+
+        if (log_accuracy) {
+            filesystem::path dest(training_logs_output_folder);
+            dest.append("population_" + get_current_datetime() + ".csv");
+            filename = get_unique_filename(dest.string());
+
+            writer.open(filename, ios_base::trunc);
+            writer << "# Population Training Results" << endl;
+            writer << "# Training Data File: " << training_data.training_data_path << endl;
+            writer << "# Members: " << members << endl;
+            writer << endl;
+            writer << "epoch,seconds,mean_accuracy,best_accuracy,worst_accuracy,ensemble_accuracy" << endl;
+        }
+
+        double total_seconds = 0;
+
+        for (int x = 0; x <= epochs; x++) {
+            double seconds = 0;
+
+            if (x > 0) {
+                auto t_start = chrono::high_resolution_clock::now();
+
+                train_epoch();
+
+                auto t_end = chrono::high_resolution_clock::now();
+                seconds = chrono::duration<double>(t_end - t_start).count();
+                total_seconds += seconds;
+            }
+
+            float ensemble_accuracy;
+            vector<float> accuracies = test_members(ensemble_accuracy);
+
+            float mean_accuracy = 0;
+            for (float accuracy : accuracies) {
+                mean_accuracy += accuracy / members;
+            }
+            float best_accuracy = *max_element(accuracies.begin(), accuracies.end());
+            float worst_accuracy = *min_element(accuracies.begin(), accuracies.end());
+
+            SPDLOG_INFO("Epoch {0}: mean {1}%, best {2}%, worst {3}%, ensemble {4}% ({5:.2f}s)", x, mean_accuracy * 100.0f,
+                        best_accuracy * 100.0f, worst_accuracy * 100.0f, ensemble_accuracy * 100.0f, seconds);
+
+            if (log_accuracy) {
+                writer << x << "," << seconds << "," << mean_accuracy << "," << best_accuracy << "," << worst_accuracy
+                       << "," << ensemble_accuracy << endl;
+            }
+        }
+
+        if (log_accuracy) {
+            if (writer.good()) {
+                SPDLOG_INFO("Wrote population results to " + filename);
+            } else {
+                SPDLOG_WARN("Unable to write population results, are you sure the target folder (" +
+                            training_logs_output_folder + ") exists?");
+            }
+        }
+
+        double records_per_second = 0;
+        if (total_seconds > 0) {
+            records_per_second = (double)training_data.training_data_items_count * epochs * members / total_seconds;
+            SPDLOG_INFO("Population throughput: {0:.0f} records/s across all members", records_per_second);
+        }
+
+        return records_per_second;
+    }
+
+    ~PopulationTrainer() {
+        delete thread_pool;
+
+        SPDLOG_DEBUG("Deleted population trainer");
+    }
+};
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "../exceptions.h"
+#include "../inference/batch_classifier.cpp"
+#include "../inference/inference_context.cpp"
+#include "../network.cpp"
+#include "../utils/string.cpp"
+
+using namespace std;
+
+/**
+ *?                             ==================================================
+ *?                                           🛈 Magnitude Pruning
+ *?                             ==================================================
+ *
+ * Most trained weights are close to 0 and barely change the outputs. Pruning sets the smallest of them to 0 for good, and
+ * the network is then trained some more (fine-tuned) so the remaining weights make up for them. Pruning a little at a
+ * time and fine-tuning in between loses much less accuracy than pruning everything at once.
+ *
+ * Weights are pruned in blocks of `Layer::PRUNE_BLOCK` consecutive weights of a row, the blocks with the smallest sum of
+ * absolute values first. Pruning whole blocks lets inference skip them with the block sparse kernel (see 🛈 Block Sparse
+ * Weights), individual pruned weights would be scattered through every block.
+ *
+ * Pruning happens in `rounds` rounds, at the start of every `interval` epochs from `start_epoch` on. The sparsity of round
+ * r of n is the final sparsity × (1 - (1 - r/n)³), so early rounds prune a lot while the network still has plenty of
+ * weights to spare, and later ones prune less. https://arxiv.org/abs/1710.01878
+ *
+ * Pruned weights are set back to 0 after every batch, as the optimizer moves them.
+ */
+
+/**
+ * @brief Decides when to prune, and how much of each layer
+ */
+class PruningSchedule {
+  public:
+    /**
+     * @brief Final sparsity of each layer with weights, starting with layer 1. Empty for no pruning.
+     */
+    vector<float> sparsity;
+
+    /**
+     * @brief Number of times to prune, the last one reaches `sparsity`
+     */
+    int rounds = 4;
+
+    /**
+     * @brief Epoch the first round is at, epoch 0 is the first epoch
+     */
+    int start_epoch = 1;
+
+    /**
+     * @brief Number of epochs of fine-tuning after each round before the next one
+     */
+    int interval = 1;
+
+    bool enabled() const { return !sparsity.empty(); }
+
+    /**
+     * @brief Parse the final sparsities as given on the command line. A single value applies to every layer but the
+     *        output layer, otherwise there must be a comma separated value for each layer with weights.
+     *
+     * @param text Sparsities, ex. 0.9 or 0.9,0.5
+     * @param weight_layers Number of layers with weights
+     */
+    static vector<float> parse(const string &text, int weight_layers) {
+        auto parse_sparsity = [](const string &value) {
+            float parsed = stof(value);
+            if (parsed < 0 || parsed >= 1) {
+                throw invalid_argument("Sparsity must be at least 0 and below 1, got " + value);
+            }
+            return parsed;
+        };
+
+        return parse_per_layer(text, weight_layers, "sparsity", parse_sparsity, 0.0f);
+    }
+
+    /**
+     * @brief Round pruned at the start of an epoch, 1 to `rounds`, or 0 if there's none
+     */
+    int round_at(int epoch) const {
+        if (!enabled() || epoch < start_epoch || (epoch - start_epoch) % interval != 0) {
+            return 0;
+        }
+
+        int round = (epoch - start_epoch) / interval + 1;
+        return round <= rounds ? round : 0;
+    }
+
+    /**
+     * @brief Number of rounds pruned before an epoch starts
+     */
+    int rounds_before(int epoch) const {
+        if (!enabled() || epoch <= start_epoch) {
+            return 0;
+        }
+        return min(rounds, (epoch - start_epoch - 1) / interval + 1);
+    }
+
+    /**
+     * @brief Epoch the last round is at
+     */
+    int last_epoch() const { return start_epoch + (rounds - 1) * interval; }
+
+    /**
+     * @brief Sparsity of a layer after a round
+     *
+     * @param layer Layer index, 1 for the first layer with weights
+     * @param round Round, 1 to `rounds`
+     */
+    float sparsity_at(int layer, int round) const {
+        float remaining = 1 - round / (float)rounds;
+        return sparsity[layer - 1] * (1 - remaining * remaining * remaining);
+    }
+
+    void validate(int weight_layers) const {
+        if (!enabled()) {
+            return;
+        }
+        if (sparsity.size() != weight_layers) {
+            throw invalid_argument("Expected a sparsity for each of the " + to_string(weight_layers) +
+                                   " layers with weights");
+        }
+        if (rounds < 1 || interval < 1 || start_epoch < 0) {
+            throw invalid_argument("Pruning needs at least 1 round, an interval of at least 1 epoch and a start epoch "
+                                   "of at least 0");
+        }
+    }
+};
+
+/**
+ * @brief How fast a network classifies, with or without the block sparse kernel
+ */
+struct InferenceSpeed {
+    /**
+     * @brief Average time to classify one image with `InferenceContext`, in microseconds
+     */
+    double single_us = 0;
+
+    /**
+     * @brief Images classified per second by a single threaded `BatchClassifier`
+     */
+    double batch_images_per_s = 0;
+
+    /**
+     * @brief Number of layers each path propagated with block sparse weights, the rest had too many blocks left for
+     *        the block sparse kernel to be faster (see 🛈 Block Sparse Weights)
+     */
+    int single_sparse_layers = 0, batch_sparse_layers = 0;
+
+    /**
+     * @brief Number of times each path is timed, the fastest counts
+     */
+    static const int RUNS = 5;
+
+    /**
+     * @brief Time the single image and batch paths of a network
+     *
+     * @param network Network to classify with
+     * @param images Images to classify, one after another, already scaled
+     * @param count Number of images
+     * @param sparse Whether to use block sparse weights for layers that are mostly pruned
+     */
+    static InferenceSpeed measure(const Network &network, const vector<float> &images, int count, bool sparse) {
+        const int values = network.layers[0]->size;
+        InferenceSpeed speed;
+
+        InferenceContext context(network, sparse);
+        BatchClassifier classifier(network, 1, sparse);
+        vector<int32_t> predictions(count);
+        vector<float> probabilities(count);
+        long sum = 0; // keeps the predictions from being optimized away
+
+        // the fastest of a few runs, the others were slowed down by something else
+        speed.single_us = numeric_limits<double>::max();
+        for (int run = 0; run < RUNS; run++) {
+            auto t_start = chrono::steady_clock::now();
+            for (int x = 0; x < count; x++) {
+                sum += context.predict(images.data() + (size_t)x * values);
+            }
+            double us = chrono::duration<double, micro>(chrono::steady_clock::now() - t_start).count() / count;
+            speed.single_us = min(speed.single_us, us);
+
+            t_start = chrono::steady_clock::now();
+            classifier.classify(images.data(), count, predictions.data(), predictions.data(), probabilities.data());
+            double images_per_s = count / chrono::duration<double>(chrono::steady_clock::now() - t_start).count();
+            speed.batch_images_per_s = max(speed.batch_images_per_s, images_per_s);
+        }
+
+        speed.single_sparse_layers = context.sparse_layers();
+        speed.batch_sparse_layers = classifier.sparse_layers();
+
+        SPDLOG_DEBUG("Classes sum to {0}", sum + predictions[0]);
+        return speed;
+    }
+};
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <sys/socket.h>
+    #include <unistd.h>
+#endif
+
+#include "../exceptions.h"
+#include "../logging.h"
+#include "../utils/socket.cpp"
+
+using namespace std;
+
+/**
+ *?                             ==================================================
+ *?                                           🛈 Ring All-Reduce
+ *?                             ==================================================
+ *
+ * Every process taking part in distributed training is connected to the next one in a ring, process K-1 being connected
+ * back to process 0. To sum a buffer across all K processes, the buffer is split into K chunks and then:
+ *
+ *  - Reduce-scatter: for K-1 steps, every process sends one chunk to the next process while receiving a different chunk
+ *    from the previous process and adding it to its own. Afterwards every process holds the complete sum of one chunk.
+ *  - All-gather: for K-1 more steps, the completed chunks are passed around the ring until every process has all of them.
+ *
+ * Every process sends and receives about 2x the buffer size in total no matter how many processes there are, and all
+ * links in the ring are busy at the same time.
+ */
+
+/**
+ * @brief Connects to the other processes taking part in distributed training and sums buffers across all of them.
+ *
+ * Addresses are either `host:port` for TCP or `unix:/path/to/socket` for Unix domain sockets. Every process is given the
+ * same list of addresses and its own index (rank) in that list.
+ */
+class RingAllReduce {
+  private:
+    /**
+     * @brief Socket accepting the connection from the previous process in the ring
+     */
+    int listen_socket = -1;
+
+    /**
+     * @brief Connection to the next process in the ring, chunks are sent to it
+     */
+    int next_socket = -1;
+
+    /**
+     * @brief Connection from the previous process in the ring, chunks are received from it
+     */
+    int previous_socket = -1;
+
+    /**
+     * @brief Path of the Unix domain socket this process listens on, deleted when done. Empty when using TCP.
+     */
+    string unix_socket_path;
+
+    /**
+     * @brief Chunks received from the previous process are stored here before being added to the buffer being reduced.
+     */
+    vector<float> receive_buffer;
+
+    /**
+     * @brief How long to keep trying to connect to the next process before giving up. Processes are usually started at
+     *        slightly different times.
+     */
+    const int connect_timeout_s = 60;
+
+  public:
+    /**
+     * @brief Index of this process in the ring
+     */
+    int rank = 0;
+
+    /**
+     * @brief Number of processes in the ring
+     */
+    int size = 1;
+
+    /**
+     * @brief Connect to the other processes. Blocks until both the previous and next process in the ring are connected.
+     *
+     * @param addresses Address of every process taking part, in order
+     * @param rank Index of this process in addresses
+     */
+    RingAllReduce(const vector<string> &addresses, int rank) {
+        if (rank < 0 || rank >= addresses.size()) {
+            throw invalid_argument("Rank " + to_string(rank) + " is outside the list of " + to_string(addresses.size()) +
+                                   " addresses");
+        }
+
+        this->rank = rank;
+        this->size = addresses.size();
+
+        if (size == 1) {
+            // nothing to connect to, reductions do nothing
+            return;
+        }
+
+#ifdef _WIN32
+        throw invalid_function_call("Distributed training is not supported on Windows");
+#else
+        const string &own_address = addresses[rank];
+        const string &next_address = addresses[(rank + 1) % size];
+
+        SPDLOG_INFO("Rank {0}/{1} listening on {2}, connecting to {3}", rank, size, own_address, next_address);
+
+        listen_socket = open_listen_socket(own_address, 1, unix_socket_path);
+        next_socket = connect_to(next_address, connect_timeout_s);
+
+        // tell the next process who we are so a mistake in the address list is caught straight away
+        int32_t handshake = rank;
+        if (!send_all(next_socket, &handshake, sizeof(handshake))) {
+            throw communication_error("Next process disconnected during handshake");
+        }
+
+        previous_socket = accept(listen_socket, NULL, NULL);
+        if (previous_socket < 0) {
+            throw communication_error("Unable to accept connection on " + own_address + ": " + strerror(errno));
+        }
+
+        if (!receive_all(previous_socket, &handshake, sizeof(handshake))) {
+            throw communication_error("Previous process disconnected during handshake");
+        }
+        int expected_rank = (rank + size - 1) % size;
+        if (handshake != expected_rank) {
+            throw communication_error("Expected previous process to be rank " + to_string(expected_rank) + " but it was " +
+                                      to_string(handshake) + ", are all processes given the same address list?");
+        }
+
+        set_no_delay(previous_socket);
+
+        // from now on sockets are only used through poll() in exchange()
+        fcntl(next_socket, F_SETFL, fcntl(next_socket, F_GETFL) | O_NONBLOCK);
+        fcntl(previous_socket, F_SETFL, fcntl(previous_socket, F_GETFL) | O_NONBLOCK);
+
+        SPDLOG_INFO("Rank {0}/{1} connected to ring", rank, size);
+#endif
+    }
+
+    RingAllReduce(const RingAllReduce &) = delete;
+    RingAllReduce &operator=(const RingAllReduce &) = delete;
+
+    /**
+     * @brief Sum a buffer across all processes. Once done, every process holds the same sums. Every process must call this
+     *        with the same count.
+     *
+     * @param data Buffer to sum, overwritten with the sums
+     * @param count Number of values in the buffer
+     */
+    void all_reduce(float *data, size_t count) {
+        if (size == 1) {
+            return;
+        }
+
+        // chunk c covers [chunk_start(c), chunk_start(c + 1))
+        auto chunk_start = [this, count](int chunk) { return count * chunk / size; };
+
+        receive_buffer.resize(count / size + 1);
+
+        // reduce-scatter
+        for (int step = 0; step < size - 1; step++) {
+            int send_chunk = (rank - step + size) % size;
+            int receive_chunk = (rank - step - 1 + size) % size;
+
+            size_t send_count = chunk_start(send_chunk + 1) - chunk_start(send_chunk);
+            size_t receive_count = chunk_start(receive_chunk + 1) - chunk_start(receive_chunk);
+
+            exchange(data + chunk_start(send_chunk), send_count, receive_buffer.data(), receive_count);
+
+            float *destination = data + chunk_start(receive_chunk);
+            for (size_t x = 0; x < receive_count; x++) {
+                destination[x] += receive_buffer[x];
+            }
+        }
+
+        // all-gather, completed chunks are received straight into the buffer
+        for (int step = 0; step < size - 1; step++) {
+            int send_chunk = (rank - step + 1 + size) % size;
+            int receive_chunk = (rank - step + size) % size;
+
+            size_t send_count = chunk_start(send_chunk + 1) - chunk_start(send_chunk);
+            size_t receive_count = chunk_start(receive_chunk + 1) - chunk_start(receive_chunk);
+
+            exchange(data + chunk_start(send_chunk), send_count, data + chunk_start(receive_chunk), receive_count);
+        }
+    }
+
+    /**
+     * @brief Copy a buffer from rank 0 to every other process.
+     *
+     * @param data Buffer to copy, overwritten with rank 0's values on every other process
+     * @param count Number of values in the buffer
+     */
+    void broadcast(float *data, size_t count) {
+        // summing rank 0's values with zeros from everyone else leaves everyone with rank 0's values
+        if (rank != 0) {
+            fill(data, data + count, 0.0f);
+        }
+
+        all_reduce(data, count);
+    }
+
+    ~RingAllReduce() {
+#ifndef _WIN32
+        if (next_socket >= 0) {
+            close(next_socket);
+        }
+        if (previous_socket >= 0) {
+            close(previous_socket);
+        }
+        if (listen_socket >= 0) {
+            close(listen_socket);
+        }
+        if (!unix_socket_path.empty()) {
+            unlink(unix_socket_path.c_str());
+        }
+#endif
+    }
+
+  private:
+#ifndef _WIN32
+    /**
+     * @brief Send values to the next process while receiving values from the previous process. Both happen at the same
+     *        time, otherwise every process could block sending a chunk too large for the socket buffers while nobody is
+     *        receiving.
+     */
+    void exchange(const float *send, size_t send_count, float *receive, size_t receive_count) {
+        const char *send_bytes = (const char *)send;
+        char *receive_bytes = (char *)receive;
+
+        size_t send_remaining = send_count * sizeof(float);
+        size_t receive_remaining = receive_count * sizeof(float);
+
+        while (send_remaining > 0 || receive_remaining > 0) {
+            pollfd fds[2];
+            int fd_count = 0;
+
+            if (send_remaining > 0) {
+                fds[fd_count++] = {next_socket, POLLOUT, 0};
+            }
+            if (receive_remaining > 0) {
+                fds[fd_count++] = {previous_socket, POLLIN, 0};
+            }
+
+            if (poll(fds, fd_count, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw communication_error(string("poll() failed: ") + strerror(errno));
+            }
+
+            for (int x = 0; x < fd_count; x++) {
+                if (fds[x].revents == 0) {
+                    continue;
+                }
+
+                if (fds[x].fd == next_socket) {
+                    ssize_t sent = send_data(next_socket, send_bytes, send_remaining);
+                    if (sent > 0) {
+                        send_bytes += sent;
+                        send_remaining -= sent;
+                    }
+                } else {
+                    ssize_t received = recv(previous_socket, receive_bytes, receive_remaining, 0);
+                    if (received == 0) {
+                        throw communication_error("Previous process in the ring disconnected");
+                    }
+                    if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                        throw communication_error(string("Receiving from previous process failed: ") + strerror(errno));
+                    }
+                    if (received > 0) {
+                        receive_bytes += received;
+                        receive_remaining -= received;
+                    }
+                }
+            }
+        }
+    }
+
+    ssize_t send_data(int socket, const char *data, size_t length) {
+        ssize_t sent = send(socket, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            throw communication_error(string("Sending to next process failed: ") + strerror(errno));
+        }
+        return sent;
+    }
+
+#else
+    void exchange(const float *, size_t, float *, size_t) {}
+#endif
+};
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+#include "../exceptions.h"
+
+using namespace std;
+
+/**
+ *?                             ==================================================
+ *?                                         🛈 Learning Rate Schedules
+ *?                             ==================================================
+ *
+ * A large step size makes fast progress early in training, but once the network is close to a minimum it keeps
+ * overshooting it. Schedules change the step size as training goes on, usually starting large and ending small:
+ *
+ *  - Step: multiply the step size by `decay` every `decay_epochs` epochs.
+ *  - Cosine: follow half a cosine wave from the full step size down to 0 by the last epoch.
+ *  - One-cycle: ramp up from step size / 25 to the full step size over the first 30% of training, then follow a cosine
+ *    down to almost 0. https://arxiv.org/abs/1708.07120
+ *
+ * Any schedule can be combined with a linear warmup, where the step size grows from 0 over the first few epochs. This
+ * stops the first few batches, with their large gradients, from throwing the weights far away from where they started.
+ */
+
+/**
+ * @brief Step size to use at any point of training
+ */
+class LearningRateSchedule {
+  public:
+    enum Type { Constant, Step, Cosine, OneCycle };
+
+    Type type = Constant;
+
+    /**
+     * @brief Number of epochs over which the step size grows linearly from 0, on top of the schedule. 0 for no warmup.
+     */
+    float warmup_epochs = 0;
+
+    /**
+     * @brief Step schedule multiplies the step size by `decay` every `decay_epochs` epochs
+     */
+    int decay_epochs = 10;
+    float decay = 0.5f;
+
+    /**
+     * @brief Parse a schedule name as given on the command line (constant, step, cosine, onecycle)
+     */
+    static Type parse(const string &name) {
+        if (name == "constant") {
+            return Constant;
+        } else if (name == "step") {
+            return Step;
+        } else if (name == "cosine") {
+            return Cosine;
+        } else if (name == "onecycle") {
+            return OneCycle;
+        }
+
+        throw invalid_argument("Unknown schedule '" + name + "', expected constant, step, cosine or onecycle");
+    }
+
+    /**
+     * @brief Calculate the step size at a point in training
+     *
+     * @param base_step_size Step size the schedule is relative to, the largest step size for every schedule
+     * @param progress Number of epochs trained so far, including the fraction of the current epoch
+     * @param epochs Total number of epochs training is planned for
+     *
+     * @return Step size
+     */
+    float step_size(float base_step_size, float progress, int epochs) const {
+        float fraction = epochs > 0 ? min(progress / epochs, 1.0f) : 0.0f;
+        float rate = base_step_size;
+
+        switch (type) {
+        case Constant:
+            break;
+        case Step:
+            rate *= pow(decay, floor(progress / max(decay_epochs, 1)));
+            break;
+        case Cosine:
+            rate *= 0.5f * (1.0f + cos(M_PI * fraction));
+            break;
+        case OneCycle: {
+            const float peak = 0.3f;
+            const float start = 1.0f / 25.0f;
+            if (fraction < peak) {
+                rate *= start + (1.0f - start) * fraction / peak;
+            } else {
+                rate *= 0.5f * (1.0f + cos(M_PI * (fraction - peak) / (1.0f - peak)));
+            }
+            break;
+        }
+        }
+
+        if (progress < warmup_epochs) {
+            rate *= progress / warmup_epochs;
+        }
+
+        return rate;
+    }
+};
+
+/**
+ *?                             ==================================================
+ *?                                          🛈 Batch Size Schedules
+ *?                             ==================================================
+ *
+ * Small batches make quick progress early in training, when every record's gradient points roughly the same way. Later
+ * on, gradients of individual records disagree more and a small batch's average is mostly noise, so larger batches
+ * (which also split better between threads) make better use of compute. Rather than shrinking the step size, the batch
+ * size can be grown:
+ *
+ *  - Step: multiply the batch size by `growth` every `growth_epochs` epochs.
+ *  - Gradient noise: estimate the "noise scale" of the gradient, the batch size at which averaging over more records
+ *    stops making the gradient noticeably more accurate, and grow the batch size whenever the noise scale is larger.
+ *
+ * The noise scale is B = tr(Σ) / |G|², where G is the true gradient and Σ the covariance of per-record gradients. Both
+ * are estimated from the squared norms of the gradient of a single record (cheap, the weight gradient of one record is
+ * an outer product so its norm is |a|²|e|²) and of a whole batch. https://arxiv.org/abs/1812.06162 (Appendix A)
+ *
+ * When the batch size grows, the step size is scaled up with it: linearly for SGD and momentum, by the square root for
+ * Adam. https://arxiv.org/abs/1711.00489
+ */
+
+/**
+ * @brief Decides the batch size of each epoch
+ */
+class BatchSizeSchedule {
+  public:
+    enum Type { Constant, Step, GradientNoise };
+
+    Type type = Constant;
+
+    /**
+     * @brief Step schedule multiplies the batch size by `growth` every `growth_epochs` epochs. Gradient noise schedule
+     *        grows it by `growth` at most once per epoch.
+     */
+    int growth_epochs = 5;
+    float growth = 2;
+
+    /**
+     * @brief The batch size never grows beyond this
+     */
+    int max_batch_size = 1000;
+
+    /**
+     * @brief Parse a batch size schedule name as given on the command line (constant, step, noise)
+     */
+    static Type parse(const string &name) {
+        if (name == "constant") {
+            return Constant;
+        } else if (name == "step") {
+            return Step;
+        } else if (name == "noise") {
+            return GradientNoise;
+        }
+
+        throw invalid_argument("Unknown batch size schedule '" + name + "', expected constant, step or noise");
+    }
+
+    /**
+     * @brief Record the gradient norms of one batch, used to estimate the gradient noise scale
+     *
+     * @param batch_norm Squared norm of the average gradient of the batch, |G_B|²
+     * @param record_norm Average squared norm of the gradients of single records in the batch, |G_1|²
+     * @param batch_size Number of records in the batch
+     */
+    void add_gradient_norms(double batch_norm, double record_norm, int batch_size) {
+        if (batch_size < 2) {
+            return;
+        }
+
+        // unbiased estimates of |G|² and tr(Σ) from two batch sizes, 1 and B
+        double B = batch_size;
+        gradient_norm_sum += (B * batch_norm - record_norm) / (B - 1);
+        noise_sum += (record_norm - batch_norm) / (1 - 1 / B);
+    }
+
+    /**
+     * @brief Estimated gradient noise scale since the last call to `next_batch_size()`, 0 if there are no estimates
+     */
+    double noise_scale() const { return gradient_norm_sum > 0 ? noise_sum / gradient_norm_sum : 0; }
+
+    /**
+     * @brief Decide the batch size of the next epoch. Resets the gradient noise estimate.
+     *
+     * @param epoch Index of the epoch about to start
+     * @param batch_size Current batch size
+     *
+     * @return Batch size to use for the next epoch
+     */
+    int next_batch_size(int epoch, int batch_size) {
+        int next = batch_size;
+
+        if (type == Step && epoch > 0 && epoch % max(growth_epochs, 1) == 0) {
+            next = (int)round(batch_size * growth);
+        } else if (type == GradientNoise && noise_scale() > batch_size) {
+            next = (int)round(batch_size * growth);
+        }
+
+        gradient_norm_sum = 0;
+        noise_sum = 0;
+
+        return max(batch_size, min(next, max_batch_size));
+    }
+
+    /**
+     * @brief Gradient noise gathered since the last call to `next_batch_size()`, for checkpoints
+     */
+    struct State {
+        double gradient_norm_sum;
+        double noise_sum;
+    };
+
+    State save_state() const { return {gradient_norm_sum, noise_sum}; }
+
+    void restore_state(const State &saved) {
+        gradient_norm_sum = saved.gradient_norm_sum;
+        noise_sum = saved.noise_sum;
+    }
+
+  private:
+    double gradient_norm_sum = 0;
+    double noise_sum = 0;
+};
+
+/**
+ * @brief Decides when training should stop before the planned number of epochs, to save time once more epochs are
+ *        unlikely to help. Every criterion is off by default.
+ */
+class StoppingCriteria {
+  public:
+    /**
+     * @brief Stop as soon as the network is at least this accurate (ex. 0.97). 0 to never stop on accuracy.
+     */
+    float target_accuracy = 0;
+
+    /**
+     * @brief Stop after this many epochs in a row without beating the best accuracy so far by at least `min_delta`. 0 to
+     *        never stop on a plateau.
+     */
+    int patience = 0;
+    float min_delta = 0.001f;
+
+    /**
+     * @brief Stop once training has taken this many seconds. 0 for no time limit.
+     */
+    double time_budget = 0;
+
+    /**
+     * @brief Forget the accuracies seen so far, before training again
+     */
+    void reset() {
+        best_accuracy = -1;
+        epochs_without_improvement = 0;
+    }
+
+    /**
+     * @brief Whether the time budget has been used up
+     *
+     * @param elapsed Seconds spent training so far
+     */
+    bool out_of_time(double elapsed) const { return time_budget > 0 && elapsed >= time_budget; }
+
+    /**
+     * @brief Check every criterion after the network has been tested
+     *
+     * @param accuracy Accuracy of the network (ex. 0.45 is 45% accuracy)
+     * @param elapsed Seconds spent training so far
+     * @param reason Set to a description of the criterion that fired
+     *
+     * @return Whether training should stop
+     */
+    bool should_stop(float accuracy, double elapsed, string &reason) {
+        if (accuracy >= best_accuracy + min_delta || best_accuracy < 0) {
+            best_accuracy = max(accuracy, best_accuracy);
+            epochs_without_improvement = 0;
+        } else {
+            epochs_without_improvement++;
+        }
+
+        if (target_accuracy > 0 && accuracy >= target_accuracy) {
+            reason = "reached target accuracy of " + to_string(target_accuracy * 100.0f) + "%";
+            return true;
+        }
+
+        if (patience > 0 && epochs_without_improvement >= patience) {
+            reason = "no improvement for " + to_string(patience) + " epochs";
+            return true;
+        }
+
+        if (out_of_time(elapsed)) {
+            reason = "used up time budget of " + to_string((int)time_budget) + "s";
+            return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * @brief Accuracies seen so far, for checkpoints
+     */
+    struct State {
+        float best_accuracy;
+        int epochs_without_improvement;
+    };
+
+    State save_state() const { return {best_accuracy, epochs_without_improvement}; }
+
+    void restore_state(const State &saved) {
+        best_accuracy = saved.best_accuracy;
+        epochs_without_improvement = saved.epochs_without_improvement;
+    }
+
+  private:
+    float best_accuracy = -1;
+    int epochs_without_improvement = 0;
+};
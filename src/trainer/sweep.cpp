@@ -0,0 +1,321 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../utils/datetime.cpp"
+#include "../utils/file.cpp"
+#include "../utils/thread_pool.cpp"
+
+#include "../logging.h"
+#include "../network.cpp"
+#include "trainer.cpp"
+#include "training_data.cpp"
+
+using namespace std;
+
+/**
+ * @brief One combination of hyperparameters tried by a sweep
+ */
+struct SweepConfig {
+    float step_size;
+    int batch_size;
+
+    /**
+     * @brief Sizes of the hidden layers, in order. The input and output layers are fixed by the data.
+     */
+    vector<int> hidden_layer_sizes;
+
+    /**
+     * @brief Human readable description, ex. "step 0.005, batch 100, hidden 64:32"
+     */
+    string describe() const {
+        string hidden;
+        for (int x = 0; x < hidden_layer_sizes.size(); x++) {
+            hidden += (x > 0 ? ":" : "") + to_string(hidden_layer_sizes[x]);
+        }
+        return "step " + to_string(step_size) + ", batch " + to_string(batch_size) + ", hidden " + hidden;
+    }
+};
+
+/**
+ *?                             ==================================================
+ *?                                          🛈 Successive Halving
+ *?                             ==================================================
+ *
+ * Rather than training every configuration for the full number of epochs, all configurations are first trained for a
+ * few epochs. Only the most accurate 1/reduction_factor of them are kept and trained for reduction_factor times as many
+ * epochs, and so on until one configuration is left or the maximum number of epochs is reached. Most of the compute ends
+ * up spent on the configurations that look the most promising.
+ *
+ * https://arxiv.org/abs/1502.07943
+ */
+
+/**
+ * @brief Trains many networks with different hyperparameters at the same time, in one process, and finds the most
+ *        accurate one. All trainers read from the same copy of the training and test data in memory.
+ */
+class Sweep {
+  private:
+    /**
+     * @brief A configuration being trained
+     */
+    struct Job {
+        SweepConfig config;
+        unique_ptr<Network> network;
+        unique_ptr<Trainer> trainer;
+
+        int epochs_trained = 0;
+        float accuracy = 0;
+
+        /**
+         * @brief Total time spent training this configuration
+         */
+        double seconds = 0;
+    };
+
+    /**
+     * @brief Data shared by every trainer, must have its training and test data loaded into memory
+     */
+    const TrainingData &data;
+
+    /**
+     * @brief Every configuration to try, a grid or a random sample depending on `random_configs`
+     */
+    vector<SweepConfig> generate_configs() {
+        vector<SweepConfig> configs;
+
+        if (random_configs == 0) {
+            // grid search
+            for (float step_size : step_sizes) {
+                for (int batch_size : batch_sizes) {
+                    for (const vector<int> &hidden : hidden_layers) {
+                        configs.push_back({step_size, batch_size, hidden});
+                    }
+                }
+            }
+        } else {
+            // random search, step sizes are picked on a log scale between the smallest and largest given
+            default_random_engine engine(seed);
+
+            float min_step = *min_element(step_sizes.begin(), step_sizes.end());
+            float max_step = *max_element(step_sizes.begin(), step_sizes.end());
+            uniform_real_distribution<float> log_step(log(min_step), log(max_step));
+            uniform_int_distribution<int> batch_index(0, batch_sizes.size() - 1);
+            uniform_int_distribution<int> hidden_index(0, hidden_layers.size() - 1);
+
+            for (int x = 0; x < random_configs; x++) {
+                float step_size = min_step == max_step ? min_step : exp(log_step(engine));
+                configs.push_back({step_size, batch_sizes[batch_index(engine)], hidden_layers[hidden_index(engine)]});
+            }
+        }
+
+        return configs;
+    }
+
+    Job *create_job(const SweepConfig &config) {
+        Job *job = new Job();
+        job->config = config;
+
+        vector<int> layer_sizes;
+        layer_sizes.push_back(data.input_rows * data.input_columns);
+        layer_sizes.insert(layer_sizes.end(), config.hidden_layer_sizes.begin(), config.hidden_layer_sizes.end());
+        layer_sizes.push_back(output_layer_size);
+
+        // every configuration starts from the same seed so differences come from the hyperparameters
+        job->network.reset(new Network(layer_sizes.data(), layer_sizes.size(), seed));
+        job->network->layers[job->network->layers.size() - 1]->activation_function = Layer::Function::Sigmoid;
+
+        // batch size has to be set before the trainer allocates its buffers
+        job->trainer.reset(new Trainer());
+        job->trainer->training_data.batch_size = config.batch_size;
+        job->trainer->training_data.shuffle = shuffle;
+        job->trainer->training_data.shuffle_engine.seed(seed);
+        job->trainer->training_data.share_data_with(data);
+        job->trainer->setNetwork(*job->network);
+        job->trainer->set_optimizer(optimizer);
+        job->trainer->step_size = config.step_size;
+
+        return job;
+    }
+
+  public:
+    vector<float> step_sizes = {0.005f};
+    vector<int> batch_sizes = {100};
+    vector<vector<int>> hidden_layers = {{40}};
+
+    /**
+     * @brief Number of configurations to pick at random from the ranges given. 0 tries every combination (grid search).
+     */
+    int random_configs = 0;
+
+    /**
+     * @brief Epochs every configuration is trained for in the first round
+     */
+    int min_epochs = 1;
+
+    /**
+     * @brief No configuration is trained for more epochs than this
+     */
+    int max_epochs = 16;
+
+    /**
+     * @brief After every round only the best 1/reduction_factor configurations are kept, and the survivors are trained
+     *        for reduction_factor times as many epochs in total
+     */
+    int reduction_factor = 2;
+
+    /**
+     * @brief Number of configurations trained at the same time
+     */
+    int jobs = 1;
+
+    unsigned int seed = 0;
+    bool shuffle = false;
+    Optimizer::Type optimizer = Optimizer::SGD;
+    int output_layer_size = 10;
+
+    /**
+     * @brief Folder the results csv file is written to
+     */
+    string training_logs_output_folder = "./log";
+
+    /**
+     * @brief Create a new sweep
+     *
+     * @param data Training and test data shared by every configuration. Both must already be loaded into memory.
+     */
+    Sweep(const TrainingData &data) : data(data) {}
+
+    /**
+     * @brief Run the sweep, logging the results of every round and writing them to a csv file.
+     *
+     * @return The most accurate configuration
+     */
+    SweepConfig run() {
+        if (step_sizes.empty() || batch_sizes.empty() || hidden_layers.empty()) {
+            throw invalid_argument("Sweep needs at least one step size, batch size and set of hidden layers");
+        }
+        if (min_epochs < 1 || max_epochs < min_epochs || reduction_factor < 2) {
+            throw invalid_argument("Sweep needs 1 <= min epochs <= max epochs and a reduction factor of at least 2");
+        }
+
+        vector<SweepConfig> configs = generate_configs();
+
+        SPDLOG_INFO("Sweeping {0} configurations on {1} threads, {2} to {3} epochs each", configs.size(), jobs,
+                    min_epochs, max_epochs);
+
+        vector<unique_ptr<Job>> all_jobs;
+        for (const SweepConfig &config : configs) {
+            all_jobs.emplace_back(create_job(config));
+        }
+
+        vector<Job *> survivors;
+        for (auto &job : all_jobs) {
+            survivors.push_back(job.get());
+        }
+
+        filesystem::path dest(training_logs_output_folder);
+        dest.append("sweep_" + get_current_datetime() + ".csv");
+        string filename = get_unique_filename(dest.string());
+
+        ofstream writer(filename, ios_base::trunc);
+        writer << "# Sweep Results" << endl;
+        writer << "# Training Data File: " << data.training_data_path << endl;
+        writer << "# Seed: " << seed << endl;
+        writer << endl;
+        writer << "round,step_size,batch_size,hidden_layers,epochs,seconds,accuracy,kept" << endl;
+
+        ThreadPool pool(jobs);
+
+        int target_epochs = min_epochs;
+
+        for (int round = 0;; round++) {
+            // start the biggest networks first so a big one doesn't hold everyone up at the end of the round
+            sort(survivors.begin(), survivors.end(), [](Job *a, Job *b) {
+                return parameter_count(*a->network) > parameter_count(*b->network);
+            });
+
+            pool.parallel_for(survivors.size(), [&survivors, target_epochs](int x) {
+                Job *job = survivors[x];
+
+                auto t_start = chrono::high_resolution_clock::now();
+
+                for (; job->epochs_trained < target_epochs; job->epochs_trained++) {
+                    job->trainer->train_epoch();
+                }
+
+                job->accuracy = job->trainer->test_network();
+
+                auto t_end = chrono::high_resolution_clock::now();
+                job->seconds += chrono::duration<double>(t_end - t_start).count();
+            });
+
+            stable_sort(survivors.begin(), survivors.end(), [](Job *a, Job *b) { return a->accuracy > b->accuracy; });
+
+            bool last_round = survivors.size() == 1 || target_epochs >= max_epochs;
+            int kept = last_round ? 1 : (survivors.size() + reduction_factor - 1) / reduction_factor;
+
+            SPDLOG_INFO("Round {0}: {1} configurations after {2} epochs", round, survivors.size(), target_epochs);
+
+            for (int x = 0; x < survivors.size(); x++) {
+                Job *job = survivors[x];
+
+                SPDLOG_INFO("  {0} {1}: {2}% ({3:.1f}s)", x < kept ? "+" : "-", job->config.describe(),
+                            job->accuracy * 100.0f, job->seconds);
+
+                string hidden;
+                for (int y = 0; y < job->config.hidden_layer_sizes.size(); y++) {
+                    hidden += (y > 0 ? ":" : "") + to_string(job->config.hidden_layer_sizes[y]);
+                }
+
+                writer << round << "," << job->config.step_size << "," << job->config.batch_size << "," << hidden << ","
+                       << job->epochs_trained << "," << job->seconds << "," << job->accuracy << "," << (x < kept)
+                       << endl;
+            }
+
+            if (last_round) {
+                break;
+            }
+
+            // throw away the worst configurations, their networks are no longer needed
+            for (int x = kept; x < survivors.size(); x++) {
+                survivors[x]->trainer.reset();
+                survivors[x]->network.reset();
+            }
+            survivors.resize(kept);
+
+            target_epochs = min(target_epochs * reduction_factor, max_epochs);
+        }
+
+        if (writer.good()) {
+            SPDLOG_INFO("Wrote sweep results to " + filename);
+        } else {
+            SPDLOG_WARN("Unable to write sweep results, are you sure the target folder (" + training_logs_output_folder +
+                        ") exists?");
+        }
+
+        SPDLOG_INFO("Best configuration: {0} with {1}% accuracy", survivors[0]->config.describe(),
+                    survivors[0]->accuracy * 100.0f);
+
+        return survivors[0]->config;
+    }
+
+    /**
+     * @brief Number of weights and biases in a network, used to estimate how long it takes to train
+     */
+    static long parameter_count(const Network &network) {
+        long count = 0;
+        for (int l = 1; l < network.layers.size(); l++) {
+            count += (long)(network.layers[l]->previous_layer_size + 1) * network.layers[l]->size;
+        }
+        return count;
+    }
+};
@@ -1,9 +1,15 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
 
 // for generating current datetime
 #include "../utils/datetime.cpp"
@@ -11,6 +17,20 @@
 // for generating name of log file
 #include "../utils/file.cpp"
 
+#include "../utils/allocation_tracker.cpp"
+#include "../utils/arena.cpp"
+#include "../utils/function_ref.cpp"
+#include "../utils/numa.cpp"
+#include "../utils/thread_pool.cpp"
+
+#include "async_evaluator.cpp"
+#include "checkpoint.cpp"
+#include "factorization.cpp"
+#include "lbfgs.cpp"
+#include "optimizer.cpp"
+#include "pruning.cpp"
+#include "ring_all_reduce.cpp"
+#include "schedule.cpp"
 #include "training_data.cpp"
 
 #include "../config.h"
@@ -28,7 +48,8 @@ class Trainer {
     // We don't want to reallocate this memory for every record trained, we do it once.
 
     /**
-     * @brief 3-D array storing activation of each layer in network in every training batch.
+     * @brief 3-D array storing activation of each layer in network in every training batch. Carved out of
+     *        `batch_arena`, like `error`.
      */
     float ***activations = NULL;
 
@@ -39,6 +60,12 @@ class Trainer {
      */
     float ***error = NULL;
 
+    /**
+     * @brief For every record in a training batch, in · U followed by V · error of each low-rank layer (2 × its rank
+     *        values, see `Layer::propagate_backpropagate()`), NULL for the other layers. Carved out of `batch_arena`.
+     */
+    float ***factored = NULL;
+
     /**
      * @brief 3D array containing the cost gradients of each weight in each layer (expect for input, which has no weights or
      *        biases). The first dimension represents the layer, the second dimension represents a neuron in the layer, and
@@ -48,6 +75,58 @@ class Trainer {
      */
     float ***weight_gradient = NULL;
 
+    /**
+     * @brief 2D array containing the sum of the error of every record in a batch, for each layer except the input layer.
+     *        Because the bias gradient is just equal to the error, this is the bias gradient of the batch.
+     */
+    float **bias_gradient = NULL;
+
+    /**
+     * @brief Rows of the weight gradient handed to a thread at a time, one row is too little work to be worth handing out
+     */
+    static const int gradient_rows_per_task = 16;
+
+    /**
+     * @brief When gradients are fused, a tile of `gradient_rows_per_task` rows for each thread to calculate the weight
+     *        gradient in, before it's applied. Carved out of `gradient_arena`.
+     */
+    float **gradient_tiles = NULL;
+
+    /**
+     * @brief Where each layer's update in the current batch is written, from `Layer::begin_update()`. Carved out of
+     *        `gradient_arena`.
+     */
+    float **update_targets = NULL;
+
+    /**
+     * @brief Rows of U's gradient calculated by each task, see `calculate_factor_gradient()`
+     */
+    static const int FACTOR_ROWS_PER_TASK = 64;
+
+    /**
+     * @brief Holds `activations` and `error`: the tables of pointers to each record and layer, and the arrays they point
+     *        to. Every record's activations and errors sit next to each other.
+     */
+    Arena batch_arena{"trainer batch scratch"};
+
+    /**
+     * @brief Holds the tables of pointers that make up `weight_gradient` and `bias_gradient`, and `gradient_tiles`
+     */
+    Arena gradient_arena{"trainer gradient tables"};
+
+    /**
+     * @brief Weight and bias gradients of every layer in one contiguous buffer, `weight_gradient` and `bias_gradient`
+     *        point into it. Each layer's gradients are laid out the same way as `Layer::parameters` (weights followed by
+     *        biases), so the optimizer can update a whole layer in one pass, and the gradients of every layer can be
+     *        summed across processes in one go during distributed training.
+     */
+    vector<float> gradient_buffer;
+
+    /**
+     * @brief Index in `gradient_buffer` where the gradients of each layer start (index 0, the input layer, is unused)
+     */
+    vector<size_t> gradient_offsets;
+
     /**
      * @brief Store a copy of network layer sizes here incase the original network object is deleted.
      *        this is to make sure we can still delete allocated memory to prevent leaks.
@@ -59,354 +138,2680 @@ class Trainer {
      */
     string log_file;
 
-  public:
-    float step_size = 0.005f;
+    /**
+     * @brief Threads used for training batches, NULL when training on a single thread.
+     */
+    ThreadPool *thread_pool = NULL;
 
     /**
-     * @brief As the network is trained, its accuracy is written to a log file. This variable defines the folder that
-     * contains the log file.
+     * @brief Whether threads and memory are placed on NUMA nodes, see `set_numa()`
+     */
+    bool numa = false;
+    NumaTopology numa_topology;
+
+    /**
+     * @brief CPUs the calling thread (training thread 0) was allowed to run on before `pin_threads()` pinned it to one
+     */
+    cpu_set_t unpinned_affinity;
+    bool calling_thread_pinned = false;
+
+    /**
+     * @brief Read bandwidth between nodes measured by `set_numa()` in GB/s, `[reader][owner]`
+     */
+    vector<vector<double>> node_bandwidth;
+
+    /**
+     * @brief Number of records `activations` and `error` have room for
+     */
+    int allocated_batch_size = 0;
+
+    /**
+     * @brief Bytes of an arena taken up by one record's activations and errors, see `allocate_record_scratch()`
+     */
+    size_t record_scratch_bytes() const {
+        size_t bytes = Arena::bytes_for<float *>(layer_sizes.size()) + Arena::bytes_for<float *>(layer_sizes.size() - 1);
+        for (int x = 0; x < layer_sizes.size(); x++) {
+            bytes += Arena::bytes_for<float>(layer_sizes[x]);
+        }
+        for (int x = 1; x < layer_sizes.size(); x++) {
+            bytes += Arena::bytes_for<float>(layer_sizes[x]);
+        }
+        return bytes;
+    }
+
+    /**
+     * @brief Carve the activations of every layer and the errors of every layer but the input out of an arena, for one
+     *        record
+     */
+    void allocate_record_scratch(Arena &arena, float **&record_activations, float **&record_error) {
+        allocate_record_tables(arena, record_activations, record_error);
+        allocate_record_arrays(arena, record_activations, record_error);
+    }
+
+    /**
+     * @brief Carve the tables pointing to each layer's activations and errors of one record out of an arena
+     */
+    void allocate_record_tables(Arena &arena, float **&record_activations, float **&record_error) {
+        record_activations = arena.allocate<float *>(layer_sizes.size());
+        record_error = arena.allocate<float *>(layer_sizes.size() - 1);
+    }
+
+    /**
+     * @brief Carve the activation and error arrays of one record out of an arena, next to each other
+     */
+    void allocate_record_arrays(Arena &arena, float **record_activations, float **record_error) {
+        for (int x = 0; x < layer_sizes.size(); x++) {
+            record_activations[x] = arena.allocate<float>(layer_sizes[x]);
+        }
+        for (int x = 0; x < layer_sizes.size() - 1; x++) {
+            record_error[x] = arena.allocate<float>(layer_sizes[x + 1]);
+        }
+    }
+
+    /**
+     * @brief Bytes of an arena taken up by one record's factored activations and errors, see `factored`
+     */
+    size_t record_factored_bytes() const {
+        size_t bytes = Arena::bytes_for<float *>(layer_sizes.size() - 1);
+        for (int l = 1; l < layer_sizes.size(); l++) {
+            bytes += Arena::bytes_for<float>(2 * network->layers[l]->rank);
+        }
+        return bytes;
+    }
+
+    /**
+     * @brief Allocate `activations`, `error` and `factored` for the current batch size and ranks, replacing any old
+     *        ones. Every table of pointers comes first, so that with NUMA placement the arrays of each record are only
+     *        ever written by the thread that propagates the record, see `parallel_records()`.
+     */
+    void allocate_batch_buffers() {
+        allocated_batch_size = training_data.batch_size;
+
+        batch_arena.reserve(3 * Arena::bytes_for<float **>(allocated_batch_size) +
+                            allocated_batch_size * (record_scratch_bytes() + record_factored_bytes()));
+
+        activations = batch_arena.allocate<float **>(allocated_batch_size);
+        error = batch_arena.allocate<float **>(allocated_batch_size);
+        factored = batch_arena.allocate<float **>(allocated_batch_size);
+        for (int b = 0; b < allocated_batch_size; b++) {
+            allocate_record_tables(batch_arena, activations[b], error[b]);
+            factored[b] = batch_arena.allocate<float *>(layer_sizes.size() - 1);
+        }
+        for (int b = 0; b < allocated_batch_size; b++) {
+            allocate_record_arrays(batch_arena, activations[b], error[b]);
+
+            for (int l = 1; l < layer_sizes.size(); l++) {
+                const int rank = network->layers[l]->rank;
+                factored[b][l - 1] = rank > 0 ? batch_arena.allocate<float>(2 * rank) : NULL;
+            }
+        }
+
+        if (numa) {
+            // first touch, places each record's arrays on the node of the thread that will propagate it
+            parallel_records(allocated_batch_size, [this](int b) {
+                for (int x = 0; x < layer_sizes.size(); x++) {
+                    fill(activations[b][x], activations[b][x] + layer_sizes[x], 0.0f);
+                }
+                for (int x = 0; x < layer_sizes.size() - 1; x++) {
+                    fill(error[b][x], error[b][x] + layer_sizes[x + 1], 0.0f);
+                    if (factored[b][x] != NULL) {
+                        fill(factored[b][x], factored[b][x] + 2 * network->layers[x + 1]->rank, 0.0f);
+                    }
+                }
+            });
+        }
+
+        record_gradient_norms.resize(allocated_batch_size);
+        batch_warmed_up = false;
+    }
+
+    void free_batch_buffers() {
+        batch_arena.release();
+        activations = NULL;
+        error = NULL;
+        factored = NULL;
+        allocated_batch_size = 0;
+    }
+
+    /**
+     * @brief Whether a batch has been trained since buffers were last allocated, later batches shouldn't allocate
+     *        anything, see `AllocationTracker`
+     */
+    bool batch_warmed_up = false;
+
+    /**
+     * @brief Activations of every layer for each thread testing the network, carved out of `test_arena`. There's one
+     *        per training thread, and one more for `test_network(const Network &)` which is called from the asynchronous
+     *        evaluator's thread.
+     */
+    float ***test_activations = NULL;
+
+    /**
+     * @brief Correct guesses counted by each training thread when testing on NUMA nodes
+     */
+    int *test_correct_guesses = NULL;
+
+    Arena test_arena{"trainer test scratch"};
+
+    /**
+     * @brief With NUMA placement on more than one node, a copy of the network on each node, tested by the training
+     *        threads on that node. Empty otherwise.
+     */
+    vector<Network *> node_replicas;
+
+    /**
+     * @brief Whether the network has been tested since `test_activations` was allocated
+     */
+    atomic<bool> test_warmed_up{false};
+
+    /**
+     * @brief Allocate everything testing needs up front: activations for each thread testing, and with NUMA placement
+     *        the copy of the network on each node, each made by a thread on its node.
+     */
+    void allocate_test_buffers() {
+        const int slots = thread_count() + 1;
+
+        size_t slot_bytes = Arena::bytes_for<float *>(layer_sizes.size());
+        for (int x = 0; x < layer_sizes.size(); x++) {
+            slot_bytes += Arena::bytes_for<float>(layer_sizes[x]);
+        }
+        test_arena.reserve(Arena::bytes_for<float **>(slots) + Arena::bytes_for<int>(slots) + slots * slot_bytes);
+
+        test_activations = test_arena.allocate<float **>(slots);
+        test_correct_guesses = test_arena.allocate<int>(slots);
+        for (int t = 0; t < slots; t++) {
+            test_activations[t] = test_arena.allocate<float *>(layer_sizes.size());
+            for (int x = 0; x < layer_sizes.size(); x++) {
+                test_activations[t][x] = test_arena.allocate<float>(layer_sizes[x]);
+            }
+        }
+
+        free_node_replicas();
+
+        if (numa && numa_topology.size() > 1 && thread_pool != NULL) {
+            node_replicas.assign(numa_topology.size(), NULL);
+            for (int n = 0; n < numa_topology.size(); n++) {
+                numa_topology.run_on_node(n, [this, n] { node_replicas[n] = new Network(*network); });
+            }
+
+            // first touch, each thread's activations on its own node
+            thread_pool->run_on_each_thread([this](int t) {
+                for (int x = 0; x < layer_sizes.size(); x++) {
+                    fill(test_activations[t][x], test_activations[t][x] + layer_sizes[x], 0.0f);
+                }
+            });
+        }
+
+        test_warmed_up = false;
+    }
+
+    void free_node_replicas() {
+        for (Network *replica : node_replicas) {
+            delete replica;
+        }
+        node_replicas.clear();
+    }
+
+    /**
+     * @brief Squared norm of the gradient of each record in the batch, and of each task's rows of the weight gradient.
+     *        Only calculated for the gradient noise batch size schedule.
+     */
+    vector<double> record_gradient_norms;
+    vector<double> task_gradient_norms;
+
+    /**
+     * @brief Step size is multiplied by this, to keep up with batch size growth
+     */
+    float batch_step_scale = 1;
+
+    /**
+     * @brief Batch size at the start of `train()`, the step size is scaled relative to it
+     */
+    int initial_batch_size = 0;
+
+    /**
+     * @brief Epochs trained with the same batch size, logged when the batch size changes
+     */
+    struct Phase {
+        int index;
+        int batch_size;
+        int first_epoch;
+        int epochs;
+        double seconds;
+    } phase = {0, 0, 0, 0, 0};
+
+    /**
+     * @brief Most recent test accuracy, -1 if not tested yet. Set from the evaluator thread with asynchronous evaluation.
+     */
+    atomic<float> last_accuracy{-1};
+
+    /**
+     * @brief Log the throughput and accuracy of the current phase
+     */
+    void log_phase() {
+        if (phase.epochs == 0) {
+            return;
+        }
+
+        double records_per_second = (double)training_data.training_data_items_count * phase.epochs / phase.seconds;
+        float accuracy = last_accuracy;
+
+        SPDLOG_INFO("Phase {0}: epochs {1}-{2}, batch size {3}, {4:.0f} records/s, accuracy {5}", phase.index,
+                    phase.first_epoch, phase.first_epoch + phase.epochs - 1, phase.batch_size, records_per_second,
+                    accuracy < 0 ? "unknown" : to_string(accuracy * 100.0f) + "%");
+    }
+
+    /**
+     * @brief Ask the batch size schedule for the batch size of the next epoch, and switch to it if it changed. The step
+     *        size is scaled along with the batch size, linearly for SGD and momentum, by the square root for Adam.
      *
-     * Default is './log'
+     * @param epoch Index of the epoch about to be trained
      */
-    string training_logs_output_folder = "./log";
+    void update_batch_size(int epoch) {
+        if (batch_schedule.type == BatchSizeSchedule::Constant) {
+            return;
+        }
 
-    void setNetwork(Network &network) {
-        this->network = &network;
+        double noise_scale = batch_schedule.noise_scale();
+        int next = batch_schedule.next_batch_size(epoch, training_data.batch_size);
 
-        // initialize the activations, error, and weight_gradient array:
+        if (communicator != NULL) {
+            // every process must use the same batch size, go with rank 0's decision
+            float value = next;
+            communicator->broadcast(&value, 1);
+            next = (int)value;
+        }
+
+        if (next == training_data.batch_size) {
+            return;
+        }
+
+        log_phase();
+
+        if (batch_schedule.type == BatchSizeSchedule::GradientNoise) {
+            SPDLOG_INFO("Growing batch size from {0} to {1} (gradient noise scale {2:.0f})", training_data.batch_size,
+                        next, noise_scale);
+        } else {
+            SPDLOG_INFO("Growing batch size from {0} to {1}", training_data.batch_size, next);
+        }
+
+        set_batch_size(next);
+
+        float ratio = next / (float)initial_batch_size;
+        bool adaptive = optimizer.type == Optimizer::Adam || optimizer.type == Optimizer::AdamW;
+        batch_step_scale = adaptive ? sqrt(ratio) : ratio;
+
+        phase = {phase.index + 1, next, epoch, 0, 0};
+    }
+
+    /**
+     * @brief Whether weight gradients are applied tile by tile, see `set_fused_gradients()`
+     */
+    bool fused_gradients = false;
+
+    /**
+     * @brief State of the L-BFGS optimizer, created on the first step. Kept between epochs along with the current
+     *        parameters, full-batch gradient and loss, so each epoch only needs the evaluations done by its line search.
+     */
+    LBFGS *lbfgs = NULL;
+    vector<float> lbfgs_parameters, lbfgs_gradient, lbfgs_candidate, lbfgs_candidate_gradient, lbfgs_direction;
+    double lbfgs_loss = 0;
+
+    /**
+     * @brief Loss of each record in a chunk while calculating the full-batch gradient
+     */
+    vector<double> record_losses;
+
+    /**
+     * @brief (Re)allocate `gradient_buffer` and point `weight_gradient` and `bias_gradient` into it. When gradients are
+     *        fused, only the biases get a gradient buffer and `weight_gradient` is left empty. The gradient of a low-rank
+     *        layer's factors is stored where its weight gradient would be, see `calculate_factor_gradient()`.
+     */
+    void allocate_gradients() {
+        gradient_offsets.assign(layer_sizes.size(), 0);
+        size_t gradient_count = 0;
+        for (int l = 1; l < layer_sizes.size(); l++) {
+            gradient_offsets[l] = gradient_count;
+            gradient_count += fused_gradients ? layer_sizes[l] : network->layers[l]->parameter_count();
+        }
+
+        gradient_buffer.assign(gradient_count, 0.0f);
+        gradient_buffer.shrink_to_fit();
+
+        size_t table_bytes = 2 * Arena::bytes_for<float *>(layer_sizes.size() - 1) +
+                             Arena::bytes_for<float *>(layer_sizes.size());
+        for (int l = 1; l < layer_sizes.size() && !fused_gradients; l++) {
+            table_bytes += Arena::bytes_for<float *>(gradient_rows(l));
+        }
+
+        int widest_layer = *max_element(layer_sizes.begin() + 1, layer_sizes.end());
+        if (fused_gradients) {
+            table_bytes += Arena::bytes_for<float *>(thread_count()) +
+                           thread_count() * Arena::bytes_for<float>((size_t)gradient_rows_per_task * widest_layer);
+        }
+        gradient_arena.reserve(table_bytes);
+
+        weight_gradient = gradient_arena.allocate<float **>(layer_sizes.size() - 1);
+        bias_gradient = gradient_arena.allocate<float *>(layer_sizes.size() - 1);
+        update_targets = gradient_arena.allocate<float *>(layer_sizes.size());
+
+        for (int l = 1; l < layer_sizes.size(); l++) {
+            float *layer_gradient = gradient_buffer.data() + gradient_offsets[l];
+
+            weight_gradient[l - 1] = NULL;
+
+            if (fused_gradients) {
+                bias_gradient[l - 1] = layer_gradient;
+                continue;
+            }
+
+            // the kernels of a convolution are one flat gradient, see `calculate_convolution_gradient()`
+            weight_gradient[l - 1] = gradient_arena.allocate<float *>(gradient_rows(l));
+            for (int x = 0; x < gradient_rows(l); x++) {
+                weight_gradient[l - 1][x] = layer_gradient + (size_t)x * layer_sizes[l];
+            }
+
+            bias_gradient[l - 1] = layer_gradient + network->layers[l]->weight_count();
+        }
+
+        gradient_tiles = NULL;
+        if (fused_gradients) {
+            gradient_tiles = gradient_arena.allocate<float *>(thread_count());
+            for (int t = 0; t < thread_count(); t++) {
+                gradient_tiles[t] = gradient_arena.allocate<float>((size_t)gradient_rows_per_task * widest_layer);
+            }
+        }
+
+        batch_warmed_up = false;
+    }
+
+    /**
+     * @brief Number of epochs `train()` was asked to train for, and how many of them have been trained so far. Used by
+     *        the learning rate schedule.
+     */
+    int planned_epochs = 0;
+    int epochs_completed = 0;
+
+    /**
+     * @brief When the current call to `train()` started, for the time budget
+     */
+    chrono::steady_clock::time_point training_start;
+
+    /**
+     * @brief Set from the background thread when asynchronous evaluation finds a stopping criterion has fired, along
+     *        with the reason why
+     */
+    atomic<bool> stop_requested{false};
+    string stop_reason;
+
+    /**
+     * @brief Held while the stopping criteria are checked or saved, with asynchronous evaluation they're checked on the
+     *        evaluator's thread
+     */
+    mutex stopping_mutex;
+
+    /**
+     * @brief Batches of the current epoch trained so far. An epoch resumed from a checkpoint starts partway.
+     */
+    int epoch_batches = 0;
+
+    /**
+     * @brief Writes checkpoints during `train()` when `checkpoint_path` is set, NULL otherwise
+     */
+    CheckpointWriter *checkpoint_writer = NULL;
+
+    /**
+     * @brief Set by `resume()`, the next call to `train()` carries on from the checkpoint's epoch and time spent rather
+     *        than starting over
+     */
+    bool resuming = false;
+    int resumed_epoch = 0;
+    int resumed_planned_epochs = 0;
+    double resumed_seconds = 0;
+
+    /**
+     * @brief Seconds since the current call to `train()` started
+     */
+    double training_seconds() const {
+        return chrono::duration<double>(chrono::steady_clock::now() - training_start).count();
+    }
+
+    /**
+     * @brief What pruning did at each sparsity level, for the report at the end of `train()`
+     */
+    struct PruningLevel {
+        int epoch;
+        float sparsity;
 
         /**
-         * TODO: Fix this pointer hell. One idea is to collapse 2-D & 3-D arrays into a single 1-D array
-         *       this should also be slightly faster
-         *       https://stackoverflow.com/questions/17259877/1d-or-2d-array-whats-faster
+         * @brief Accuracy right after pruning, and after fine-tuning until the next round or the end of training
          */
+        float pruned_accuracy, tuned_accuracy;
 
-        for (int l = 0; l < network.layers.size(); l++) {
-            layer_sizes.push_back(network.layers[l]->size);
+        InferenceSpeed dense, sparse;
+    };
+
+    vector<PruningLevel> pruning_levels;
+
+    /**
+     * @brief Test images the speed of inference is measured on after every pruning round, one after another
+     */
+    vector<float> benchmark_images;
+    int benchmark_count = 0;
+
+    /**
+     * @brief Copy the first test images into `benchmark_images`, unless they're already there
+     */
+    void load_benchmark_images() {
+        if (!benchmark_images.empty()) {
+            return;
+        }
+
+        const int values = layer_sizes[0];
+        benchmark_count = min(training_data.test_data_items_count, 1000);
+        benchmark_images.resize((size_t)benchmark_count * values);
+        for (int x = 0; x < benchmark_count; x++) {
+            copy(training_data.test_data_buffer[x], training_data.test_data_buffer[x] + values,
+                 benchmark_images.data() + (size_t)x * values);
+        }
+    }
+
+    /**
+     * @brief Prune every layer to its sparsity for a round, then measure the accuracy and how fast the pruned network
+     *        classifies with and without the block sparse kernel
+     *
+     * @param round Pruning round, 1 to `pruning.rounds`
+     * @param epoch Epoch the round is at
+     * @param report Whether to test and measure the network, only one process needs to when training is distributed
+     */
+    void prune_network(int round, int epoch, bool report) {
+        if (!pruning_levels.empty()) {
+            pruning_levels.back().tuned_accuracy = last_accuracy;
+        }
+
+        long pruned = 0, total = 0;
+        for (int l = 1; l < network->layers.size(); l++) {
+            Layer *layer = network->layers[l];
+            layer->prune(pruning.sparsity_at(l, round));
+
+            pruned += layer->pruned_weight_count();
+            total += layer->weight_count();
+        }
+
+        if (!report) {
+            return;
+        }
+
+        PruningLevel level;
+        level.epoch = epoch;
+        level.sparsity = pruned / (double)total;
+        level.pruned_accuracy = test_network();
+        level.tuned_accuracy = -1;
+
+        load_benchmark_images();
+        level.dense = InferenceSpeed::measure(*network, benchmark_images, benchmark_count, false);
+        level.sparse = InferenceSpeed::measure(*network, benchmark_images, benchmark_count, true);
+        pruning_levels.push_back(level);
+
+        string layers;
+        for (int l = 1; l < network->layers.size(); l++) {
+            layers += (l > 1 ? ", " : "") + to_string((int)lround(network->layers[l]->sparsity() * 100)) + "%";
+        }
+
+        SPDLOG_INFO("Pruning round {0} of {1}: {2:.1f}% of weights pruned (blocks pruned per layer: {3}), accuracy {4:.2f}% "
+                    "before fine-tuning",
+                    round, pruning.rounds, level.sparsity * 100, layers, level.pruned_accuracy * 100);
+        SPDLOG_INFO("Single image {0:.2f} µs dense, {1:.2f} µs with {2} block sparse layers ({3}), batches {4:.0f} "
+                    "images/s dense, {5:.0f} images/s with {6} block sparse layers ({7})",
+                    level.dense.single_us, level.sparse.single_us, level.sparse.single_sparse_layers,
+                    sparse_speedup(level.dense.single_us / level.sparse.single_us, level.sparse.single_sparse_layers),
+                    level.dense.batch_images_per_s, level.sparse.batch_images_per_s, level.sparse.batch_sparse_layers,
+                    sparse_speedup(level.sparse.batch_images_per_s / level.dense.batch_images_per_s,
+                                   level.sparse.batch_sparse_layers));
+    }
+
+    /**
+     * @brief Speedup of the block sparse kernel over the dense weights for the pruning logs, "dense" when no layer had
+     *        few enough blocks left to use it and both timings are of the same dense weights
+     */
+    static string sparse_speedup(double speedup, int sparse_layers) {
+        return sparse_layers > 0 ? fmt::format("{0:.2f}x", speedup) : "dense";
+    }
+
+    /**
+     * @brief Log the accuracy and speedup of every sparsity level pruned to
+     */
+    void log_pruning_report() {
+        if (pruning_levels.empty()) {
+            return;
+        }
+
+        pruning_levels.back().tuned_accuracy = last_accuracy;
+
+        SPDLOG_INFO("Pruning report, speedups are the same kernels with block sparse weights for the layers with few "
+                    "enough blocks left against dense weights for every layer, \"dense\" where no layer had:");
+        SPDLOG_INFO("  epoch  sparsity  pruned acc.  tuned acc.  single image       speedup  batch images/s    speedup");
+        for (const PruningLevel &level : pruning_levels) {
+            SPDLOG_INFO("  {0:5d}  {1:7.1f}%  {2:10.2f}%  {3:9.2f}%  {4:5.2f} -> {5:5.2f} µs  {6:>7}  {7:6.0f} -> {8:6.0f}  "
+                        "{9:>7}",
+                        level.epoch, level.sparsity * 100, level.pruned_accuracy * 100, level.tuned_accuracy * 100,
+                        level.dense.single_us, level.sparse.single_us,
+                        sparse_speedup(level.dense.single_us / level.sparse.single_us, level.sparse.single_sparse_layers),
+                        level.dense.batch_images_per_s, level.sparse.batch_images_per_s,
+                        sparse_speedup(level.sparse.batch_images_per_s / level.dense.batch_images_per_s,
+                                       level.sparse.batch_sparse_layers));
+        }
+    }
+
+    FactorizationReport factorization_report;
+
+    /**
+     * @brief Factor every layer with a rank to it (see 🛈 Low-Rank Layers). Before factoring trained layers, measures
+     *        the dense network and the accuracy of the network factored to a quarter, half, twice and four times the
+     *        ranks as well, all straight from one decomposition of each layer, so the report shows what each rank costs.
+     *
+     * @param epoch Epoch the layers are factored at
+     * @param report Whether to test and measure the network, only one process needs to when training is distributed
+     */
+    void factorize_network(int epoch, bool report) {
+        vector<unique_ptr<SingularValueDecomposition>> decompositions(network->layers.size());
+        for (int l = 1; l < network->layers.size(); l++) {
+            Layer *layer = network->layers[l];
+            if (factorization.ranks[l - 1] > 0) {
+                // a layer that's already factored is decomposed from the product of its factors
+                layer->set_rank(0);
+                decompositions[l] =
+                    make_unique<SingularValueDecomposition>(layer->weights, layer->previous_layer_size, layer->size);
+            }
+        }
+
+        // ranks of every factored layer times a multiplier, as many as the layer can have
+        auto factor_all = [&](double multiplier) {
+            string ranks;
+            for (int l = 1; l < network->layers.size(); l++) {
+                if (decompositions[l] != NULL) {
+                    const Layer *layer = network->layers[l];
+                    int max_rank = SingularValueDecomposition::max_rank(layer->previous_layer_size, layer->size);
+                    int rank = max(1, min(max_rank, (int)lround(factorization.ranks[l - 1] * multiplier)));
+
+                    network->layers[l]->factorize(*decompositions[l], rank);
+                    ranks += (ranks.empty() ? "" : ",") + to_string(rank);
+                }
+            }
+            return ranks;
+        };
+
+        if (report) {
+            load_benchmark_images();
+
+            factorization_report = FactorizationReport();
+            factorization_report.epoch = epoch;
+            factorization_report.dense_cost = NetworkCost::of(*network);
+            factorization_report.dense_accuracy = test_network();
+            factorization_report.dense_speed =
+                InferenceSpeed::measure(*network, benchmark_images, benchmark_count, true);
+
+            // the random initial weights have no accuracy to lose
+            for (double multiplier : {0.25, 0.5, 1.0, 2.0, 4.0}) {
+                if (epoch == 0) {
+                    break;
+                }
+
+                // small layers can run out of ranks to try
+                string ranks = factor_all(multiplier);
+                if (factorization_report.levels.empty() || factorization_report.levels.back().ranks != ranks) {
+                    factorization_report.levels.push_back({ranks, NetworkCost::of(*network), test_network()});
+                }
+            }
+        }
+
+        factor_all(1.0);
+
+        // the factors are new parameters, any optimizer state kept for the layer's weights no longer applies
+        for (int l = 1; l < network->layers.size(); l++) {
+            if (decompositions[l] != NULL) {
+                optimizer.initialize_layer(l, *network->layers[l]);
+                SPDLOG_INFO("Factored layer {0} ({1} x {2}) to rank {3}, keeping {4:.1f}% of its energy", l,
+                            network->layers[l]->previous_layer_size, network->layers[l]->size,
+                            network->layers[l]->rank, decompositions[l]->energy(network->layers[l]->rank) * 100);
+            }
+        }
+        allocate_gradients();
+        allocate_batch_buffers();
+
+        if (!report) {
+            return;
+        }
+
+        factorization_report.factored_cost = NetworkCost::of(*network);
+        factorization_report.factored_accuracy = test_network();
+        factorization_report.factored_speed =
+            InferenceSpeed::measure(*network, benchmark_images, benchmark_count, true);
+
+        if (epoch > 0) {
+            SPDLOG_INFO("Accuracy {0:.2f}% after factoring, {1:.2f}% dense", factorization_report.factored_accuracy * 100,
+                        factorization_report.dense_accuracy * 100);
+        }
+    }
+
+    /**
+     * @brief Whether any layer of the network has low-rank factors, or will have them once it's factored
+     */
+    bool has_low_rank_layers() const {
+        if (factorization.enabled()) {
+            return true;
+        }
+        for (int l = 1; l < network->layers.size(); l++) {
+            if (network->layers[l]->rank > 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+  public:
+    float step_size = 0.005f;
+
+    /**
+     * @brief Optimizer used to update the weights and biases after every batch, see `set_optimizer()`
+     */
+    Optimizer optimizer;
+
+    /**
+     * @brief Changes the step size as training goes on, `step_size` is the step size the schedule is relative to
+     */
+    LearningRateSchedule schedule;
+
+    /**
+     * @brief Criteria for stopping `train()` before all epochs have been trained
+     */
+    StoppingCriteria stopping;
+
+    /**
+     * @brief Changes the batch size between epochs during `train()`
+     */
+    BatchSizeSchedule batch_schedule;
+
+    /**
+     * @brief When to prune the network during `train()`, and how much, see 🛈 Magnitude Pruning
+     */
+    PruningSchedule pruning;
+
+    /**
+     * @brief Which layers to factor during `train()`, to what rank, and when, see 🛈 Low-Rank Layers
+     */
+    FactorizationSchedule factorization;
+
+    /**
+     * @brief As the network is trained, its accuracy is written to a log file. This variable defines the folder that
+     * contains the log file.
+     *
+     * Default is './log'
+     */
+    string training_logs_output_folder = "./log";
+
+    /**
+     * @brief When enabled, the network is not tested at the start of every epoch. Instead a snapshot of its weights and
+     *        biases is handed to a background thread, and training continues immediately. Accuracy is logged once the
+     *        snapshot has been evaluated.
+     */
+    bool async_evaluation = false;
+
+    /**
+     * @brief Number of threads used for Hogwild training. When greater than 0, epochs are trained using
+     *        `train_epoch_hogwild()` rather than in synchronous batches. Requires the training data to be loaded into
+     *        memory using `TrainingData::load_training_data()`.
+     */
+    int hogwild_threads = 0;
+
+    /**
+     * @brief Connection to the other processes when training is distributed across processes, NULL otherwise. Every
+     *        process trains on its own shard of the training data, and the gradients of every batch are summed across
+     *        all processes before the weights are updated, so every process keeps identical weights.
+     */
+    RingAllReduce *communicator = NULL;
+
+    /**
+     * @brief When set, `train()` writes a checkpoint of the whole training state to this file after every epoch, from a
+     *        background thread. See 🛈 Checkpoints and `resume()`.
+     */
+    string checkpoint_path;
+
+    /**
+     * @brief Also write a checkpoint every this many batches within an epoch, 0 for only after every epoch
+     */
+    int checkpoint_interval = 0;
+
+    void setNetwork(Network &network) {
+        this->network = &network;
+
+        // initialize the activations, error, and weight_gradient array:
+
+        for (int l = 0; l < network.layers.size(); l++) {
+            layer_sizes.push_back(network.layers[l]->size);
+        }
+
+        allocate_batch_buffers();
+        allocate_gradients();
+        allocate_test_buffers();
+
+        optimizer.initialize(network);
+    }
+
+    /**
+     * @brief Apply weight gradients as they are calculated rather than storing the gradient of the whole batch first.
+     *        The weight gradient is calculated a tile of rows at a time into a small buffer, and each tile is handed to
+     *        the optimizer right away. This saves a buffer the size of every weight in the network, as well as the
+     *        passes over it to clear it, fill it and read it back. Results are identical to the default mode.
+     *
+     *        Not available for distributed training, where the gradients of every process are summed before they can be
+     *        applied.
+     *
+     * @param fused Whether to apply gradients tile by tile
+     */
+    void set_fused_gradients(bool fused) {
+        fused_gradients = fused;
+
+        if (network != NULL) {
+            allocate_gradients();
+        }
+    }
+
+    /**
+     * @brief Set the optimizer used to update the weights and biases. Any state kept by the previous optimizer (ex.
+     *        momentum) is thrown away.
+     */
+    void set_optimizer(Optimizer::Type type) {
+        optimizer.type = type;
+
+        if (network != NULL) {
+            optimizer.initialize(*network);
+        }
+
+        delete lbfgs;
+        lbfgs = NULL;
+    }
+
+    /**
+     * @brief Set the number of threads used to train each batch. Records in a batch are propagated in parallel and the
+     *        weight gradient is split between threads by rows. Every weight's gradient is always summed over the
+     *        records of the batch in the same order, so results are bit-for-bit identical no matter how many threads are
+     *        used.
+     *
+     * @param threads Number of threads, 1 to train on the calling thread only
+     */
+    void set_threads(int threads) {
+        if (threads < 1) {
+            throw invalid_argument("Number of training threads must be at least 1");
+        }
+
+        delete thread_pool;
+        thread_pool = threads > 1 ? new ThreadPool(threads) : NULL;
+
+        if (numa) {
+            pin_threads();
+        }
+
+        if (network != NULL) {
+            // fused gradient tiles and test scratch are per thread
+            allocate_gradients();
+            allocate_test_buffers();
+        }
+    }
+
+    /**
+     * @brief Place training threads and memory on NUMA nodes:
+     *
+     *         - Training threads are pinned to CPUs, a contiguous block of threads per node.
+     *         - Each thread is the first to touch the activations and errors of the records it propagates, and always
+     *           propagates the same records of every batch.
+     *         - Training data loaded into memory is split into one shard per node, placed on its node. Hogwild threads
+     *           train on their own node's shard first.
+     *         - Testing uses a copy of the network on each node, tested by the training threads on that node.
+     *
+     *        Measures the read bandwidth between every pair of nodes and logs it, it's also written to the log file.
+     *        Should be called after the training data has been loaded into memory.
+     *
+     * @param enabled Whether to place threads and memory on nodes
+     */
+    void set_numa(bool enabled) {
+        numa = enabled;
+        if (!numa) {
+            return;
+        }
+
+        numa_topology = NumaTopology::detect();
+        numa_topology.log();
+
+        node_bandwidth = numa_topology.measure_bandwidth();
+        for (int reader = 0; reader < numa_topology.size(); reader++) {
+            for (int owner = 0; owner < numa_topology.size(); owner++) {
+                SPDLOG_INFO("Node {0} reading memory on node {1}: {2:.1f} GB/s", numa_topology.nodes[reader].id,
+                            numa_topology.nodes[owner].id, node_bandwidth[reader][owner]);
+            }
+        }
+
+        pin_threads();
+
+        if (training_data.training_data_buffer != NULL && !training_data.shares_data) {
+            training_data.place_on_nodes(numa_topology);
+        }
+
+        if (network != NULL) {
+            allocate_batch_buffers();
+            allocate_test_buffers();
+        }
+    }
+
+    /**
+     * @brief Create a new trainer object
+     */
+    Trainer() {}
+
+    /**
+     * @brief Create a new trainer object
+     *
+     * @param network Network trainer is being created for
+     */
+    Trainer(Network &network) { setNetwork(network); }
+
+    /**
+     * @brief Change the number of records in each batch, reallocating every buffer that depends on it. Should only be
+     *        called between epochs, training data is read from the first record again.
+     *
+     * @param batch_size New batch size
+     */
+    void set_batch_size(int batch_size) {
+        training_data.set_batch_size(batch_size);
+
+        if (network != NULL) {
+            allocate_batch_buffers();
+        }
+    }
+
+    ~Trainer() {
+        // finishes writing the checkpoint in progress if training threw
+        delete checkpoint_writer;
+
+        free_batch_buffers();
+        free_node_replicas();
+
+        delete lbfgs;
+
+        delete thread_pool;
+
+        SPDLOG_DEBUG("Deleted trainer");
+    }
+
+    /**
+     * @brief Create the log file that will be written to using `write_to_log_file()`
+     */
+    void create_log_file() {
+        // first we need to generate a name for the file,
+        string filename = "log_";
+        filename += get_current_datetime();
+        filename += ".csv";
+
+        filesystem::path dest(training_logs_output_folder);
+        dest.append(filename);
+
+        filename = get_unique_filename(dest.string());
+
+        SPDLOG_INFO("Writing training stats to " + dest.string());
+
+        ofstream writer(filename, ios_base::trunc);
+
+        if (!writer.good()) {
+            SPDLOG_WARN("Unable to create log file, are you sure the target folder (" + training_logs_output_folder +
+                        ") exists?");
+        }
+
+        log_file = filename;
+
+        // write some initial data to file
+
+        // configuration headers
+        writer << "# Training Log File" << endl;
+        writer << "# ******************************************" << endl;
+        writer << "# Generated On: " << get_current_datetime() << endl;
+        writer << "# Training Data File: " << training_data.training_data_path << endl;
+        writer << "# Training Labels File: " << training_data.training_labels_path << endl;
+        writer << "# Test Data File: " << training_data.test_data_path << endl;
+        writer << "# Test Labels File: " << training_data.test_labels_path << endl;
+        writer << "# Batch Size: " << training_data.batch_size << endl;
+        writer << "# Total batches in training data: " << training_data.total_batch_count << endl;
+        writer << "# Total records in training data " << training_data.training_data_items_count << endl;
+        writer << "# Total records in test data " << training_data.test_data_items_count << endl;
+        for (int reader = 0; reader < node_bandwidth.size(); reader++) {
+            for (int owner = 0; owner < node_bandwidth.size(); owner++) {
+                writer << "# Node " << numa_topology.nodes[reader].id << " reading memory on node "
+                       << numa_topology.nodes[owner].id << ": " << node_bandwidth[reader][owner] << " GB/s" << endl;
+            }
+        }
+
+        writer << endl;
+
+        // write csv headers
+        writer << "epoch,accuracy" << endl;
+    }
+
+    /**
+     * @brief Append to log file. Make sure to call `create_log_file()` before this function.
+     */
+    void write_to_log_file(int epoch, float accuracy) {
+        ofstream writer(log_file, ios_base::app);
+        writer << epoch << "," << accuracy << endl;
+    }
+
+    /**
+     *?                             ==================================================
+     *?                                               🛈 Training Data
+     *?                             ==================================================
+     *
+     * Training data comprises of two files, input and labels stored in binary files.
+     *
+     * Test data is formatted the same as training data and is used for determining how accurate the neural network is on
+     * data not in the training set. If the neural network performs well on training data and unwell on test data, that
+     * could mean we are over fitting the model.
+     *
+     * Check out /training_data/convert_to_csv.py for documentation and some simple code that can help with understanding
+     * the format of the training data.
+     */
+
+    /**
+     * @brief Instance of TrainingData object used for storing and reading from training data files
+     */
+    TrainingData training_data;
+
+    /**
+     * @brief Propagate training data through network and return accuracy
+     *
+     * @return Accuracy (ex, 0.45 is 45% accuracy)
+     */
+    float test_network() {
+
+        // SPDLOG_INFO("Testing neural network on " + to_string(training_data.test_data_items_count) + " test records...");
+
+        if (network == NULL) {
+            throw invalid_function_call("Trainer does not have any network to test on");
+        }
+
+        AllocationTracker::Scope scope(AllocationTracker::Test, !test_warmed_up.exchange(true));
+
+        if (!node_replicas.empty()) {
+            return test_network_on_nodes();
+        }
+
+        return count_correct_guesses(*network, 0, training_data.test_data_items_count, test_activations[0]) /
+               (float)training_data.test_data_items_count;
+    }
+
+    /**
+     * @brief Propagate test data through a network and return accuracy. Only reads the test data, so it is safe to call
+     *        from another thread while training continues, as long as the network given isn't being trained. Only one
+     *        thread may call it at a time.
+     *
+     * @param network Network to test, a snapshot of the trained network, it must have the same layer sizes
+     *
+     * @return Accuracy (ex, 0.45 is 45% accuracy)
+     */
+    float test_network(const Network &network) {
+        if (network.layers.size() != layer_sizes.size()) {
+            throw invalid_argument("Network being tested doesn't have the layers of the network being trained");
+        }
+        for (int l = 0; l < layer_sizes.size(); l++) {
+            if (network.layers[l]->size != layer_sizes[l]) {
+                throw invalid_argument("Network being tested doesn't have the layers of the network being trained");
+            }
+        }
+
+        AllocationTracker::Scope scope(AllocationTracker::Test, !test_warmed_up.exchange(true));
+
+        return count_correct_guesses(network, 0, training_data.test_data_items_count, test_activations[thread_count()]) /
+               (float)training_data.test_data_items_count;
+    }
+
+    /**
+     * @brief Test the network with every training thread testing its own part of the test data, on the copy of the
+     *        network on its NUMA node. The first thread of each node copies the current weights into its node's copy,
+     *        so the weights every thread reads are in local memory.
+     *
+     * @return Accuracy (ex, 0.45 is 45% accuracy)
+     */
+    float test_network_on_nodes() {
+        const int threads = thread_pool->size();
+        const int count = training_data.test_data_items_count;
+
+        thread_pool->run_on_each_thread([this, threads](int t) {
+            int node = numa_topology.node_of_thread(t, threads);
+            if (t > 0 && numa_topology.node_of_thread(t - 1, threads) == node) {
+                return;
+            }
+
+            for (int l = 1; l < layer_sizes.size(); l++) {
+                const Layer *layer = network->layers[l];
+                copy(layer->parameters, layer->parameters + layer->parameter_count(),
+                     node_replicas[node]->layers[l]->parameters);
+            }
+        });
+
+        thread_pool->run_on_each_thread([this, threads, count](int t) {
+            const Network &replica = *node_replicas[numa_topology.node_of_thread(t, threads)];
+            test_correct_guesses[t] = count_correct_guesses(replica, (long)count * t / threads,
+                                                            (long)count * (t + 1) / threads, test_activations[t]);
+        });
+
+        int total = 0;
+        for (int t = 0; t < threads; t++) {
+            total += test_correct_guesses[t];
+        }
+
+        return total / (float)count;
+    }
+
+    /**
+     * @brief Propagate part of the test data through a network and count how many records it classifies correctly
+     *
+     * @param network Network to test
+     * @param first Index of the first test record
+     * @param last One past the index of the last test record
+     * @param activations_per_layer Activations of every layer of the network, from `test_activations`
+     */
+    int count_correct_guesses(const Network &network, int first, int last, float **activations_per_layer) {
+        int correct_guesses = 0; // number of test input that resulted in correct guesses
+
+        // for each test item
+        for (int t = first; t < last; t++) {
+            // first layer activations should be test input,
+            for (int x = 0; x < network.layers[0]->size; x++) {
+                activations_per_layer[0][x] = training_data.test_data_buffer[t][x];
+            }
+
+            // initialize hidden & output layer activations to zero
+            for (int x = 1; x < network.layers.size(); x++) {
+                for (int y = 0; y < network.layers[x]->size; y++) {
+                    activations_per_layer[x][y] = 0;
+                }
+            }
+
+            network.propagate(activations_per_layer);
+
+            // find index of neuron in output layer that has the highest activation,
+            const float *last_layer_activations = activations_per_layer[network.layers.size() - 1];
+
+            int index_of_highest_activation = 0;
+            float highest_activation = last_layer_activations[0];
+
+            // for each neuron in output layer...
+            for (int n = 1; n < network.layers[network.layers.size() - 1]->size; n++) {
+                if (last_layer_activations[n] > highest_activation) {
+                    highest_activation = last_layer_activations[n];
+                    index_of_highest_activation = n;
+                }
+            }
+
+            // if highest index equals test label, this guess was a success
+            if (training_data.test_labels_buffer[t] == index_of_highest_activation) {
+                // correct guess
+                correct_guesses++;
+            }
+        }
+
+        return correct_guesses;
+    }
+
+    /**
+     * @brief Train neural network for some number of epochs while writing accuracy to a log file. The network is tested
+     *        before the first epoch and after every epoch, training stops early as soon as one of the `stopping` criteria
+     *        fires.
+     *
+     * @param epochs Number of epochs to train for
+     * @param log_accuracy Whether or not to create and write to a log file the accuracy of the network as epochs are trained
+     */
+    void train(int epochs, bool log_accuracy) {
+        SPDLOG_INFO("Training network for {0} epochs", epochs);
+
+        // when training is distributed, every process has the same weights so only the first one needs to test them
+        bool test_accuracy = communicator == NULL || communicator->rank == 0;
+        log_accuracy = log_accuracy && test_accuracy;
+
+        if (communicator != NULL) {
+            if (hogwild_threads > 0) {
+                throw invalid_argument("Hogwild training cannot be distributed across processes");
+            }
+            if (fused_gradients) {
+                throw invalid_argument("Fused gradients cannot be used with distributed training, gradients have to be "
+                                       "summed across processes before they are applied");
+            }
+
+            synchronize_network();
+        }
+
+        pruning.validate(network->layers.size() - 1);
+        if (pruning.enabled() && (hogwild_threads > 0 || optimizer.type == Optimizer::LBFGS)) {
+            throw invalid_argument("Pruning needs synchronous batches, it can't be used with Hogwild or L-BFGS");
+        }
+        if (pruning.enabled() && pruning.last_epoch() >= epochs) {
+            SPDLOG_WARN("The last pruning round is at epoch {0}, it won't be reached or fine-tuned in {1} epochs",
+                        pruning.last_epoch(), epochs);
+        }
+
+        factorization.validate(*network);
+        if (has_low_rank_layers() && (hogwild_threads > 0 || optimizer.type == Optimizer::LBFGS || fused_gradients)) {
+            throw invalid_argument("Low-rank layers are trained through their factors with synchronous batches, they "
+                                   "can't be used with Hogwild, L-BFGS or fused gradients");
+        }
+        if (has_low_rank_layers() && pruning.enabled()) {
+            throw invalid_argument("Low-rank layers can't be pruned, they only store the factors of their weights");
+        }
+        if (has_convolution_layers() && (hogwild_threads > 0 || fused_gradients || pruning.enabled() ||
+                                         has_low_rank_layers() || measuring_gradient_noise())) {
+            throw invalid_argument("Convolution and pooling layers are trained with synchronous batches, they can't be "
+                                   "used with Hogwild, fused gradients, pruning, low-rank layers or the noise batch size "
+                                   "schedule");
+        }
+        if (factorization.enabled() && factorization.start_epoch >= epochs) {
+            SPDLOG_WARN("Layers are factored at epoch {0}, which won't be reached in {1} epochs",
+                        factorization.start_epoch, epochs);
+        }
+
+        int first_epoch = 0;
+
+        if (resuming) {
+            // the rest was restored by resume()
+            if (epochs != resumed_planned_epochs) {
+                SPDLOG_WARN("Checkpoint was taken training for {0} epochs rather than {1}, the step size schedule will "
+                            "differ from the original run",
+                            resumed_planned_epochs, epochs);
+            }
+
+            first_epoch = resumed_epoch;
+
+            // pruned blocks aren't checkpointed, but they're the blocks that are 0, which pruning to the same sparsity
+            // finds again. An epoch resumed partway already had its round.
+            int rounds = pruning.rounds_before(first_epoch + (epoch_batches > 0 ? 1 : 0));
+            for (int l = 1; l < network->layers.size() && rounds > 0; l++) {
+                network->layers[l]->prune(pruning.sparsity_at(l, rounds));
+            }
+
+            training_start = chrono::steady_clock::now() -
+                             chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(resumed_seconds));
+        } else {
+            epoch_batches = 0;
+            pruning_levels.clear();
+            factorization_report = FactorizationReport();
+            initial_batch_size = training_data.batch_size;
+            batch_step_scale = 1;
+            phase = {0, training_data.batch_size, 0, 0, 0};
+            last_accuracy = -1;
+            training_start = chrono::steady_clock::now();
+            stopping.reset();
+        }
+
+        if (log_accuracy) {
+            if (resuming && !log_file.empty()) {
+                SPDLOG_INFO("Appending training stats to " + log_file);
+            } else {
+                create_log_file();
+            }
+        }
+
+        resuming = false;
+        planned_epochs = epochs;
+        epochs_completed = first_epoch;
+        stop_requested = false;
+
+        if (!checkpoint_path.empty() && communicator != NULL) {
+            throw invalid_argument("Checkpoints cannot be used with distributed training");
+        }
+
+        // the background threads are free to run on any CPU, only the training threads are pinned
+        if (numa) {
+            unpin_calling_thread();
+        }
+
+        if (!checkpoint_path.empty()) {
+            checkpoint_writer = new CheckpointWriter(checkpoint_path);
+        }
+
+        // owned here so that an exception out of an epoch (ex. a ring peer dying) stops the evaluator's thread before it
+        // can test a network that is being destroyed
+        unique_ptr<AsyncEvaluator> evaluator;
+
+        if (async_evaluation && test_accuracy) {
+            // snapshots are evaluated on a background thread, results are logged as they come in tagged with their epoch.
+            // A stopping criterion firing here stops training at the start of the next epoch.
+            auto log_result = [this, log_accuracy](int epoch, float accuracy) {
+                SPDLOG_INFO("Accuracy at epoch {0}: {1}%", epoch, accuracy * 100.0f);
+
+                if (log_accuracy) {
+                    write_to_log_file(epoch, accuracy);
+                }
+
+                last_accuracy = accuracy;
+
+                string reason;
+                lock_guard<mutex> lock(stopping_mutex);
+                if (!stop_requested && stopping.should_stop(accuracy, training_seconds(), reason)) {
+                    stop_reason = reason;
+                    stop_requested = true;
+                }
+            };
+
+            evaluator = make_unique<AsyncEvaluator>(
+                [this](const Network &snapshot) { return test_network(snapshot); }, log_result);
+        }
+
+        if (numa && thread_pool != NULL) {
+            thread_pool->pin_thread(0, numa_topology.cpu_of_thread(0, thread_pool->size()));
+        }
+
+        for (int x = first_epoch; x <= epochs; x++) {
+            bool stop = false;
+            string reason;
+
+            // an epoch resumed partway was tested before the checkpoint was taken, and its batch size already picked
+            bool partway = x == first_epoch && epoch_batches > 0;
+
+            if (!test_accuracy || partway) {
+                // nothing to test
+            } else if (evaluator != NULL) {
+                evaluator->submit(x, network->snapshot());
+
+                if (stop_requested) {
+                    stop = true;
+                    reason = stop_reason;
+                }
+            } else {
+                float accuracy = test_network();
+                SPDLOG_INFO("Accuracy: {0}%", to_string(accuracy * 100.0f));
+
+                if (log_accuracy) {
+                    write_to_log_file(x, accuracy);
+                }
+
+                last_accuracy = accuracy;
+                stop = stopping.should_stop(accuracy, training_seconds(), reason);
+            }
+
+            if (!stop && stopping.out_of_time(training_seconds())) {
+                stop = true;
+                reason = "used up time budget of " + to_string((int)stopping.time_budget) + "s";
+            }
+
+            if (communicator != NULL) {
+                // every process has to stop at the same time, and only rank 0 knows the accuracy
+                float stop_flag = stop ? 1.0f : 0.0f;
+                communicator->broadcast(&stop_flag, 1);
+
+                if (stop_flag != 0 && !stop) {
+                    reason = "rank 0 stopped training";
+                }
+                stop = stop_flag != 0;
+            }
+
+            if (stop) {
+                SPDLOG_INFO("Stopping after {0} epochs, {1}", x, reason);
+                break;
+            }
+
+            if (x == epochs) {
+                // the final test is done, nothing left to train
+                break;
+            }
+
+            if (!partway && pruning.round_at(x) > 0) {
+                prune_network(pruning.round_at(x), x, test_accuracy);
+            }
+
+            // a network resumed from a checkpoint taken after this epoch started is factored already
+            if (!partway && x == factorization.start_epoch && factorization.pending(*network)) {
+                factorize_network(x, test_accuracy);
+            }
+
+            epochs_completed = x;
+            if (partway) {
+                SPDLOG_INFO("Resuming epoch {0} at batch {1} of {2}...", x, epoch_batches,
+                            training_data.total_batch_count);
+            } else {
+                update_batch_size(x);
+
+                if (optimizer.type == Optimizer::LBFGS) {
+                    // the line search picks its own step length
+                    SPDLOG_INFO("Training epoch {0}...", x);
+                } else {
+                    SPDLOG_INFO("Training epoch {0} (step size {1})...", x, current_step_size(0));
+                }
+            }
+
+            auto t_start = std::chrono::high_resolution_clock::now();
+
+            bool finished = train_epoch();
+
+            auto t_end = std::chrono::high_resolution_clock::now();
+            double elapsed_time_s = std::chrono::duration<double>(t_end - t_start).count();
+
+            phase.epochs++;
+            phase.seconds += elapsed_time_s;
+
+            SPDLOG_DEBUG("Training took {0} seconds", elapsed_time_s);
+
+            if (checkpoint_writer != NULL) {
+                // an epoch cut short by the time budget carries on where it stopped, even before its first batch
+                save_checkpoint(finished ? x + 1 : x);
+            }
+        }
+
+        if (batch_schedule.type != BatchSizeSchedule::Constant) {
+            log_phase();
+        }
+
+        log_pruning_report();
+
+        if (!factorization_report.empty()) {
+            factorization_report.log(last_accuracy);
+        }
+
+        SPDLOG_INFO("Training took {0:.1f} seconds", training_seconds());
+
+        if (evaluator != NULL) {
+            // don't return until the accuracy of every snapshot has been logged
+            evaluator->wait();
+            evaluator.reset();
+        }
+
+        if (checkpoint_writer != NULL) {
+            // the last checkpoint is on disk by the time training returns
+            checkpoint_writer->wait();
+            delete checkpoint_writer;
+            checkpoint_writer = NULL;
+        }
+
+        // runs with the same seed and options should end with the same checksum
+        SPDLOG_INFO("Final weights checksum: {0:016x}", network->checksum());
+    }
+
+    /**
+     * @brief Train the network on one epoch of training data. The neural network is given the training data in batches.
+     *        If there are N batches of training data, an epoch occurs when all N batches have been seen by the network once.
+     *
+     * @return Whether the whole epoch was trained, false if the time budget ran out partway
+     */
+    bool train_epoch() {
+        if (network == NULL) {
+            throw invalid_function_call("Trainer does not have any network to train");
+        }
+
+        if (optimizer.type == Optimizer::LBFGS) {
+            train_epoch_lbfgs();
+            return true;
+        }
+
+        if (hogwild_threads > 0) {
+            train_epoch_hogwild(hogwild_threads);
+            return true;
+        }
+
+        AllocationTracker::Scope scope(AllocationTracker::Epoch);
+
+        while (epoch_batches < training_data.total_batch_count) {
+            // processes in distributed training have to train the same number of batches, they only stop between epochs
+            if (communicator == NULL && stopping.out_of_time(training_seconds())) {
+                SPDLOG_INFO("Time budget used up partway through the epoch");
+                return false;
+            }
+
+            train_next_batch();
+            epoch_batches++;
+
+            // the checkpoint at the end of the epoch is taken by train()
+            if (checkpoint_writer != NULL && checkpoint_interval > 0 && epoch_batches % checkpoint_interval == 0 &&
+                epoch_batches < training_data.total_batch_count) {
+                save_checkpoint(epochs_completed);
+            }
+        }
+
+        epoch_batches = 0;
+        return true;
+    }
+
+    /**
+     * @brief Hand the current training state over to `checkpoint_writer`, unless it's still writing the last checkpoint.
+     *        The weights aren't copied, the checkpoint holds a snapshot of them.
+     *
+     * @param epoch Epoch training carries on from, `epoch_batches` of its batches have been trained
+     */
+    void save_checkpoint(int epoch) {
+        if (checkpoint_writer->busy()) {
+            SPDLOG_WARN("Skipping checkpoint at epoch {0}, batch {1}, the previous one is still being written", epoch,
+                        epoch_batches);
+            return;
+        }
+
+        Checkpoint checkpoint;
+        checkpoint.network = network->snapshot();
+
+        checkpoint.epoch = epoch;
+        checkpoint.epoch_batches = epoch_batches;
+        checkpoint.planned_epochs = planned_epochs;
+        checkpoint.elapsed_seconds = training_seconds();
+        checkpoint.last_accuracy = last_accuracy;
+        checkpoint.log_file = log_file;
+
+        checkpoint.batch_size = training_data.batch_size;
+        checkpoint.initial_batch_size = initial_batch_size;
+        checkpoint.batch_step_scale = batch_step_scale;
+        checkpoint.phase_index = phase.index;
+        checkpoint.phase_batch_size = phase.batch_size;
+        checkpoint.phase_first_epoch = phase.first_epoch;
+        checkpoint.phase_epochs = phase.epochs;
+        checkpoint.phase_seconds = phase.seconds;
+        checkpoint.batch_schedule = batch_schedule.save_state();
+        {
+            lock_guard<mutex> lock(stopping_mutex);
+            checkpoint.stopping = stopping.save_state();
+        }
+
+        checkpoint.current_record = training_data.current_record;
+        checkpoint.current_batch = training_data.current_batch;
+        ostringstream engine_state;
+        engine_state << training_data.shuffle_engine;
+        checkpoint.shuffle_engine = engine_state.str();
+        checkpoint.record_order = training_data.record_order;
+
+        checkpoint.optimizer_type = optimizer.type;
+        optimizer.save_state(checkpoint.optimizer);
+
+        checkpoint.has_lbfgs = lbfgs != NULL;
+        if (lbfgs != NULL) {
+            lbfgs->save_state(checkpoint.lbfgs);
+            checkpoint.lbfgs_parameters = lbfgs_parameters;
+            checkpoint.lbfgs_gradient = lbfgs_gradient;
+            checkpoint.lbfgs_loss = lbfgs_loss;
+        }
+
+        checkpoint_writer->submit(move(checkpoint));
+    }
+
+    /**
+     * @brief Carry on training from a checkpoint written by an earlier run, see 🛈 Checkpoints. Restores the weights,
+     *        optimizer and position in the training data right away, the next call to `train()` continues from the
+     *        checkpoint's epoch. Run with the same options as the run that wrote the checkpoint, training ends with the
+     *        same weights as if it had never stopped.
+     *
+     *        Must be called once everything else is set up and the training data has been loaded (if it's loaded at all).
+     *
+     * @param path Path of the checkpoint file
+     */
+    void resume(const string &path) {
+        if (network == NULL) {
+            throw invalid_function_call("Trainer does not have any network to resume training");
+        }
+
+        if (communicator != NULL) {
+            throw invalid_argument("Checkpoints cannot be used with distributed training");
+        }
+
+        Checkpoint checkpoint = Checkpoint::load(path);
+
+        if (checkpoint.optimizer_type != optimizer.type) {
+            throw invalid_argument("Checkpoint '" + path + "' was taken training with another optimizer");
+        }
+
+        network->copy_weights_from(checkpoint.network);
+
+        // the checkpoint's layers can be factored, which changes what the optimizer keeps, the gradients needed and what
+        // each record keeps to calculate them
+        for (int l = 1; l < network->layers.size(); l++) {
+            optimizer.initialize_layer(l, *network->layers[l]);
+        }
+        allocate_gradients();
+        allocate_batch_buffers();
+
+        if (checkpoint.batch_size != training_data.batch_size) {
+            set_batch_size(checkpoint.batch_size);
+        }
+
+        training_data.seek(checkpoint.current_record, checkpoint.current_batch);
+
+        bool partway_through_data = checkpoint.current_record > 0 &&
+                                    checkpoint.current_record < training_data.training_data_items_count;
+        if (training_data.shuffle && partway_through_data &&
+            checkpoint.record_order.size() != training_data.training_data_items_count) {
+            throw invalid_argument("Checkpoint '" + path + "' was taken without --shuffle, or with other training data");
+        }
+
+        istringstream engine_state(checkpoint.shuffle_engine);
+        engine_state >> training_data.shuffle_engine;
+        training_data.record_order = checkpoint.record_order;
+
+        optimizer.restore_state(checkpoint.optimizer);
+
+        delete lbfgs;
+        lbfgs = NULL;
+
+        if (checkpoint.has_lbfgs) {
+            size_t count = gradient_buffer.size();
+            if (checkpoint.lbfgs_parameters.size() != count || checkpoint.lbfgs_gradient.size() != count) {
+                throw invalid_argument("Checkpoint '" + path + "' has L-BFGS state for a different network");
+            }
+
+            lbfgs = new LBFGS(count, lbfgs_history);
+            lbfgs->restore_state(checkpoint.lbfgs);
+
+            lbfgs_parameters = checkpoint.lbfgs_parameters;
+            lbfgs_gradient = checkpoint.lbfgs_gradient;
+            lbfgs_candidate.resize(count);
+            lbfgs_candidate_gradient.resize(count);
+            lbfgs_direction.resize(count);
+            lbfgs_loss = checkpoint.lbfgs_loss;
+        }
+
+        batch_schedule.restore_state(checkpoint.batch_schedule);
+        stopping.restore_state(checkpoint.stopping);
+
+        initial_batch_size = checkpoint.initial_batch_size;
+        batch_step_scale = checkpoint.batch_step_scale;
+        phase = {checkpoint.phase_index, checkpoint.phase_batch_size, checkpoint.phase_first_epoch,
+                 checkpoint.phase_epochs, checkpoint.phase_seconds};
+        last_accuracy = checkpoint.last_accuracy;
+        log_file = checkpoint.log_file;
+
+        epoch_batches = checkpoint.epoch_batches;
+        resumed_epoch = checkpoint.epoch;
+        resumed_planned_epochs = checkpoint.planned_epochs;
+        resumed_seconds = checkpoint.elapsed_seconds;
+        resuming = true;
+
+        SPDLOG_INFO("Resuming training from {0} at epoch {1}, batch {2} ({3:.1f}s in), weights checksum {4:016x}", path,
+                    resumed_epoch, epoch_batches, resumed_seconds, network->checksum());
+    }
+
+    /**
+     * @brief Step size given by the learning rate schedule at the current point in training
+     *
+     * @param epoch_fraction Fraction of the current epoch trained so far
+     */
+    float current_step_size(float epoch_fraction) const {
+        return schedule.step_size(step_size, epochs_completed + epoch_fraction, planned_epochs) * batch_step_scale;
+    }
+
+    /**
+     * @brief Number of (s, y) pairs kept by L-BFGS
+     */
+    int lbfgs_history = 10;
+
+    /**
+     * @brief Most loss evaluations a single L-BFGS line search may use before giving up on the step
+     */
+    int lbfgs_max_line_search = 20;
+
+    /**
+     * @brief Take one L-BFGS step: calculate the search direction from the full-batch gradient and the (s, y) history,
+     *        then search along it for a step that lowers the loss enough (Armijo condition), halving the step each time
+     *        it doesn't. Requires the training data to be loaded into memory.
+     */
+    void train_epoch_lbfgs() {
+        if (fused_gradients) {
+            throw invalid_argument("L-BFGS needs the full-batch gradient of every weight, it cannot use fused gradients");
+        }
+
+        size_t count = gradient_buffer.size();
+
+        if (lbfgs == NULL) {
+            lbfgs = new LBFGS(count, lbfgs_history);
+
+            lbfgs_parameters.resize(count);
+            lbfgs_gradient.resize(count);
+            lbfgs_candidate.resize(count);
+            lbfgs_candidate_gradient.resize(count);
+            lbfgs_direction.resize(count);
+
+            get_parameters(lbfgs_parameters.data());
+            lbfgs_loss = full_batch_gradient(lbfgs_gradient.data());
+        }
+
+        lbfgs->direction(lbfgs_gradient.data(), lbfgs_direction.data());
+
+        double slope = 0, gradient_norm = 0;
+        for (size_t x = 0; x < count; x++) {
+            slope += (double)lbfgs_gradient[x] * lbfgs_direction[x];
+            gradient_norm += (double)lbfgs_gradient[x] * lbfgs_gradient[x];
+        }
+        gradient_norm = sqrt(gradient_norm);
+
+        if (slope >= 0) {
+            // the curvature estimate has gone bad and doesn't point downhill, start over from steepest descent
+            lbfgs->reset();
+            for (size_t x = 0; x < count; x++) {
+                lbfgs_direction[x] = -lbfgs_gradient[x];
+            }
+            slope = -gradient_norm * gradient_norm;
+        }
+
+        // without any history there's no idea of how far to go, so limit the first step to a length of 1
+        double t = lbfgs->stored_pairs() == 0 ? min(1.0, 1.0 / max(gradient_norm, 1e-12)) : 1.0;
+        const double armijo = 1e-4;
+
+        double loss;
+        int evaluations = 0;
+
+        while (true) {
+            for (size_t x = 0; x < count; x++) {
+                lbfgs_candidate[x] = lbfgs_parameters[x] + t * lbfgs_direction[x];
+            }
+            set_parameters(lbfgs_candidate.data());
+
+            loss = full_batch_gradient(lbfgs_candidate_gradient.data());
+            evaluations++;
+
+            if (loss <= lbfgs_loss + armijo * t * slope) {
+                break;
+            }
+
+            if (evaluations >= lbfgs_max_line_search) {
+                SPDLOG_WARN("L-BFGS line search failed to lower the loss after {0} evaluations, resetting history",
+                            evaluations);
+                set_parameters(lbfgs_parameters.data());
+                lbfgs->reset();
+                return;
+            }
+
+            t *= 0.5;
+        }
+
+        // s and y are written over the direction and old gradient, which aren't needed anymore
+        for (size_t x = 0; x < count; x++) {
+            lbfgs_direction[x] = lbfgs_candidate[x] - lbfgs_parameters[x];
+            lbfgs_gradient[x] = lbfgs_candidate_gradient[x] - lbfgs_gradient[x];
+        }
+        lbfgs->add_pair(lbfgs_direction.data(), lbfgs_gradient.data());
+
+        swap(lbfgs_parameters, lbfgs_candidate);
+        swap(lbfgs_gradient, lbfgs_candidate_gradient);
+
+        SPDLOG_INFO("L-BFGS step: loss {0:.6f} -> {1:.6f}, step length {2}, {3} evaluations", lbfgs_loss, loss, t,
+                    evaluations);
+
+        lbfgs_loss = loss;
+    }
+
+    /**
+     * @brief Calculate the average loss and gradient over every record of the training data, using every thread. The
+     *        training data is propagated a batch at a time using the same kernels as batch training. When training is
+     *        distributed, the loss and gradient are averaged over the training data of every process.
+     *
+     * @param gradient Where to write the gradient, every layer's weights and biases one after another in the same
+     *                 layout as `Layer::parameters`
+     *
+     * @return Average loss (quadratic cost) over the training data
+     */
+    double full_batch_gradient(float *gradient) {
+        if (training_data.training_data_buffer == NULL) {
+            throw invalid_function_call("Full-batch gradients require the training data to be loaded into memory first");
+        }
+
+        if (allocated_batch_size != training_data.batch_size) {
+            allocate_batch_buffers();
+        }
+
+        const size_t count = gradient_buffer.size();
+        const int last = layer_sizes.size() - 1;
+
+        fill(gradient, gradient + count, 0.0f);
+        record_losses.resize(allocated_batch_size);
+
+        double totals[2] = {0, (double)training_data.training_data_items_count};
+
+        for (int start = 0; start < training_data.training_data_items_count; start += allocated_batch_size) {
+            int batch_size = min(allocated_batch_size, training_data.training_data_items_count - start);
+
+            for (int b = 0; b < batch_size; b++) {
+                for (int l = 0; l < layer_sizes.size(); l++) {
+                    fill(activations[b][l], activations[b][l] + layer_sizes[l], 0.0f);
+                }
+            }
+
+            parallel_records(batch_size, [this, start, last](int b) {
+                unsigned char label = training_data.training_labels_buffer[start + b];
+                train_record(training_data.training_data_buffer[start + b], label, b);
+
+                double loss = 0;
+                for (int y = 0; y < layer_sizes[last]; y++) {
+                    double difference = activations[b][last][y] - (y == label ? 1.0 : 0.0);
+                    loss += 0.5 * difference * difference;
+                }
+                record_losses[b] = loss;
+            });
+
+            for (int b = 0; b < batch_size; b++) {
+                totals[0] += record_losses[b];
+            }
+
+            calculate_weight_gradient(batch_size);
+            calculate_bias_gradient(batch_size);
+
+            for (size_t x = 0; x < count; x++) {
+                gradient[x] += gradient_buffer[x];
+            }
+        }
+
+        if (communicator != NULL) {
+            communicator->all_reduce(gradient, count);
+
+            float reduced[2] = {(float)totals[0], (float)totals[1]};
+            communicator->all_reduce(reduced, 2);
+            totals[0] = reduced[0];
+            totals[1] = reduced[1];
+        }
+
+        for (size_t x = 0; x < count; x++) {
+            gradient[x] /= totals[1];
+        }
+
+        return totals[0] / totals[1];
+    }
+
+    /**
+     * @brief Copy every layer's weights and biases into one array, in the same layout as `full_batch_gradient()`
+     */
+    void get_parameters(float *parameters) {
+        for (int l = 1; l < layer_sizes.size(); l++) {
+            Layer *layer = network->layers[l];
+            copy(layer->parameters, layer->parameters + layer->parameter_count(), parameters + gradient_offsets[l]);
+        }
+    }
+
+    /**
+     * @brief Set every layer's weights and biases from one array, in the same layout as `full_batch_gradient()`
+     */
+    void set_parameters(const float *parameters) {
+        network->detach();
+
+        for (int l = 1; l < layer_sizes.size(); l++) {
+            Layer *layer = network->layers[l];
+            copy(parameters + gradient_offsets[l], parameters + gradient_offsets[l] + layer->parameter_count(),
+                 layer->parameters);
+        }
+    }
+
+    /**
+     *?                             ==================================================
+     *?                                               🛈 Hogwild Training
+     *?                             ==================================================
+     *
+     * Rather than averaging the gradients of a batch and then updating the weights once, each thread picks the next
+     * training record, calculates its gradient and immediately applies it to the shared weights and biases. There are no
+     * locks or barriers, so threads can read weights halfway through another thread's update and can occasionally
+     * overwrite each other's updates. When inputs are sparse (like MNIST, where most pixels are 0), two records rarely
+     * update the same weights, so this hardly affects convergence while letting every thread run at full speed.
+     *
+     * https://arxiv.org/abs/1106.5730
+     */
+
+    /**
+     * @brief Train the network on one epoch of training data using Hogwild.
+     *
+     * @param threads Number of threads updating the network at the same time
+     */
+    void train_epoch_hogwild(int threads) {
+        if (network == NULL) {
+            throw invalid_function_call("Trainer does not have any network to train");
+        }
+
+        if (training_data.training_data_buffer == NULL) {
+            throw invalid_function_call("Hogwild training requires the training data to be loaded into memory first");
+        }
+
+        if (optimizer.type != Optimizer::SGD) {
+            throw invalid_argument("Hogwild training applies every record's gradient directly, it only supports SGD");
+        }
+        if (has_convolution_layers()) {
+            throw invalid_argument("Hogwild training only supports fully connected layers");
+        }
+
+        // records are applied one at a time, so scale the step size down to move the weights about as far per epoch as
+        // training in batches does
+        float coefficient = current_step_size(0) / training_data.batch_size;
+
+        // with NUMA placement every node has its own shard of the training data, otherwise there's one shard
+        const bool on_nodes = numa && !training_data.node_shard_begin.empty();
+        vector<HogwildShard> shards(on_nodes ? numa_topology.size() : 1);
+
+        for (int n = 0; n < shards.size(); n++) {
+            shards[n].next_record = on_nodes ? training_data.node_shard_begin[n] : 0;
+            shards[n].end = on_nodes ? training_data.node_shard_begin[n + 1] : training_data.training_data_items_count;
+        }
+
+        // workers write straight into the weights
+        network->detach();
+
+        auto t_start = chrono::high_resolution_clock::now();
+
+        vector<thread> workers;
+        for (int t = 0; t < threads; t++) {
+            int node = on_nodes ? numa_topology.node_of_thread(t, threads) : 0;
+            int cpu = numa ? numa_topology.cpu_of_thread(t, threads) : -1;
+
+            workers.emplace_back(
+                [this, &shards, node, cpu, coefficient] { hogwild_worker(shards, node, cpu, coefficient); });
+        }
+
+        for (int t = 0; t < threads; t++) {
+            workers[t].join();
+        }
+
+        auto t_end = chrono::high_resolution_clock::now();
+        double seconds = chrono::duration<double>(t_end - t_start).count();
+
+        if (on_nodes) {
+            const double record_bytes = (double)layer_sizes[0] * sizeof(float);
+
+            for (int n = 0; n < shards.size(); n++) {
+                long records = shards[n].records;
+                SPDLOG_INFO("Node {0}: {1} records ({2:.1f}% from other nodes), {3:.2f} GB/s of training data",
+                            numa_topology.nodes[n].id, records, 100.0 * shards[n].remote_records / max(records, 1L),
+                            records * record_bytes / seconds / 1e9);
+            }
+        }
+    }
+
+    /**
+     * @brief Records of one shard of the training data during a Hogwild epoch
+     */
+    struct HogwildShard {
+        /**
+         * @brief Index of the next record of the shard no thread has started training on yet, and one past its last
+         */
+        atomic<int> next_record{0};
+        int end = 0;
+
+        /**
+         * @brief Records trained by threads on this shard's node, and how many of those came from other shards
+         */
+        atomic<long> records{0};
+        atomic<long> remote_records{0};
+    };
+
+    /**
+     * @brief Run by every Hogwild thread, trains on records until there are none left in this epoch. Takes records from
+     *        its own node's shard first, then helps with the others.
+     *
+     * @param shards Shards of the training data, shared between threads
+     * @param home Index of the shard on the thread's own node
+     * @param cpu CPU to pin the thread to, -1 to leave it unpinned
+     * @param coefficient Amount each record's gradient is multiplied by before being applied
+     */
+    void hogwild_worker(vector<HogwildShard> &shards, int home, int cpu, float coefficient) {
+        // pin before allocating anything, so the scratch is placed on this thread's node
+        if (cpu >= 0 && !NumaTopology::pin_thread(pthread_self(), cpu)) {
+            SPDLOG_WARN("Unable to pin Hogwild thread to CPU {0}", cpu);
+        }
+
+        // every thread has its own activations and error, only the weights and biases are shared
+        Arena arena(record_scratch_bytes(), "hogwild worker scratch");
+        float **worker_activations, **worker_error;
+        allocate_record_scratch(arena, worker_activations, worker_error);
+
+        // taking a few records at a time keeps threads from fighting over next_record
+        const int records_per_fetch = 16;
+
+        for (int s = 0; s < shards.size(); s++) {
+            HogwildShard &shard = shards[(home + s) % shards.size()];
+
+            while (true) {
+                int start = shard.next_record.fetch_add(records_per_fetch, memory_order_relaxed);
+                if (start >= shard.end) {
+                    break;
+                }
+
+                int end = min(start + records_per_fetch, shard.end);
+
+                shards[home].records += end - start;
+                if (s > 0) {
+                    shards[home].remote_records += end - start;
+                }
+
+                for (int r = start; r < end; r++) {
+                    for (int x = 0; x < layer_sizes[0]; x++) {
+                        worker_activations[0][x] = training_data.training_data_buffer[r][x];
+                    }
+
+                    for (int l = 1; l < layer_sizes.size(); l++) {
+                        for (int x = 0; x < layer_sizes[l]; x++) {
+                            worker_activations[l][x] = 0;
+                        }
+                    }
+
+                    network->calculate_error(worker_activations, worker_error, training_data.training_labels_buffer[r]);
+
+                    // apply the gradient straight to the shared weights and biases
+                    for (int l = 1; l < layer_sizes.size(); l++) {
+                        Layer *layer = network->layers[l];
+
+                        for (int x = 0; x < layer_sizes[l - 1]; x++) {
+                            float activation = worker_activations[l - 1][x] * coefficient;
+
+                            // weights from inactive neurons/pixels have no gradient, skipping them is what keeps threads
+                            // from touching the same weights most of the time
+                            if (activation == 0) {
+                                continue;
+                            }
+
+                            for (int y = 0; y < layer_sizes[l]; y++) {
+                                racy_add(layer->weights[x][y], -activation * worker_error[l - 1][y]);
+                            }
+                        }
+
+                        for (int y = 0; y < layer_sizes[l]; y++) {
+                            racy_add(layer->biases[y], -coefficient * worker_error[l - 1][y]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Train the network both synchronously and using Hogwild, starting from the same weights, and report how their
+     *        accuracy and throughput compare after every epoch. Results are also written to a csv file in
+     *        `training_logs_output_folder`. Once done, the network is reset to the weights it started with.
+     *
+     * @param epochs Number of epochs to train each mode for
+     * @param threads Number of threads used for Hogwild training
+     */
+    void hogwild_report(int epochs, int threads) {
+        if (network == NULL) {
+            throw invalid_function_call("Trainer does not have any network to train");
+        }
+
+        if (epochs < 1) {
+            throw invalid_argument("Hogwild report needs at least 1 epoch");
+        }
+
+        SPDLOG_INFO("Comparing synchronous training with {0}-thread Hogwild training over {1} epochs", threads, epochs);
+
+        Network initial_network(*network);
+
+        struct Result {
+            double seconds;
+            float accuracy;
+        };
+
+        // results[0] is synchronous training, results[1] is Hogwild
+        vector<Result> results[2];
+
+        int original_hogwild_threads = hogwild_threads;
+
+        for (int mode = 0; mode < 2; mode++) {
+            network->copy_weights_from(initial_network);
+            training_data.rewind();
+            hogwild_threads = mode == 0 ? 0 : threads;
+
+            for (int e = 0; e < epochs; e++) {
+                auto t_start = std::chrono::high_resolution_clock::now();
+
+                train_epoch();
+
+                auto t_end = std::chrono::high_resolution_clock::now();
+                double elapsed_time_s = std::chrono::duration<double>(t_end - t_start).count();
+
+                float accuracy = test_network();
+                results[mode].push_back({elapsed_time_s, accuracy});
+
+                SPDLOG_INFO("{0} epoch {1}: accuracy {2}%, {3:.0f} records/s", mode == 0 ? "Synchronous" : "Hogwild", e,
+                            accuracy * 100.0f, training_data.training_data_items_count / elapsed_time_s);
+            }
+        }
+
+        hogwild_threads = original_hogwild_threads;
+        network->copy_weights_from(initial_network);
+
+        // write report
+        filesystem::path dest(training_logs_output_folder);
+        dest.append("hogwild_report_" + get_current_datetime() + ".csv");
+        string filename = get_unique_filename(dest.string());
+
+        ofstream writer(filename, ios_base::trunc);
+        writer << "# Hogwild Report" << endl;
+        writer << "# Hogwild Threads: " << threads << endl;
+        writer << "# Batch Size: " << training_data.batch_size << endl;
+        writer << "# Step Size: " << step_size << endl;
+        writer << endl;
+        writer << "mode,epoch,seconds,records_per_second,accuracy" << endl;
+
+        for (int mode = 0; mode < 2; mode++) {
+            for (int e = 0; e < epochs; e++) {
+                writer << (mode == 0 ? "synchronous" : "hogwild") << "," << e << "," << results[mode][e].seconds << ","
+                       << training_data.training_data_items_count / results[mode][e].seconds << ","
+                       << results[mode][e].accuracy << endl;
+            }
         }
 
-        activations = new float **[training_data.batch_size];
-        for (int b = 0; b < training_data.batch_size; b++) {
-            activations[b] = new float *[network.layers.size()];
-            for (int x = 0; x < network.layers.size(); x++) {
-                activations[b][x] = new float[network.layers[x]->size];
-            }
+        if (writer.good()) {
+            SPDLOG_INFO("Wrote Hogwild report to " + filename);
+        } else {
+            SPDLOG_WARN("Unable to write Hogwild report, are you sure the target folder (" + training_logs_output_folder +
+                        ") exists?");
         }
 
-        error = new float **[training_data.batch_size];
-        for (int b = 0; b < training_data.batch_size; b++) {
-            error[b] = new float *[network.layers.size() - 1];
-            for (int x = 0; x < network.layers.size() - 1; x++) {
-                error[b][x] = new float[network.layers[x + 1]->size];
+        // summary
+        double total_seconds[2] = {0, 0};
+        for (int mode = 0; mode < 2; mode++) {
+            for (int e = 0; e < epochs; e++) {
+                total_seconds[mode] += results[mode][e].seconds;
             }
         }
 
-        weight_gradient = new float **[network.layers.size() - 1];
-        for (int l = 1; l < network.layers.size(); l++) {
-            weight_gradient[l - 1] = new float *[network.layers[l - 1]->size];
-            for (int x = 0; x < network.layers[l - 1]->size; x++) {
-                weight_gradient[l - 1][x] = new float[network.layers[l]->size];
+        float synchronous_accuracy = results[0][epochs - 1].accuracy;
+        float hogwild_accuracy = results[1][epochs - 1].accuracy;
+
+        SPDLOG_INFO("Hogwild throughput is {0:.2f}x synchronous, final accuracy {1}% vs {2}% synchronous",
+                    total_seconds[0] / total_seconds[1], hogwild_accuracy * 100.0f, synchronous_accuracy * 100.0f);
+
+        // how long did Hogwild take to get as accurate as synchronous training ended up?
+        double elapsed = 0;
+        for (int e = 0; e < epochs; e++) {
+            elapsed += results[1][e].seconds;
+            if (results[1][e].accuracy >= synchronous_accuracy) {
+                SPDLOG_INFO("Hogwild reached the final synchronous accuracy after {0} epochs ({1:.2f}s vs {2:.2f}s)",
+                            e + 1, elapsed, total_seconds[0]);
+                return;
             }
         }
+
+        SPDLOG_INFO("Hogwild did not reach the final synchronous accuracy within {0} epochs", epochs);
     }
 
     /**
-     * @brief Create a new trainer object
+     * @brief Train the network on the next batch of training data. Note that the last batch may be smaller than batch size.
      */
-    Trainer() {}
+    void train_next_batch() {
+        // SPDLOG_INFO("Training batch " + to_string(training_data.current_batch) + "/" +
+        // to_string(training_data.total_batch_count));
+
+        if (allocated_batch_size != training_data.batch_size) {
+            // batch size was changed directly on training_data
+            allocate_batch_buffers();
+        }
+
+        // nothing should be allocated here once the first batch after allocating buffers is done
+        AllocationTracker::Scope scope(AllocationTracker::Batch, !batch_warmed_up);
+        batch_warmed_up = true;
+
+        training_data.get_next_training_batch();
+
+        int batch_size = training_data.batch_size;
+        int remainder = training_data.training_data_items_count % batch_size;
+        if (training_data.current_batch == training_data.total_batch_count && remainder != 0) {
+            // on the last batch so batch size will be different,
+            batch_size = remainder;
+        }
+
+        float epoch_fraction = max(training_data.current_batch - 1, 0) / (float)training_data.total_batch_count;
+
+        train_batch(training_data.training_data_batch_buffer, training_data.training_labels_batch_buffer, batch_size,
+                    epoch_fraction);
+    }
 
     /**
-     * @brief Create a new trainer object
+     * @brief Train the network on one batch of records that can come from anywhere, such as buffers owned by a program
+     *        embedding the library (see `src/mnistdnn.h`). Records are read where they are, not copied first.
      *
-     * @param network Network trainer is being created for
+     * @param records Every record of the batch, each as many values as the input layer
+     * @param labels Label of each record
+     * @param batch_size Number of records, at most the batch size buffers were allocated for
+     * @param epoch_fraction How far through the epoch the batch is, for the learning rate schedule
      */
-    Trainer(Network &network) { setNetwork(network); }
+    void train_batch(const float *const *records, const unsigned char *labels, int batch_size, float epoch_fraction) {
+        if (batch_size < 1 || batch_size > allocated_batch_size) {
+            throw invalid_argument("Batch of " + to_string(batch_size) + " records doesn't fit in buffers for " +
+                                   to_string(allocated_batch_size));
+        }
 
-    ~Trainer() {
-        for (int b = 0; b < training_data.batch_size; b++) {
-            for (int x = 0; x < layer_sizes.size(); x++) {
-                delete[] activations[b][x];
+        // set all values to zero in activations and weight_gradient matrix.
+
+        for (int b = 0; b < batch_size; b++) {
+            for (int l = 0; l < network->layers.size(); l++) {
+                for (int x = 0; x < network->layers[l]->size; x++) {
+                    activations[b][l][x] = 0;
+                }
             }
-            delete[] activations[b];
         }
-        delete[] activations;
 
-        for (int b = 0; b < training_data.batch_size; b++) {
-            for (int x = 0; x < layer_sizes.size() - 1; x++) {
-                delete[] error[b][x];
-            }
-            delete[] error[b];
+        // records only write to their own activations and error, so they can be propagated in parallel
+        parallel_records(batch_size, [&](int x) { train_record(records[x], labels[x], x); });
+
+        if (!fused_gradients) {
+            calculate_weight_gradient(batch_size);
+        }
+
+        // weight gradients now contains the sum of weight gradients of all training records, the bias gradient is the
+        // sum of the error of all training records
+        calculate_bias_gradient(batch_size);
+
+        if (measuring_gradient_noise() && !fused_gradients) {
+            add_gradient_noise_sample(batch_size);
+        }
+
+        // when distributed, every other process has trained its own batch, add up all of their gradients
+        int batches = 1;
+        if (communicator != NULL) {
+            all_reduce_gradients();
+            batches = communicator->size;
         }
-        delete[] error;
 
+        // dividing each gradient by the number of records gives us the average gradient vector of all training records
+        // in the batch. Now we update the weights and biases,
+
+        optimizer.begin_update(current_step_size(epoch_fraction), 1.0f / (batch_size * batches));
+
+        // updates are written to a spare block rather than in place while a snapshot shares a layer's parameters
         for (int l = 1; l < layer_sizes.size(); l++) {
-            for (int x = 0; x < layer_sizes[l - 1]; x++) {
-                delete[] weight_gradient[l - 1][x];
+            update_targets[l] = network->layers[l]->begin_update();
+        }
+
+        if (fused_gradients) {
+            // weight gradients are applied tile by tile as they're calculated, which leaves just the biases
+            calculate_weight_gradient(batch_size);
+
+            if (measuring_gradient_noise()) {
+                add_gradient_noise_sample(batch_size);
+            }
+
+            for (int l = 1; l < layer_sizes.size(); l++) {
+                Layer *layer = network->layers[l];
+                optimizer.update(l, layer->parameters, update_targets[l], bias_gradient[l - 1], layer->weight_count(),
+                                 layer->parameter_count());
+                layer->commit_update();
+                layer->apply_pruning();
             }
-            delete[] weight_gradient[l - 1];
+            return;
         }
-        delete[] weight_gradient;
 
-        SPDLOG_DEBUG("Deleted trainer");
+        // every weight and bias is updated on its own, so each layer is split into blocks that are updated in parallel
+        const int parameters_per_task = 4096;
+
+        for (int l = 1; l < layer_sizes.size(); l++) {
+            Layer *layer = network->layers[l];
+            const float *layer_gradient = gradient_buffer.data() + gradient_offsets[l];
+            int count = layer->parameter_count();
+
+            parallel_for((count + parameters_per_task - 1) / parameters_per_task, [&](int task) {
+                int begin = task * parameters_per_task;
+                optimizer.update(l, layer->parameters, update_targets[l], layer_gradient + begin, begin,
+                                 min(begin + parameters_per_task, count));
+            });
+
+            layer->commit_update();
+            layer->apply_pruning();
+        }
     }
 
     /**
-     * @brief Create the log file that will be written to using `write_to_log_file()`
+     * @brief Calculate the weight gradient of a batch from the activations and error of each record, once every record
+     *        in the batch has been propagated. When gradients are fused, each tile of rows is applied to the weights by
+     *        the optimizer as soon as it's calculated instead of being stored in `weight_gradient`, so
+     *        `optimizer.begin_update()` must already have been called.
+     *
+     *        Threads are each given whole rows of the weight gradient, and each weight's gradient is summed over the
+     *        records in order. Because the order of additions never depends on how rows are split between threads,
+     *        the result is bit-for-bit the same for any number of threads.
+     *
+     * @param batch_size Number of records in the batch
      */
-    void create_log_file() {
-        // first we need to generate a name for the file,
-        string filename = "log_";
-        filename += get_current_datetime();
-        filename += ".csv";
+    void calculate_weight_gradient(int batch_size) {
+        const int rows_per_task = gradient_rows_per_task;
 
-        filesystem::path dest(training_logs_output_folder);
-        dest.append(filename);
+        // tasks are numbered through the rows of every fully connected layer, one after another
+        int total_rows = 0;
+        for (int l = 1; l < layer_sizes.size(); l++) {
+            total_rows += gradient_rows(l);
+        }
 
-        filename = get_unique_filename(dest.string());
+        int tasks = (total_rows + rows_per_task - 1) / rows_per_task;
+        bool measure_norms = measuring_gradient_noise();
+        task_gradient_norms.assign(measure_norms ? tasks : 0, 0.0);
 
-        SPDLOG_INFO("Writing training stats to " + dest.string());
+        parallel_for_threads(tasks, [this, batch_size, total_rows, measure_norms](int task, int thread) {
+            int first_row = task * rows_per_task;
+            int last_row = min(first_row + rows_per_task, total_rows);
 
-        ofstream writer(filename, ios_base::trunc);
+            // find the layer that the first row is in
+            int l = 1;
+            int layer_first_row = 0;
+            while (first_row >= layer_first_row + gradient_rows(l)) {
+                layer_first_row += gradient_rows(l);
+                l++;
+            }
 
-        if (!writer.good()) {
-            SPDLOG_WARN("Unable to create log file, are you sure the target folder (" + training_logs_output_folder +
-                        ") exists?");
-        }
+            // a task's rows can span the end of one layer and the start of the next, handle one layer at a time
+            for (int row = first_row; row < last_row;) {
+                while (row >= layer_first_row + gradient_rows(l)) {
+                    layer_first_row += gradient_rows(l);
+                    l++;
+                }
 
-        log_file = filename;
+                int x_begin = row - layer_first_row;
+                int x_end = min(last_row - layer_first_row, gradient_rows(l));
 
-        // write some initial data to file
+                float *gradient;
+                if (fused_gradients) {
+                    gradient = gradient_tiles[thread];
+                } else {
+                    gradient = weight_gradient[l - 1][x_begin];
+                }
 
-        // configuration headers
-        writer << "# Training Log File" << endl;
-        writer << "# ******************************************" << endl;
-        writer << "# Generated On: " << get_current_datetime() << endl;
-        writer << "# Training Data File: " << training_data.training_data_path << endl;
-        writer << "# Training Labels File: " << training_data.training_labels_path << endl;
-        writer << "# Test Data File: " << training_data.test_data_path << endl;
-        writer << "# Test Labels File: " << training_data.test_labels_path << endl;
-        writer << "# Batch Size: " << training_data.batch_size << endl;
-        writer << "# Total batches in training data: " << training_data.total_batch_count << endl;
-        writer << "# Total records in training data " << training_data.training_data_items_count << endl;
-        writer << "# Total records in test data " << training_data.test_data_items_count << endl;
+                sum_weight_gradient_rows(l, x_begin, x_end, batch_size, gradient);
 
-        writer << endl;
+                if (measure_norms) {
+                    for (size_t x = 0; x < (size_t)(x_end - x_begin) * layer_sizes[l]; x++) {
+                        task_gradient_norms[task] += (double)gradient[x] * gradient[x];
+                    }
+                }
 
-        // write csv headers
-        writer << "epoch,accuracy" << endl;
+                if (fused_gradients) {
+                    optimizer.update(l, network->layers[l]->parameters, update_targets[l], gradient,
+                                     x_begin * layer_sizes[l], x_end * layer_sizes[l]);
+                }
+
+                row += x_end - x_begin;
+            }
+        });
+
+        if (has_convolution_layers()) {
+            calculate_convolution_gradient(batch_size);
+        }
+        calculate_factor_gradient(batch_size);
     }
 
     /**
-     * @brief Append to log file. Make sure to call `create_log_file()` before this function.
+     * @brief Number of rows of a layer's weight gradient handed out by `calculate_weight_gradient()`, one for each neuron
+     *        of the previous layer of a fully connected layer, none for other layers or low-rank layers
      */
-    void write_to_log_file(int epoch, float accuracy) {
-        ofstream writer(log_file, ios_base::app);
-        writer << epoch << "," << accuracy << endl;
+    int gradient_rows(int l) const {
+        const Layer *layer = network->layers[l];
+        return layer->kind == Layer::Dense && layer->rank == 0 ? layer_sizes[l - 1] : 0;
     }
 
     /**
-     *?                             ==================================================
-     *?                                               🛈 Training Data
-     *?                             ==================================================
+     * @brief Calculate the gradients of the factors of every low-rank layer of a batch (see 🛈 Low-Rank Layers), once
+     *        every record has been propagated: U's from each record's activations times its V · error, V's from each
+     *        record's in · U times its error, both kept in `factored`. Tasks are a block of `FACTOR_ROWS_PER_TASK` rows
+     *        of U or a row of V, each summed over the records in order, so the result is the same for any number of
+     *        threads.
      *
-     * Training data comprises of two files, input and labels stored in binary files.
-     *
-     * Test data is formatted the same as training data and is used for determining how accurate the neural network is on
-     * data not in the training set. If the neural network performs well on training data and unwell on test data, that
-     * could mean we are over fitting the model.
-     *
-     * Check out /training_data/convert_to_csv.py for documentation and some simple code that can help with understanding
-     * the format of the training data.
+     * @param batch_size Number of records in the batch
      */
+    void calculate_factor_gradient(int batch_size) {
+        auto u_tasks = [](const Layer *layer) {
+            return (layer->previous_layer_size + FACTOR_ROWS_PER_TASK - 1) / FACTOR_ROWS_PER_TASK;
+        };
 
-    /**
-     * @brief Instance of TrainingData object used for storing and reading from training data files
-     */
-    TrainingData training_data;
+        int tasks = 0;
+        for (int l = 1; l < layer_sizes.size(); l++) {
+            if (network->layers[l]->rank > 0) {
+                tasks += u_tasks(network->layers[l]) + network->layers[l]->rank;
+            }
+        }
+
+        parallel_for(tasks, [this, batch_size, &u_tasks](int task) {
+            // find the layer the task is in
+            int l = 1;
+            for (;; l++) {
+                const Layer *layer = network->layers[l];
+                if (layer->rank == 0) {
+                    continue;
+                }
+                if (task < u_tasks(layer) + layer->rank) {
+                    break;
+                }
+                task -= u_tasks(layer) + layer->rank;
+            }
+
+            const Layer *layer = network->layers[l];
+            const int rank = layer->rank;
+            const int size = layer->size;
+            float *u_gradient = gradient_buffer.data() + gradient_offsets[l];
+            float *v_gradient = u_gradient + (size_t)layer->previous_layer_size * rank;
+
+            if (task < u_tasks(layer)) {
+                const int begin = task * FACTOR_ROWS_PER_TASK;
+                const int end = min(begin + FACTOR_ROWS_PER_TASK, layer->previous_layer_size);
+                fill(u_gradient + (size_t)begin * rank, u_gradient + (size_t)end * rank, 0.0f);
+
+                for (int x = begin; x < end; x++) {
+                    float *row = u_gradient + (size_t)x * rank;
+
+                    for (int b = 0; b < batch_size; b++) {
+                        const float activation = activations[b][l - 1][x];
+
+                        // adding 0 changes nothing, and most input pixels are 0
+                        if (activation == 0) {
+                            continue;
+                        }
+
+                        const float *factored_error = factored[b][l - 1] + rank;
+                        for (int k = 0; k < rank; k++) {
+                            row[k] += activation * factored_error[k];
+                        }
+                    }
+                }
+                return;
+            }
+
+            const int k = task - u_tasks(layer);
+            float *row = v_gradient + (size_t)k * size;
+            fill(row, row + size, 0.0f);
+
+            for (int b = 0; b < batch_size; b++) {
+                const float factored_in = factored[b][l - 1][k];
+                for (int y = 0; y < size; y++) {
+                    row[y] += factored_in * error[b][l - 1][y];
+                }
+            }
+        });
+    }
 
     /**
-     * @brief Propagate training data through network and return accuracy
+     * @brief Calculate the kernel gradients of every convolution layer of a batch (see 🛈 Convolution Layers), once every
+     *        record has been propagated. Each task is one row of the kernel between an input channel and a block of
+     *        output channels, summed over the records of the batch in order, so like the rows of fully connected
+     *        layers the result is the same for any number of threads.
      *
-     * @return Accuracy (ex, 0.45 is 45% accuracy)
+     * @param batch_size Number of records in the batch
      */
-    float test_network() {
-
-        // SPDLOG_INFO("Testing neural network on " + to_string(training_data.test_data_items_count) + " test records...");
+    void calculate_convolution_gradient(int batch_size) {
+        auto kernel_rows = [](const Layer *layer) {
+            const FeatureShape &shape = layer->shape;
+            return shape.output.channels / CHANNEL_BLOCK * shape.input.channels * shape.window;
+        };
 
-        if (network == NULL) {
-            throw invalid_function_call("Trainer does not have any network to test on");
+        int tasks = 0;
+        for (int l = 1; l < layer_sizes.size(); l++) {
+            if (network->layers[l]->kind == Layer::Convolution) {
+                tasks += kernel_rows(network->layers[l]);
+            }
         }
 
-        // 2-d array that will store our activations,
-        float **activations_per_layer = new float *[network->layers.size()];
+        parallel_for(tasks, [this, batch_size, &kernel_rows](int task) {
+            // find the layer the row is in
+            int l = 1;
+            for (;; l++) {
+                if (network->layers[l]->kind != Layer::Convolution) {
+                    continue;
+                }
+                if (task < kernel_rows(network->layers[l])) {
+                    break;
+                }
+                task -= kernel_rows(network->layers[l]);
+            }
 
-        for (int x = 0; x < network->layers.size(); x++) {
-            activations_per_layer[x] = new float[network->layers[x]->size];
-        }
+            // rows are numbered in the order the weights are stored, [output block][input channel][kernel row]
+            const FeatureShape &shape = network->layers[l]->shape;
+            const int k_row = task % shape.window;
+            const int channel = task / shape.window % shape.input.channels;
+            const int o_block = task / shape.window / shape.input.channels;
 
-        int correct_guesses = 0; // number of test input that resulted in correct guesses
+            const size_t row_values = (size_t)shape.window * CHANNEL_BLOCK;
+            float *gradient = gradient_buffer.data() + gradient_offsets[l] + task * row_values;
 
-        // for each test item
-        for (int t = 0; t < training_data.test_data_items_count; t++) {
-            // first layer activations should be test input,
-            for (int x = 0; x < network->layers[0]->size; x++) {
-                activations_per_layer[0][x] = training_data.test_data_buffer[t][x];
+            fill(gradient, gradient + row_values, 0.0f);
+            for (int b = 0; b < batch_size; b++) {
+                convolution_weight_gradient(activations[b][l - 1], error[b][l - 1], shape, o_block, channel, k_row,
+                                            gradient);
             }
+        });
+    }
 
-            // initialize hidden & output layer activations to zero
-            for (int x = 1; x < network->layers.size(); x++) {
-                for (int y = 0; y < network->layers[x]->size; y++) {
-                    activations_per_layer[x][y] = 0;
+    /**
+     * @brief Sum the error of every record in the batch into `bias_gradient`, for each neuron, or for each output channel
+     *        of a convolution over every position
+     *
+     * @param batch_size Number of records in the batch
+     */
+    void calculate_bias_gradient(int batch_size) {
+        for (int l = 1; l < layer_sizes.size(); l++) {
+            const Layer *layer = network->layers[l];
+
+            if (layer->kind == Layer::Convolution) {
+                const FeatureMaps &output = layer->shape.output;
+                const int positions = output.height * output.width;
+
+                for (int o_block = 0; o_block < output.channels / CHANNEL_BLOCK; o_block++) {
+                    float *gradient = bias_gradient[l - 1] + o_block * CHANNEL_BLOCK;
+                    fill(gradient, gradient + CHANNEL_BLOCK, 0.0f);
+
+                    for (int b = 0; b < batch_size; b++) {
+                        const float *errors = error[b][l - 1] + o_block * output.block_size();
+                        for (int p = 0; p < positions; p++) {
+                            for (int c = 0; c < CHANNEL_BLOCK; c++) {
+                                gradient[c] += errors[p * CHANNEL_BLOCK + c];
+                            }
+                        }
+                    }
                 }
+                continue;
             }
 
-            network->propagate(activations_per_layer);
+            for (int x = 0; x < layer->bias_count(); x++) {
+                float error_sum = 0;
+                for (int b = 0; b < batch_size; b++) {
+                    error_sum += error[b][l - 1][x];
+                }
+                bias_gradient[l - 1][x] = error_sum;
+            }
+        }
+    }
 
-            // find index of neuron in output layer that has the highest activation,
-            const float *last_layer_activations = activations_per_layer[network->layers.size() - 1];
+    /**
+     * @brief Whether any layer of the network is a convolution or pooling layer
+     */
+    bool has_convolution_layers() const {
+        for (int l = 1; l < network->layers.size(); l++) {
+            if (network->layers[l]->kind != Layer::Dense) {
+                return true;
+            }
+        }
+        return false;
+    }
 
-            int index_of_highest_activation = 0;
-            float highest_activation = last_layer_activations[0];
+    /**
+     * @brief Whether gradient norms need to be measured for the batch size schedule
+     */
+    bool measuring_gradient_noise() const { return batch_schedule.type == BatchSizeSchedule::GradientNoise; }
 
-            // for each neuron in output layer...
-            for (int n = 1; n < network->layers[network->layers.size() - 1]->size; n++) {
-                if (last_layer_activations[n] > highest_activation) {
-                    highest_activation = last_layer_activations[n];
-                    index_of_highest_activation = n;
+    /**
+     * @brief Estimate the squared gradient norms of the batch and of its individual records, once the weight and bias
+     *        gradients of the batch have been calculated, and pass them on to the batch size schedule.
+     *
+     * @param batch_size Number of records in the batch
+     */
+    void add_gradient_noise_sample(int batch_size) {
+        // each record's weight gradient is the outer product of activations and error, so its squared norm is the
+        // product of their squared norms
+        parallel_for(batch_size, [this](int b) {
+            double norm = 0;
+            for (int l = 1; l < layer_sizes.size(); l++) {
+                double activation_norm = 0, error_norm = 0;
+                for (int x = 0; x < layer_sizes[l - 1]; x++) {
+                    activation_norm += (double)activations[b][l - 1][x] * activations[b][l - 1][x];
+                }
+                for (int y = 0; y < layer_sizes[l]; y++) {
+                    error_norm += (double)error[b][l - 1][y] * error[b][l - 1][y];
                 }
+                norm += activation_norm * error_norm + error_norm;
             }
+            record_gradient_norms[b] = norm;
+        });
 
-            // if highest index equals test label, this guess was a success
-            if (training_data.test_labels_buffer[t] == index_of_highest_activation) {
-                // correct guess
-                correct_guesses++;
-            }
+        double record_norm = 0;
+        for (int b = 0; b < batch_size; b++) {
+            record_norm += record_gradient_norms[b];
         }
 
-        for (int x = 0; x < network->layers.size(); x++) {
-            delete[] activations_per_layer[x];
+        double batch_norm = 0;
+        for (double norm : task_gradient_norms) {
+            batch_norm += norm;
+        }
+        for (int l = 1; l < layer_sizes.size(); l++) {
+            for (int y = 0; y < layer_sizes[l]; y++) {
+                batch_norm += (double)bias_gradient[l - 1][y] * bias_gradient[l - 1][y];
+            }
         }
-        delete[] activations_per_layer;
 
-        return correct_guesses / (float)training_data.test_data_items_count;
+        // gradients are sums over the batch, turn them into averages
+        batch_schedule.add_gradient_norms(batch_norm / ((double)batch_size * batch_size), record_norm / batch_size,
+                                          batch_size);
     }
 
     /**
-     * @brief Train neural network for some number of epochs while writing accuracy to a log file.
+     * @brief Sum the weight gradients of a few consecutive rows of a layer's weight matrix over every record in the batch
      *
-     * @param epochs Number of epochs to train for
-     * @param log_accuracy Whether or not to create and write to a log file the accuracy of the network as epochs are trained
+     * @param l Index of the layer
+     * @param x_begin First row (neuron in the previous layer)
+     * @param x_end One past the last row
+     * @param batch_size Number of records in the batch
+     * @param gradient Where to write the gradients, rows one after another
      */
-    void train(int epochs, bool log_accuracy) {
-        SPDLOG_INFO("Training network for {0} epochs", epochs);
-
-        if (log_accuracy) {
-            create_log_file();
-        }
+    void sum_weight_gradient_rows(int l, int x_begin, int x_end, int batch_size, float *gradient) {
+        const int size = layer_sizes[l];
 
-        for (int x = 0; x <= epochs; x++) {
-            float accuracy = test_network();
-            SPDLOG_INFO("Accuracy: {0}%", to_string(accuracy * 100.0f));
+        for (int x = x_begin; x < x_end; x++) {
+            float *row = gradient + (size_t)(x - x_begin) * size;
 
-            if (log_accuracy) {
-                write_to_log_file(x, accuracy);
+            for (int y = 0; y < size; y++) {
+                row[y] = 0;
             }
 
-            SPDLOG_INFO("Training epoch {0}...", x);
-
-            auto t_start = std::chrono::high_resolution_clock::now();
-
-            train_epoch();
+            for (int b = 0; b < batch_size; b++) {
+                float activation = activations[b][l - 1][x];
 
-            auto t_end = std::chrono::high_resolution_clock::now();
-            double elapsed_time_s = std::chrono::duration<double>(t_end - t_start).count();
+                // adding 0 changes nothing, and most input pixels are 0
+                if (activation == 0) {
+                    continue;
+                }
 
-            SPDLOG_DEBUG("Training took {0} seconds", elapsed_time_s);
+                for (int y = 0; y < size; y++) {
+                    row[y] += activation * error[b][l - 1][y];
+                }
+            }
         }
     }
 
     /**
-     * @brief Train the network on one epoch of training data. The neural network is given the training data in batches.
-     *        If there are N batches of training data, an epoch occurs when all N batches have been seen by the network once.
+     * @brief Pin the training threads to CPUs, a contiguous block of threads per NUMA node
      */
-    void train_epoch() {
-        if (network == NULL) {
-            throw invalid_function_call("Trainer does not have any network to train");
+    void pin_threads() {
+        if (thread_pool == NULL) {
+            return;
         }
 
-        for (int x = 0; x < training_data.total_batch_count; x++) {
-            train_next_batch();
+        if (!calling_thread_pinned) {
+            calling_thread_pinned =
+                pthread_getaffinity_np(pthread_self(), sizeof(unpinned_affinity), &unpinned_affinity) == 0;
+        }
+
+        for (int t = 0; t < thread_pool->size(); t++) {
+            int cpu = numa_topology.cpu_of_thread(t, thread_pool->size());
+            if (!thread_pool->pin_thread(t, cpu)) {
+                SPDLOG_WARN("Unable to pin training thread {0} to CPU {1}", t, cpu);
+            }
         }
     }
 
     /**
-     * @brief Train the network on the next batch of training data. Note that the last batch may be smaller than batch size.
+     * @brief Let the calling thread (training thread 0) run on every CPU it could before `pin_threads()` pinned it, until
+     *        it's pinned again. Threads inherit the CPUs of the thread that starts them, so background threads started
+     *        from a pinned thread would all share training thread 0's CPU rather than use idle ones.
      */
-    void train_next_batch() {
-        // SPDLOG_INFO("Training batch " + to_string(training_data.current_batch) + "/" +
-        // to_string(training_data.total_batch_count));
-
-        training_data.get_next_training_data_batch();
-        training_data.get_next_training_labels_batch();
+    void unpin_calling_thread() {
+        if (calling_thread_pinned) {
+            pthread_setaffinity_np(pthread_self(), sizeof(unpinned_affinity), &unpinned_affinity);
+        }
+    }
 
-        int batch_size = training_data.batch_size;
-        if (training_data.current_batch == training_data.total_batch_count) {
-            // on the last batch so batch size will be different,
-            batch_size = training_data.training_data_items_count % batch_size;
+    /**
+     * @brief Run a function for every record of a batch. With NUMA placement each thread always gets the same
+     *        contiguous range of records, so it only touches memory on its own node, otherwise records are handed out
+     *        to whichever thread is free like `parallel_for()`.
+     */
+    void parallel_records(int count, FunctionRef<void(int)> function) {
+        if (!numa || thread_pool == NULL) {
+            parallel_for(count, function);
+            return;
         }
 
-        // set all values to zero in activations and weight_gradient matrix.
+        const int threads = thread_pool->size();
+        const int per_thread = (allocated_batch_size + threads - 1) / threads;
 
-        for (int b = 0; b < training_data.batch_size; b++) {
-            for (int l = 0; l < network->layers.size(); l++) {
-                for (int x = 0; x < network->layers[l]->size; x++) {
-                    activations[b][l][x] = 0;
-                }
+        thread_pool->run_on_each_thread([&function, count, per_thread](int thread) {
+            int end = min(count, (thread + 1) * per_thread);
+            for (int b = thread * per_thread; b < end; b++) {
+                function(b);
             }
-        }
+        });
+    }
 
-        for (int l = 1; l < network->layers.size(); l++) {
-            for (int x = 0; x < network->layers[l - 1]->size; x++) {
-                for (int y = 0; y < network->layers[l]->size; y++) {
-                    weight_gradient[l - 1][x][y] = 0;
-                }
+    /**
+     * @brief Run a loop on the trainer's threads, or on the calling thread when training single threaded.
+     */
+    void parallel_for(int count, FunctionRef<void(int)> function) {
+        if (thread_pool != NULL) {
+            thread_pool->parallel_for(count, function);
+        } else {
+            for (int x = 0; x < count; x++) {
+                function(x);
             }
         }
+    }
 
-        for (int x = 0; x < batch_size; x++) {
-            train_record(training_data.training_data_batch_buffer[x], training_data.training_labels_batch_buffer[x], x);
+    /**
+     * @brief Like `parallel_for()`, also passing the index of the thread running each iteration, for per-thread
+     *        scratch buffers. Iterations are still handed out to whichever thread is free.
+     */
+    void parallel_for_threads(int count, FunctionRef<void(int, int)> function) {
+        if (thread_pool == NULL) {
+            for (int x = 0; x < count; x++) {
+                function(x, 0);
+            }
+            return;
         }
 
-        // weight gradients now contains the sum of weight gradients of all training records,
-        // dividing each gradient by the batch size gives us the average gradient vector of all
-        // training records in the batch. Now we update the weights and biases,
+        atomic<int> next{0};
+        thread_pool->run_on_each_thread([&next, count, &function](int thread) {
+            for (int x = next++; x < count; x = next++) {
+                function(x, thread);
+            }
+        });
+    }
 
-        /**
-         * @brief The average weight gradient is dW/dC * (step_size / batch_size)
-         *        rather than calculating this everytime, we do it once here.
-         */
-        float coefficient = step_size / training_data.batch_size;
+    /**
+     * @brief Number of threads used for training, 1 when training on the calling thread only
+     */
+    int thread_count() const { return thread_pool != NULL ? thread_pool->size() : 1; }
 
-        // first update weights
-        for (int l = 1; l < layer_sizes.size(); l++) {
-            for (int x = 0; x < layer_sizes[l - 1]; x++) {
-                for (int y = 0; y < layer_sizes[l]; y++) {
-                    network->layers[l]->weights[x][y] -= weight_gradient[l - 1][x][y] * coefficient;
-                }
-            }
-        }
+    /**
+     * @brief Sum the weight and bias gradients of the current batch across all processes taking part in distributed
+     *        training. Afterwards `weight_gradient` and `bias_gradient` contain the sums.
+     */
+    void all_reduce_gradients() { communicator->all_reduce(gradient_buffer.data(), gradient_buffer.size()); }
+
+    /**
+     * @brief Copy the weights and biases of the first process to all other processes taking part in distributed training,
+     *        so every process starts from the same network.
+     */
+    void synchronize_network() {
+        size_t count = 0;
+        network->detach();
 
-        // now update biases, we need to calculate average bias change for each neuron first
+        // every layer's weights and biases are contiguous, so they can be broadcast in place
         for (int l = 1; l < layer_sizes.size(); l++) {
-            for (int x = 0; x < layer_sizes[l]; x++) {
-                float average_error = 0;
-                for (int b = 0; b < training_data.batch_size; b++) {
-                    average_error += error[b][l - 1][x];
-                }
-                average_error /= training_data.batch_size;
-                network->layers[l]->biases[x] -= average_error * step_size;
-            }
+            communicator->broadcast(network->layers[l]->parameters, network->layers[l]->parameter_count());
+            count += network->layers[l]->parameter_count();
         }
+
+        SPDLOG_INFO("Synchronized {0} weights and biases with rank 0", count);
     }
 
     /**
@@ -416,12 +2821,14 @@ class Trainer {
      * @param label Label for this record
      * @param batch_record_index Index in record that this batch is part of
      */
-    void train_record(float *record, unsigned char label, int batch_record_index) {
+    void train_record(const float *record, unsigned char label, int batch_record_index) {
         // load record into input layer
         for (int x = 0; x < network->layers[0]->size; x++) {
             activations[batch_record_index][0][x] = record[x];
         }
 
-        network->propagate_backpropagate(activations[batch_record_index], error[batch_record_index], weight_gradient, label);
+        // the weight gradient is calculated for the whole batch at once afterwards, see `calculate_weight_gradient()`
+        network->calculate_error(activations[batch_record_index], error[batch_record_index], label,
+                                 factored[batch_record_index]);
     }
 };
\ No newline at end of file
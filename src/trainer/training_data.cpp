@@ -1,9 +1,16 @@
+#pragma once
+
+#include <algorithm>
 #include <fstream>
+#include <random>
 #include <sstream> // for parsing comma deliminated string
 #include <string>
+#include <vector>
 
 #include "../logging.h"
 #include "../utils/endian.cpp"
+#include "../utils/huge_pages.cpp"
+#include "../utils/numa.cpp"
 
 using namespace std;
 
@@ -13,6 +20,38 @@ using namespace std;
  */
 class TrainingData {
   private:
+    /**
+     * @brief Number of rows allocated in `training_data_batch_buffer`, needed to free it if `batch_size` changes
+     */
+    int allocated_batch_size = 0;
+
+    /**
+     * @brief Block every row of `test_data_buffer` points into, NULL when the test data belongs to another object
+     */
+    float *test_data_block = NULL;
+
+    /**
+     * @brief Blocks the rows of `training_data_buffer` point into once the training data has been split between NUMA
+     *        nodes by `place_on_nodes()`, one per node. Empty otherwise.
+     */
+    vector<float *> node_blocks;
+
+    /**
+     * @brief Raw bytes of one training record, when reading batches from file
+     */
+    vector<uint8_t> record_bytes;
+
+    /**
+     * @brief Free `test_data_buffer` along with the block its rows point into
+     */
+    void free_test_data() {
+        HugePageAllocator::instance().free(test_data_block);
+        test_data_block = NULL;
+
+        delete[] test_data_buffer;
+        test_data_buffer = NULL;
+    }
+
   public:
     /**
      * @brief Number of items in single batch
@@ -94,7 +133,46 @@ class TrainingData {
     unsigned char *training_labels_batch_buffer = NULL;
 
     /**
-     * @brief 2-D array containing test data.
+     * @brief When enabled, the order of records is shuffled at the start of every epoch. Only used when the training data
+     *        has been loaded into memory.
+     */
+    bool shuffle = false;
+
+    /**
+     * @brief Random engine used for shuffling records. Seed it to get the same order every run.
+     */
+    default_random_engine shuffle_engine;
+
+    /**
+     * @brief Order in which records are read during this epoch when shuffling
+     */
+    vector<int> record_order;
+
+    /**
+     * @brief 2-D array containing the entire training data set, once it has been loaded into memory using
+     *        `load_training_data()`. Every row points into one contiguous block of memory. NULL when training data is read
+     *        from file one batch at a time.
+     */
+    float **training_data_buffer = NULL;
+
+    /**
+     * @brief 1-D array containing every training label, once loaded into memory using `load_training_data()`.
+     */
+    unsigned char *training_labels_buffer = NULL;
+
+    /**
+     * @brief Index of the first record of each NUMA node's shard of the training data, followed by the number of
+     *        records, once placed by `place_on_nodes()`. Empty when the training data isn't split between nodes.
+     */
+    vector<int> node_shard_begin;
+
+    /**
+     * @brief Whether the training and test data buffers belong to another TrainingData object, see `share_data_with()`.
+     */
+    bool shares_data = false;
+
+    /**
+     * @brief 2-D array containing test data. Every row points into one contiguous block of memory.
      */
     float **test_data_buffer = NULL;
 
@@ -112,6 +190,7 @@ class TrainingData {
         SPDLOG_INFO("Opening training data file '" + path + "' ...");
 
         delete training_data_file;
+        unload_training_data();
 
         training_data_path = path;
         training_data_file = new ifstream(path, ios::in | ios::binary);
@@ -135,7 +214,7 @@ class TrainingData {
 
             // initialize training data bufferarray, first delete old one incase batch size or bytes-per-item changes
             if (training_data_batch_buffer != NULL) {
-                for (int x = 0; x < batch_size; x++) {
+                for (int x = 0; x < allocated_batch_size; x++) {
                     delete[] training_data_batch_buffer[x];
                 }
                 delete[] training_data_batch_buffer;
@@ -147,6 +226,9 @@ class TrainingData {
             for (int x = 0; x < batch_size; x++) {
                 training_data_batch_buffer[x] = new float[values_per_input];
             }
+
+            allocated_batch_size = batch_size;
+            record_bytes.resize(values_per_input);
         }
     }
 
@@ -159,6 +241,7 @@ class TrainingData {
         SPDLOG_INFO("Opening training labels file '" + path + "' ...");
 
         delete training_labels_file;
+        unload_training_data();
 
         training_labels_path = path;
         training_labels_file = new ifstream(path, ios::in | ios::binary);
@@ -212,18 +295,16 @@ class TrainingData {
                          to_string(input_columns));
 
             // initialize test data bufferarray, first delete old one incase item count or bytes-per-item changes
-            if (test_data_buffer != NULL) {
-                for (int x = 0; x < test_data_items_count; x++) {
-                    delete[] test_data_buffer[x];
-                }
-                delete[] test_data_buffer;
-            }
+            free_test_data();
 
             const int values_per_input = input_rows * input_columns;
 
+            test_data_block = (float *)HugePageAllocator::instance().allocate(
+                (size_t)test_data_items_count * values_per_input * sizeof(float), "test data");
+
             test_data_buffer = new float *[test_data_items_count];
             for (int x = 0; x < test_data_items_count; x++) {
-                test_data_buffer[x] = new float[values_per_input];
+                test_data_buffer[x] = test_data_block + (size_t)x * values_per_input;
             }
         }
     }
@@ -274,56 +355,374 @@ class TrainingData {
     }
 
     /**
-     * @brief Get the next training batch from training data file
+     * @brief Read the entire training data set and its labels into memory. Once loaded, batches are copied from memory
+     *        rather than read from file, and the whole data set can be accessed at random through
+     *        `training_data_buffer` and `training_labels_buffer`.
+     *
+     * The data set can be split into equally sized shards, in which case only one shard is loaded and it takes the place
+     * of the whole training data set (`training_data_items_count` and `total_batch_count` only count the shard). Records
+     * left over when the data set doesn't split evenly are dropped so that every shard has the same number of batches.
+     *
+     * @param shard Index of the shard to load
+     * @param shards Number of shards the data set is split into
      */
-    void get_next_training_data_batch() {
+    void load_training_data(int shard = 0, int shards = 1) {
         verify_file_open(training_data_file, "Training data");
+        verify_file_open(training_labels_file, "Training labels");
 
-        int bytes_per_item = input_rows * input_columns;
+        if (shards < 1 || shard < 0 || shard >= shards) {
+            throw invalid_argument("Invalid training data shard " + to_string(shard) + " of " + to_string(shards));
+        }
 
-        uint8_t temp; // temporarily stores byte to be converted to float
+        unload_training_data();
+
+        const int values_per_input = input_rows * input_columns;
+
+        // re-read the item count from the labels file in case an earlier call replaced it with a shard's size
+        training_labels_file->clear();
+        training_labels_file->seekg(4);
+        int32_t total_items = file_read_big_endian_int32(*training_labels_file);
+
+        int32_t shard_items = total_items / shards;
+        int32_t first_item = shard_items * shard;
+
+        if (shards > 1) {
+            SPDLOG_INFO("Loading training shard {0}/{1} ({2} records starting at {3}) into memory...", shard, shards,
+                        shard_items, first_item);
+        } else {
+            SPDLOG_INFO("Loading {0} training records into memory...", shard_items);
+        }
+
+        training_data_items_count = shard_items;
+        total_batch_count = (int)ceil(training_data_items_count / (float)batch_size);
+
+        // read the raw bytes all at once, reading them one at a time is very slow
+        vector<uint8_t> bytes((size_t)training_data_items_count * values_per_input);
+
+        training_data_file->clear();
+        training_data_file->seekg(16 + (streamoff)first_item * values_per_input);
+        training_data_file->read((char *)bytes.data(), bytes.size());
+
+        training_labels_buffer = new unsigned char[training_data_items_count];
+
+        training_labels_file->seekg(8 + (streamoff)first_item);
+        training_labels_file->read((char *)training_labels_buffer, training_data_items_count);
+
+        if (training_data_file->fail() || training_labels_file->fail()) {
+            delete[] training_labels_buffer;
+            training_labels_buffer = NULL;
+            throw invalid_argument("Training data or labels file ended before all " +
+                                   to_string(training_data_items_count) + " records could be read");
+        }
+
+        float *block =
+            (float *)HugePageAllocator::instance().allocate(bytes.size() * sizeof(float), "resident training data");
+        for (size_t x = 0; x < bytes.size(); x++) {
+            block[x] = bytes[x] / 255.0f; // normalize input between 0 and 1
+        }
+
+        training_data_buffer = new float *[training_data_items_count];
+        for (int x = 0; x < training_data_items_count; x++) {
+            training_data_buffer[x] = block + (size_t)x * values_per_input;
+        }
+
+        // batches now come from memory, start again from the first record
+        current_record = 0;
+        current_batch = 0;
+    }
+
+    /**
+     * @brief Use the training and test data already loaded into memory by another TrainingData object rather than loading
+     *        another copy. The data is only ever read, so any number of TrainingData objects can share it, even from
+     *        different threads. Each keeps its own batch size, batch buffers and position in the data.
+     *
+     *        The other object must have loaded its training data using `load_training_data()` as well as its test data,
+     *        and must outlive this one.
+     *
+     * @param source TrainingData object that owns the data
+     */
+    void share_data_with(const TrainingData &source) {
+        if (source.training_data_buffer == NULL || source.test_data_buffer == NULL) {
+            throw invalid_function_call("Training and test data must be loaded into memory before they can be shared");
+        }
+
+        unload_training_data();
+
+        shares_data = true;
+
+        training_data_path = source.training_data_path;
+        training_labels_path = source.training_labels_path;
+        test_data_path = source.test_data_path;
+        test_labels_path = source.test_labels_path;
+
+        input_rows = source.input_rows;
+        input_columns = source.input_columns;
+        training_data_items_count = source.training_data_items_count;
+        test_data_items_count = source.test_data_items_count;
+
+        training_data_buffer = source.training_data_buffer;
+        training_labels_buffer = source.training_labels_buffer;
+        test_data_buffer = source.test_data_buffer;
+        test_labels_buffer = source.test_labels_buffer;
+
+        allocate_batch_buffers();
+        rewind();
+    }
+
+    /**
+     * @brief Change the number of records in each batch, reallocating the batch buffers. Should only be called between
+     *        epochs, reading starts again from the first record.
+     *
+     * @param size New batch size
+     */
+    void set_batch_size(int size) {
+        if (size < 1) {
+            throw invalid_argument("Batch size must be at least 1");
+        }
+
+        batch_size = size;
+
+        if (training_data_file != NULL || training_data_buffer != NULL) {
+            allocate_batch_buffers();
+            rewind();
+        }
+    }
 
+    /**
+     * @brief Allocate the training batch buffers for the current batch size and input size, replacing any old ones.
+     */
+    void allocate_batch_buffers() {
+        if (training_data_batch_buffer != NULL) {
+            for (int x = 0; x < allocated_batch_size; x++) {
+                delete[] training_data_batch_buffer[x];
+            }
+            delete[] training_data_batch_buffer;
+        }
+        delete[] training_labels_batch_buffer;
+
+        const int values_per_input = input_rows * input_columns;
+
+        training_data_batch_buffer = new float *[batch_size];
         for (int x = 0; x < batch_size; x++) {
-            for (int y = 0; y < bytes_per_item; y++) {
-                training_data_file->read((char *)(&temp), 1);
-                training_data_batch_buffer[x][y] = temp / 255.0f; // normalize input between 0 and 1
-                current_record++;
+            training_data_batch_buffer[x] = new float[values_per_input];
+        }
+
+        training_labels_batch_buffer = new unsigned char[batch_size];
+
+        allocated_batch_size = batch_size;
+        total_batch_count = (int)ceil(training_data_items_count / (float)batch_size);
+    }
+
+    /**
+     * @brief Split the training data loaded into memory into one contiguous shard per NUMA node, in proportion to each
+     *        node's CPUs, and move each shard into memory on its node. Each shard is copied by a thread running on its
+     *        node, so its pages are placed there on first touch. Records keep their order and indexes.
+     *
+     * @param topology Nodes to split the data between
+     */
+    void place_on_nodes(const NumaTopology &topology) {
+        if (training_data_buffer == NULL || shares_data) {
+            throw invalid_function_call("Training data must be loaded into memory by this object to place it on nodes");
+        }
+
+        const int values_per_input = input_rows * input_columns;
+        const int nodes = topology.size();
+
+        int total_cpus = 0;
+        for (const NumaTopology::Node &node : topology.nodes) {
+            total_cpus += node.cpus.size();
+        }
+
+        node_shard_begin.assign(nodes + 1, training_data_items_count);
+        int cpus_before = 0;
+        for (int n = 0; n < nodes; n++) {
+            node_shard_begin[n] = (long)training_data_items_count * cpus_before / total_cpus;
+            cpus_before += topology.nodes[n].cpus.size();
+        }
+
+        float *old_block = node_blocks.empty() ? training_data_buffer[0] : NULL;
+        vector<float *> old_blocks = node_blocks;
+        node_blocks.assign(nodes, NULL);
+
+        for (int n = 0; n < nodes; n++) {
+            int first = node_shard_begin[n], last = node_shard_begin[n + 1];
+            size_t values = (size_t)(last - first) * values_per_input;
+
+            topology.run_on_node(n, [this, n, first, last, values, values_per_input] {
+                node_blocks[n] = (float *)HugePageAllocator::instance().allocate(
+                    values * sizeof(float), "training data shard, node " + to_string(n));
+
+                for (int x = first; x < last; x++) {
+                    float *row = node_blocks[n] + (size_t)(x - first) * values_per_input;
+                    copy(training_data_buffer[x], training_data_buffer[x] + values_per_input, row);
+                    training_data_buffer[x] = row;
+                }
+            });
+
+            SPDLOG_INFO("Placed training records {0}-{1} on NUMA node {2}", first, last - 1, topology.nodes[n].id);
+        }
+
+        HugePageAllocator::instance().free(old_block);
+        for (float *block : old_blocks) {
+            HugePageAllocator::instance().free(block);
+        }
+    }
+
+    /**
+     * @brief Free the training data loaded by `load_training_data()`, batches will be read from file again.
+     */
+    void unload_training_data() {
+        if (shares_data) {
+            // the data belongs to another object, just forget about it
+            training_data_buffer = NULL;
+            training_labels_buffer = NULL;
+            return;
+        }
+
+        if (training_data_buffer != NULL) {
+            if (node_blocks.empty()) {
+                HugePageAllocator::instance().free(training_data_buffer[0]);
             }
-            if (training_data_file->eof()) {
-                break;
+            for (float *block : node_blocks) {
+                HugePageAllocator::instance().free(block);
             }
+            node_blocks.clear();
+            node_shard_begin.clear();
+
+            delete[] training_data_buffer;
+            training_data_buffer = NULL;
         }
 
-        current_batch++;
+        delete[] training_labels_buffer;
+        training_labels_buffer = NULL;
+    }
 
-        // if we've reached the end of the training data file, re-open so that we loop back
-        if (training_data_file->eof()) {
+    /**
+     * @brief Start reading training batches from the first record again.
+     */
+    void rewind() {
+        current_record = 0;
+        current_batch = 0;
+
+        if (training_data_file != NULL) {
             training_data_file->clear();
             training_data_file->seekg(16);
-            current_record = 0;
-            current_batch = 0;
+        }
+
+        if (training_labels_file != NULL) {
+            training_labels_file->clear();
+            training_labels_file->seekg(8);
         }
     }
 
     /**
-     * @brief Get the next training labels batch from training labels data file
+     * @brief Carry on reading training batches from a record, ex. when resuming training from a checkpoint
+     *
+     * @param record Index of the next record to read, `training_data_items_count` if the last batch has been read
+     * @param batch Number of batches read before that record in this epoch
      */
-    void get_next_training_labels_batch() {
-        verify_file_open(training_labels_file, "Training labels");
+    void seek(int record, int batch) {
+        if (record < 0 || record > training_data_items_count || batch < 0 || batch > total_batch_count) {
+            throw invalid_argument("Cannot continue from training record " + to_string(record) + ", batch " +
+                                   to_string(batch) + ", there are " + to_string(training_data_items_count) +
+                                   " records in " + to_string(total_batch_count) + " batches");
+        }
 
-        for (int x = 0; x < batch_size; x++) {
-            training_labels_file->read((char *)(&training_labels_batch_buffer[x]), 1);
-            if (training_labels_file->eof()) {
-                break;
+        rewind();
+        current_record = record;
+        current_batch = batch;
+
+        if (training_data_buffer == NULL) {
+            const int values_per_input = input_rows * input_columns;
+
+            verify_file_open(training_data_file, "Training data");
+            verify_file_open(training_labels_file, "Training labels");
+            training_data_file->seekg(16 + (streamoff)record * values_per_input);
+            training_labels_file->seekg(8 + (streamoff)record);
+        }
+    }
+
+    /**
+     * @brief Get the next training batch and its labels. Copied from memory if the training data has been loaded using
+     *        `load_training_data()`, otherwise read from the training data and labels files.
+     */
+    void get_next_training_batch() {
+        // the previous batch was the last one, loop back to the start
+        if (current_record >= training_data_items_count) {
+            rewind();
+        }
+
+        if (training_data_buffer == NULL) {
+            // the last batch is cut short
+            int count = min(batch_size, training_data_items_count - current_record);
+
+            get_next_training_data_batch(count);
+            get_next_training_labels_batch(count);
+
+            current_record += count;
+            current_batch++;
+            return;
+        }
+
+        if (shuffle && current_record == 0) {
+            // new epoch, new order
+            record_order.resize(training_data_items_count);
+            for (int x = 0; x < training_data_items_count; x++) {
+                record_order[x] = x;
             }
+            std::shuffle(record_order.begin(), record_order.end(), shuffle_engine);
         }
 
-        // if we've reached the end of the training labels file, re-open so that we loop back
-        if (training_labels_file->eof()) {
-            training_labels_file->clear();
-            training_labels_file->seekg(8);
-            current_record = 0;
-            current_batch = 0;
+        const int values_per_input = input_rows * input_columns;
+
+        for (int x = 0; x < batch_size && current_record < training_data_items_count; x++) {
+            int record = shuffle ? record_order[current_record] : current_record;
+
+            copy(training_data_buffer[record], training_data_buffer[record] + values_per_input,
+                 training_data_batch_buffer[x]);
+            training_labels_batch_buffer[x] = training_labels_buffer[record];
+            current_record++;
+        }
+
+        current_batch++;
+    }
+
+    /**
+     * @brief Read the next records of the training data file into the batch buffer. Doesn't move `current_record`,
+     *        `get_next_training_batch()` does once the labels are read too.
+     *
+     * @param count Number of records to read
+     */
+    void get_next_training_data_batch(int count) {
+        verify_file_open(training_data_file, "Training data");
+
+        int bytes_per_item = input_rows * input_columns;
+
+        for (int x = 0; x < count; x++) {
+            training_data_file->read((char *)record_bytes.data(), bytes_per_item);
+            if (training_data_file->fail()) {
+                throw invalid_argument("Training data file ended at record " + to_string(current_record + x) +
+                                       " of " + to_string(training_data_items_count));
+            }
+
+            for (int y = 0; y < bytes_per_item; y++) {
+                training_data_batch_buffer[x][y] = record_bytes[y] / 255.0f; // normalize input between 0 and 1
+            }
+        }
+    }
+
+    /**
+     * @brief Read the labels of the next records from the training labels file into the batch buffer
+     *
+     * @param count Number of labels to read
+     */
+    void get_next_training_labels_batch(int count) {
+        verify_file_open(training_labels_file, "Training labels");
+
+        training_labels_file->read((char *)training_labels_batch_buffer, count);
+        if (training_labels_file->fail()) {
+            throw invalid_argument("Training labels file ended before record " + to_string(current_record + count) +
+                                   " of " + to_string(training_data_items_count));
         }
     }
 
@@ -363,22 +762,22 @@ class TrainingData {
         delete test_labels_file;
 
         if (training_data_batch_buffer != NULL) {
-            for (int x = 0; x < batch_size; x++) {
+            for (int x = 0; x < allocated_batch_size; x++) {
                 delete[] training_data_batch_buffer[x];
             }
         }
         delete[] training_data_batch_buffer;
 
-        if (test_data_buffer != NULL) {
-            for (int x = 0; x < test_data_items_count; x++) {
-                delete[] test_data_buffer[x];
-            }
+        if (!shares_data) {
+            free_test_data();
+
+            delete[] test_labels_buffer;
         }
-        delete[] test_data_buffer;
 
-        delete[] test_labels_buffer;
         delete[] training_labels_batch_buffer;
 
+        unload_training_data();
+
         SPDLOG_DEBUG("Deleted training data");
     }
 };
\ No newline at end of file
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "../logging.h"
+
+/**
+ *?                             ==================================================
+ *?                                           🛈 Allocation Tracking
+ *?                             ==================================================
+ *
+ * Once training is warmed up, every buffer it needs already exists, so a heap allocation inside the batch loop or while
+ * testing is wasted time (and a sign of a buffer being rebuilt that shouldn't be). Building with the CMake option
+ * TRACK_ALLOCATIONS replaces the global `operator new`/`operator delete` and, with glibc, `malloc` and friends, with
+ * versions that count every allocation and attribute it to the phase of training the allocating thread is in.
+ *
+ * Whoever enters a phase says whether it's warming up, ex. the first batch after the trainer's buffers were (re)allocated
+ * is, later batches aren't. Allocations in the batch or test phases outside of warm-up are steady state allocations:
+ * they're reported at the end of training and make the process exit with an error.
+ *
+ * Phases belong to threads. Threads of a `ThreadPool` take on the phase of the thread that handed them work, other
+ * threads are in the setup phase until they enter another one.
+ *
+ * Without TRACK_ALLOCATIONS nothing is hooked and every count stays 0.
+ */
+
+/**
+ * @brief Counts heap allocations per phase of training
+ */
+class AllocationTracker {
+  public:
+    /**
+     * @brief Background is for threads running alongside training, ex. the asynchronous evaluator
+     */
+    enum Phase { Setup, Epoch, Batch, Test, Background, PHASES };
+
+    /**
+     * @brief Phase of a thread, and whether it's warming up
+     */
+    struct ThreadState {
+        int phase;
+        bool warm_up;
+    };
+
+    static const char *phase_name(int phase) {
+        static const char *names[] = {"setup", "between batches", "train_next_batch", "test_network", "background"};
+        return names[phase];
+    }
+
+    static bool enabled() {
+#ifdef TRACK_ALLOCATIONS
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * @brief Called by the hooks for every allocation
+     */
+    static void record() {
+        counts[state.phase].fetch_add(1, std::memory_order_relaxed);
+        if (!state.warm_up) {
+            steady_counts[state.phase].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Allocations made in a phase, in total and outside of warm-up
+     */
+    static long count(Phase phase) { return counts[phase]; }
+    static long steady_count(Phase phase) { return steady_counts[phase]; }
+
+    /**
+     * @brief Whether no batch or test allocated anything outside of warm-up
+     */
+    static bool steady_state_clean() { return steady_counts[Batch] == 0 && steady_counts[Test] == 0; }
+
+    /**
+     * @brief Log the allocations of every phase
+     */
+    static void log_report() {
+        if (!enabled()) {
+            return;
+        }
+
+        SPDLOG_INFO("Heap allocations per phase:");
+        for (int phase = 0; phase < PHASES; phase++) {
+            SPDLOG_INFO("  {0}: {1} calls, {2} allocations, {3} after warm-up", phase_name(phase), calls[phase].load(),
+                        counts[phase].load(), steady_counts[phase].load());
+        }
+
+        if (!steady_state_clean()) {
+            SPDLOG_ERROR("Training allocated memory after warm-up, every buffer should be allocated before the first batch");
+        }
+    }
+
+    static ThreadState thread_state() { return state; }
+
+    /**
+     * @brief Puts the calling thread in a state until destroyed, then puts it back in the state it was in before
+     */
+    class Scope {
+      public:
+        /**
+         * @param phase Phase to enter
+         * @param warm_up Whether allocations are expected, ex. on the first batch after buffers were reallocated
+         */
+        Scope(Phase phase, bool warm_up = false) : Scope(ThreadState{phase, warm_up}) {
+            calls[phase].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Take on the state of another thread, used by threads doing work for it
+         */
+        explicit Scope(ThreadState adopted) : previous(state) { state = adopted; }
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+        ~Scope() { state = previous; }
+
+      private:
+        ThreadState previous;
+    };
+
+  private:
+    static std::atomic<long> counts[PHASES];
+    static std::atomic<long> steady_counts[PHASES];
+    static std::atomic<long> calls[PHASES];
+
+    /**
+     * @brief State of the calling thread, threads start out warming up in the setup phase
+     */
+    static thread_local ThreadState state;
+};
+
+inline std::atomic<long> AllocationTracker::counts[PHASES];
+inline std::atomic<long> AllocationTracker::steady_counts[PHASES];
+inline std::atomic<long> AllocationTracker::calls[PHASES];
+inline thread_local AllocationTracker::ThreadState AllocationTracker::state{Setup, true};
+
+#ifdef TRACK_ALLOCATIONS
+
+#ifdef __GLIBC__
+// glibc's own allocator, so the hooks below can count malloc calls without counting operator new twice
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *address, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *address);
+
+void *malloc(size_t size) {
+    AllocationTracker::record();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    AllocationTracker::record();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *address, size_t size) {
+    AllocationTracker::record();
+    return __libc_realloc(address, size);
+}
+
+void free(void *address) { __libc_free(address); }
+}
+
+static void *tracked_allocate(size_t size) { return __libc_malloc(size == 0 ? 1 : size); }
+static void *tracked_allocate_aligned(size_t size, size_t alignment) {
+    return __libc_memalign(alignment, size == 0 ? 1 : size);
+}
+static void tracked_free(void *address) { __libc_free(address); }
+#else
+static void *tracked_allocate(size_t size) { return std::malloc(size == 0 ? 1 : size); }
+static void *tracked_allocate_aligned(size_t size, size_t alignment) {
+    return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+static void tracked_free(void *address) { std::free(address); }
+#endif
+
+void *operator new(size_t size) {
+    AllocationTracker::record();
+    void *address = tracked_allocate(size);
+    if (address == NULL) {
+        throw std::bad_alloc();
+    }
+    return address;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    AllocationTracker::record();
+    return tracked_allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept { return operator new(size, tag); }
+
+void *operator new(size_t size, std::align_val_t alignment) {
+    AllocationTracker::record();
+    void *address = tracked_allocate_aligned(size, (size_t)alignment);
+    if (address == NULL) {
+        throw std::bad_alloc();
+    }
+    return address;
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) { return operator new(size, alignment); }
+
+void operator delete(void *address) noexcept { tracked_free(address); }
+void operator delete[](void *address) noexcept { tracked_free(address); }
+void operator delete(void *address, size_t) noexcept { tracked_free(address); }
+void operator delete[](void *address, size_t) noexcept { tracked_free(address); }
+void operator delete(void *address, std::align_val_t) noexcept { tracked_free(address); }
+void operator delete[](void *address, std::align_val_t) noexcept { tracked_free(address); }
+void operator delete(void *address, size_t, std::align_val_t) noexcept { tracked_free(address); }
+void operator delete[](void *address, size_t, std::align_val_t) noexcept { tracked_free(address); }
+
+#endif
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <string>
+#include <type_traits>
+
+#include "../exceptions.h"
+#include "huge_pages.cpp"
+
+/**
+ *?                             ==================================================
+ *?                                                 🛈 Arenas
+ *?                             ==================================================
+ *
+ * Scratch buffers like the activations and errors of every record in a batch are made of many small arrays that are all
+ * allocated together and freed together. Allocating each one with `new[]` costs a call to the allocator per array,
+ * scatters them across the heap, and needs a matching loop of `delete[]` to free them.
+ *
+ * An arena (or bump allocator) instead reserves one slab of memory up front and hands out consecutive pieces of it by
+ * moving a pointer forward. Every piece is aligned to a cache line. Nothing is freed on its own, the whole slab is
+ * released (or reused after `reset()`) at once, so teardown costs the same no matter how many arrays were carved out.
+ *
+ * Only trivially destructible types (floats, pointers) can be allocated, since no destructors are ever run. Slabs come
+ * from `HugePageAllocator`, so large arenas get huge pages when they're enabled.
+ */
+
+/**
+ * @brief One aligned slab of memory that arrays are carved out of, freed all at once
+ */
+class Arena {
+  private:
+    char *slab = NULL;
+    size_t slab_capacity = 0;
+    size_t used = 0;
+
+    /**
+     * @brief Shown in the huge page report
+     */
+    std::string name;
+
+  public:
+    /**
+     * @brief Every allocation starts on its own cache line, so arrays used by different threads never share one
+     */
+    static const size_t ALIGNMENT = 64;
+
+    explicit Arena(const std::string &name = "scratch") : name(name) {}
+
+    /**
+     * @brief Create an arena with room for `capacity` bytes
+     */
+    explicit Arena(size_t capacity, const std::string &name = "scratch") : name(name) { reserve(capacity); }
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena() { release(); }
+
+    /**
+     * @brief Round a number of bytes up to a multiple of `ALIGNMENT`
+     */
+    static size_t aligned(size_t bytes) { return (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; }
+
+    /**
+     * @brief Space an array of `count` values of type T takes up in an arena, used to work out how big an arena needs to
+     *        be before carving anything out of it
+     */
+    template <typename T> static size_t bytes_for(size_t count) { return aligned(count * sizeof(T)); }
+
+    /**
+     * @brief Free the current slab (invalidating everything allocated from it) and allocate a new one
+     *
+     * @param capacity Size of the new slab in bytes
+     */
+    void reserve(size_t capacity) {
+        release();
+
+        slab_capacity = aligned(capacity);
+        if (slab_capacity > 0) {
+            slab = static_cast<char *>(HugePageAllocator::instance().allocate(slab_capacity, name));
+        }
+    }
+
+    /**
+     * @brief Carve an array out of the arena. The values are not initialized.
+     *
+     * @param count Number of values in the array
+     *
+     * @return Array aligned to `ALIGNMENT`, valid until the arena is reset, released or destroyed
+     */
+    template <typename T> T *allocate(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "Arenas never run destructors");
+        static_assert(alignof(T) <= ALIGNMENT, "Arena allocations are only aligned to ALIGNMENT");
+
+        size_t size = bytes_for<T>(count);
+        if (used + size > slab_capacity) {
+            throw invalid_function_call("Arena of " + std::to_string(slab_capacity) + " bytes is out of space");
+        }
+
+        T *array = reinterpret_cast<T *>(slab + used);
+        used += size;
+        return array;
+    }
+
+    /**
+     * @brief Hand out the whole slab again from the start. Everything allocated so far becomes invalid.
+     */
+    void reset() { used = 0; }
+
+    /**
+     * @brief Free the slab
+     */
+    void release() {
+        HugePageAllocator::instance().free(slab);
+
+        slab = NULL;
+        slab_capacity = 0;
+        used = 0;
+    }
+
+    /**
+     * @brief Bytes allocated so far, and the size of the slab
+     */
+    size_t size() const { return used; }
+    size_t capacity() const { return slab_capacity; }
+};
@@ -6,7 +6,7 @@
 #include <iomanip>
 #include <sstream>
 
-std::string get_current_datetime() {
+inline std::string get_current_datetime() {
     auto t = std::time(nullptr);
     auto tm = *std::localtime(&t);
 
@@ -7,7 +7,7 @@
  *
  * @return Big endian parsed integer
  */
-int file_read_big_endian_int32(std::ifstream &stream) {
+inline int file_read_big_endian_int32(std::ifstream &stream) {
 
     int num = 1;
     if (*(char *)&num == 1) {
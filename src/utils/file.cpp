@@ -1,7 +1,15 @@
+#pragma once
+
+#include <cstdio>
 #include <filesystem>
+#include <fstream>
+#include <stdexcept>
 #include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include "function_ref.cpp"
 
-std::filesystem::path set_file_name(std::filesystem::path path, string new_name) {
+inline std::filesystem::path set_file_name(std::filesystem::path path, string new_name) {
     std::filesystem::path p(path.parent_path());
     p.append(new_name + path.extension().string());
     return p;
@@ -14,7 +22,7 @@ std::filesystem::path set_file_name(std::filesystem::path path, string new_name)
  *
  * @return Unique filename
  */
-std::string get_unique_filename(std::string filename) {
+inline std::string get_unique_filename(std::string filename) {
     //? Maybe figure out a better way to do this
 
     std::filesystem::path p(filename);
@@ -34,4 +42,49 @@ std::string get_unique_filename(std::string filename) {
         }
         return set_file_name(p, name + "_" + to_string(suffix)).string();
     }
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Write a file through a temporary file next to it, which is synced to disk and renamed over the file once
+ *        it's complete. The file is never seen half written, and a file that is mapped into memory (ex. the model a
+ *        network was loaded from) is replaced rather than truncated from under its mapping. The temporary file is
+ *        removed if writing fails.
+ *
+ * @param path Path of the file
+ * @param kind What the file is for error messages, ex. "model file"
+ * @param writer Writes the contents to the stream it's given, may throw
+ */
+inline void write_atomically(const std::string &path, const std::string &kind,
+                             FunctionRef<void(std::ostream &)> writer) {
+    std::string temporary = path + ".tmp";
+
+    std::ofstream file(temporary, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.good()) {
+        throw std::invalid_argument("Unable to create " + kind + " '" + temporary + "'");
+    }
+
+    try {
+        writer(file);
+
+        file.close();
+        if (file.fail()) {
+            throw std::invalid_argument("Unable to write " + kind + " '" + temporary + "'");
+        }
+    } catch (...) {
+        file.close();
+        std::remove(temporary.c_str());
+        throw;
+    }
+
+    // on disk before the rename, so a crash can't leave the file renamed but empty
+    int descriptor = open(temporary.c_str(), O_RDONLY);
+    if (descriptor >= 0) {
+        fsync(descriptor);
+        close(descriptor);
+    }
+
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        throw std::invalid_argument("Unable to replace " + kind + " '" + path + "'");
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+/**
+ * @brief A reference to something callable, like a `std::function` that doesn't own what it calls. A `std::function`
+ *        copies the lambda it's given, onto the heap when its captures don't fit in a few pointers, which is an
+ *        allocation on every call of a function like `ThreadPool::parallel_for()`. A FunctionRef only stores the address
+ *        of the lambda and how to call it, so it must not outlive the lambda: fine for parameters, not for members.
+ */
+template <typename Signature> class FunctionRef;
+
+template <typename Result, typename... Arguments> class FunctionRef<Result(Arguments...)> {
+  private:
+    void *callable;
+    Result (*invoke)(void *, Arguments...);
+
+  public:
+    template <typename Callable,
+              typename = std::enable_if_t<!std::is_same<std::decay_t<Callable>, FunctionRef>::value>>
+    FunctionRef(Callable &&function)
+        : callable((void *)std::addressof(function)), invoke([](void *callable, Arguments... arguments) -> Result {
+              return (*(std::remove_reference_t<Callable> *)callable)(std::forward<Arguments>(arguments)...);
+          }) {}
+
+    Result operator()(Arguments... arguments) const { return invoke(callable, std::forward<Arguments>(arguments)...); }
+};
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include "../logging.h"
+
+/**
+ *?                             ==================================================
+ *?                                               🛈 Huge Pages
+ *?                             ==================================================
+ *
+ * Every memory access has to translate a virtual address into a physical one, and the CPU caches recent translations in
+ * its TLB. With regular 4 KB pages the TLB only covers a few MB, so walking over large weight matrices or the resident
+ * data set misses it constantly. Backing those buffers with 2 MB pages covers 512 times as much memory per TLB entry.
+ *
+ * Linux offers huge pages two ways, both tried in order:
+ *
+ *  - Explicit (`MAP_HUGETLB`): pages come from a pool the administrator reserved up front
+ *    (/proc/sys/vm/nr_hugepages). Guaranteed huge, but the pool is usually empty.
+ *  - Transparent (`madvise(MADV_HUGEPAGE)`): the kernel backs the region with huge pages when it can, as it's first
+ *    touched or later on by khugepaged. Requires /sys/kernel/mm/transparent_hugepage/enabled to be `always` or
+ *    `madvise`.
+ *
+ * If neither is available, regions fall back to regular pages and everything works as before. Regions smaller than
+ * `min_bytes` always use the regular heap, since a huge page for them would mostly be wasted.
+ */
+
+/**
+ * @brief Allocates the large buffers (weights, training scratch, resident data) and keeps track of which of them got
+ *        huge pages, for the startup report. Shared by the whole process, see `instance()`.
+ */
+class HugePageAllocator {
+  public:
+    static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    /**
+     * @brief Alignment of every allocation, at least a cache line
+     */
+    static const size_t ALIGNMENT = 64;
+
+    /**
+     * @brief How a region ended up being backed
+     */
+    enum Backing { Heap, Explicit, Transparent, Regular };
+
+    /**
+     * @brief Whether large allocations should try to use huge pages. Off by default, allocations then come from the heap.
+     */
+    bool enabled = false;
+
+    /**
+     * @brief Regions smaller than this never use huge pages
+     */
+    size_t min_bytes = HUGE_PAGE_SIZE / 2;
+
+    static HugePageAllocator &instance() {
+        static HugePageAllocator allocator;
+        return allocator;
+    }
+
+    /**
+     * @brief Allocate a region, aligned to at least `ALIGNMENT`. Never fails over to anything but regular memory, only
+     *        throws `bad_alloc` when there is no memory at all.
+     *
+     * @param bytes Size of the region
+     * @param name Description shown in the report, ex. "layer 1 parameters"
+     */
+    void *allocate(size_t bytes, const std::string &name) {
+        Region region{name, NULL, bytes, 0, Heap};
+
+        if (enabled && bytes >= min_bytes) {
+            map_region(region);
+        }
+
+        if (region.address == NULL) {
+            region.backing = Heap;
+            region.address = operator new(std::max(bytes, (size_t)1), std::align_val_t(ALIGNMENT));
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        regions.push_back(region);
+        return region.address;
+    }
+
+    /**
+     * @brief Free a region returned by `allocate()`. NULL is ignored.
+     */
+    void free(void *address) {
+        if (address == NULL) {
+            return;
+        }
+
+        Region region;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = std::find_if(regions.begin(), regions.end(),
+                                      [address](const Region &region) { return region.address == address; });
+            if (found == regions.end()) {
+                SPDLOG_ERROR("Freeing memory that wasn't allocated by HugePageAllocator");
+                return;
+            }
+            region = *found;
+            regions.erase(found);
+        }
+
+        if (region.backing == Heap) {
+            operator delete(region.address, std::align_val_t(ALIGNMENT));
+        } else {
+            munmap(region.address, region.mapped_bytes);
+        }
+    }
+
+    /**
+     * @brief Log every region currently allocated, how it's backed and, for transparent huge pages, how much of it the
+     *        kernel has actually backed with huge pages so far (from /proc/self/smaps).
+     */
+    void log_report() {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        SPDLOG_INFO("Huge pages {0}, {1} regions:", enabled ? "enabled" : "disabled", regions.size());
+
+        size_t total = 0, huge = 0;
+        for (const Region &region : regions) {
+            size_t huge_bytes = 0;
+            std::string backing;
+
+            switch (region.backing) {
+            case Heap:
+                backing = region.bytes < min_bytes && enabled ? "heap (too small)" : "heap";
+                break;
+            case Explicit:
+                backing = "explicit huge pages";
+                huge_bytes = region.mapped_bytes;
+                break;
+            case Transparent:
+                huge_bytes = transparent_huge_bytes(region);
+                backing = "transparent huge pages, " + std::to_string(huge_bytes / 1024) + " KB backed so far";
+                break;
+            case Regular:
+                backing = "regular pages (huge pages unavailable)";
+                break;
+            }
+
+            SPDLOG_INFO("  {0}: {1:.2f} MB, {2}", region.name, region.bytes / (1024.0 * 1024.0), backing);
+
+            total += region.bytes;
+            huge += std::min(huge_bytes, region.bytes);
+        }
+
+        SPDLOG_INFO("{0:.2f} of {1:.2f} MB backed by huge pages", huge / (1024.0 * 1024.0), total / (1024.0 * 1024.0));
+    }
+
+  private:
+    struct Region {
+        std::string name;
+        void *address;
+        size_t bytes;
+
+        /**
+         * @brief Size of the mapping, `bytes` rounded up to whole huge pages. 0 for heap regions.
+         */
+        size_t mapped_bytes;
+        Backing backing;
+    };
+
+    std::vector<Region> regions;
+    std::mutex mutex;
+
+    HugePageAllocator() {}
+
+    /**
+     * @brief Map a region with explicit huge pages, falling back to a huge page aligned mapping with transparent huge
+     *        pages requested, then to regular pages. Leaves `region.address` NULL if nothing could be mapped.
+     */
+    void map_region(Region &region) {
+        size_t mapped = (region.bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+#ifdef MAP_HUGETLB
+        void *address = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (address != MAP_FAILED) {
+            region.address = address;
+            region.mapped_bytes = mapped;
+            region.backing = Explicit;
+            return;
+        }
+#endif
+
+        // map an extra huge page so the region can start on a huge page boundary, then give back the unused ends
+        char *raw = (char *)mmap(NULL, mapped + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            return;
+        }
+
+        char *aligned = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+        if (aligned > raw) {
+            munmap(raw, aligned - raw);
+        }
+        size_t tail = (raw + mapped + HUGE_PAGE_SIZE) - (aligned + mapped);
+        if (tail > 0) {
+            munmap(aligned + mapped, tail);
+        }
+
+        region.address = aligned;
+        region.mapped_bytes = mapped;
+        region.backing = Regular;
+
+#ifdef MADV_HUGEPAGE
+        if (madvise(aligned, mapped, MADV_HUGEPAGE) == 0) {
+            region.backing = Transparent;
+        }
+#endif
+    }
+
+    /**
+     * @brief Bytes of a region currently backed by transparent huge pages, the sum of AnonHugePages of every mapping in
+     *        /proc/self/smaps that overlaps it
+     */
+    static size_t transparent_huge_bytes(const Region &region) {
+        std::ifstream smaps("/proc/self/smaps");
+        uintptr_t begin = (uintptr_t)region.address, end = begin + region.mapped_bytes;
+
+        size_t huge = 0;
+        bool overlaps = false;
+        std::string line;
+
+        while (getline(smaps, line)) {
+            uintptr_t start, stop;
+            char dash;
+            std::istringstream header(line);
+
+            // mapping headers look like "7f1c2a000000-7f1c2a400000 rw-p ...", fields below them like "Size: 4 kB"
+            if (header >> std::hex >> start >> dash >> stop && dash == '-') {
+                overlaps = start < end && stop > begin;
+            } else if (overlaps && line.rfind("AnonHugePages:", 0) == 0) {
+                size_t kilobytes = 0;
+                std::istringstream(line.substr(14)) >> kilobytes;
+                huge += kilobytes * 1024;
+            }
+        }
+
+        return huge;
+    }
+};
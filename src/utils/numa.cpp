@@ -0,0 +1,272 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "../logging.h"
+
+/**
+ *?                             ==================================================
+ *?                                                🛈 NUMA
+ *?                             ==================================================
+ *
+ * On machines with more than one CPU socket, every socket has its own memory controller and memory (a NUMA node).
+ * Any thread can read any memory, but memory attached to another socket has to be fetched across the interconnect
+ * between sockets, which is slower and has far less bandwidth.
+ *
+ * Linux places a page on the node of the thread that first writes to it ("first touch"). So to keep memory local:
+ *
+ *  - Pin each thread to the CPUs of one node, so it doesn't wander to another socket.
+ *  - Have each thread (or a thread on the same node) be the first to write the data it's going to read most.
+ *
+ * The topology is read from /sys/devices/system/node. Machines (or containers) without it are treated as a single node
+ * holding every CPU, where all of this costs nothing.
+ */
+
+/**
+ * @brief The NUMA nodes of the machine and the CPUs belonging to each
+ */
+class NumaTopology {
+  public:
+    struct Node {
+        int id;
+        std::vector<int> cpus;
+    };
+
+    std::vector<Node> nodes;
+
+    /**
+     * @brief Read the topology of this machine, only including CPUs this process is allowed to run on
+     */
+    static NumaTopology detect() {
+        NumaTopology topology;
+
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        bool have_allowed = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+        std::error_code error;
+        for (const auto &entry : std::filesystem::directory_iterator("/sys/devices/system/node", error)) {
+            std::string name = entry.path().filename().string();
+            if (name.rfind("node", 0) != 0 || name.size() == 4 ||
+                !all_of(name.begin() + 4, name.end(), [](char c) { return isdigit(c); })) {
+                continue;
+            }
+
+            std::ifstream file(entry.path() / "cpulist");
+            std::string list;
+            getline(file, list);
+
+            Node node{stoi(name.substr(4)), {}};
+            for (int cpu : parse_cpu_list(list)) {
+                if (!have_allowed || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))) {
+                    node.cpus.push_back(cpu);
+                }
+            }
+
+            if (!node.cpus.empty()) {
+                topology.nodes.push_back(node);
+            }
+        }
+
+        if (topology.nodes.empty()) {
+            // no NUMA information, one node with every CPU we can run on
+            Node node{0, {}};
+            for (int cpu = 0; cpu < CPU_SETSIZE && have_allowed; cpu++) {
+                if (CPU_ISSET(cpu, &allowed)) {
+                    node.cpus.push_back(cpu);
+                }
+            }
+            if (node.cpus.empty()) {
+                for (int cpu = 0; cpu < (int)std::max(1u, std::thread::hardware_concurrency()); cpu++) {
+                    node.cpus.push_back(cpu);
+                }
+            }
+            topology.nodes.push_back(node);
+        }
+
+        sort(topology.nodes.begin(), topology.nodes.end(), [](const Node &a, const Node &b) { return a.id < b.id; });
+        return topology;
+    }
+
+    /**
+     * @brief Parse a list of CPUs as written in /sys, ex. "0-3,8-11" or "5"
+     */
+    static std::vector<int> parse_cpu_list(const std::string &list) {
+        std::vector<int> cpus;
+        std::stringstream stream(list);
+        std::string range;
+
+        while (getline(stream, range, ',')) {
+            if (range.empty() || !isdigit(range[0])) {
+                continue;
+            }
+
+            size_t dash = range.find('-');
+            int first = stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : stoi(range.substr(dash + 1));
+
+            for (int cpu = first; cpu <= last; cpu++) {
+                cpus.push_back(cpu);
+            }
+        }
+
+        return cpus;
+    }
+
+    int size() const { return nodes.size(); }
+
+    /**
+     * @brief Node a thread is placed on when `threads` threads are split between nodes. Threads are split into one
+     *        contiguous block per node, in proportion to the number of CPUs of each node.
+     *
+     * @param thread Index of the thread
+     * @param threads Total number of threads
+     *
+     * @return Index of the node in `nodes`
+     */
+    int node_of_thread(int thread, int threads) const {
+        int total_cpus = 0;
+        for (const Node &node : nodes) {
+            total_cpus += node.cpus.size();
+        }
+
+        // the thread's position in [0, total_cpus), then find the node whose CPUs cover it
+        long position = (long)thread * total_cpus / std::max(threads, 1);
+        for (int n = 0; n < nodes.size(); n++) {
+            if (position < (long)nodes[n].cpus.size()) {
+                return n;
+            }
+            position -= nodes[n].cpus.size();
+        }
+        return nodes.size() - 1;
+    }
+
+    /**
+     * @brief CPU a thread is pinned to when `threads` threads are split between nodes, see `node_of_thread()`. Threads
+     *        on the same node get different CPUs until the node runs out.
+     */
+    int cpu_of_thread(int thread, int threads) const {
+        int node = node_of_thread(thread, threads);
+
+        int index_on_node = 0;
+        for (int t = 0; t < thread; t++) {
+            index_on_node += node_of_thread(t, threads) == node;
+        }
+
+        const std::vector<int> &cpus = nodes[node].cpus;
+        return cpus[index_on_node % cpus.size()];
+    }
+
+    /**
+     * @brief Pin a thread to a single CPU
+     *
+     * @return Whether the thread was pinned, pinning can be disallowed (ex. in some containers)
+     */
+    static bool pin_thread(pthread_t thread, int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+    }
+
+    /**
+     * @brief Allow a thread to run on any CPU of a node
+     */
+    bool pin_thread_to_node(pthread_t thread, int node) const {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : nodes[node].cpus) {
+            CPU_SET(cpu, &set);
+        }
+        return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+    }
+
+    /**
+     * @brief Log every node and its CPUs
+     */
+    void log() const {
+        SPDLOG_INFO("NUMA topology: {0} node{1}", nodes.size(), nodes.size() == 1 ? "" : "s");
+        for (const Node &node : nodes) {
+            std::string cpus;
+            for (int x = 0; x < node.cpus.size(); x++) {
+                cpus += (x > 0 ? "," : "") + std::to_string(node.cpus[x]);
+            }
+            SPDLOG_INFO("  node {0}: CPUs {1}", node.id, cpus);
+        }
+    }
+
+    /**
+     * @brief Measure how fast a thread on each node can read blocks of memory placed on each node. Every block is
+     *        first touched by a thread on its own node, then read by a thread pinned to each node in turn.
+     *
+     * @param bytes Size of the block placed on each node
+     *
+     * @return Bandwidth in GB/s, `[reader][owner]`, so the diagonal is local bandwidth
+     */
+    std::vector<std::vector<double>> measure_bandwidth(size_t bytes = 64 * 1024 * 1024) const {
+        const size_t count = bytes / sizeof(float);
+        std::vector<float *> blocks(nodes.size(), NULL);
+        std::vector<std::vector<double>> bandwidth(nodes.size(), std::vector<double>(nodes.size(), 0.0));
+
+        for (int n = 0; n < nodes.size(); n++) {
+            run_on_node(n, [&blocks, n, count] {
+                blocks[n] = new float[count];
+                std::fill(blocks[n], blocks[n] + count, 1.0f);
+            });
+        }
+
+        for (int reader = 0; reader < nodes.size(); reader++) {
+            run_on_node(reader, [&] {
+                for (int owner = 0; owner < nodes.size(); owner++) {
+                    auto t_start = std::chrono::high_resolution_clock::now();
+
+                    // several accumulators so the loop is limited by memory rather than by the latency of adds
+                    float sums[8] = {0};
+                    for (size_t x = 0; x + 8 <= count; x += 8) {
+                        for (int y = 0; y < 8; y++) {
+                            sums[y] += blocks[owner][x + y];
+                        }
+                    }
+
+                    auto t_end = std::chrono::high_resolution_clock::now();
+                    double seconds = std::chrono::duration<double>(t_end - t_start).count();
+
+                    // the sum has to be used or the compiler drops the loop
+                    volatile float sink = sums[0] + sums[7];
+                    (void)sink;
+
+                    bandwidth[reader][owner] = seconds > 0 ? bytes / seconds / 1e9 : 0;
+                }
+            });
+        }
+
+        for (float *block : blocks) {
+            delete[] block;
+        }
+
+        return bandwidth;
+    }
+
+    /**
+     * @brief Run a function on a new thread allowed to run only on one node's CPUs, and wait for it to finish
+     */
+    void run_on_node(int node, const std::function<void()> &function) const {
+        std::thread worker([this, node, &function] {
+            pin_thread_to_node(pthread_self(), node);
+            function();
+        });
+        worker.join();
+    }
+};
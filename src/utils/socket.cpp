@@ -0,0 +1,234 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#ifndef _WIN32
+    #include <netdb.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+#endif
+
+#include "../exceptions.h"
+
+/**
+ * Sockets used to talk to other processes. Addresses are either `host:port` for TCP or `unix:/path/to/socket` for Unix
+ * domain sockets.
+ */
+
+#ifndef _WIN32
+
+/**
+ * @brief Send data as soon as it's written rather than waiting to fill up packets. Fails harmlessly on Unix sockets.
+ */
+inline void set_no_delay(int socket) {
+    int flag = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+}
+
+/**
+ * @brief Split a `host:port` address into its host and port
+ */
+inline void split_address(const std::string &address, std::string &host, std::string &port) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        throw std::invalid_argument("Address '" + address + "' should be host:port or unix:/path");
+    }
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+}
+
+inline bool is_unix_address(const std::string &address) { return address.rfind("unix:", 0) == 0; }
+
+inline sockaddr_un unix_socket_address(const std::string &address) {
+    std::string path = address.substr(5);
+
+    sockaddr_un socket_address = {};
+    socket_address.sun_family = AF_UNIX;
+
+    if (path.size() >= sizeof(socket_address.sun_path)) {
+        throw std::invalid_argument("Unix socket path '" + path + "' is too long");
+    }
+    strcpy(socket_address.sun_path, path.c_str());
+
+    return socket_address;
+}
+
+/**
+ * @brief Close a socket that couldn't be set up to listen and report why, errno is read before closing changes it
+ */
+[[noreturn]] inline void close_and_throw(int fd, const std::string &address) {
+    std::string reason = strerror(errno);
+    close(fd);
+    throw communication_error("Unable to listen on " + address + ": " + reason);
+}
+
+/**
+ * @brief Start listening on an address
+ *
+ * @param address Address to listen on
+ * @param backlog Number of connections that can wait to be accepted
+ * @param unix_socket_path Set to the path of the socket file when listening on a Unix domain socket, which should be
+ *                         deleted once done
+ *
+ * @return The listening socket
+ */
+inline int open_listen_socket(const std::string &address, int backlog, std::string &unix_socket_path) {
+    int fd;
+
+    if (is_unix_address(address)) {
+        sockaddr_un socket_address = unix_socket_address(address);
+        unix_socket_path = socket_address.sun_path;
+
+        // remove a socket left behind by an earlier run
+        unlink(unix_socket_path.c_str());
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            throw communication_error("Unable to listen on " + address + ": " + strerror(errno));
+        }
+
+        if (bind(fd, (sockaddr *)&socket_address, sizeof(socket_address)) < 0) {
+            close_and_throw(fd, address);
+        }
+    } else {
+        std::string host, port;
+        split_address(address, host, port);
+
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+
+        addrinfo *result;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0) {
+            throw std::invalid_argument("Unable to resolve address '" + address + "'");
+        }
+
+        fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+        if (fd < 0) {
+            freeaddrinfo(result);
+            throw communication_error("Unable to listen on " + address + ": " + strerror(errno));
+        }
+
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        int bound = bind(fd, result->ai_addr, result->ai_addrlen);
+        freeaddrinfo(result);
+
+        if (bound < 0) {
+            close_and_throw(fd, address);
+        }
+    }
+
+    if (listen(fd, backlog) < 0) {
+        close_and_throw(fd, address);
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Connect to an address, retrying until the process at that address starts listening
+ *
+ * @param address Address to connect to
+ * @param timeout_s How long to keep trying before giving up
+ *
+ * @return The connected socket
+ */
+inline int connect_to(const std::string &address, int timeout_s) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout_s);
+
+    while (true) {
+        int fd = -1;
+        bool connected = false;
+
+        if (is_unix_address(address)) {
+            sockaddr_un socket_address = unix_socket_address(address);
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            connected = fd >= 0 && connect(fd, (sockaddr *)&socket_address, sizeof(socket_address)) == 0;
+        } else {
+            std::string host, port;
+            split_address(address, host, port);
+
+            addrinfo hints = {};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+
+            addrinfo *result;
+            if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0) {
+                throw std::invalid_argument("Unable to resolve address '" + address + "'");
+            }
+
+            fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+            connected = fd >= 0 && connect(fd, result->ai_addr, result->ai_addrlen) == 0;
+            freeaddrinfo(result);
+        }
+
+        if (connected) {
+            set_no_delay(fd);
+            return fd;
+        }
+
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        if (std::chrono::steady_clock::now() > deadline) {
+            throw communication_error("Timed out connecting to " + address);
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}
+
+/**
+ * @brief Blocking write of a whole buffer
+ *
+ * @return Whether everything was sent, false if the other end disconnected
+ */
+inline bool send_all(int socket, const void *data, size_t length) {
+    const char *bytes = (const char *)data;
+    while (length > 0) {
+        ssize_t sent = send(socket, bytes, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        bytes += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+/**
+ * @brief Blocking read of a whole buffer
+ *
+ * @return Whether everything was received, false if the other end disconnected
+ */
+inline bool receive_all(int socket, void *data, size_t length) {
+    char *bytes = (char *)data;
+    while (length > 0) {
+        ssize_t received = recv(socket, bytes, length, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        bytes += received;
+        length -= received;
+    }
+    return true;
+}
+
+#endif
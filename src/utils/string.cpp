@@ -0,0 +1,58 @@
+#pragma once
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Split a string into the parts between a delimiter, ex. "a,b,c" into {"a", "b", "c"}
+ *
+ * @param text String to split
+ * @param delimiter Character separating the parts
+ *
+ * @return Parts of the string, empty parts are skipped
+ */
+inline std::vector<std::string> split_string(const std::string &text, char delimiter) {
+    std::vector<std::string> parts;
+
+    std::stringstream stream(text);
+    std::string part;
+    while (std::getline(stream, part, delimiter)) {
+        if (!part.empty()) {
+            parts.push_back(part);
+        }
+    }
+
+    return parts;
+}
+
+/**
+ * @brief Parse a setting given per layer with weights on the command line, ex. "0.9" or "0.9,0.5". A single value
+ *        applies to every layer but the output layer, which is small and every output depends on, otherwise there must
+ *        be a comma separated value for each layer with weights.
+ *
+ * @param text Values as given on the command line
+ * @param weight_layers Number of layers with weights
+ * @param name What a value is for error messages, ex. "sparsity"
+ * @param parse_value Converts one value, throwing if it's out of range
+ * @param output_value Value of the output layer when a single value is given
+ */
+template <typename T, typename Parse>
+std::vector<T> parse_per_layer(const std::string &text, int weight_layers, const std::string &name, Parse parse_value,
+                               T output_value) {
+    std::vector<T> values;
+    for (const std::string &value : split_string(text, ',')) {
+        values.push_back(parse_value(value));
+    }
+
+    if (values.size() == 1) {
+        values.assign(weight_layers, values[0]);
+        values.back() = output_value;
+    } else if (values.size() != weight_layers) {
+        throw std::invalid_argument("Expected one " + name + ", or one for each of the " +
+                                    std::to_string(weight_layers) + " layers with weights");
+    }
+
+    return values;
+}
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "allocation_tracker.cpp"
+#include "function_ref.cpp"
+
+/**
+ * @brief A fixed set of threads that split loops between them. Threads are started once and reused, starting threads
+ *        for every batch would cost more than the work they do. An exception thrown by an iteration stops the loop, and
+ *        is rethrown on the thread that started it once every thread is done with the loop.
+ */
+class ThreadPool {
+  private:
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable work_available;
+    std::condition_variable work_finished;
+
+    /**
+     * @brief Incremented every time a new loop is started, so workers can tell a new loop apart from the one they just
+     *        finished.
+     */
+    long generation = 0;
+
+    bool stopping = false;
+
+    /**
+     * @brief Number of workers still running the current loop
+     */
+    int active_workers = 0;
+
+    /**
+     * @brief The loop currently being run
+     */
+    const FunctionRef<void(int)> *task = NULL;
+    int task_count = 0;
+
+    /**
+     * @brief Allocation tracking state of the thread that started the current loop, workers take it on while they help
+     */
+    AllocationTracker::ThreadState task_state{AllocationTracker::Setup, true};
+
+    /**
+     * @brief Whether the current loop runs exactly once on every thread, see `run_on_each_thread()`
+     */
+    bool each_thread = false;
+
+    /**
+     * @brief Next iteration of the current loop that no thread has picked up yet
+     */
+    std::atomic<int> next_task{0};
+
+    /**
+     * @brief First exception thrown by an iteration of the current loop, rethrown by `run()`
+     */
+    std::exception_ptr task_exception;
+
+    /**
+     * @brief Run iterations of the current loop until there are none left
+     */
+    void run_tasks() {
+        while (true) {
+            int t = next_task.fetch_add(1);
+            if (t >= task_count) {
+                break;
+            }
+            (*task)(t);
+        }
+    }
+
+    /**
+     * @brief Run this thread's part of the current loop, keeping the first exception thrown for `run()` to rethrow. No
+     *        more iterations are handed out once one has thrown.
+     *
+     * @param index Index of the thread
+     */
+    void run_part(int index) {
+        try {
+            if (each_thread) {
+                (*task)(index);
+            } else {
+                run_tasks();
+            }
+        } catch (...) {
+            next_task = task_count;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (task_exception == NULL) {
+                task_exception = std::current_exception();
+            }
+        }
+    }
+
+    /**
+     * @param index Index of this worker's thread, the thread calling `parallel_for()` is 0
+     */
+    void worker_loop(int index) {
+        long seen_generation = 0;
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_available.wait(lock, [&] { return stopping || generation != seen_generation; });
+
+                if (stopping) {
+                    return;
+                }
+
+                seen_generation = generation;
+            }
+
+            {
+                AllocationTracker::Scope scope(task_state);
+                run_part(index);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                active_workers--;
+            }
+            work_finished.notify_one();
+        }
+    }
+
+  public:
+    /**
+     * @brief Create a new thread pool
+     *
+     * @param threads Total number of threads working on each loop, including the thread calling `parallel_for()`
+     */
+    ThreadPool(int threads) {
+        for (int x = 1; x < threads; x++) {
+            workers.emplace_back(&ThreadPool::worker_loop, this, x);
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    /**
+     * @brief Total number of threads working on each loop
+     */
+    int size() const { return workers.size() + 1; }
+
+    /**
+     * @brief Call a function once for every index in [0, count), spread across all threads. Blocks until every call is
+     *        done. Iterations can run in any order and on any thread, so each one should only write to its own data.
+     *
+     * @param count Number of iterations
+     * @param function Function to call with the index of each iteration
+     */
+    void parallel_for(int count, FunctionRef<void(int)> function) {
+        if (workers.empty() || count == 1) {
+            for (int x = 0; x < count; x++) {
+                function(x);
+            }
+            return;
+        }
+
+        run(function, count, false);
+    }
+
+    /**
+     * @brief Call a function exactly once on every thread, with the index of the thread (0 is the calling thread). Used
+     *        to split work by thread rather than by task, ex. so each thread always works on the same part of a buffer.
+     */
+    void run_on_each_thread(FunctionRef<void(int)> function) {
+        if (workers.empty()) {
+            function(0);
+            return;
+        }
+
+        run(function, size(), true);
+    }
+
+    /**
+     * @brief Pin one of the threads to a CPU
+     *
+     * @param thread Index of the thread, 0 is the thread that created the pool
+     * @param cpu CPU to pin it to
+     *
+     * @return Whether the thread was pinned, pinning can be disallowed (ex. in some containers)
+     */
+    bool pin_thread(int thread, int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        pthread_t handle = thread == 0 ? pthread_self() : workers[thread - 1].native_handle();
+        return pthread_setaffinity_np(handle, sizeof(set), &set) == 0;
+    }
+
+  private:
+    void run(const FunctionRef<void(int)> &function, int count, bool once_per_thread) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = &function;
+            task_state = AllocationTracker::thread_state();
+            task_count = count;
+            each_thread = once_per_thread;
+            next_task = 0;
+            active_workers = workers.size();
+            generation++;
+        }
+        work_available.notify_all();
+
+        // the calling thread helps out rather than waiting around
+        run_part(0);
+
+        std::exception_ptr exception;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            work_finished.wait(lock, [this] { return active_workers == 0; });
+            task = NULL;
+            std::swap(exception, task_exception);
+        }
+
+        // only now that no thread is using the loop's function can it go out of scope
+        if (exception != NULL) {
+            std::rethrow_exception(exception);
+        }
+    }
+
+  public:
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_available.notify_all();
+
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+};
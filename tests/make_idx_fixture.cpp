@@ -0,0 +1,87 @@
+// Writes a tiny synthetic data set in the IDX format of MNIST, for the tests in CMakeLists.txt
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * @brief Width and height of every image, the same as MNIST's
+ */
+const int IMAGE_SIDE = 28;
+
+void write_big_endian_int32(ofstream &stream, uint32_t value) {
+    const char bytes[4] = {(char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value};
+    stream.write(bytes, sizeof(bytes));
+}
+
+/**
+ * @brief Write `count` images and their labels. An image of digit d is a bright square in a place of its own, plus a
+ *        few pixels of noise, so a network can learn to tell them apart in an epoch or two while most pixels stay 0
+ *        like in MNIST.
+ */
+void write_set(const filesystem::path &images_path, const filesystem::path &labels_path, int count,
+               minstd_rand &engine) {
+    ofstream images(images_path, ios::binary | ios::trunc);
+    ofstream labels(labels_path, ios::binary | ios::trunc);
+
+    write_big_endian_int32(images, 0x00000803); // unsigned bytes, 3 dimensions
+    write_big_endian_int32(images, count);
+    write_big_endian_int32(images, IMAGE_SIDE);
+    write_big_endian_int32(images, IMAGE_SIDE);
+
+    write_big_endian_int32(labels, 0x00000801); // unsigned bytes, 1 dimension
+    write_big_endian_int32(labels, count);
+
+    uniform_int_distribution<int> pixel(0, IMAGE_SIDE * IMAGE_SIDE - 1);
+    vector<uint8_t> image(IMAGE_SIDE * IMAGE_SIDE);
+
+    for (int x = 0; x < count; x++) {
+        const int digit = x % 10;
+        fill(image.begin(), image.end(), 0);
+
+        const int top = 4 + digit / 5 * 12, left = 2 + digit % 5 * 5;
+        for (int row = top; row < top + 8; row++) {
+            for (int column = left; column < left + 4; column++) {
+                image[row * IMAGE_SIDE + column] = 255;
+            }
+        }
+        for (int noise = 0; noise < 20; noise++) {
+            image[pixel(engine)] = 128;
+        }
+
+        images.write((const char *)image.data(), image.size());
+        labels.put((char)digit);
+    }
+
+    if (!images.good() || !labels.good()) {
+        throw runtime_error("Unable to write " + images_path.string() + " or " + labels_path.string());
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        cerr << "Usage: make_idx_fixture <output folder>" << endl;
+        return 1;
+    }
+
+    try {
+        const filesystem::path folder(argv[1]);
+        filesystem::create_directories(folder);
+
+        minstd_rand engine(1);
+        write_set(folder / "train-images.idx3-ubyte", folder / "train-labels.idx1-ubyte", 500, engine);
+        write_set(folder / "test-images.idx3-ubyte", folder / "test-labels.idx1-ubyte", 100, engine);
+    } catch (const exception &e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}